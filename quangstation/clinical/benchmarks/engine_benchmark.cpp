@@ -0,0 +1,275 @@
+/**
+ * Benchmark dose engine và optimizer (Google Benchmark) trên phantom tấm tổng hợp.
+ *
+ * Dựng bằng: python setup.py build_benchmarks, chạy build/benchmarks/engine_benchmark.
+ * Mỗi trường hợp có tham số (phantom, kế hoạch, số luồng) và báo cáo:
+ *   voxel_beams  - voxel CT × hướng chùm tia mỗi giây
+ *   peak_rss_MB  - bộ nhớ thường trú đỉnh trong lúc chạy trường hợp đó
+ *   threads      - số luồng OpenMP
+ * Mọi số ngẫu nhiên (Monte Carlo, GeneticOptimizer) dùng seed cố định để kết quả lặp lại được.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include <benchmark/benchmark.h>
+
+#include "dose_engine.h"
+#include "optimizer.h"
+#include "phantoms.h"
+
+using namespace quangstation::bench;
+
+namespace {
+
+// Đặt lại mốc bộ nhớ đỉnh (chỉ Linux hỗ trợ; nơi khác giá trị đỉnh tính từ đầu tiến trình)
+void reset_peak_rss() {
+#if defined(__linux__)
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    if (clear_refs) {
+        clear_refs << "5";
+    }
+#endif
+}
+
+// Bộ nhớ thường trú đỉnh (MB)
+double peak_rss_mb() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+    }
+    return 0.0;
+#else
+#if defined(__linux__)
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            return std::stod(line.substr(6)) / 1024.0;
+        }
+    }
+#endif
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / (1024.0 * 1024.0);  // byte trên macOS
+#else
+    return usage.ru_maxrss / 1024.0;             // KB trên Linux/BSD
+#endif
+#endif
+}
+
+// Tắt std::cout trong một phạm vi (optimizer in tiến trình mỗi lần lặp khi không chạy dưới job)
+class ScopedSilentCout {
+public:
+    ScopedSilentCout() : previous_(std::cout.rdbuf(nullptr)) {}
+    ~ScopedSilentCout() { std::cout.rdbuf(previous_); }
+    
+private:
+    std::streambuf* previous_;
+};
+
+// 1, 2, 4, ... đến số luồng phần cứng (luôn có số luồng phần cứng)
+std::vector<std::int64_t> thread_counts() {
+    const std::int64_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::int64_t> counts;
+    for (std::int64_t threads = 1; threads < hardware; threads *= 2) {
+        counts.push_back(threads);
+    }
+    counts.push_back(hardware);
+    return counts;
+}
+
+void dose_arguments(benchmark::internal::Benchmark* benchmark) {
+    benchmark->ArgNames({"phantom", "plan", "threads"});
+    for (std::int64_t size = 0; size < 3; ++size) {
+        for (std::int64_t kind = 0; kind < 3; ++kind) {
+            for (std::int64_t threads : thread_counts()) {
+                benchmark->Args({size, kind, threads});
+            }
+        }
+    }
+}
+
+// Monte Carlo chậm hơn vài bậc: chỉ chạy phantom 128³
+void monte_carlo_arguments(benchmark::internal::Benchmark* benchmark) {
+    benchmark->ArgNames({"phantom", "plan", "threads"});
+    for (std::int64_t kind = 0; kind < 3; ++kind) {
+        for (std::int64_t threads : thread_counts()) {
+            benchmark->Args({0, kind, threads});
+        }
+    }
+}
+
+void optimizer_arguments(benchmark::internal::Benchmark* benchmark) {
+    benchmark->ArgNames({"threads"});
+    for (std::int64_t threads : thread_counts()) {
+        benchmark->Args({threads});
+    }
+}
+
+void configure(DoseAlgorithm&) {}
+
+void configure(MonteCarlo& algorithm) {
+    algorithm.set_num_histories(2000000);
+    algorithm.set_target_uncertainty(0.0);
+    algorithm.set_seed(42);
+}
+
+void report(benchmark::State& state, const Phantom& phantom, const Plan& plan, int threads) {
+    const double voxel_beams = static_cast<double>(phantom.ct.size()) * beam_directions(plan);
+    state.counters["voxel_beams"] = benchmark::Counter(voxel_beams, benchmark::Counter::kIsIterationInvariantRate);
+    state.counters["threads"] = threads;
+    state.counters["peak_rss_MB"] = peak_rss_mb();
+    state.SetLabel(std::string(phantom.name) + "/" + plan.id);
+}
+
+/**
+ * Một lần tính liều đầy đủ trên lưới CT. Mỗi vòng dùng đối tượng thuật toán mới như
+ * dose_engine_wrapper (bộ đệm density/radiological depth nguội), nên thời gian gồm cả
+ * chuyển đổi HU và ray tracing.
+ */
+template <typename Algorithm>
+void BM_Dose(benchmark::State& state) {
+    const Phantom& phantom_ref = phantom(static_cast<PhantomSize>(state.range(0)));
+    const Plan plan = make_plan(static_cast<PlanKind>(state.range(1)), phantom_ref);
+    const int threads = static_cast<int>(state.range(2));
+    
+    reset_peak_rss();
+    ScopedSilentCout silent;
+    for (auto _ : state) {
+        Algorithm algorithm;
+        configure(algorithm);
+        algorithm.set_num_threads(threads);
+        DoseVolume dose = algorithm.calculate(phantom_ref.ct, phantom_ref.ptv, plan);
+        benchmark::DoNotOptimize(dose.data());
+        benchmark::ClobberMemory();
+    }
+    report(state, phantom_ref, plan, threads);
+}
+
+// Ma trận ảnh hưởng IMRT trên phantom 128³ (một cột mỗi control point), dựng một lần
+const DoseInfluenceMatrix& imrt_influence_matrix() {
+    static std::unique_ptr<DoseInfluenceMatrix> matrix;
+    if (!matrix) {
+        const Phantom& phantom_ref = phantom(PhantomSize::Small);
+        const Plan plan = make_plan(PlanKind::IMRT, phantom_ref);
+        PencilBeam algorithm;
+        matrix.reset(new DoseInfluenceMatrix(algorithm.calculate_influence_matrix(
+            phantom_ref.ct, plan, DoseInfluenceMatrix::structure_union(phantom_ref.ct, phantom_ref.structures(), 0))));
+    }
+    return *matrix;
+}
+
+std::vector<ObjectiveFunction> imrt_objectives() {
+    return {
+        ObjectiveFunction("PTV", ObjectiveFunction::MIN_DOSE, 1.95, 0, 10.0),
+        ObjectiveFunction("PTV", ObjectiveFunction::MAX_DOSE, 2.1, 0, 10.0),
+        ObjectiveFunction("OAR", ObjectiveFunction::MEAN_DOSE, 0.5, 0, 1.0)
+    };
+}
+
+/**
+ * Một lần tối ưu trọng số control point với số vòng lặp cố định (tolerance 0 để không
+ * dừng sớm). range(0) chọn bộ giải: 0 gradient_descent, 1 lbfgsb.
+ */
+void BM_GradientOptimizer(benchmark::State& state) {
+    const Phantom& phantom_ref = phantom(PhantomSize::Small);
+    const DoseInfluenceMatrix& matrix = imrt_influence_matrix();
+    const int threads = static_cast<int>(state.range(1));
+    
+    reset_peak_rss();
+    SolverResult result;
+    ScopedSilentCout silent;
+    for (auto _ : state) {
+        ScopedThreadCount scoped(threads);
+        GradientOptimizer optimizer(DoseVolume::like(phantom_ref.ct, 0.0), phantom_ref.structures(), 0.01, 50, 0.0);
+        for (const ObjectiveFunction& objective : imrt_objectives()) {
+            optimizer.add_objective(objective);
+        }
+        optimizer.set_solver(state.range(0) == 0 ? "gradient_descent" : "lbfgsb");
+        optimizer.set_influence_matrix(matrix);
+        result = optimizer.optimize();
+        benchmark::DoNotOptimize(result);
+    }
+    // Phần tử khác 0 của ma trận ảnh hưởng đi qua mỗi giây (một lượt nhân mỗi vòng lặp)
+    state.counters["nnz_iterations"] = benchmark::Counter(
+        static_cast<double>(matrix.nnz()) * result.iterations,
+        benchmark::Counter::kIsIterationInvariantRate);
+    state.counters["objective"] = result.objective;
+    state.counters["threads"] = threads;
+    state.counters["peak_rss_MB"] = peak_rss_mb();
+    state.SetLabel(state.range(0) == 0 ? "gradient_descent" : "lbfgsb");
+}
+
+void gradient_optimizer_arguments(benchmark::internal::Benchmark* benchmark) {
+    benchmark->ArgNames({"solver", "threads"});
+    for (std::int64_t solver = 0; solver < 2; ++solver) {
+        for (std::int64_t threads : thread_counts()) {
+            benchmark->Args({solver, threads});
+        }
+    }
+}
+
+/**
+ * Thuật toán di truyền với seed cố định: cùng số luồng cho cùng trọng số tốt nhất
+ * (weights_checksum), nên có thể so sánh cả thời gian lẫn kết quả giữa các lần chạy.
+ */
+void BM_GeneticOptimizer(benchmark::State& state) {
+    const Phantom& phantom_ref = phantom(PhantomSize::Small);
+    const DoseInfluenceMatrix& matrix = imrt_influence_matrix();
+    const int threads = static_cast<int>(state.range(0));
+    
+    reset_peak_rss();
+    std::vector<double> weights;
+    ScopedSilentCout silent;
+    for (auto _ : state) {
+        ScopedThreadCount scoped(threads);
+        GeneticOptimizer optimizer(DoseVolume::like(phantom_ref.ct, 0.0), phantom_ref.structures(), 32, 9);
+        for (const ObjectiveFunction& objective : imrt_objectives()) {
+            optimizer.add_objective(objective);
+        }
+        optimizer.set_influence_matrix(matrix);
+        optimizer.set_seed(42);
+        optimizer.initialize_population(static_cast<int>(matrix.num_columns()));
+        weights = optimizer.optimize();
+        benchmark::DoNotOptimize(weights.data());
+    }
+    double checksum = 0.0;
+    for (std::size_t i = 0; i < weights.size(); ++i) {
+        checksum += (i + 1) * weights[i];
+    }
+    state.counters["weights_checksum"] = checksum;
+    state.counters["threads"] = threads;
+    state.counters["peak_rss_MB"] = peak_rss_mb();
+}
+
+} // namespace
+
+BENCHMARK_TEMPLATE(BM_Dose, CollapsedConeConvolution)->Apply(dose_arguments)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Dose, PencilBeam)->Apply(dose_arguments)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Dose, AAA)->Apply(dose_arguments)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Dose, MonteCarlo)->Apply(monte_carlo_arguments)
+    ->Unit(benchmark::kMillisecond)->UseRealTime()->Iterations(1);
+BENCHMARK(BM_GradientOptimizer)->Apply(gradient_optimizer_arguments)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_GeneticOptimizer)->Apply(optimizer_arguments)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
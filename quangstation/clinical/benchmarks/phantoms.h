@@ -0,0 +1,222 @@
+#ifndef QUANGSTATION_BENCHMARK_PHANTOMS_H
+#define QUANGSTATION_BENCHMARK_PHANTOMS_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "volume3d.h"
+#include "dose_engine.h"
+
+namespace quangstation {
+namespace bench {
+
+// Kích thước phantom chuẩn (z × y × x voxel)
+enum class PhantomSize {
+    Small,   // 128³, 2.5 mm
+    Medium,  // 256³, 2.0 mm
+    Large    // 512² × 200, 1.0 × 1.0 × 2.5 mm (CT lâm sàng điển hình)
+};
+
+enum class PlanKind {
+    Conformal3D,  // 4 trường hộp 0/90/180/270
+    IMRT,         // 7 trường đều góc, 5 control point step-and-shoot mỗi trường
+    VMAT          // 2 cung 358° ngược chiều, 36 control point mỗi cung
+};
+
+/**
+ * Phantom tấm: không khí bao quanh một khối nước (10% mỗi phía theo x, y), trong đó
+ * có tấm phổi (-750 HU) và tấm xương (+700 HU) vuông góc với trục y (hướng chùm tia
+ * gantry 0). PTV là cầu bán kính 25 mm ở tâm, OAR là hộp 20 × 20 mm sau PTV theo y,
+ * kéo dài suốt trục z (như tủy sống). isocenter ở tâm phantom (mm, origin 0).
+ */
+struct Phantom {
+    std::string name;
+    CTVolume ct;
+    MaskVolume ptv;
+    MaskVolume oar;
+    std::array<double, 3> isocenter;
+    
+    std::map<std::string, MaskVolume> structures() const {
+        return {{"PTV", ptv}, {"OAR", oar}};
+    }
+};
+
+inline Phantom make_slab_phantom(const std::string& name, std::size_t depth, std::size_t height, std::size_t width,
+                                 const std::array<double, 3>& spacing) {
+    Phantom phantom;
+    phantom.name = name;
+    phantom.ct = CTVolume(depth, height, width, static_cast<std::int16_t>(-1000), spacing);
+    phantom.ptv = MaskVolume::like(phantom.ct, static_cast<std::uint8_t>(0));
+    phantom.oar = MaskVolume::like(phantom.ct, static_cast<std::uint8_t>(0));
+    
+    const std::array<double, 3> extent = {width * spacing[0], height * spacing[1], depth * spacing[2]};
+    phantom.isocenter = {0.5 * (width - 1) * spacing[0], 0.5 * (height - 1) * spacing[1],
+                         0.5 * (depth - 1) * spacing[2]};
+    const double body_x0 = 0.1 * extent[0], body_x1 = 0.9 * extent[0];
+    const double body_y0 = 0.1 * extent[1], body_y1 = 0.9 * extent[1];
+    const double body_depth = body_y1 - body_y0;
+    const double ptv_radius = 25.0;
+    
+    for (std::size_t z = 0; z < depth; ++z) {
+        const double pz = z * spacing[2] - phantom.isocenter[2];
+        for (std::size_t y = 0; y < height; ++y) {
+            const double py = y * spacing[1];
+            std::int16_t* ct_row = phantom.ct.row(z, y);
+            std::uint8_t* ptv_row = phantom.ptv.row(z, y);
+            std::uint8_t* oar_row = phantom.oar.row(z, y);
+            if (py < body_y0 || py > body_y1) {
+                continue;
+            }
+            const double fraction = (py - body_y0) / body_depth;
+            std::int16_t hu = 0;
+            if (fraction >= 0.25 && fraction < 0.38) {
+                hu = -750;
+            } else if (fraction >= 0.62 && fraction < 0.67) {
+                hu = 700;
+            }
+            for (std::size_t x = 0; x < width; ++x) {
+                const double px = x * spacing[0];
+                if (px < body_x0 || px > body_x1) {
+                    continue;
+                }
+                ct_row[x] = hu;
+                const double dx = px - phantom.isocenter[0];
+                const double dy = py - phantom.isocenter[1];
+                if (dx * dx + dy * dy + pz * pz <= ptv_radius * ptv_radius) {
+                    ptv_row[x] = 1;
+                }
+                if (std::abs(dx) <= 10.0 && dy >= 40.0 && dy <= 60.0) {
+                    oar_row[x] = 1;
+                }
+            }
+        }
+    }
+    return phantom;
+}
+
+// Phantom chuẩn, dựng một lần rồi dùng chung cho mọi benchmark
+inline const Phantom& phantom(PhantomSize size) {
+    static std::unique_ptr<Phantom> phantoms[3];
+    std::unique_ptr<Phantom>& slot = phantoms[static_cast<int>(size)];
+    if (!slot) {
+        switch (size) {
+            case PhantomSize::Small:
+                slot.reset(new Phantom(make_slab_phantom("128^3", 128, 128, 128, {2.5, 2.5, 2.5})));
+                break;
+            case PhantomSize::Medium:
+                slot.reset(new Phantom(make_slab_phantom("256^3", 256, 256, 256, {2.0, 2.0, 2.0})));
+                break;
+            case PhantomSize::Large:
+                slot.reset(new Phantom(make_slab_phantom("512^2x200", 200, 512, 512, {1.0, 1.0, 2.5})));
+                break;
+        }
+    }
+    return *slot;
+}
+
+inline const char* phantom_name(PhantomSize size) {
+    switch (size) {
+        case PhantomSize::Small: return "128^3";
+        case PhantomSize::Medium: return "256^3";
+        case PhantomSize::Large: return "512^2x200";
+    }
+    return "";
+}
+
+inline const char* plan_name(PlanKind kind) {
+    switch (kind) {
+        case PlanKind::Conformal3D: return "3DCRT-4";
+        case PlanKind::IMRT: return "IMRT-7";
+        case PlanKind::VMAT: return "VMAT-2";
+    }
+    return "";
+}
+
+// Khẩu độ num_leaves cặp lá mở [center - half_width, center + half_width] mm (cùng quy ước với ApertureFluence)
+inline std::vector<double> aperture(std::size_t num_leaves, double center, double half_width) {
+    std::vector<double> mlc;
+    for (std::size_t leaf = 0; leaf < num_leaves; ++leaf) {
+        // Các lá ngoài PTV (|v| > 30 mm) đóng bớt cho trường có dạng
+        const double v = -50.0 + (leaf + 0.5) * 100.0 / num_leaves;
+        const double width = std::abs(v) > 30.0 ? 0.5 * half_width : half_width;
+        mlc.push_back(center - width);
+        mlc.push_back(center + width);
+    }
+    return mlc;
+}
+
+// Kế hoạch chuẩn quanh isocenter của phantom, liều kê toa 2 Gy
+inline Plan make_plan(PlanKind kind, const Phantom& phantom) {
+    const std::size_t num_leaves = 20;
+    Plan plan(plan_name(kind), plan_name(kind), 2.0, 1);
+    auto add_beam = [&](const std::string& id) {
+        auto beam = std::make_shared<Beam>(id, "photon", 6.0);
+        beam->isocenter = phantom.isocenter;
+        plan.beams.push_back(beam);
+        return beam;
+    };
+    switch (kind) {
+        case PlanKind::Conformal3D:
+            plan.technique = "3DCRT";
+            for (int b = 0; b < 4; ++b) {
+                auto beam = add_beam("3dcrt-" + std::to_string(b));
+                beam->gantry_angle = 90.0 * b;
+                beam->mlc_positions = {aperture(num_leaves, 0.0, 30.0)};
+                beam->weights = {1.0};
+            }
+            break;
+        case PlanKind::IMRT:
+            plan.technique = "IMRT";
+            for (int b = 0; b < 7; ++b) {
+                auto beam = add_beam("imrt-" + std::to_string(b));
+                beam->gantry_angle = 360.0 * b / 7.0;
+                for (int cp = 0; cp < 5; ++cp) {
+                    beam->mlc_positions.push_back(aperture(num_leaves, -20.0 + 10.0 * cp, 10.0 + 4.0 * cp));
+                    beam->weights.push_back(0.2);
+                }
+            }
+            break;
+        case PlanKind::VMAT:
+            plan.technique = "VMAT";
+            for (int a = 0; a < 2; ++a) {
+                auto beam = add_beam("vmat-" + std::to_string(a));
+                beam->is_arc = true;
+                beam->arc_direction = a == 0 ? 1.0 : -1.0;
+                beam->arc_start_angle = a == 0 ? 181.0 : 179.0;
+                beam->arc_stop_angle = beam->arc_start_angle + 358.0;
+                for (int cp = 0; cp < 36; ++cp) {
+                    const double phase = 2.0 * M_PI * cp / 36.0;
+                    beam->mlc_positions.push_back(aperture(num_leaves, 15.0 * std::sin(phase), 20.0 + 8.0 * std::cos(phase)));
+                    beam->weights.push_back(1.0 / 36.0);
+                }
+            }
+            break;
+    }
+    return plan;
+}
+
+// Số hướng chùm tia dose engine tính cho plan: 1 cho trường tĩnh, một sector gantry_step độ cho cung
+inline std::size_t beam_directions(const Plan& plan, double gantry_step = 2.0) {
+    std::size_t directions = 0;
+    for (const auto& beam : plan.beams) {
+        if (beam->is_arc) {
+            const double span = std::abs(beam->arc_stop_angle - beam->arc_start_angle);
+            directions += static_cast<std::size_t>(std::max(1.0, std::ceil(span / gantry_step)));
+        } else {
+            directions += 1;
+        }
+    }
+    return directions;
+}
+
+} // namespace bench
+} // namespace quangstation
+
+#endif // QUANGSTATION_BENCHMARK_PHANTOMS_H
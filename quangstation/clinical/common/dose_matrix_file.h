@@ -0,0 +1,410 @@
+#ifndef QUANGSTATION_DOSE_MATRIX_FILE_H
+#define QUANGSTATION_DOSE_MATRIX_FILE_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "volume3d.h"
+#include "influence_matrix.h"
+#include "mapped_file.h"
+
+namespace quangstation {
+
+/**
+ * Tệp ma trận liều theo chùm tia/beamlet, ánh xạ thẳng vào bộ nhớ khi đọc.
+ *
+ * Bố cục (little-endian, mọi offset là bội của 8 nên các mảng được căn chỉnh):
+ *   DoseMatrixFileHeader (128 byte): lưới (kích thước, spacing, origin), hash CT
+ *   rồi từng khối, mỗi khối một cột:
+ *     DoseMatrixChunkHeader | id cột | chỉ số voxel uint32 (chỉ cột thưa) | liều float32 | DoseMatrixChunkTrailer
+ *
+ * Các khối chỉ được nối thêm và mỗi khối được ghi xong (kể cả trailer) trước khối
+ * sau, nên tệp bị ngắt giữa chừng vẫn đọc được mọi cột đã ghi xong; khối dở cuối
+ * tệp bị bỏ qua (và bị cắt khi ghi tiếp). Cột cùng id ghi sau thay cho cột ghi trước.
+ */
+struct DoseMatrixFileHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t header_bytes;
+    std::uint64_t depth;
+    std::uint64_t height;
+    std::uint64_t width;
+    double spacing[3];
+    double origin[3];
+    std::uint64_t ct_hash;
+    std::uint8_t reserved[32];
+};
+
+struct DoseMatrixChunkHeader {
+    std::uint32_t magic;
+    std::uint32_t encoding;       // 0: thưa (chỉ số + giá trị), 1: dày (một giá trị mỗi voxel)
+    std::uint64_t count;          // Số phần tử
+    std::uint32_t id_bytes;
+    std::uint32_t reserved;
+    std::uint64_t payload_bytes;  // Từ sau header tới trước trailer
+};
+
+struct DoseMatrixChunkTrailer {
+    std::uint32_t magic;
+    std::uint32_t reserved;
+    std::uint64_t payload_bytes;  // Lặp lại của header: khớp nghĩa là khối đã ghi xong
+};
+
+static_assert(sizeof(DoseMatrixFileHeader) == 128, "Header tệp ma trận liều phải 128 byte");
+static_assert(sizeof(DoseMatrixChunkHeader) == 32, "Header khối ma trận liều phải 32 byte");
+static_assert(sizeof(DoseMatrixChunkTrailer) == 16, "Trailer khối ma trận liều phải 16 byte");
+
+constexpr char kDoseMatrixFileMagic[8] = {'Q', 'S', 'D', 'O', 'S', 'E', 'M', 'X'};
+constexpr std::uint32_t kDoseMatrixFileVersion = 1;
+constexpr std::uint32_t kDoseMatrixChunkMagic = 0x4b435351;    // "QSCK"
+constexpr std::uint32_t kDoseMatrixChunkEndMagic = 0x45435351; // "QSCE"
+
+// Vị trí một cột trong tệp
+struct DoseMatrixChunk {
+    std::string id;
+    bool dense = false;
+    std::uint64_t count = 0;
+    std::uint64_t rows_offset = 0;    // Chỉ cột thưa
+    std::uint64_t values_offset = 0;
+};
+
+// Thông tin tệp: lưới, hash CT, các cột đã ghi xong (id duy nhất, theo thứ tự tệp)
+struct DoseMatrixFileInfo {
+    std::array<std::size_t, 3> shape = {0, 0, 0};  // (z, y, x)
+    std::array<double, 3> spacing = {1.0, 1.0, 1.0};
+    std::array<double, 3> origin = {0.0, 0.0, 0.0};
+    std::uint64_t ct_hash = 0;
+    std::vector<DoseMatrixChunk> chunks;
+    std::map<std::string, std::size_t> index;  // id -> vị trí trong chunks
+    std::uint64_t valid_bytes = 0;    // Phần đầu tệp gồm header và các khối hoàn chỉnh
+    
+    std::size_t num_voxels() const { return shape[0] * shape[1] * shape[2]; }
+    
+    std::vector<std::string> column_ids() const {
+        std::vector<std::string> ids;
+        for (const auto& chunk : chunks) {
+            ids.push_back(chunk.id);
+        }
+        return ids;
+    }
+    
+    const DoseMatrixChunk* find(const std::string& id) const {
+        auto it = index.find(id);
+        return it == index.end() ? nullptr : &chunks[it->second];
+    }
+};
+
+namespace detail {
+
+inline std::uint64_t pad8(std::uint64_t bytes) {
+    return (bytes + 7) & ~std::uint64_t(7);
+}
+
+inline std::uint64_t chunk_payload_bytes(std::uint64_t id_bytes, bool dense, std::uint64_t count) {
+    return pad8(id_bytes) + (dense ? 0 : pad8(count * sizeof(std::uint32_t))) + pad8(count * sizeof(float));
+}
+
+// Đọc header và duyệt các khối của vùng nhớ data (nội dung tệp); ném lỗi nếu header không hợp lệ
+inline DoseMatrixFileInfo scan_dose_matrix_file(const unsigned char* data, std::size_t size, const std::string& path) {
+    DoseMatrixFileHeader header;
+    if (size < sizeof(header)) {
+        throw std::runtime_error("Tệp ma trận liều quá ngắn: " + path);
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, kDoseMatrixFileMagic, sizeof(header.magic)) != 0) {
+        throw std::runtime_error("Không phải tệp ma trận liều: " + path);
+    }
+    if (header.version != kDoseMatrixFileVersion || header.header_bytes != sizeof(header)) {
+        throw std::runtime_error("Phiên bản tệp ma trận liều không được hỗ trợ: " + path);
+    }
+    
+    DoseMatrixFileInfo info;
+    info.shape = {static_cast<std::size_t>(header.depth), static_cast<std::size_t>(header.height),
+                  static_cast<std::size_t>(header.width)};
+    info.spacing = {header.spacing[0], header.spacing[1], header.spacing[2]};
+    info.origin = {header.origin[0], header.origin[1], header.origin[2]};
+    info.ct_hash = header.ct_hash;
+    
+    std::uint64_t offset = sizeof(header);
+    while (offset + sizeof(DoseMatrixChunkHeader) + sizeof(DoseMatrixChunkTrailer) <= size) {
+        DoseMatrixChunkHeader chunk_header;
+        std::memcpy(&chunk_header, data + offset, sizeof(chunk_header));
+        if (chunk_header.magic != kDoseMatrixChunkMagic || chunk_header.encoding > 1) {
+            break;
+        }
+        const bool dense = chunk_header.encoding == 1;
+        if ((dense && chunk_header.count != info.num_voxels()) ||
+            chunk_header.count > info.num_voxels() ||
+            chunk_header.payload_bytes != chunk_payload_bytes(chunk_header.id_bytes, dense, chunk_header.count)) {
+            break;
+        }
+        const std::uint64_t payload = offset + sizeof(chunk_header);
+        const std::uint64_t end = payload + chunk_header.payload_bytes + sizeof(DoseMatrixChunkTrailer);
+        if (end > size) {
+            break;
+        }
+        DoseMatrixChunkTrailer trailer;
+        std::memcpy(&trailer, data + end - sizeof(trailer), sizeof(trailer));
+        if (trailer.magic != kDoseMatrixChunkEndMagic || trailer.payload_bytes != chunk_header.payload_bytes) {
+            break;
+        }
+        
+        DoseMatrixChunk chunk;
+        chunk.id.assign(reinterpret_cast<const char*>(data + payload), chunk_header.id_bytes);
+        chunk.dense = dense;
+        chunk.count = chunk_header.count;
+        std::uint64_t cursor = payload + pad8(chunk_header.id_bytes);
+        if (!dense) {
+            chunk.rows_offset = cursor;
+            cursor += pad8(chunk.count * sizeof(std::uint32_t));
+        }
+        chunk.values_offset = cursor;
+        
+        auto it = info.index.find(chunk.id);
+        if (it == info.index.end()) {
+            info.index.emplace(chunk.id, info.chunks.size());
+            info.chunks.push_back(chunk);
+        } else {
+            info.chunks[it->second] = chunk;
+        }
+        offset = end;
+    }
+    info.valid_bytes = offset;
+    return info;
+}
+
+} // namespace detail
+
+// Đọc thông tin tệp (ánh xạ tạm thời, không đọc dữ liệu liều)
+inline DoseMatrixFileInfo read_dose_matrix_file_info(const std::string& path) {
+    MappedFile file(path);
+    return detail::scan_dose_matrix_file(file.data(), file.size(), path);
+}
+
+/**
+ * Ghi nối thêm các cột vào tệp ma trận liều. Tệp đã có với cùng lưới và cùng hash
+ * CT được ghi tiếp (contains() cho biết cột nào đã có, khối dở cuối tệp bị cắt bỏ);
+ * ngược lại, hoặc khi resume = false, tệp được tạo lại từ đầu. Mỗi cột được đẩy
+ * xuống hệ điều hành ngay sau khi ghi nên tiến trình bị dừng chỉ mất cột đang ghi.
+ */
+class DoseMatrixFileWriter {
+public:
+    template <typename U>
+    DoseMatrixFileWriter(const std::string& path, const Volume3D<U>& grid, std::uint64_t ct_hash,
+                         bool resume = true)
+        : path_(path), num_voxels_(grid.size()) {
+        if (grid.size() > std::numeric_limits<std::uint32_t>::max()) {
+            throw std::length_error("Lưới liều quá lớn cho chỉ số voxel 32 bit");
+        }
+        
+        std::uint64_t valid_bytes = 0;
+        if (resume) {
+            std::ifstream probe(path, std::ios::binary);
+            if (probe.good()) {
+                probe.close();
+                DoseMatrixFileInfo info;
+                bool readable = true;
+                try {
+                    info = read_dose_matrix_file_info(path);
+                } catch (const std::runtime_error&) {
+                    readable = false;
+                }
+                if (readable && info.shape[0] == grid.depth() && info.shape[1] == grid.height() &&
+                    info.shape[2] == grid.width() && info.spacing == grid.spacing() &&
+                    info.origin == grid.origin() && info.ct_hash == ct_hash) {
+                    columns_ = info.column_ids();
+                    known_.insert(columns_.begin(), columns_.end());
+                    valid_bytes = info.valid_bytes;
+                }
+            }
+        }
+        
+        if (valid_bytes > 0) {
+            if (!truncate_file(path, valid_bytes)) {
+                throw std::runtime_error("Không cắt được phần ghi dở của tệp ma trận liều " + path);
+            }
+            out_.open(path, std::ios::binary | std::ios::app);
+        } else {
+            // Xóa trước khi tạo lại: các ánh xạ đang mở của tệp cũ (POSIX) vẫn đọc được bản cũ
+            std::remove(path.c_str());
+            out_.open(path, std::ios::binary | std::ios::trunc);
+            DoseMatrixFileHeader header;
+            std::memset(&header, 0, sizeof(header));
+            std::memcpy(header.magic, kDoseMatrixFileMagic, sizeof(header.magic));
+            header.version = kDoseMatrixFileVersion;
+            header.header_bytes = sizeof(header);
+            header.depth = grid.depth();
+            header.height = grid.height();
+            header.width = grid.width();
+            for (int a = 0; a < 3; ++a) {
+                header.spacing[a] = grid.spacing()[a];
+                header.origin[a] = grid.origin()[a];
+            }
+            header.ct_hash = ct_hash;
+            out_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        }
+        resumed_ = valid_bytes > 0;
+        if (!out_) {
+            throw std::runtime_error("Không ghi được tệp ma trận liều " + path);
+        }
+        out_.flush();
+    }
+    
+    bool resumed() const { return resumed_; }
+    const std::vector<std::string>& column_ids() const { return columns_; }
+    
+    bool contains(const std::string& id) const {
+        return known_.count(id) > 0;
+    }
+    
+    /**
+     * Ghi một cột (thường là cột của DoseInfluenceMatrix). Cột thưa có hơn nửa số
+     * voxel khác 0 được lưu dạng dày: không cần chỉ số voxel nên tệp nhỏ hơn.
+     */
+    void append(const std::string& id, const DoseInfluenceMatrix::Column& column) {
+        const bool dense = column.dense || 2 * column.count > num_voxels_;
+        std::vector<float> expanded;
+        const float* values = column.values;
+        if (dense && !column.dense) {
+            expanded.assign(num_voxels_, 0.0f);
+            for (std::size_t k = 0; k < column.count; ++k) {
+                expanded[column.rows[k]] = column.values[k];
+            }
+            values = expanded.data();
+        }
+        const std::uint64_t count = dense ? num_voxels_ : column.count;
+        
+        DoseMatrixChunkHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = kDoseMatrixChunkMagic;
+        header.encoding = dense ? 1 : 0;
+        header.count = count;
+        header.id_bytes = static_cast<std::uint32_t>(id.size());
+        header.payload_bytes = detail::chunk_payload_bytes(id.size(), dense, count);
+        out_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        
+        write_padded(id.data(), id.size());
+        if (!dense) {
+            write_padded(column.rows, count * sizeof(std::uint32_t));
+        }
+        write_padded(values, count * sizeof(float));
+        
+        DoseMatrixChunkTrailer trailer;
+        std::memset(&trailer, 0, sizeof(trailer));
+        trailer.magic = kDoseMatrixChunkEndMagic;
+        trailer.payload_bytes = header.payload_bytes;
+        out_.write(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+        out_.flush();
+        if (!out_) {
+            throw std::runtime_error("Không ghi được cột " + id + " vào tệp ma trận liều " + path_);
+        }
+        if (known_.insert(id).second) {
+            columns_.push_back(id);
+        }
+    }
+    
+private:
+    void write_padded(const void* data, std::uint64_t bytes) {
+        static const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        if (bytes > 0) {
+            out_.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+        }
+        out_.write(zeros, static_cast<std::streamsize>(detail::pad8(bytes) - bytes));
+    }
+    
+    std::string path_;
+    std::size_t num_voxels_;
+    std::ofstream out_;
+    std::vector<std::string> columns_;
+    std::set<std::string> known_;
+    bool resumed_ = false;
+};
+
+// Ghi toàn bộ một ma trận ảnh hưởng thành tệp mới, cột j có id column_ids[j]
+inline void save_dose_matrix_file(const std::string& path, const DoseInfluenceMatrix& matrix,
+                                  const std::vector<std::string>& column_ids, std::uint64_t ct_hash = 0) {
+    if (column_ids.size() != matrix.num_columns()) {
+        throw std::invalid_argument("Số id cột không khớp với số cột của ma trận ảnh hưởng");
+    }
+    const auto shape = matrix.shape();
+    MaskVolume grid = MaskVolume::view(nullptr, shape[0], shape[1], shape[2], matrix.spacing(), matrix.origin());
+    DoseMatrixFileWriter writer(path, grid, ct_hash, false);
+    for (std::size_t j = 0; j < matrix.num_columns(); ++j) {
+        writer.append(column_ids[j], matrix.column(j));
+    }
+}
+
+/**
+ * Ánh xạ tệp thành ma trận ảnh hưởng chỉ đọc: các cột trỏ thẳng vào tệp, không
+ * sao chép. column_ids chọn và sắp các cột (thiếu cột nào thì ném lỗi); rỗng lấy
+ * mọi cột theo thứ tự tệp. expected_ct_hash khác 0 thì phải khớp hash trong tệp.
+ * verify = true kiểm tra chỉ số voxel của các cột thưa (trong lưới, tăng ngặt; đọc toàn bộ tệp).
+ */
+inline DoseInfluenceMatrix open_dose_matrix_file(const std::string& path,
+                                                 const std::vector<std::string>& column_ids = {},
+                                                 std::uint64_t expected_ct_hash = 0,
+                                                 bool verify = false) {
+    auto file = std::make_shared<const MappedFile>(path);
+    DoseMatrixFileInfo info = detail::scan_dose_matrix_file(file->data(), file->size(), path);
+    if (expected_ct_hash != 0 && info.ct_hash != expected_ct_hash) {
+        throw std::runtime_error("Tệp ma trận liều " + path + " được tính trên CT khác");
+    }
+    
+    std::vector<const DoseMatrixChunk*> selected;
+    if (column_ids.empty()) {
+        for (const auto& chunk : info.chunks) {
+            selected.push_back(&chunk);
+        }
+    } else {
+        for (const auto& id : column_ids) {
+            const DoseMatrixChunk* chunk = info.find(id);
+            if (chunk == nullptr) {
+                throw std::out_of_range("Tệp ma trận liều " + path + " không có cột " + id);
+            }
+            selected.push_back(chunk);
+        }
+    }
+    
+    const std::size_t num_voxels = info.num_voxels();
+    std::vector<DoseInfluenceMatrix::Column> columns;
+    for (const DoseMatrixChunk* chunk : selected) {
+        DoseInfluenceMatrix::Column column;
+        column.dense = chunk->dense;
+        column.count = static_cast<std::size_t>(chunk->count);
+        column.values = reinterpret_cast<const float*>(file->data() + chunk->values_offset);
+        if (!chunk->dense) {
+            column.rows = reinterpret_cast<const std::uint32_t*>(file->data() + chunk->rows_offset);
+            if (verify) {
+                for (std::size_t k = 0; k < column.count; ++k) {
+                    if (column.rows[k] >= num_voxels) {
+                        throw std::out_of_range("Chỉ số voxel của cột " + chunk->id + " vượt ngoài lưới liều");
+                    }
+                    if (k > 0 && column.rows[k] <= column.rows[k - 1]) {
+                        throw std::runtime_error("Chỉ số voxel của cột " + chunk->id + " không tăng dần");
+                    }
+                }
+            }
+        }
+        columns.push_back(column);
+    }
+    
+    MaskVolume grid = MaskVolume::view(nullptr, info.shape[0], info.shape[1], info.shape[2],
+                                       info.spacing, info.origin);
+    return DoseInfluenceMatrix::from_columns(grid, std::move(columns), std::move(file));
+}
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_DOSE_MATRIX_FILE_H
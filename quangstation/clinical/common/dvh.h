@@ -0,0 +1,359 @@
+#ifndef QUANGSTATION_DVH_H
+#define QUANGSTATION_DVH_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "volume3d.h"
+#include "structure_mask.h"
+
+namespace quangstation {
+
+// Cấu trúc cho DVH (Dose Volume Histogram)
+struct DVH {
+    std::string structure_name;
+    std::vector<double> dose_bins;  // Giá trị liều (Gy)
+    std::vector<double> volume;     // Thể tích tích lũy (%)
+    
+    // Thông số thống kê liều
+    double d_min;   // Liều tối thiểu
+    double d_max;   // Liều tối đa
+    double d_mean;  // Liều trung bình
+    double v95;     // Thể tích nhận 95% liều
+    double v100;    // Thể tích nhận 100% liều
+    double d95;     // Liều tại 95% thể tích
+    double d50;     // Liều tại 50% thể tích
+    double d2cc;    // Liều tại 2cc thể tích
+    
+    std::size_t voxel_count = 0;
+    double volume_cc = 0.0;
+    
+    DVH(const std::string& name) : structure_name(name), d_min(0), d_max(0),
+          d_mean(0), v95(0), v100(0), d95(0), d50(0), d2cc(0) {}
+};
+
+struct DVHOptions {
+    std::size_t bins = 1000;       // Số bin cố định trên [0, dose_max]
+    double dose_max = 0.0;         // Gy, <= 0: liều lớn nhất trên lưới
+    double prescribed_dose = 0.0;  // Gy, mốc của V95/V100; <= 0: dùng dose_max
+};
+
+/**
+ * Liều (Gy) mà percent% thể tích cấu trúc nhận ít nhất. dose_bins là các cạnh bin
+ * và volume[i] là thể tích tích lũy đúng tại cạnh i; trong một bin liều coi như
+ * phân bố đều (nội suy tuyến tính), bin cuối kéo dài tới d_max.
+ */
+inline double dose_at_volume(const DVH& dvh, double percent) {
+    if (dvh.voxel_count == 0 || dvh.volume.empty()) {
+        return 0.0;
+    }
+    if (percent <= 0.0) {
+        return dvh.d_max;
+    }
+    if (percent >= 100.0) {
+        return dvh.d_min;
+    }
+    const std::size_t n = dvh.volume.size();
+    // Cạnh cuối cùng còn có thể tích tích lũy >= percent
+    std::size_t i = 0;
+    while (i + 1 < n && dvh.volume[i + 1] >= percent) {
+        ++i;
+    }
+    const double next = i + 1 < n ? dvh.volume[i + 1] : 0.0;
+    const double upper = i + 1 < n ? dvh.dose_bins[i + 1] : std::max(dvh.d_max, dvh.dose_bins[i]);
+    double dose = dvh.dose_bins[i];
+    if (dvh.volume[i] > next) {
+        dose += (upper - dvh.dose_bins[i]) * (dvh.volume[i] - percent) / (dvh.volume[i] - next);
+    }
+    return std::min(std::max(dose, dvh.d_min), dvh.d_max);
+}
+
+// Thể tích (%) nhận ít nhất dose (Gy), nội suy tuyến tính giữa các cạnh bin
+inline double volume_at_dose(const DVH& dvh, double dose) {
+    if (dvh.voxel_count == 0 || dvh.volume.empty() || dose > dvh.d_max) {
+        return 0.0;
+    }
+    if (dose <= dvh.d_min) {
+        return 100.0;
+    }
+    const std::size_t n = dvh.volume.size();
+    const double width = n > 1 ? dvh.dose_bins[1] - dvh.dose_bins[0] : 0.0;
+    std::size_t i = width > 0.0 ? static_cast<std::size_t>(dose / width) : n - 1;
+    i = std::min(i, n - 1);
+    const double next = i + 1 < n ? dvh.volume[i + 1] : 0.0;
+    const double upper = i + 1 < n ? dvh.dose_bins[i + 1] : dvh.d_max;
+    if (upper <= dvh.dose_bins[i]) {
+        return dvh.volume[i];
+    }
+    return dvh.volume[i] + (next - dvh.volume[i]) * (dose - dvh.dose_bins[i]) / (upper - dvh.dose_bins[i]);
+}
+
+/**
+ * DVH tích lũy và các chỉ số của DVH cho mọi cấu trúc trong một lượt duyệt lưới liều.
+ *
+ * Mỗi cấu trúc chỉ duyệt các đoạn voxel của mặt nạ nén (StructureMask) trong hộp
+ * bao của nó, nên mô ngoài các cấu trúc không được đổi sang bin; các lát z chia cho
+ * các luồng, mỗi luồng giữ histogram riêng (cấu trúc × bin) và gộp lại ở cuối, nên
+ * kết quả không phụ thuộc số luồng. Bin có bề rộng cố định dose_max / bins, thêm một
+ * bin tràn cho liều >= dose_max, nên thể tích tích lũy tại các cạnh bin là chính xác.
+ * d_min, d_max, d_mean tính trực tiếp từ liều; Dx, Vx nội suy trong bin (xem
+ * dose_at_volume, volume_at_dose). Mặt nạ phải cùng kích thước với dose; spacing
+ * của dose (mm) cho thể tích cc và D2cc.
+ */
+template <typename T>
+std::vector<DVH> calculate_dvhs(const Volume3D<T>& dose,
+                                const std::map<std::string, StructureMask>& structures,
+                                const DVHOptions& options = DVHOptions()) {
+    std::vector<const StructureMask*> masks;
+    std::vector<DVH> result;
+    for (const auto& entry : structures) {
+        if (!entry.second.same_shape(dose)) {
+            throw std::invalid_argument("Kích thước mặt nạ " + entry.first + " không khớp với lưới liều");
+        }
+        masks.push_back(&entry.second);
+        result.emplace_back(entry.first);
+    }
+    if (masks.empty() || dose.empty()) {
+        return result;
+    }
+    
+    const long depth = static_cast<long>(dose.depth());
+    const std::size_t num_structures = masks.size();
+    const std::size_t bins = std::max<std::size_t>(options.bins, 1);
+    const std::size_t row_bins = bins + 1;  // Bin cuối: liều >= dose_max
+    
+    double dose_max = options.dose_max;
+    if (dose_max <= 0.0) {
+        dose_max = 0.0;
+        const std::size_t n = dose.size();
+        const T* d = dose.data();
+        for (std::size_t i = 0; i < n; ++i) {
+            dose_max = std::max(dose_max, static_cast<double>(d[i]));
+        }
+        if (dose_max <= 0.0) {
+            dose_max = 1.0;
+        }
+    }
+    const double bin_width = dose_max / bins;
+    const double inv_width = 1.0 / bin_width;
+    
+    std::vector<std::uint64_t> histogram(num_structures * row_bins, 0);
+    std::vector<std::uint64_t> count(num_structures, 0);
+    std::vector<double> sum(num_structures, 0.0);
+    std::vector<double> min_dose(num_structures, std::numeric_limits<double>::infinity());
+    std::vector<double> max_dose(num_structures, -std::numeric_limits<double>::infinity());
+    
+    #pragma omp parallel
+    {
+        std::vector<std::uint64_t> local_histogram(num_structures * row_bins, 0);
+        std::vector<std::uint64_t> local_count(num_structures, 0);
+        std::vector<double> local_sum(num_structures, 0.0);
+        std::vector<double> local_min(num_structures, std::numeric_limits<double>::infinity());
+        std::vector<double> local_max(num_structures, -std::numeric_limits<double>::infinity());
+        
+        #pragma omp for schedule(dynamic)
+        for (long z = 0; z < depth; ++z) {
+            for (std::size_t s = 0; s < num_structures; ++s) {
+                std::uint64_t* h = local_histogram.data() + s * row_bins;
+                double slice_sum = 0.0;
+                double slice_min = local_min[s];
+                double slice_max = local_max[s];
+                std::uint64_t n = 0;
+                masks[s]->for_each_run_in_slice(static_cast<std::size_t>(z),
+                    [&](std::size_t rz, std::size_t y, std::size_t x_begin, std::size_t x_end) {
+                        const T* dose_row = dose.row(rz, y);
+                        for (std::size_t x = x_begin; x < x_end; ++x) {
+                            const double value = dose_row[x];
+                            const double bin = std::max(0.0, value * inv_width);
+                            ++h[static_cast<std::size_t>(std::min(bin, static_cast<double>(bins)))];
+                            slice_sum += value;
+                            slice_min = std::min(slice_min, value);
+                            slice_max = std::max(slice_max, value);
+                        }
+                        n += x_end - x_begin;
+                    });
+                local_count[s] += n;
+                local_sum[s] += slice_sum;
+                local_min[s] = slice_min;
+                local_max[s] = slice_max;
+            }
+        }
+        
+        #pragma omp critical(quangstation_dvh_merge)
+        {
+            for (std::size_t k = 0; k < histogram.size(); ++k) {
+                histogram[k] += local_histogram[k];
+            }
+            for (std::size_t s = 0; s < num_structures; ++s) {
+                count[s] += local_count[s];
+                sum[s] += local_sum[s];
+                min_dose[s] = std::min(min_dose[s], local_min[s]);
+                max_dose[s] = std::max(max_dose[s], local_max[s]);
+            }
+        }
+    }
+    
+    const double voxel_volume_cc = dose.spacing()[0] * dose.spacing()[1] * dose.spacing()[2] / 1000.0;
+    const double reference_dose = options.prescribed_dose > 0.0 ? options.prescribed_dose : dose_max;
+    for (std::size_t s = 0; s < num_structures; ++s) {
+        DVH& dvh = result[s];
+        dvh.voxel_count = static_cast<std::size_t>(count[s]);
+        dvh.volume_cc = dvh.voxel_count * voxel_volume_cc;
+        if (dvh.voxel_count == 0) {
+            continue;
+        }
+        
+        // Thể tích tích lũy tại cạnh i = số voxel ở bin >= i
+        const std::uint64_t* h = histogram.data() + s * row_bins;
+        dvh.dose_bins.resize(row_bins);
+        dvh.volume.resize(row_bins);
+        std::uint64_t cumulative = 0;
+        for (std::size_t i = row_bins; i-- > 0;) {
+            cumulative += h[i];
+            dvh.dose_bins[i] = i * bin_width;
+            dvh.volume[i] = 100.0 * static_cast<double>(cumulative) / static_cast<double>(count[s]);
+        }
+        
+        dvh.d_min = min_dose[s];
+        dvh.d_max = max_dose[s];
+        dvh.d_mean = sum[s] / static_cast<double>(count[s]);
+        dvh.d95 = dose_at_volume(dvh, 95.0);
+        dvh.d50 = dose_at_volume(dvh, 50.0);
+        dvh.d2cc = dose_at_volume(dvh, 100.0 * 2.0 / dvh.volume_cc);  // Cấu trúc < 2cc: d_min
+        dvh.v95 = volume_at_dose(dvh, 0.95 * reference_dose);
+        dvh.v100 = volume_at_dose(dvh, reference_dose);
+    }
+    return result;
+}
+
+// Như trên với mặt nạ dạng lưới (giá trị > 0 thuộc cấu trúc), nén từng mặt nạ một lần
+template <typename T, typename M>
+std::vector<DVH> calculate_dvhs(const Volume3D<T>& dose,
+                                const std::map<std::string, Volume3D<M>>& structures,
+                                const DVHOptions& options = DVHOptions()) {
+    std::map<std::string, StructureMask> masks;
+    for (const auto& entry : structures) {
+        if (!entry.second.same_shape(dose)) {
+            throw std::invalid_argument("Kích thước mặt nạ " + entry.first + " không khớp với lưới liều");
+        }
+        masks.emplace(entry.first, StructureMask(entry.second));
+    }
+    return calculate_dvhs(dose, masks, options);
+}
+
+// Histogram liều và các thống kê chính xác (theo thứ hạng) của một cấu trúc
+struct DoseHistogram {
+    std::string structure_name;
+    std::vector<std::int64_t> counts;  // Số voxel theo bin, như numpy.histogram
+    std::size_t voxel_count = 0;       // Mọi voxel của cấu trúc, kể cả liều ngoài [0, dose_max]
+    double d_min = 0.0;
+    double d_max = 0.0;
+    double d_mean = 0.0;
+    double d_median = 0.0;
+    std::vector<double> dose_at_volume;  // Theo volume_levels (xem calculate_dose_histograms)
+    
+    DoseHistogram(const std::string& name) : structure_name(name) {}
+};
+
+/**
+ * Histogram và thống kê liều của từng cấu trúc theo đúng quy ước của DVHCalculator
+ * (dvh.py) để đường C++ cho cùng kết quả với NumPy:
+ *  - counts như numpy.histogram(values, bins, range=(0, dose_max)): cạnh i·(dose_max/bins),
+ *    bin cuối đóng bên phải, liều ngoài [0, dose_max] không được đếm;
+ *  - d_median như numpy.median; dose_at_volume[k] là liều đã sắp xếp tại thứ hạng
+ *    round(n·(100 - volume_levels[k])/100) (làm tròn về số chẵn như numpy.round),
+ *    kẹp vào [0, n - 1].
+ * Mỗi cấu trúc gom liều theo các đoạn của mặt nạ nén rồi sắp xếp một lần; các cấu trúc
+ * chia cho các luồng. dose_max phải dương.
+ */
+template <typename T>
+std::vector<DoseHistogram> calculate_dose_histograms(const Volume3D<T>& dose,
+                                                     const std::map<std::string, StructureMask>& structures,
+                                                     std::size_t bins, double dose_max,
+                                                     const std::vector<double>& volume_levels) {
+    if (bins == 0 || !(dose_max > 0.0)) {
+        throw std::invalid_argument("Histogram liều cần bins > 0 và dose_max > 0");
+    }
+    std::vector<const StructureMask*> masks;
+    std::vector<DoseHistogram> result;
+    for (const auto& entry : structures) {
+        if (!entry.second.same_shape(dose)) {
+            throw std::invalid_argument("Kích thước mặt nạ " + entry.first + " không khớp với lưới liều");
+        }
+        masks.push_back(&entry.second);
+        result.emplace_back(entry.first);
+    }
+    
+    // Cạnh bin như numpy.linspace(0, dose_max, bins + 1)
+    const double step = dose_max / static_cast<double>(bins);
+    std::vector<double> edges(bins + 1);
+    for (std::size_t i = 0; i < bins; ++i) {
+        edges[i] = static_cast<double>(i) * step;
+    }
+    edges[bins] = dose_max;
+    
+    const long num_structures = static_cast<long>(masks.size());
+    #pragma omp parallel for schedule(dynamic)
+    for (long s = 0; s < num_structures; ++s) {
+        DoseHistogram& histogram = result[s];
+        std::vector<double> values;
+        values.reserve(masks[s]->count());
+        masks[s]->for_each_run([&](std::size_t z, std::size_t y, std::size_t x_begin, std::size_t x_end) {
+            const T* dose_row = dose.row(z, y);
+            for (std::size_t x = x_begin; x < x_end; ++x) {
+                values.push_back(static_cast<double>(dose_row[x]));
+            }
+        });
+        
+        histogram.counts.assign(bins, 0);
+        double sum = 0.0;
+        for (double value : values) {
+            sum += value;
+            if (!(value >= 0.0 && value <= dose_max)) {
+                continue;
+            }
+            // Chỉ số ước lượng rồi hiệu chỉnh theo cạnh bin, như numpy
+            std::size_t bin = std::min(static_cast<std::size_t>(value / dose_max * static_cast<double>(bins)),
+                                       bins - 1);
+            if (bin > 0 && value < edges[bin]) {
+                --bin;
+            } else if (bin + 1 < bins && value >= edges[bin + 1]) {
+                ++bin;
+            }
+            ++histogram.counts[bin];
+        }
+        
+        const std::size_t n = values.size();
+        histogram.voxel_count = n;
+        histogram.dose_at_volume.assign(volume_levels.size(), 0.0);
+        if (n == 0) {
+            continue;
+        }
+        std::sort(values.begin(), values.end());
+        histogram.d_min = values.front();
+        histogram.d_max = values.back();
+        histogram.d_mean = sum / static_cast<double>(n);
+        histogram.d_median = (n % 2 == 1) ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2.0;
+        for (std::size_t k = 0; k < volume_levels.size(); ++k) {
+            const double rank = std::nearbyint(static_cast<double>(n) * (100.0 - volume_levels[k]) / 100.0);
+            const double index = std::min(std::max(rank, 0.0), static_cast<double>(n - 1));
+            histogram.dose_at_volume[k] = values[static_cast<std::size_t>(index)];
+        }
+    }
+    return result;
+}
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_DVH_H
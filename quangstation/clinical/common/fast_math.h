@@ -0,0 +1,54 @@
+#ifndef QUANGSTATION_FAST_MATH_H
+#define QUANGSTATION_FAST_MATH_H
+
+#include <cstdint>
+#include <cstring>
+
+namespace quangstation {
+
+/**
+ * exp(x) không rẽ nhánh, dùng được trong vòng lặp `omp simd` (std::exp của libm
+ * chỉ được vector hóa khi bật -ffast-math). Rút gọn Cody–Waite về |r| <= ln2/2
+ * rồi đa thức Taylor bậc 12; sai số tương đối < 1e-15 trên [-708, 709].
+ * x < -708 cho 0, x > 709 bị chặn tại exp(709).
+ */
+inline double fast_exp(double x) {
+    const double log2e = 1.4426950408889634;
+    const double ln2_hi = 6.93147180369123816490e-01;
+    const double ln2_lo = 1.90821492927058770002e-10;
+    const double round_magic = 6755399441055744.0;  // 1.5 · 2^52: cộng vào để làm tròn về số nguyên gần nhất
+    
+    const double clamped = x < -708.0 ? -708.0 : (x > 709.0 ? 709.0 : x);
+    const double shifted = clamped * log2e + round_magic;
+    const double k = shifted - round_magic;
+    const double r = (clamped - k * ln2_hi) - k * ln2_lo;
+    
+    // e^r = Σ r^n / n!, n = 0..12 (Horner)
+    double p = 1.0 / 479001600.0;
+    p = p * r + 1.0 / 39916800.0;
+    p = p * r + 1.0 / 3628800.0;
+    p = p * r + 1.0 / 362880.0;
+    p = p * r + 1.0 / 40320.0;
+    p = p * r + 1.0 / 5040.0;
+    p = p * r + 1.0 / 720.0;
+    p = p * r + 1.0 / 120.0;
+    p = p * r + 1.0 / 24.0;
+    p = p * r + 1.0 / 6.0;
+    p = p * r + 0.5;
+    p = p * r + 1.0;
+    p = p * r + 1.0;
+    
+    // 2^k: các bit thấp của shifted chứa k (bù hai), đưa vào trường số mũ
+    std::int64_t shifted_bits, magic_bits;
+    std::memcpy(&shifted_bits, &shifted, sizeof(double));
+    std::memcpy(&magic_bits, &round_magic, sizeof(double));
+    const std::int64_t scale_bits = (shifted_bits - magic_bits + 1023) << 52;
+    double scale;
+    std::memcpy(&scale, &scale_bits, sizeof(double));
+    
+    return x < -708.0 ? 0.0 : p * scale;
+}
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_FAST_MATH_H
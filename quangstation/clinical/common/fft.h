@@ -0,0 +1,138 @@
+#ifndef QUANGSTATION_FFT_H
+#define QUANGSTATION_FFT_H
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <vector>
+
+namespace quangstation {
+
+/**
+ * FFT phức một chiều, mixed-radix (Cooley-Tukey) cho độ dài bất kỳ.
+ * Hiệu quả nhất khi độ dài chỉ có thừa số 2, 3, 5 (xem FFT::good_size).
+ */
+class FFT {
+public:
+    using Complex = std::complex<double>;
+    
+    explicit FFT(std::size_t n) : n_(n), twiddles_(n) {
+        for (std::size_t i = 0; i < n_; ++i) {
+            double phase = -2.0 * M_PI * static_cast<double>(i) / static_cast<double>(n_);
+            twiddles_[i] = Complex(std::cos(phase), std::sin(phase));
+        }
+        
+        // Phân tích n thành các cặp (p, m) với p là thừa số nguyên tố
+        std::size_t m = n_;
+        std::size_t p = 2;
+        while (m > 1) {
+            while (m % p != 0) {
+                p = (p == 2) ? 3 : p + 2;
+                if (p * p > m) {
+                    p = m;
+                }
+            }
+            m /= p;
+            factors_.push_back(p);
+            factors_.push_back(m);
+        }
+    }
+    
+    std::size_t size() const { return n_; }
+    
+    // out = DFT(in), in và out là hai buffer riêng biệt độ dài n
+    void forward(const Complex* in, Complex* out) const {
+        if (n_ == 0) {
+            return;
+        }
+        if (n_ == 1) {
+            out[0] = in[0];
+            return;
+        }
+        std::vector<Complex> scratch(max_factor());
+        work(out, in, 1, factors_.data(), scratch);
+    }
+    
+    // out = IDFT(in) (đã chia cho n)
+    void inverse(const Complex* in, Complex* out) const {
+        std::vector<Complex> conj_in(n_);
+        for (std::size_t i = 0; i < n_; ++i) {
+            conj_in[i] = std::conj(in[i]);
+        }
+        forward(conj_in.data(), out);
+        double scale = 1.0 / static_cast<double>(n_);
+        for (std::size_t i = 0; i < n_; ++i) {
+            out[i] = std::conj(out[i]) * scale;
+        }
+    }
+    
+    // Độ dài nhỏ nhất >= n chỉ gồm thừa số 2, 3, 5
+    static std::size_t good_size(std::size_t n) {
+        if (n <= 1) {
+            return 1;
+        }
+        for (std::size_t candidate = n; ; ++candidate) {
+            std::size_t m = candidate;
+            for (std::size_t p : {2, 3, 5}) {
+                while (m % p == 0) {
+                    m /= p;
+                }
+            }
+            if (m == 1) {
+                return candidate;
+            }
+        }
+    }
+    
+private:
+    std::size_t max_factor() const {
+        std::size_t result = 1;
+        for (std::size_t i = 0; i < factors_.size(); i += 2) {
+            result = std::max(result, factors_[i]);
+        }
+        return result;
+    }
+    
+    void work(Complex* out, const Complex* in, std::size_t fstride,
+              const std::size_t* factors, std::vector<Complex>& scratch) const {
+        const std::size_t p = factors[0];
+        const std::size_t m = factors[1];
+        
+        if (m == 1) {
+            for (std::size_t i = 0; i < p; ++i) {
+                out[i] = in[i * fstride];
+            }
+        } else {
+            for (std::size_t i = 0; i < p; ++i) {
+                work(out + i * m, in + i * fstride, fstride * p, factors + 2, scratch);
+            }
+        }
+        
+        // Butterfly tổng quát cho thừa số p
+        for (std::size_t u = 0; u < m; ++u) {
+            for (std::size_t q = 0; q < p; ++q) {
+                scratch[q] = out[u + q * m];
+            }
+            for (std::size_t q1 = 0; q1 < p; ++q1) {
+                std::size_t k = u + q1 * m;
+                Complex sum = scratch[0];
+                std::size_t twidx = 0;
+                for (std::size_t q = 1; q < p; ++q) {
+                    twidx += fstride * k;
+                    twidx %= n_;
+                    sum += scratch[q] * twiddles_[twidx];
+                }
+                out[k] = sum;
+            }
+        }
+    }
+    
+    std::size_t n_;
+    std::vector<Complex> twiddles_;
+    std::vector<std::size_t> factors_;
+};
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_FFT_H
@@ -0,0 +1,262 @@
+#ifndef QUANGSTATION_GRID_POOL_H
+#define QUANGSTATION_GRID_POOL_H
+
+#include <complex>
+#include <cstddef>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "volume3d.h"
+#include "resample.h"
+
+namespace quangstation {
+
+// Thống kê của GridPool, đếm từ khi tạo hoặc từ lần reset_stats gần nhất
+struct GridPoolStats {
+    std::size_t allocations = 0;      // Lần phải cấp phát heap (không có buffer phù hợp trong pool)
+    std::size_t reuses = 0;           // Lần dùng lại buffer đã trả về
+    std::size_t bytes_allocated = 0;  // Tổng byte cấp phát mới
+    std::size_t pooled_buffers = 0;   // Buffer đang chờ trong pool
+    std::size_t pooled_bytes = 0;
+};
+
+template <typename T>
+class PooledVolume;
+
+/**
+ * Pool bộ nhớ cho các lưới trung gian của một lần tính (lưới riêng của mỗi luồng,
+ * TERMA từng control point, liều từng chùm tia, buffer FFT...). acquire lấy buffer
+ * đã trả về nhỏ nhất đủ chứa (không quá hai lần kích thước cần), chỉ cấp phát mới
+ * khi không có; release trả buffer về pool thay vì giải phóng. Đối tượng sở hữu pool
+ * (thuật toán liều, optimizer) dùng nó qua các chùm tia, lần lặp và lần gọi, nên ở
+ * trạng thái ổn định allocations không tăng. Tổng dung lượng giữ lại không vượt
+ * max_bytes (buffer trả về khi pool đã đầy được giải phóng). An toàn luồng; hỗ trợ
+ * phần tử double, float và std::complex<double>.
+ */
+class GridPool {
+public:
+    template <typename T>
+    using Buffer = std::vector<T, AlignedAllocator<T>>;
+    
+    explicit GridPool(std::size_t max_bytes = std::size_t(1) << 30) : max_bytes_(max_bytes) {}
+    
+    // Bản sao là pool rỗng cùng giới hạn: buffer không dùng chung giữa hai đối tượng
+    GridPool(const GridPool& other) : max_bytes_(other.max_bytes()) {}
+    
+    GridPool& operator=(const GridPool& other) {
+        if (this != &other) {
+            set_max_bytes(other.max_bytes());
+        }
+        return *this;
+    }
+    
+    // Buffer n phần tử, mọi phần tử bằng value
+    template <typename T>
+    Buffer<T> acquire_buffer(std::size_t n, const T& value = T()) {
+        Buffer<T> buffer = take<T>(n);
+        buffer.assign(n, value);
+        return buffer;
+    }
+    
+    template <typename T>
+    void release_buffer(Buffer<T>&& buffer) noexcept {
+        const std::size_t bytes = buffer.capacity() * sizeof(T);
+        if (bytes == 0) {
+            return;
+        }
+        Buffer<T> dropped;  // Giải phóng ngoài khóa khi pool đã đầy
+        std::lock_guard<std::mutex> lock(mutex_);
+        try {
+            if (pooled_bytes_ + bytes > max_bytes_) {
+                dropped = std::move(buffer);
+                return;
+            }
+            std::get<FreeList<T>>(free_lists_).push_back(std::move(buffer));
+            pooled_bytes_ += bytes;
+            ++pooled_buffers_;
+        } catch (...) {
+            dropped = std::move(buffer);
+        }
+    }
+    
+    template <typename T>
+    Volume3D<T> acquire(std::size_t depth, std::size_t height, std::size_t width, T value = T(),
+                        const std::array<double, 3>& spacing = {1.0, 1.0, 1.0},
+                        const std::array<double, 3>& origin = {0.0, 0.0, 0.0}) {
+        return Volume3D<T>(acquire_buffer<T>(depth * height * width, value),
+                           depth, height, width, spacing, origin);
+    }
+    
+    template <typename T>
+    Volume3D<T> acquire(const GridGeometry& grid, T value = T()) {
+        return acquire<T>(grid.depth, grid.height, grid.width, value, grid.spacing, grid.origin);
+    }
+    
+    // Như Volume3D<T>::like nhưng bộ nhớ lấy từ pool
+    template <typename T, typename U>
+    Volume3D<T> acquire_like(const Volume3D<U>& other, T value = T()) {
+        return acquire<T>(other.depth(), other.height(), other.width(), value,
+                          other.spacing(), other.origin());
+    }
+    
+    // Trả bộ nhớ của grid về pool (grid trở thành rỗng); view không có bộ nhớ để trả
+    template <typename T>
+    void release(Volume3D<T>& grid) noexcept {
+        release_buffer<T>(grid.release_storage());
+    }
+    
+    template <typename T>
+    void release(Volume3D<T>&& grid) noexcept {
+        release(grid);
+    }
+    
+    // Lưới lấy từ pool, tự trả về khi ra khỏi phạm vi
+    template <typename T>
+    PooledVolume<T> lease(const GridGeometry& grid, T value = T());
+    
+    template <typename T, typename U>
+    PooledVolume<T> lease_like(const Volume3D<U>& other, T value = T());
+    
+    GridPoolStats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        GridPoolStats result = stats_;
+        result.pooled_buffers = pooled_buffers_;
+        result.pooled_bytes = pooled_bytes_;
+        return result;
+    }
+    
+    void reset_stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_ = GridPoolStats();
+    }
+    
+    // Giảm giới hạn thì các buffer đang giữ được giải phóng
+    void set_max_bytes(std::size_t max_bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        max_bytes_ = max_bytes;
+        if (pooled_bytes_ > max_bytes_) {
+            clear_locked();
+        }
+    }
+    
+    std::size_t max_bytes() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return max_bytes_;
+    }
+    
+    // Giải phóng mọi buffer đang giữ
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        clear_locked();
+    }
+    
+private:
+    template <typename T>
+    using FreeList = std::vector<Buffer<T>>;
+    
+    // Buffer dung lượng trong [n, 2n] nhỏ nhất trong pool, hoặc buffer mới dung lượng n
+    template <typename T>
+    Buffer<T> take(std::size_t n) {
+        if (n == 0) {
+            return Buffer<T>();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            FreeList<T>& list = std::get<FreeList<T>>(free_lists_);
+            auto best = list.end();
+            for (auto it = list.begin(); it != list.end(); ++it) {
+                if (it->capacity() >= n && it->capacity() <= 2 * n &&
+                    (best == list.end() || it->capacity() < best->capacity())) {
+                    best = it;
+                }
+            }
+            if (best != list.end()) {
+                std::swap(*best, list.back());
+                Buffer<T> buffer = std::move(list.back());
+                list.pop_back();
+                pooled_bytes_ -= buffer.capacity() * sizeof(T);
+                --pooled_buffers_;
+                ++stats_.reuses;
+                return buffer;
+            }
+            ++stats_.allocations;
+            stats_.bytes_allocated += n * sizeof(T);
+        }
+        Buffer<T> buffer;
+        buffer.reserve(n);
+        return buffer;
+    }
+    
+    void clear_locked() {
+        std::get<FreeList<double>>(free_lists_).clear();
+        std::get<FreeList<float>>(free_lists_).clear();
+        std::get<FreeList<std::complex<double>>>(free_lists_).clear();
+        pooled_bytes_ = 0;
+        pooled_buffers_ = 0;
+    }
+    
+    mutable std::mutex mutex_;
+    std::size_t max_bytes_;
+    std::size_t pooled_bytes_ = 0;
+    std::size_t pooled_buffers_ = 0;
+    GridPoolStats stats_;
+    std::tuple<FreeList<double>, FreeList<float>, FreeList<std::complex<double>>> free_lists_;
+};
+
+/**
+ * Lưới mượn từ GridPool, trả bộ nhớ về pool khi hủy (kể cả khi có ngoại lệ).
+ * Chỉ di chuyển được, không sao chép.
+ */
+template <typename T>
+class PooledVolume {
+public:
+    PooledVolume(GridPool& pool, Volume3D<T> grid) : pool_(&pool), grid_(std::move(grid)) {}
+    
+    PooledVolume(PooledVolume&& other) noexcept : pool_(other.pool_), grid_(std::move(other.grid_)) {}
+    
+    PooledVolume(const PooledVolume&) = delete;
+    PooledVolume& operator=(const PooledVolume&) = delete;
+    PooledVolume& operator=(PooledVolume&&) = delete;
+    
+    ~PooledVolume() { pool_->release(grid_); }
+    
+    Volume3D<T>& get() { return grid_; }
+    const Volume3D<T>& get() const { return grid_; }
+    Volume3D<T>& operator*() { return grid_; }
+    const Volume3D<T>& operator*() const { return grid_; }
+    Volume3D<T>* operator->() { return &grid_; }
+    const Volume3D<T>* operator->() const { return &grid_; }
+    
+private:
+    GridPool* pool_;
+    Volume3D<T> grid_;
+};
+
+template <typename T>
+PooledVolume<T> GridPool::lease(const GridGeometry& grid, T value) {
+    return PooledVolume<T>(*this, acquire<T>(grid, value));
+}
+
+template <typename T, typename U>
+PooledVolume<T> GridPool::lease_like(const Volume3D<U>& other, T value) {
+    return PooledVolume<T>(*this, acquire_like<T>(other, value));
+}
+
+// Như GridPool::acquire_like / release với pool có thể null (cấp phát và giải phóng thông thường)
+template <typename T, typename U>
+Volume3D<T> pool_acquire_like(GridPool* pool, const Volume3D<U>& other, T value = T()) {
+    return pool ? pool->acquire_like<T>(other, value) : Volume3D<T>::like(other, value);
+}
+
+template <typename T>
+void pool_release(GridPool* pool, Volume3D<T>& grid) noexcept {
+    if (pool) {
+        pool->release(grid);
+    }
+}
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_GRID_POOL_H
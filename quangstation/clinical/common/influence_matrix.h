@@ -0,0 +1,443 @@
+#ifndef QUANGSTATION_INFLUENCE_MATRIX_H
+#define QUANGSTATION_INFLUENCE_MATRIX_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "volume3d.h"
+#include "structure_mask.h"
+
+namespace quangstation {
+
+/**
+ * Ma trận ảnh hưởng liều thưa dạng CSC: mỗi cột là liều trên một đơn vị trọng số
+ * của một chùm tia (hoặc beamlet), hàng là chỉ số voxel tuyến tính trên lưới liều.
+ *
+ * Giá trị lưu float, chỉ số voxel 32 bit. Chỉ các voxel được giữ (mặc định: hợp
+ * các mặt nạ cấu trúc) và có liều vượt ngưỡng mới được lưu, nên bộ nhớ tỷ lệ với
+ * số voxel thực sự nhận liều thay vì (số cột × kích thước lưới).
+ *
+ * Các cột có thể nằm trong bộ nhớ (CSC, dựng bằng add_column/from_csc) hoặc là view
+ * trên vùng nhớ ngoài, ví dụ tệp ánh xạ (from_columns, xem dose_matrix_file.h); khi
+ * đó mỗi cột thưa hoặc dày và ma trận chỉ đọc.
+ */
+class DoseInfluenceMatrix {
+public:
+    using index_type = std::uint32_t;
+    using value_type = float;
+    
+    // Một cột: count phần tử (rows[k], values[k]); cột dày có rows = nullptr và phần tử k là voxel k
+    struct Column {
+        const index_type* rows = nullptr;
+        const value_type* values = nullptr;
+        std::size_t count = 0;
+        bool dense = false;
+        
+        index_type row(std::size_t k) const {
+            return dense ? static_cast<index_type>(k) : rows[k];
+        }
+    };
+    
+    DoseInfluenceMatrix() = default;
+    
+    // Ma trận rỗng trên lưới có cùng kích thước, spacing và origin với grid
+    template <typename U>
+    explicit DoseInfluenceMatrix(const Volume3D<U>& grid)
+        : depth_(grid.depth()), height_(grid.height()), width_(grid.width()),
+          spacing_(grid.spacing()), origin_(grid.origin()) {
+        if (grid.size() > std::numeric_limits<index_type>::max()) {
+            throw std::length_error("Lưới liều quá lớn cho chỉ số voxel 32 bit");
+        }
+    }
+    
+    // Dựng từ ba mảng CSC (col_ptr có num_columns + 1 phần tử). Hàng trong mỗi cột được sắp
+    // tăng dần; một voxel xuất hiện hai lần trong cùng cột là lỗi (invalid_argument)
+    template <typename U>
+    static DoseInfluenceMatrix from_csc(const Volume3D<U>& grid,
+                                        std::vector<std::size_t> col_ptr,
+                                        std::vector<index_type> row_index,
+                                        std::vector<value_type> values) {
+        if (col_ptr.empty() || col_ptr.front() != 0 || col_ptr.back() != row_index.size() ||
+            row_index.size() != values.size()) {
+            throw std::invalid_argument("Dữ liệu CSC của ma trận ảnh hưởng không hợp lệ");
+        }
+        for (std::size_t j = 1; j < col_ptr.size(); ++j) {
+            if (col_ptr[j] < col_ptr[j - 1]) {
+                throw std::invalid_argument("col_ptr của ma trận ảnh hưởng phải không giảm");
+            }
+        }
+        for (index_type r : row_index) {
+            if (r >= grid.size()) {
+                throw std::out_of_range("Chỉ số voxel vượt ngoài lưới liều");
+            }
+        }
+        sort_columns(col_ptr, row_index, values);
+        DoseInfluenceMatrix matrix(grid);
+        matrix.col_ptr_ = std::move(col_ptr);
+        matrix.row_index_ = std::move(row_index);
+        matrix.values_ = std::move(values);
+        return matrix;
+    }
+    
+    /**
+     * Ma trận chỉ đọc trên các cột nằm trong storage (giữ sống cùng ma trận và mọi bản
+     * sao của nó). Hình học lưới lấy từ grid; cột dày phải có đúng grid.size() phần tử.
+     * Chỉ số voxel của cột thưa không được kiểm tra ở đây (sẽ phải đọc toàn bộ dữ liệu):
+     * người gọi bảo đảm chúng < grid.size() và tăng ngặt trong mỗi cột.
+     */
+    template <typename U>
+    static DoseInfluenceMatrix from_columns(const Volume3D<U>& grid, std::vector<Column> columns,
+                                            std::shared_ptr<const void> storage) {
+        if (!storage) {
+            throw std::invalid_argument("Ma trận ảnh hưởng chỉ đọc cần vùng nhớ chứa các cột");
+        }
+        DoseInfluenceMatrix matrix(grid);
+        matrix.external_.reserve(columns.size());
+        for (Column& column : columns) {
+            if (column.dense && column.count != grid.size()) {
+                throw std::invalid_argument("Cột dày của ma trận ảnh hưởng phải có một giá trị cho mỗi voxel");
+            }
+            matrix.external_nnz_ += column.count;
+            matrix.external_.push_back(column);
+        }
+        matrix.storage_ = std::move(storage);
+        return matrix;
+    }
+    
+    /**
+     * Mặt nạ voxel cần giữ: hợp các mặt nạ cấu trúc cùng kích thước với grid.
+     * outside_stride > 0 giữ thêm các voxel ngoài cấu trúc trên lưới con cách
+     * đều outside_stride voxel theo mỗi trục (lấy mẫu mô lành).
+     */
+    template <typename U>
+    static MaskVolume structure_union(const Volume3D<U>& grid,
+                                      const std::map<std::string, MaskVolume>& masks,
+                                      int outside_stride = 0) {
+        MaskVolume keep = MaskVolume::like(grid, 0);
+        for (const auto& entry : masks) {
+            if (!entry.second.same_shape(grid)) {
+                continue;
+            }
+            const std::size_t n = keep.size();
+            const std::uint8_t* mask_data = entry.second.data();
+            std::uint8_t* keep_data = keep.data();
+            for (std::size_t i = 0; i < n; ++i) {
+                keep_data[i] |= (mask_data[i] > 0);
+            }
+        }
+        add_outside_samples(keep, outside_stride);
+        return keep;
+    }
+    
+    // Như trên với mặt nạ nén: chỉ ghi các đoạn voxel của mỗi cấu trúc trong hộp bao
+    template <typename U>
+    static MaskVolume structure_union(const Volume3D<U>& grid,
+                                      const std::map<std::string, StructureMask>& masks,
+                                      int outside_stride = 0) {
+        MaskVolume keep = MaskVolume::like(grid, 0);
+        for (const auto& entry : masks) {
+            if (!entry.second.same_shape(grid)) {
+                continue;
+            }
+            entry.second.for_each_run([&keep](std::size_t z, std::size_t y, std::size_t x_begin, std::size_t x_end) {
+                std::fill(keep.row(z, y) + x_begin, keep.row(z, y) + x_end, static_cast<std::uint8_t>(1));
+            });
+        }
+        add_outside_samples(keep, outside_stride);
+        return keep;
+    }
+    
+    // Chỉ lưu các voxel có keep > 0 trong các cột thêm sau đó (mặt nạ rỗng: giữ mọi voxel)
+    void set_voxel_mask(const MaskVolume& keep) {
+        if (!keep.empty() && !same_grid(keep)) {
+            throw std::invalid_argument("Mặt nạ voxel không khớp với lưới của ma trận ảnh hưởng");
+        }
+        keep_ = keep.clone();
+    }
+    
+    // Các cột chỉ lưu voxel của mặt nạ (không lưu toàn bộ lưới)
+    bool has_voxel_mask() const {
+        return !keep_.empty();
+    }
+    
+    // Bỏ mọi cột (giữ lưới và mặt nạ voxel), ví dụ khi từng cột được ghi ra tệp ngay sau khi tính
+    void clear_columns() {
+        if (is_external()) {
+            throw std::logic_error("Không xóa cột được của ma trận ảnh hưởng chỉ đọc");
+        }
+        col_ptr_.assign(1, 0);
+        row_index_.clear();
+        values_.clear();
+    }
+    
+    // Thêm một cột từ lưới liều dày, bỏ các giá trị <= threshold. Trả về chỉ số cột.
+    std::size_t add_column(const DoseVolume& dose, double threshold = 0.0) {
+        if (is_external()) {
+            throw std::logic_error("Không thêm cột được vào ma trận ảnh hưởng chỉ đọc");
+        }
+        if (!same_grid(dose)) {
+            throw std::invalid_argument("Kích thước ma trận liều chùm tia không khớp với ma trận ảnh hưởng");
+        }
+        const std::size_t n = dose.size();
+        const double* dose_data = dose.data();
+        const std::uint8_t* keep_data = keep_.empty() ? nullptr : keep_.data();
+        for (std::size_t i = 0; i < n; ++i) {
+            if (dose_data[i] > threshold && (!keep_data || keep_data[i])) {
+                row_index_.push_back(static_cast<index_type>(i));
+                values_.push_back(static_cast<value_type>(dose_data[i]));
+            }
+        }
+        col_ptr_.push_back(row_index_.size());
+        return col_ptr_.size() - 2;
+    }
+    
+    // out += Σ_j weights[j] · cột j (out phải cùng lưới)
+    void multiply_add(const std::vector<double>& weights, DoseVolume& out) const {
+        if (!same_grid(out)) {
+            throw std::invalid_argument("Lưới liều đích không khớp với ma trận ảnh hưởng");
+        }
+        double* out_data = out.data();
+        const std::size_t columns = std::min(num_columns(), weights.size());
+        
+        // Mỗi khối hàng liên tục của out thuộc về một luồng: với mỗi cột, đoạn phần tử rơi
+        // vào khối tìm bằng tìm kiếm nhị phân (hàng trong cột tăng dần), nên không có rào
+        // chắn giữa các cột và không có hai luồng ghi cùng voxel
+        const std::size_t n = out.size();
+        const long blocks = static_cast<long>(std::min<std::size_t>(
+            std::max<std::size_t>(1, n / kMultiplyBlock), 4 * static_cast<std::size_t>(max_threads())));
+        #pragma omp parallel for schedule(dynamic)
+        for (long b = 0; b < blocks; ++b) {
+            const std::size_t lo = n * static_cast<std::size_t>(b) / static_cast<std::size_t>(blocks);
+            const std::size_t hi = n * static_cast<std::size_t>(b + 1) / static_cast<std::size_t>(blocks);
+            for (std::size_t j = 0; j < columns; ++j) {
+                const double w = weights[j];
+                if (w == 0.0) {
+                    continue;
+                }
+                const Column c = column(j);
+                if (c.dense) {
+                    for (std::size_t k = lo; k < hi; ++k) {
+                        out_data[k] += w * c.values[k];
+                    }
+                    continue;
+                }
+                const index_type* first = std::lower_bound(c.rows, c.rows + c.count, static_cast<index_type>(lo));
+                const index_type* last = hi >= n ? c.rows + c.count
+                                                 : std::lower_bound(first, c.rows + c.count, static_cast<index_type>(hi));
+                const value_type* values = c.values + (first - c.rows);
+                for (const index_type* r = first; r != last; ++r, ++values) {
+                    out_data[*r] += w * *values;
+                }
+            }
+        }
+    }
+    
+    /**
+     * Tích khối cho nhiều vector trọng số cùng lúc: outs[p] += B · weights[p],
+     * với weights[p] = weights + p · weight_stride (num_columns phần tử). Mỗi phần
+     * tử của B chỉ được đọc một lần cho cả khối. Không tự song song hóa: người
+     * gọi chia các khối cho các luồng.
+     */
+    void multiply_add_batch(const double* weights, std::size_t weight_stride,
+                            std::size_t count, double* const* outs) const {
+        constexpr std::size_t kMaxBatch = 16;
+        double w[kMaxBatch];
+        for (std::size_t first = 0; first < count; first += kMaxBatch) {
+            const std::size_t n = std::min(kMaxBatch, count - first);
+            for (std::size_t j = 0; j < num_columns(); ++j) {
+                bool any = false;
+                for (std::size_t p = 0; p < n; ++p) {
+                    w[p] = weights[(first + p) * weight_stride + j];
+                    any = any || w[p] != 0.0;
+                }
+                if (!any) {
+                    continue;
+                }
+                const Column c = column(j);
+                for (std::size_t k = 0; k < c.count; ++k) {
+                    const index_type r = c.row(k);
+                    const double v = c.values[k];
+                    for (std::size_t p = 0; p < n; ++p) {
+                        outs[first + p][r] += w[p] * v;
+                    }
+                }
+            }
+        }
+    }
+    
+    // Liều tổng Σ_j weights[j] · cột j trên lưới mới
+    DoseVolume multiply(const std::vector<double>& weights) const {
+        DoseVolume out = make_grid();
+        multiply_add(weights, out);
+        return out;
+    }
+    
+    // (B^T · g)_j = Σ_i g_i · B_ij, g là một giá trị cho mỗi voxel của lưới
+    std::vector<double> transpose_multiply(const double* g) const {
+        const long columns = static_cast<long>(num_columns());
+        std::vector<double> result(columns, 0.0);
+        #pragma omp parallel for schedule(dynamic)
+        for (long j = 0; j < columns; ++j) {
+            const Column c = column(j);
+            double sum = 0.0;
+            if (c.dense) {
+                for (std::size_t k = 0; k < c.count; ++k) {
+                    sum += g[k] * c.values[k];
+                }
+            } else {
+                for (std::size_t k = 0; k < c.count; ++k) {
+                    sum += g[c.rows[k]] * c.values[k];
+                }
+            }
+            result[j] = sum;
+        }
+        return result;
+    }
+    
+    // Khôi phục một cột thành lưới liều dày (voxel không được lưu bằng 0)
+    DoseVolume column_dose(std::size_t j) const {
+        DoseVolume out = make_grid();
+        if (j >= num_columns()) {
+            throw std::out_of_range("Chỉ số cột của ma trận ảnh hưởng vượt giới hạn");
+        }
+        double* out_data = out.data();
+        const Column c = column(j);
+        for (std::size_t k = 0; k < c.count; ++k) {
+            out_data[c.row(k)] = c.values[k];
+        }
+        return out;
+    }
+    
+    // Lưới liều rỗng (0) cùng hình học
+    DoseVolume make_grid() const {
+        return DoseVolume(depth_, height_, width_, 0.0, spacing_, origin_);
+    }
+    
+    template <typename U>
+    bool same_grid(const Volume3D<U>& volume) const {
+        return volume.depth() == depth_ && volume.height() == height_ && volume.width() == width_;
+    }
+    
+    Column column(std::size_t j) const {
+        if (is_external()) {
+            return external_[j];
+        }
+        Column c;
+        c.rows = row_index_.data() + col_ptr_[j];
+        c.values = values_.data() + col_ptr_[j];
+        c.count = col_ptr_[j + 1] - col_ptr_[j];
+        return c;
+    }
+    
+    bool empty() const { return depth_ * height_ * width_ == 0; }
+    bool is_external() const { return storage_ != nullptr; }
+    std::size_t num_columns() const { return is_external() ? external_.size() : col_ptr_.size() - 1; }
+    std::size_t num_voxels() const { return depth_ * height_ * width_; }
+    std::size_t nnz() const { return is_external() ? external_nnz_ : values_.size(); }
+    
+    // Bộ nhớ heap của ma trận (không tính vùng nhớ ngoài của các cột chỉ đọc)
+    std::size_t memory_bytes() const {
+        return col_ptr_.size() * sizeof(std::size_t) +
+               row_index_.size() * sizeof(index_type) +
+               values_.size() * sizeof(value_type) + keep_.size() +
+               external_.size() * sizeof(Column);
+    }
+    
+    // Ba mảng CSC của ma trận trong bộ nhớ (ma trận chỉ đọc: dùng column())
+    const std::vector<std::size_t>& col_ptr() const { require_csc(); return col_ptr_; }
+    const std::vector<index_type>& row_index() const { require_csc(); return row_index_; }
+    const std::vector<value_type>& values() const { require_csc(); return values_; }
+    
+    std::array<std::size_t, 3> shape() const { return {depth_, height_, width_}; }
+    const std::array<double, 3>& spacing() const { return spacing_; }
+    const std::array<double, 3>& origin() const { return origin_; }
+    
+private:
+    // Số voxel tối thiểu của một khối hàng trong multiply_add
+    static constexpr std::size_t kMultiplyBlock = 4096;
+    
+    static int max_threads() {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+    
+    // Sắp hàng tăng dần trong từng cột (kèm giá trị), từ chối voxel lặp lại trong một cột
+    static void sort_columns(const std::vector<std::size_t>& col_ptr, std::vector<index_type>& row_index,
+                             std::vector<value_type>& values) {
+        std::vector<std::pair<index_type, value_type>> entries;
+        for (std::size_t j = 0; j + 1 < col_ptr.size(); ++j) {
+            const std::size_t begin = col_ptr[j];
+            const std::size_t end = col_ptr[j + 1];
+            if (!std::is_sorted(row_index.begin() + begin, row_index.begin() + end)) {
+                entries.clear();
+                for (std::size_t k = begin; k < end; ++k) {
+                    entries.emplace_back(row_index[k], values[k]);
+                }
+                std::sort(entries.begin(), entries.end(),
+                          [](const std::pair<index_type, value_type>& a, const std::pair<index_type, value_type>& b) {
+                              return a.first < b.first;
+                          });
+                for (std::size_t k = begin; k < end; ++k) {
+                    row_index[k] = entries[k - begin].first;
+                    values[k] = entries[k - begin].second;
+                }
+            }
+            if (std::adjacent_find(row_index.begin() + begin, row_index.begin() + end) != row_index.begin() + end) {
+                throw std::invalid_argument("Cột " + std::to_string(j) + " của ma trận ảnh hưởng có chỉ số voxel lặp lại");
+            }
+        }
+    }
+    
+    // Giữ thêm các voxel ngoài cấu trúc trên lưới con cách đều stride voxel theo mỗi trục
+    static void add_outside_samples(MaskVolume& keep, int stride) {
+        if (stride <= 0) {
+            return;
+        }
+        const std::size_t s = static_cast<std::size_t>(stride);
+        for (std::size_t z = 0; z < keep.depth(); z += s) {
+            for (std::size_t y = 0; y < keep.height(); y += s) {
+                std::uint8_t* row = keep.row(z, y);
+                for (std::size_t x = 0; x < keep.width(); x += s) {
+                    row[x] = 1;
+                }
+            }
+        }
+    }
+    
+    void require_csc() const {
+        if (is_external()) {
+            throw std::logic_error("Ma trận ảnh hưởng chỉ đọc không có mảng CSC trong bộ nhớ");
+        }
+    }
+    
+    std::size_t depth_ = 0, height_ = 0, width_ = 0;
+    std::array<double, 3> spacing_ = {1.0, 1.0, 1.0};
+    std::array<double, 3> origin_ = {0.0, 0.0, 0.0};
+    MaskVolume keep_;
+    std::vector<std::size_t> col_ptr_ = {0};
+    std::vector<index_type> row_index_;
+    std::vector<value_type> values_;
+    std::vector<Column> external_;          // Các cột chỉ đọc (khi storage_ khác rỗng)
+    std::size_t external_nnz_ = 0;
+    std::shared_ptr<const void> storage_;   // Giữ sống vùng nhớ của external_
+};
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_INFLUENCE_MATRIX_H
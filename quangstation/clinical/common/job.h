@@ -0,0 +1,201 @@
+#ifndef QUANGSTATION_JOB_H
+#define QUANGSTATION_JOB_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "volume3d.h"
+
+namespace quangstation {
+
+// Tiến trình của một công việc chạy nền
+struct JobProgress {
+    std::string stage;       // "dose", "optimize", "genetic"
+    int step = 0;            // Số chùm tia đã tính / lần lặp / thế hệ đã xong
+    int total = 0;           // Tổng số bước dự kiến (0: chưa biết)
+    double objective = std::numeric_limits<double>::quiet_NaN();  // Giá trị mục tiêu tốt nhất (NaN: không áp dụng)
+};
+
+// Công việc dừng vì bị hủy trước khi có kết quả hoàn chỉnh
+class JobCancelled : public std::runtime_error {
+public:
+    JobCancelled() : std::runtime_error("Công việc đã bị hủy") {}
+};
+
+/**
+ * Trạng thái dùng chung giữa một công việc và bên điều khiển nó: cờ hủy (công việc
+ * kiểm tra giữa các chùm tia, lần lặp, thế hệ), tiến trình mới nhất và kết quả tạm
+ * (trọng số tốt nhất, liều đã cộng dồn) đọc được khi công việc còn chạy. Callback
+ * tiến trình đặt khi tạo và được gọi trên luồng của công việc, ngoài mọi khóa.
+ */
+class JobControl {
+public:
+    using ProgressCallback = std::function<void(const JobProgress&)>;
+    
+    explicit JobControl(ProgressCallback callback = ProgressCallback()) : callback_(std::move(callback)) {}
+    
+    JobControl(const JobControl&) = delete;
+    JobControl& operator=(const JobControl&) = delete;
+    
+    void cancel() {
+        cancelled_.store(true);
+    }
+    
+    bool cancelled() const {
+        return cancelled_.load();
+    }
+    
+    void throw_if_cancelled() const {
+        if (cancelled()) {
+            throw JobCancelled();
+        }
+    }
+    
+    // Lưu tiến trình rồi gọi callback
+    void report(const JobProgress& progress) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            progress_ = progress;
+        }
+        if (callback_) {
+            callback_(progress);
+        }
+    }
+    
+    JobProgress progress() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return progress_;
+    }
+    
+    // Trọng số tốt nhất đến hiện tại, phẳng theo thứ tự chùm tia (và control point)
+    void publish_weights(std::vector<double> weights) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        weights_ = std::move(weights);
+    }
+    
+    std::vector<double> best_weights() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return weights_;
+    }
+    
+    // Liều cộng dồn đến hiện tại; ảnh chụp bất biến nên bên đọc giữ được bao lâu tùy ý
+    void publish_dose(std::shared_ptr<const DoseVolume> dose) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        dose_ = std::move(dose);
+    }
+    
+    std::shared_ptr<const DoseVolume> partial_dose() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return dose_;
+    }
+    
+private:
+    std::atomic<bool> cancelled_{false};
+    ProgressCallback callback_;
+    mutable std::mutex mutex_;
+    JobProgress progress_;
+    std::vector<double> weights_;
+    std::shared_ptr<const DoseVolume> dose_;
+};
+
+/**
+ * Chạy work(control) trên một luồng riêng ngay khi tạo. Ngoại lệ của work (kể cả
+ * JobCancelled) được giữ lại và ném lại ở get(). Hủy đối tượng thì yêu cầu hủy và
+ * chờ luồng kết thúc. Các đối tượng mà work tham chiếu (thuật toán, optimizer, lưới
+ * đầu vào) phải sống lâu hơn công việc và không được dùng ở nơi khác khi nó chạy.
+ */
+template <typename Result>
+class AsyncJob {
+public:
+    using Work = std::function<Result(JobControl&)>;
+    
+    explicit AsyncJob(Work work, JobControl::ProgressCallback callback = JobControl::ProgressCallback())
+        : control_(std::move(callback)), work_(std::move(work)) {
+        thread_ = std::thread([this]() {
+            Result result{};
+            std::exception_ptr error;
+            try {
+                result = work_(control_);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            result_ = std::move(result);
+            error_ = error;
+            done_ = true;
+            finished_.notify_all();
+        });
+    }
+    
+    AsyncJob(const AsyncJob&) = delete;
+    AsyncJob& operator=(const AsyncJob&) = delete;
+    
+    ~AsyncJob() {
+        cancel();
+        join();
+    }
+    
+    void cancel() {
+        control_.cancel();
+    }
+    
+    bool done() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return done_;
+    }
+    
+    // Chờ tối đa timeout_seconds (< 0: đến khi xong); trả về true nếu công việc đã xong
+    bool wait(double timeout_seconds = -1.0) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (timeout_seconds < 0.0) {
+            finished_.wait(lock, [this]() { return done_; });
+            return true;
+        }
+        return finished_.wait_for(lock, std::chrono::duration<double>(timeout_seconds),
+                                  [this]() { return done_; });
+    }
+    
+    // Kết quả (chờ nếu chưa xong); ném lại ngoại lệ của công việc
+    Result& get() {
+        wait();
+        join();
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        return result_;
+    }
+    
+    JobControl& control() { return control_; }
+    const JobControl& control() const { return control_; }
+    
+private:
+    void join() {
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+    
+    JobControl control_;
+    Work work_;
+    mutable std::mutex mutex_;
+    std::condition_variable finished_;
+    bool done_ = false;
+    Result result_;
+    std::exception_ptr error_;
+    std::thread thread_;
+};
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_JOB_H
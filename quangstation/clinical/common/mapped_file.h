@@ -0,0 +1,142 @@
+#ifndef QUANGSTATION_MAPPED_FILE_H
+#define QUANGSTATION_MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace quangstation {
+
+/**
+ * Ánh xạ chỉ đọc toàn bộ một tệp vào bộ nhớ. Hệ điều hành nạp trang theo nhu cầu
+ * và có thể bỏ trang khi thiếu bộ nhớ, nên mở tệp hàng GB gần như không tốn thời
+ * gian và không chiếm bộ nhớ heap. Không sao chép được; giữ bằng shared_ptr khi
+ * nhiều đối tượng cùng đọc.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) : path_(path) {
+#ifdef _WIN32
+        file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Không mở được tệp " + path);
+        }
+        LARGE_INTEGER length;
+        if (!GetFileSizeEx(file_, &length)) {
+            close();
+            throw std::runtime_error("Không đọc được kích thước tệp " + path);
+        }
+        size_ = static_cast<std::size_t>(length.QuadPart);
+        if (size_ > 0) {
+            mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping_ != nullptr) {
+                data_ = static_cast<const unsigned char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+            }
+            if (data_ == nullptr) {
+                close();
+                throw std::runtime_error("Không ánh xạ được tệp " + path);
+            }
+        }
+#else
+        fd_ = ::open(path.c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            throw std::runtime_error("Không mở được tệp " + path);
+        }
+        struct stat info;
+        if (::fstat(fd_, &info) != 0) {
+            close();
+            throw std::runtime_error("Không đọc được kích thước tệp " + path);
+        }
+        size_ = static_cast<std::size_t>(info.st_size);
+        if (size_ > 0) {
+            void* address = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+            if (address == MAP_FAILED) {
+                close();
+                throw std::runtime_error("Không ánh xạ được tệp " + path);
+            }
+            data_ = static_cast<const unsigned char*>(address);
+        }
+#endif
+    }
+    
+    ~MappedFile() { close(); }
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    const unsigned char* data() const { return data_; }
+    std::size_t size() const { return size_; }
+    const std::string& path() const { return path_; }
+    
+private:
+    void close() {
+#ifdef _WIN32
+        if (data_ != nullptr) {
+            UnmapViewOfFile(data_);
+        }
+        if (mapping_ != nullptr) {
+            CloseHandle(mapping_);
+        }
+        if (file_ != INVALID_HANDLE_VALUE) {
+            CloseHandle(file_);
+        }
+        mapping_ = nullptr;
+        file_ = INVALID_HANDLE_VALUE;
+#else
+        if (data_ != nullptr) {
+            ::munmap(const_cast<unsigned char*>(data_), size_);
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+        fd_ = -1;
+#endif
+        data_ = nullptr;
+    }
+    
+    std::string path_;
+    const unsigned char* data_ = nullptr;
+    std::size_t size_ = 0;
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+};
+
+// Cắt tệp về length byte (bỏ phần ghi dở ở cuối); false nếu không thành công
+inline bool truncate_file(const std::string& path, std::uint64_t length) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER position;
+    position.QuadPart = static_cast<LONGLONG>(length);
+    const bool ok = SetFilePointerEx(file, position, nullptr, FILE_BEGIN) && SetEndOfFile(file);
+    CloseHandle(file);
+    return ok;
+#else
+    return ::truncate(path.c_str(), static_cast<off_t>(length)) == 0;
+#endif
+}
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_MAPPED_FILE_H
@@ -0,0 +1,254 @@
+#ifndef QUANGSTATION_PROFILER_H
+#define QUANGSTATION_PROFILER_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "grid_pool.h"
+
+namespace quangstation {
+
+// Thời gian và khối lượng của một giai đoạn, cộng dồn qua mọi lần vào giai đoạn trong một lần gọi
+struct PhaseStats {
+    double seconds = 0.0;     // Tổng thời gian (cộng qua các luồng nên có thể vượt thời gian thực)
+    std::size_t calls = 0;
+    std::size_t voxels = 0;   // Số voxel đã xử lý (0 nếu giai đoạn không đếm)
+};
+
+// Thời gian của một chùm tia: tổng các tác vụ (control point, sector, pencil) của nó qua mọi luồng
+struct BeamProfile {
+    std::string beam_id;
+    double seconds = 0.0;
+    std::size_t tasks = 0;
+};
+
+// Một lần lặp (thế hệ với thuật toán di truyền) của optimizer
+struct IterationProfile {
+    int iteration = 0;
+    double seconds = 0.0;
+    double objective = 0.0;
+};
+
+// Thống kê của lần gọi ngoài cùng gần nhất (calculate, calculate_influence_matrix, optimize, ...)
+struct ProfileStats {
+    double total_seconds = 0.0;                     // Thời gian thực của lần gọi
+    std::map<std::string, PhaseStats> phases;
+    std::map<std::string, std::uint64_t> counters;  // Cache hit/miss, cấp phát, history, ...
+    std::vector<BeamProfile> beams;
+    std::vector<IterationProfile> iterations;
+};
+
+/**
+ * Bộ đo thời gian và bộ đếm cho các đường nóng của dose engine và optimizer.
+ * Đối tượng sở hữu (thuật toán liều, optimizer) mở một phiên ở mỗi điểm vào công
+ * khai; phiên ngoài cùng xóa thống kê cũ, các phiên lồng bên trong (calculate_plans
+ * gọi calculate, ...) cộng vào cùng thống kê. Chỉ đo ở mức giai đoạn/chùm tia/tác
+ * vụ/lần lặp, không đo trong vòng lặp voxel, nên chi phí không đáng kể so với phần
+ * việc được đo. An toàn luồng: các tác vụ song song cộng vào qua một mutex.
+ */
+class Profiler {
+public:
+    using Clock = std::chrono::steady_clock;
+    
+    Profiler() = default;
+    
+    // Bản sao là bộ đo rỗng: thống kê thuộc về lần gọi của đối tượng gốc
+    Profiler(const Profiler&) {}
+    
+    Profiler& operator=(const Profiler&) {
+        return *this;
+    }
+    
+    // Thời gian từ lúc tạo đến lúc hủy cộng vào giai đoạn phase
+    class ScopedTimer {
+    public:
+        ScopedTimer(Profiler& profiler, const char* phase, std::size_t voxels = 0)
+            : profiler_(profiler), phase_(phase), voxels_(voxels), start_(Clock::now()) {}
+        
+        ~ScopedTimer() {
+            profiler_.add_phase(phase_, seconds_since(start_), voxels_);
+        }
+        
+        void add_voxels(std::size_t voxels) {
+            voxels_ += voxels;
+        }
+        
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator=(const ScopedTimer&) = delete;
+        
+    private:
+        Profiler& profiler_;
+        const char* phase_;
+        std::size_t voxels_;
+        Clock::time_point start_;
+    };
+    
+    // Thời gian một tác vụ của chùm tia beam_id
+    class ScopedBeamTimer {
+    public:
+        ScopedBeamTimer(Profiler& profiler, const std::string& beam_id)
+            : profiler_(profiler), beam_id_(beam_id), start_(Clock::now()) {}
+        
+        ~ScopedBeamTimer() {
+            profiler_.add_beam_task(beam_id_, seconds_since(start_));
+        }
+        
+        ScopedBeamTimer(const ScopedBeamTimer&) = delete;
+        ScopedBeamTimer& operator=(const ScopedBeamTimer&) = delete;
+        
+    private:
+        Profiler& profiler_;
+        const std::string& beam_id_;
+        Clock::time_point start_;
+    };
+    
+    // Mở phiên; true nếu là phiên ngoài cùng (thống kê vừa được xóa)
+    bool begin() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (depth_++ > 0) {
+            return false;
+        }
+        ++sessions_;
+        stats_ = ProfileStats();
+        start_ = Clock::now();
+        last_iteration_ = start_;
+        return true;
+    }
+    
+    void end() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (depth_ > 0 && --depth_ == 0) {
+            stats_.total_seconds = seconds_since(start_);
+        }
+    }
+    
+    void add_phase(const std::string& phase, double seconds, std::size_t voxels = 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        PhaseStats& entry = stats_.phases[phase];
+        entry.seconds += seconds;
+        entry.calls += 1;
+        entry.voxels += voxels;
+    }
+    
+    void count(const std::string& counter, std::uint64_t amount = 1) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.counters[counter] += amount;
+    }
+    
+    void add_beam_task(const std::string& beam_id, double seconds) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (BeamProfile& beam : stats_.beams) {
+            if (beam.beam_id == beam_id) {
+                beam.seconds += seconds;
+                beam.tasks += 1;
+                return;
+            }
+        }
+        BeamProfile beam;
+        beam.beam_id = beam_id;
+        beam.seconds = seconds;
+        beam.tasks = 1;
+        stats_.beams.push_back(beam);
+    }
+    
+    // Kết thúc lần lặp iteration: thời gian tính từ lần lặp trước (hoặc đầu phiên)
+    void end_iteration(int iteration, double objective) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const Clock::time_point now = Clock::now();
+        IterationProfile entry;
+        entry.iteration = iteration;
+        entry.seconds = std::chrono::duration<double>(now - last_iteration_).count();
+        entry.objective = objective;
+        stats_.iterations.push_back(entry);
+        last_iteration_ = now;
+    }
+    
+    // Cộng thống kê của một đối tượng phụ (ví dụ optimizer giai đoạn thô) vào phiên hiện tại
+    void merge(const ProfileStats& other) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& entry : other.phases) {
+            PhaseStats& phase = stats_.phases[entry.first];
+            phase.seconds += entry.second.seconds;
+            phase.calls += entry.second.calls;
+            phase.voxels += entry.second.voxels;
+        }
+        for (const auto& entry : other.counters) {
+            stats_.counters[entry.first] += entry.second;
+        }
+        stats_.beams.insert(stats_.beams.end(), other.beams.begin(), other.beams.end());
+        stats_.iterations.insert(stats_.iterations.end(), other.iterations.begin(), other.iterations.end());
+        last_iteration_ = Clock::now();
+    }
+    
+    // Bản sao thống kê (đọc được cả khi phiên đang chạy, ví dụ từ công việc chạy nền)
+    ProfileStats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ProfileStats result = stats_;
+        if (depth_ > 0) {
+            result.total_seconds = seconds_since(start_);
+        }
+        return result;
+    }
+    
+    // Số thứ tự của phiên ngoài cùng đang mở (0 nếu không có phiên): kết quả đệm theo
+    // phiên (ví dụ hash của CT) chỉ dùng lại trong cùng một lần gọi công khai
+    std::uint64_t session() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return depth_ > 0 ? sessions_ : 0;
+    }
+    
+    static double seconds_since(Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    
+private:
+
+    mutable std::mutex mutex_;
+    ProfileStats stats_;
+    int depth_ = 0;
+    std::uint64_t sessions_ = 0;
+    Clock::time_point start_;
+    Clock::time_point last_iteration_;
+};
+
+/**
+ * Phiên đo của một điểm vào công khai. Phiên ngoài cùng cộng thêm số lần cấp phát
+ * lưới của pool trong lần gọi (grid_allocations, grid_reuses, grid_bytes_allocated).
+ */
+class ScopedProfileSession {
+public:
+    ScopedProfileSession(Profiler& profiler, const GridPool& pool)
+        : profiler_(profiler), pool_(pool), outermost_(profiler.begin()), start_(pool.stats()) {}
+    
+    ~ScopedProfileSession() {
+        if (outermost_) {
+            const GridPoolStats stats = pool_.stats();
+            profiler_.count("grid_allocations", stats.allocations - start_.allocations);
+            profiler_.count("grid_reuses", stats.reuses - start_.reuses);
+            profiler_.count("grid_bytes_allocated", stats.bytes_allocated - start_.bytes_allocated);
+        }
+        profiler_.end();
+    }
+    
+    bool outermost() const {
+        return outermost_;
+    }
+    
+    ScopedProfileSession(const ScopedProfileSession&) = delete;
+    ScopedProfileSession& operator=(const ScopedProfileSession&) = delete;
+    
+private:
+    Profiler& profiler_;
+    const GridPool& pool_;
+    bool outermost_;
+    GridPoolStats start_;
+};
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_PROFILER_H
@@ -0,0 +1,337 @@
+#ifndef QUANGSTATION_PYBIND_VOLUME_H
+#define QUANGSTATION_PYBIND_VOLUME_H
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "volume3d.h"
+#include "grid_pool.h"
+#include "job.h"
+#include "profiler.h"
+
+namespace quangstation {
+namespace pyutil {
+
+namespace py = pybind11;
+
+/**
+ * Giữ tham chiếu tới các mảng NumPy mà các view Volume3D đang trỏ vào.
+ * Lớp binding kế thừa lớp này để buffer sống ít nhất bằng đối tượng C++.
+ */
+struct BufferKeeper {
+    std::vector<py::object> buffers;
+    
+    void keep(const py::object& obj) {
+        buffers.push_back(obj);
+    }
+};
+
+// Kiểm tra mảng 3D, C-contiguous với kiểu dữ liệu T (không cần sao chép)
+template <typename T>
+inline bool is_zero_copy_compatible(const py::array& arr) {
+    return arr.ndim() == 3 &&
+           arr.itemsize() == static_cast<py::ssize_t>(sizeof(T)) &&
+           (arr.flags() & py::array::c_style) != 0;
+}
+
+/**
+ * Tạo view Volume3D<T> trên buffer NumPy.
+ *
+ * Nếu mảng đã đúng kiểu và C-contiguous thì không sao chép; ngược lại NumPy
+ * chuyển đổi một lần sang mảng tạm. Mảng thực sự được dùng được trả về qua
+ * `holder` để người gọi giữ tham chiếu trong suốt thời gian dùng view.
+ */
+template <typename T>
+inline Volume3D<T> borrow_volume(const py::array& input,
+                                 const std::array<double, 3>& spacing,
+                                 py::object& holder,
+                                 const char* name = "array") {
+    if (input.ndim() != 3) {
+        throw py::value_error(std::string(name) + " phải là mảng 3D");
+    }
+    
+    // Mặt nạ bool của NumPy (1 byte) được đọc trực tiếp như uint8_t
+    bool same_kind = py::isinstance<py::array_t<T>>(input) ||
+                     (sizeof(T) == 1 && input.dtype().kind() == 'b');
+    
+    py::array arr = input;
+    if (!same_kind || !is_zero_copy_compatible<T>(input)) {
+        arr = py::array_t<T, py::array::c_style | py::array::forcecast>::ensure(input);
+        if (!arr) {
+            throw py::value_error(std::string("Không thể chuyển đổi ") + name + " sang kiểu dữ liệu yêu cầu");
+        }
+    }
+    
+    holder = arr;
+    T* data = static_cast<T*>(const_cast<void*>(arr.data()));
+    return Volume3D<T>::view(
+        data,
+        static_cast<std::size_t>(arr.shape(0)),
+        static_cast<std::size_t>(arr.shape(1)),
+        static_cast<std::size_t>(arr.shape(2)),
+        spacing
+    );
+}
+
+/**
+ * Chuyển Volume3D sở hữu bộ nhớ thành mảng NumPy mà không sao chép.
+ * Buffer C++ được chuyển vào một capsule, NumPy giải phóng khi mảng bị thu hồi.
+ */
+template <typename T>
+inline py::array_t<T> to_numpy(Volume3D<T>&& volume) {
+    if (!volume.owns_data()) {
+        volume = volume.clone();
+    }
+    
+    auto* owner = new Volume3D<T>(std::move(volume));
+    py::capsule free_when_done(owner, [](void* ptr) {
+        delete static_cast<Volume3D<T>*>(ptr);
+    });
+    
+    std::vector<py::ssize_t> shape = {
+        static_cast<py::ssize_t>(owner->depth()),
+        static_cast<py::ssize_t>(owner->height()),
+        static_cast<py::ssize_t>(owner->width())
+    };
+    std::vector<py::ssize_t> strides = {
+        static_cast<py::ssize_t>(owner->slice_stride() * sizeof(T)),
+        static_cast<py::ssize_t>(owner->row_stride() * sizeof(T)),
+        static_cast<py::ssize_t>(sizeof(T))
+    };
+    
+    return py::array_t<T>(shape, strides, owner->data(), free_when_done);
+}
+
+// Như trên cho vector 1D (ví dụ đường DVH)
+template <typename T>
+inline py::array_t<T> to_numpy(std::vector<T>&& values) {
+    auto* owner = new std::vector<T>(std::move(values));
+    py::capsule free_when_done(owner, [](void* ptr) {
+        delete static_cast<std::vector<T>*>(ptr);
+    });
+    return py::array_t<T>(static_cast<py::ssize_t>(owner->size()), owner->data(), free_when_done);
+}
+
+/**
+ * Ghép các lưới cùng kích thước thành một mảng NumPy (N, z, y, x); mỗi lưới được
+ * chép một lần vào buffer chung rồi trả lại bộ nhớ. Danh sách rỗng cho mảng (0, 0, 0, 0).
+ */
+template <typename T>
+inline py::array_t<T> stack_to_numpy(std::vector<Volume3D<T>>&& volumes) {
+    const std::size_t depth = volumes.empty() ? 0 : volumes[0].depth();
+    const std::size_t height = volumes.empty() ? 0 : volumes[0].height();
+    const std::size_t width = volumes.empty() ? 0 : volumes[0].width();
+    for (const Volume3D<T>& volume : volumes) {
+        if (!volume.same_shape(volumes[0])) {
+            throw py::value_error("Các lưới có kích thước khác nhau");
+        }
+    }
+    auto* owner = new std::vector<T>(volumes.size() * depth * height * width);
+    py::capsule free_when_done(owner, [](void* ptr) {
+        delete static_cast<std::vector<T>*>(ptr);
+    });
+    
+    T* out = owner->data();
+    for (Volume3D<T>& volume : volumes) {
+        for (std::size_t z = 0; z < depth; ++z) {
+            for (std::size_t y = 0; y < height; ++y) {
+                std::copy(volume.row(z, y), volume.row(z, y) + width, out);
+                out += width;
+            }
+        }
+        volume = Volume3D<T>();
+    }
+    
+    std::vector<py::ssize_t> shape = {
+        static_cast<py::ssize_t>(volumes.size()),
+        static_cast<py::ssize_t>(depth),
+        static_cast<py::ssize_t>(height),
+        static_cast<py::ssize_t>(width)
+    };
+    return py::array_t<T>(shape, owner->data(), free_when_done);
+}
+
+// Đọc spacing (x, y, z) từ sequence Python
+inline std::array<double, 3> to_spacing(const py::sequence& seq) {
+    if (py::len(seq) != 3) {
+        throw py::value_error("spacing phải có 3 phần tử (mm)");
+    }
+    return {seq[0].cast<double>(), seq[1].cast<double>(), seq[2].cast<double>()};
+}
+
+// Thống kê cấp phát của GridPool thành dict Python
+inline py::dict to_dict(const GridPoolStats& stats) {
+    py::dict result;
+    result["allocations"] = stats.allocations;
+    result["reuses"] = stats.reuses;
+    result["bytes_allocated"] = stats.bytes_allocated;
+    result["pooled_buffers"] = stats.pooled_buffers;
+    result["pooled_bytes"] = stats.pooled_bytes;
+    return result;
+}
+
+/**
+ * Thống kê Profiler thành dict Python: {total_seconds, phases: {tên: {seconds, calls,
+ * voxels}}, counters: {tên: số}, beams: [{beam_id, seconds, tasks}], iterations:
+ * [{iteration, seconds, objective}]}
+ */
+inline py::dict to_dict(const ProfileStats& stats) {
+    py::dict phases;
+    for (const auto& entry : stats.phases) {
+        py::dict phase;
+        phase["seconds"] = entry.second.seconds;
+        phase["calls"] = entry.second.calls;
+        phase["voxels"] = entry.second.voxels;
+        phases[py::str(entry.first)] = phase;
+    }
+    py::dict counters;
+    for (const auto& entry : stats.counters) {
+        counters[py::str(entry.first)] = entry.second;
+    }
+    py::list beams;
+    for (const BeamProfile& beam : stats.beams) {
+        py::dict item;
+        item["beam_id"] = beam.beam_id;
+        item["seconds"] = beam.seconds;
+        item["tasks"] = beam.tasks;
+        beams.append(item);
+    }
+    py::list iterations;
+    for (const IterationProfile& iteration : stats.iterations) {
+        py::dict item;
+        item["iteration"] = iteration.iteration;
+        item["seconds"] = iteration.seconds;
+        item["objective"] = iteration.objective;
+        iterations.append(item);
+    }
+    py::dict result;
+    result["total_seconds"] = stats.total_seconds;
+    result["phases"] = phases;
+    result["counters"] = counters;
+    result["beams"] = beams;
+    result["iterations"] = iterations;
+    return result;
+}
+
+// Tiến trình của công việc chạy nền thành dict Python
+inline py::dict to_dict(const JobProgress& progress) {
+    py::dict result;
+    result["stage"] = progress.stage;
+    result["step"] = progress.step;
+    result["total"] = progress.total;
+    result["objective"] = progress.objective;
+    return result;
+}
+
+/**
+ * Callback tiến trình của JobControl gọi hàm Python callback(dict tiến trình) trên
+ * luồng của công việc: lấy GIL trước khi gọi, và ngoại lệ Python được đổi thành
+ * std::runtime_error khi vẫn giữ GIL (công việc dừng với lỗi đó). None: không gọi gì.
+ */
+inline JobControl::ProgressCallback progress_callback(const py::object& callback) {
+    if (callback.is_none()) {
+        return JobControl::ProgressCallback();
+    }
+    // Bản sao của callback có thể bị hủy trên luồng không giữ GIL
+    std::shared_ptr<py::object> function(new py::object(callback), [](py::object* ptr) {
+        py::gil_scoped_acquire gil;
+        delete ptr;
+    });
+    return [function](const JobProgress& progress) {
+        py::gil_scoped_acquire gil;
+        try {
+            (*function)(to_dict(progress));
+        } catch (py::error_already_set& e) {
+            throw std::runtime_error(e.what());
+        }
+    };
+}
+
+/**
+ * AsyncJob cho binding: giữ buffer NumPy mà công việc đọc (BufferKeeper), nhả GIL
+ * khi chờ hoặc khi hủy và chờ luồng kết thúc lúc bị thu hồi, và đổi kết quả sang
+ * Python đúng một lần ở result() (lần gọi sau trả về cùng đối tượng). Đối tượng
+ * C++ mà công việc dùng (thuật toán, optimizer) được giữ bằng py::keep_alive.
+ */
+template <typename Result>
+class PyJob : public BufferKeeper {
+public:
+    using Convert = std::function<py::object(Result&&)>;
+    
+    PyJob(BufferKeeper&& keeper, typename AsyncJob<Result>::Work work,
+          const py::object& callback, Convert convert)
+        : BufferKeeper(std::move(keeper)), convert_(std::move(convert)),
+          job_(new AsyncJob<Result>(std::move(work), progress_callback(callback))) {}
+    
+    ~PyJob() {
+        py::gil_scoped_release release;
+        job_.reset();
+    }
+    
+    void cancel() {
+        job_->cancel();
+    }
+    
+    bool done() const {
+        return job_->done();
+    }
+    
+    bool wait(double timeout_seconds) {
+        py::gil_scoped_release release;
+        return job_->wait(timeout_seconds);
+    }
+    
+    py::object result() {
+        if (!result_) {
+            wait(-1.0);
+            result_ = convert_(std::move(job_->get()));
+        }
+        return result_;
+    }
+    
+    py::dict progress() const {
+        return to_dict(job_->control().progress());
+    }
+    
+    const JobControl& control() const {
+        return job_->control();
+    }
+    
+private:
+    Convert convert_;
+    py::object result_;
+    std::unique_ptr<AsyncJob<Result>> job_;
+};
+
+/**
+ * Đăng ký lớp Python name cho PyJob<Result> với các phương thức chung: cancel, done,
+ * wait(timeout=None) (True nếu đã xong), result (chờ; ném lại lỗi của công việc) và
+ * progress ({stage, step, total, objective}). Module thêm các kết quả tạm riêng.
+ */
+template <typename Result>
+inline py::class_<PyJob<Result>> bind_job(py::module& m, const char* name) {
+    using Job = PyJob<Result>;
+    return py::class_<Job>(m, name)
+        .def("cancel", &Job::cancel, "Yêu cầu hủy; công việc dừng ở lần kiểm tra kế tiếp")
+        .def("done", &Job::done)
+        .def("wait", [](Job& job, const py::object& timeout) {
+                 return job.wait(timeout.is_none() ? -1.0 : timeout.cast<double>());
+             }, py::arg("timeout") = py::none(),
+             "Chờ tối đa timeout giây (None: đến khi xong); trả về True nếu đã xong")
+        .def("result", &Job::result, "Kết quả (chờ nếu chưa xong); ném lại lỗi của công việc")
+        .def("progress", &Job::progress, "Tiến trình mới nhất {stage, step, total, objective}");
+}
+
+} // namespace pyutil
+} // namespace quangstation
+
+#endif // QUANGSTATION_PYBIND_VOLUME_H
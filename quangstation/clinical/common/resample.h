@@ -0,0 +1,342 @@
+#ifndef QUANGSTATION_RESAMPLE_H
+#define QUANGSTATION_RESAMPLE_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "volume3d.h"
+
+namespace quangstation {
+
+/**
+ * Hình học của một lưới (kích thước, spacing, origin) không kèm dữ liệu.
+ * Vị trí voxel (x, y, z) là origin + (x, y, z) · spacing (mm), giống Volume3D.
+ */
+struct GridGeometry {
+    std::size_t depth = 0;
+    std::size_t height = 0;
+    std::size_t width = 0;
+    std::array<double, 3> spacing = {1.0, 1.0, 1.0};
+    std::array<double, 3> origin = {0.0, 0.0, 0.0};
+    
+    template <typename T>
+    static GridGeometry of(const Volume3D<T>& volume) {
+        GridGeometry grid;
+        grid.depth = volume.depth();
+        grid.height = volume.height();
+        grid.width = volume.width();
+        grid.spacing = volume.spacing();
+        grid.origin = volume.origin();
+        return grid;
+    }
+    
+    template <typename T>
+    Volume3D<T> make(T value = T()) const {
+        return Volume3D<T>(depth, height, width, value, spacing, origin);
+    }
+    
+    std::size_t size() const { return depth * height * width; }
+    bool empty() const { return size() == 0; }
+    
+    // Số voxel theo trục (0 = x, 1 = y, 2 = z)
+    std::size_t extent(int axis) const {
+        return axis == 0 ? width : (axis == 1 ? height : depth);
+    }
+    
+    bool operator==(const GridGeometry& other) const {
+        return depth == other.depth && height == other.height && width == other.width &&
+               spacing == other.spacing && origin == other.origin;
+    }
+    
+    bool operator!=(const GridGeometry& other) const { return !(*this == other); }
+    
+    std::uint64_t hash() const {
+        std::uint64_t h = 0xcbf29ce484222325ULL;
+        auto mix = [&h](std::uint64_t v) {
+            h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+            h *= 0x100000001b3ULL;
+        };
+        mix(depth);
+        mix(height);
+        mix(width);
+        for (int a = 0; a < 3; ++a) {
+            std::uint64_t bits = 0;
+            std::memcpy(&bits, &spacing[a], sizeof(double));
+            mix(bits);
+            std::memcpy(&bits, &origin[a], sizeof(double));
+            mix(bits);
+        }
+        return h;
+    }
+};
+
+/**
+ * Lưới cùng origin phủ vùng [origin, origin + (n - 1) · spacing] của grid với
+ * spacing trục a bằng max(resolution[a], spacing của grid). Trục đã thô hơn
+ * giữ nguyên.
+ */
+inline GridGeometry coarsened(const GridGeometry& grid, const std::array<double, 3>& resolution) {
+    GridGeometry result = grid;
+    for (int a = 0; a < 3; ++a) {
+        const std::size_t n = grid.extent(a);
+        if (grid.spacing[a] >= resolution[a] || n <= 1) {
+            continue;
+        }
+        const double length = (n - 1) * grid.spacing[a];
+        const std::size_t m = static_cast<std::size_t>(std::ceil(length / resolution[a] - 1e-9)) + 1;
+        result.spacing[a] = resolution[a];
+        (a == 0 ? result.width : (a == 1 ? result.height : result.depth)) = m;
+    }
+    return result;
+}
+
+// Như trên với cùng resolution cho cả ba trục; resolution <= 0 trả lại grid
+inline GridGeometry coarsened(const GridGeometry& grid, double resolution) {
+    if (resolution <= 0.0) {
+        return grid;
+    }
+    return coarsened(grid, {resolution, resolution, resolution});
+}
+
+/**
+ * Trọng số lọc theo một trục (dạng CSR): điểm đích i lấy Σ weight[k] · nguồn[index[k]],
+ * k ∈ [offset[i], offset[i + 1]). Bộ lọc tam giác có nửa bề rộng h = max(spacing
+ * nguồn, spacing đích): khi lưới đích mịn hơn (h = spacing nguồn) đó đúng là nội suy
+ * tuyến tính, khi lưới đích thô hơn lọc trung bình trên vùng voxel đích, tránh răng
+ * cưa khi lấy mẫu thưa. Ngoài lưới nguồn lấy giá trị biên.
+ */
+struct AxisFilter {
+    std::vector<int> offset;
+    std::vector<int> index;
+    std::vector<double> weight;
+};
+
+inline AxisFilter axis_filter(std::size_t source_count, double source_origin, double source_spacing,
+                              std::size_t target_count, double target_origin, double target_spacing) {
+    AxisFilter filter;
+    filter.offset.assign(1, 0);
+    const int last = static_cast<int>(source_count) - 1;
+    const double half_width = std::max(1.0, target_spacing / source_spacing);  // Theo chỉ số nguồn
+    for (std::size_t i = 0; i < target_count; ++i) {
+        const double position = (target_origin + i * target_spacing - source_origin) / source_spacing;
+        const double clamped = std::min(std::max(position, 0.0), static_cast<double>(std::max(last, 0)));
+        const int begin = static_cast<int>(std::floor(clamped - half_width)) + 1;
+        const int end = static_cast<int>(std::ceil(clamped + half_width)) - 1;
+        const std::size_t first = filter.index.size();
+        double sum = 0.0;
+        for (int j = begin; j <= end; ++j) {
+            const double w = 1.0 - std::abs(j - clamped) / half_width;
+            if (w <= 0.0) {
+                continue;
+            }
+            const int source = std::min(std::max(j, 0), std::max(last, 0));
+            if (filter.index.size() > first && filter.index.back() == source) {
+                filter.weight.back() += w;
+            } else {
+                filter.index.push_back(source);
+                filter.weight.push_back(w);
+            }
+            sum += w;
+        }
+        for (std::size_t k = first; k < filter.weight.size(); ++k) {
+            filter.weight[k] /= sum;
+        }
+        filter.offset.push_back(static_cast<int>(filter.index.size()));
+    }
+    return filter;
+}
+
+/**
+ * Lấy mẫu lại source lên lưới out (theo kích thước, spacing, origin của out, lưu kiểu U)
+ * bằng bộ lọc tam giác tách được: nội suy tam tuyến tính khi out mịn hơn, lọc trung bình
+ * khi out thô hơn (xem AxisFilter). Trọng số theo từng trục được tính trước; mỗi hàng
+ * đích gộp các hàng nguồn theo z, y trên cả chiều rộng (liên tục, vector hóa được) rồi
+ * lọc theo x.
+ */
+template <typename U, typename T>
+void resample_trilinear_into(const Volume3D<T>& source, Volume3D<U>& out) {
+    const GridGeometry target = GridGeometry::of(out);
+    if (source.empty() || target.empty()) {
+        return;
+    }
+    
+    const AxisFilter fx = axis_filter(source.width(), source.origin()[0], source.spacing()[0],
+                                      target.width, target.origin[0], target.spacing[0]);
+    const AxisFilter fy = axis_filter(source.height(), source.origin()[1], source.spacing()[1],
+                                      target.height, target.origin[1], target.spacing[1]);
+    const AxisFilter fz = axis_filter(source.depth(), source.origin()[2], source.spacing()[2],
+                                      target.depth, target.origin[2], target.spacing[2]);
+    
+    const long depth = static_cast<long>(target.depth);
+    const long height = static_cast<long>(target.height);
+    const int source_width = static_cast<int>(source.width());
+    const int target_width = static_cast<int>(target.width);
+    
+    #pragma omp parallel
+    {
+        std::vector<double> line(source_width);
+        double* plane = line.data();
+        
+        #pragma omp for collapse(2) schedule(static)
+        for (long z = 0; z < depth; ++z) {
+            for (long y = 0; y < height; ++y) {
+                std::fill(line.begin(), line.end(), 0.0);
+                for (int kz = fz.offset[z]; kz < fz.offset[z + 1]; ++kz) {
+                    for (int ky = fy.offset[y]; ky < fy.offset[y + 1]; ++ky) {
+                        const double w = fz.weight[kz] * fy.weight[ky];
+                        const T* row = source.row(fz.index[kz], fy.index[ky]);
+                        #pragma omp simd
+                        for (int x = 0; x < source_width; ++x) {
+                            plane[x] += w * row[x];
+                        }
+                    }
+                }
+                
+                U* out_row = out.row(z, y);
+                for (int x = 0; x < target_width; ++x) {
+                    double value = 0.0;
+                    for (int kx = fx.offset[x]; kx < fx.offset[x + 1]; ++kx) {
+                        value += fx.weight[kx] * plane[fx.index[kx]];
+                    }
+                    out_row[x] = static_cast<U>(value);
+                }
+            }
+        }
+    }
+}
+
+// Như trên vào lưới mới theo hình học target
+template <typename U, typename T>
+Volume3D<U> resample_trilinear(const Volume3D<T>& source, const GridGeometry& target) {
+    Volume3D<U> out = target.make<U>();
+    resample_trilinear_into(source, out);
+    return out;
+}
+
+/**
+ * Mặt nạ (giá trị > 0) coi như nằm trên lưới source, lấy mẫu lại lên lưới target:
+ * voxel đích bật khi tỷ lệ phủ (lọc như resample_trilinear) >= threshold. Cấu trúc
+ * nhỏ hơn một voxel đích không biến mất: khi không voxel nào đạt ngưỡng, các voxel
+ * có tỷ lệ phủ lớn nhất (> 0) được giữ.
+ */
+template <typename T>
+Volume3D<std::uint8_t> resample_mask(const Volume3D<T>& mask, const GridGeometry& source,
+                                     const GridGeometry& target, double threshold = 0.5) {
+    if (mask.depth() != source.depth || mask.height() != source.height || mask.width() != source.width) {
+        throw std::invalid_argument("Kích thước mặt nạ không khớp với lưới nguồn");
+    }
+    Volume3D<std::uint8_t> out = target.make<std::uint8_t>(0);
+    if (mask.empty() || target.empty()) {
+        return out;
+    }
+    Volume3D<float> coverage = source.make<float>(0.0f);
+    std::transform(mask.begin(), mask.end(), coverage.begin(),
+                   [](T value) { return value > 0 ? 1.0f : 0.0f; });
+    const Volume3D<float> fraction = resample_trilinear<float>(coverage, target);
+    
+    const std::size_t n = fraction.size();
+    const float* f = fraction.data();
+    std::uint8_t* o = out.data();
+    float max_fraction = 0.0f;
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        o[i] = f[i] >= threshold;
+        count += o[i];
+        max_fraction = std::max(max_fraction, f[i]);
+    }
+    if (count == 0 && max_fraction > 0.0f) {
+        for (std::size_t i = 0; i < n; ++i) {
+            o[i] = f[i] >= max_fraction;
+        }
+    }
+    return out;
+}
+
+// Như trên với lưới nguồn là hình học của chính mask
+template <typename T>
+Volume3D<std::uint8_t> resample_mask(const Volume3D<T>& mask, const GridGeometry& target,
+                                     double threshold = 0.5) {
+    return resample_mask(mask, GridGeometry::of(mask), target, threshold);
+}
+
+// Hộp chỉ số [lo, hi] (x, y, z) trên một lưới; rỗng khi hi < lo
+struct IndexBox {
+    std::array<long, 3> lo = {0, 0, 0};
+    std::array<long, 3> hi = {-1, -1, -1};
+    
+    bool empty() const { return hi[0] < lo[0] || hi[1] < lo[1] || hi[2] < lo[2]; }
+    
+    std::size_t size() const {
+        if (empty()) {
+            return 0;
+        }
+        return static_cast<std::size_t>((hi[0] - lo[0] + 1) * (hi[1] - lo[1] + 1) * (hi[2] - lo[2] + 1));
+    }
+    
+    void include(long x, long y, long z) {
+        if (empty()) {
+            lo = {x, y, z};
+            hi = {x, y, z};
+            return;
+        }
+        lo = {std::min(lo[0], x), std::min(lo[1], y), std::min(lo[2], z)};
+        hi = {std::max(hi[0], x), std::max(hi[1], y), std::max(hi[2], z)};
+    }
+    
+    void include(const IndexBox& other) {
+        if (!other.empty()) {
+            include(other.lo[0], other.lo[1], other.lo[2]);
+            include(other.hi[0], other.hi[1], other.hi[2]);
+        }
+    }
+    
+    // Mở rộng margin[a] voxel mỗi phía, kẹp trong lưới grid
+    void dilate(const std::array<long, 3>& margin, const GridGeometry& grid) {
+        if (empty()) {
+            return;
+        }
+        for (int a = 0; a < 3; ++a) {
+            lo[a] = std::max(0L, lo[a] - margin[a]);
+            hi[a] = std::min(static_cast<long>(grid.extent(a)) - 1, hi[a] + margin[a]);
+        }
+    }
+    
+    // Lưới con của grid giới hạn trong hộp (cùng spacing)
+    GridGeometry crop(const GridGeometry& grid) const {
+        GridGeometry result = grid;
+        result.width = static_cast<std::size_t>(hi[0] - lo[0] + 1);
+        result.height = static_cast<std::size_t>(hi[1] - lo[1] + 1);
+        result.depth = static_cast<std::size_t>(hi[2] - lo[2] + 1);
+        for (int a = 0; a < 3; ++a) {
+            result.origin[a] = grid.origin[a] + lo[a] * grid.spacing[a];
+        }
+        return result;
+    }
+};
+
+// Hộp bao các voxel có mask > 0
+template <typename T>
+IndexBox bounding_box(const Volume3D<T>& mask) {
+    IndexBox box;
+    for (std::size_t z = 0; z < mask.depth(); ++z) {
+        for (std::size_t y = 0; y < mask.height(); ++y) {
+            const T* row = mask.row(z, y);
+            for (std::size_t x = 0; x < mask.width(); ++x) {
+                if (row[x] > 0) {
+                    box.include(static_cast<long>(x), static_cast<long>(y), static_cast<long>(z));
+                }
+            }
+        }
+    }
+    return box;
+}
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_RESAMPLE_H
@@ -0,0 +1,357 @@
+#ifndef QUANGSTATION_STRUCTURE_MASK_H
+#define QUANGSTATION_STRUCTURE_MASK_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "volume3d.h"
+#include "resample.h"
+
+namespace quangstation {
+
+// Số bit 1 của một từ 64 bit (lệnh POPCNT khi được bật, ví dụ -mpopcnt / -march=native)
+inline int popcount64(std::uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(word);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    return static_cast<int>(__popcnt64(word));
+#else
+    word = word - ((word >> 1) & 0x5555555555555555ULL);
+    word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return static_cast<int>((word * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// Vị trí bit 1 thấp nhất của word (word khác 0)
+inline int lowest_bit64(std::uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(word);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return static_cast<int>(index);
+#else
+    int index = 0;
+    while (!(word & 1)) {
+        word >>= 1;
+        ++index;
+    }
+    return index;
+#endif
+}
+
+/**
+ * Mặt nạ cấu trúc nén: hộp bao các voxel của cấu trúc và một bitset cho mỗi hàng (z, y)
+ * trong hộp. Từ 64 bit căn theo chỉ số x tuyệt đối (từ thứ k phủ x trong [64k, 64k + 64)),
+ * nên hai mặt nạ cùng lưới AND/popcount được trực tiếp theo từ trên phần giao của hai hộp.
+ * Bộ nhớ là 1 bit mỗi voxel của hộp bao, thay cho 1 byte (MaskVolume) hoặc 4 byte
+ * (mảng int lồng nhau) mỗi voxel của cả lưới. Chỉ số tuyến tính của voxel là chỉ số
+ * trong lưới liên tục cùng kích thước: (z · height + y) · width + x.
+ */
+class StructureMask {
+public:
+    StructureMask() = default;
+
+    // Nén mặt nạ: voxel có giá trị > 0 thuộc cấu trúc
+    template <typename M>
+    explicit StructureMask(const Volume3D<M>& mask) {
+        build(mask, [](M value) { return value > 0; });
+    }
+
+    // Các voxel có values >= threshold, ví dụ thể tích đồng liều kê toa (PIV của chỉ số Paddick)
+    template <typename T>
+    static StructureMask at_least(const Volume3D<T>& values, double threshold) {
+        StructureMask mask;
+        mask.build(values, [threshold](T value) { return static_cast<double>(value) >= threshold; });
+        return mask;
+    }
+
+    // Kích thước lưới (không có lưới: mặt nạ rỗng, như MaskVolume mặc định)
+    std::size_t depth() const { return depth_; }
+    std::size_t height() const { return height_; }
+    std::size_t width() const { return width_; }
+    std::size_t size() const { return depth_ * height_ * width_; }
+    bool empty() const { return size() == 0; }
+    std::array<std::size_t, 3> shape() const { return {depth_, height_, width_}; }
+    const std::array<double, 3>& spacing() const { return spacing_; }
+    const std::array<double, 3>& origin() const { return origin_; }
+
+    template <typename U>
+    bool same_shape(const Volume3D<U>& other) const {
+        return depth_ == other.depth() && height_ == other.height() && width_ == other.width();
+    }
+
+    bool same_shape(const StructureMask& other) const {
+        return depth_ == other.depth_ && height_ == other.height_ && width_ == other.width_;
+    }
+
+    bool same_shape(const GridGeometry& grid) const {
+        return depth_ == grid.depth && height_ == grid.height && width_ == grid.width;
+    }
+
+    // Số voxel thuộc cấu trúc
+    std::size_t count() const { return count_; }
+
+    // Hộp bao (chỉ số x, y, z) các voxel thuộc cấu trúc; rỗng nếu không có voxel
+    const IndexBox& bounds() const { return bounds_; }
+
+    // Bộ nhớ của bitset (byte)
+    std::size_t memory_bytes() const { return words_.size() * sizeof(std::uint64_t); }
+
+    bool contains(std::size_t z, std::size_t y, std::size_t x) const {
+        if (!in_bounds(z, y, x)) {
+            return false;
+        }
+        return (row_words(z, y)[x / 64 - first_word_] >> (x % 64)) & 1;
+    }
+
+    /**
+     * Gọi f(z, y, x_begin, x_end) cho mỗi đoạn x liên tục [x_begin, x_end) của cấu trúc,
+     * theo thứ tự bộ nhớ. Dùng cho vòng lặp trên hàng của lưới liều (x chạy liên tục).
+     */
+    template <typename F>
+    void for_each_run(F f) const {
+        if (count_ == 0) {
+            return;
+        }
+        for (long z = bounds_.lo[2]; z <= bounds_.hi[2]; ++z) {
+            for_each_run_in_slice(static_cast<std::size_t>(z), f);
+        }
+    }
+
+    // Như for_each_run nhưng chỉ trên lát z (ví dụ khi chia các lát cho nhiều luồng)
+    template <typename F>
+    void for_each_run_in_slice(std::size_t z, F&& f) const {
+        if (count_ == 0 || static_cast<long>(z) < bounds_.lo[2] || static_cast<long>(z) > bounds_.hi[2]) {
+            return;
+        }
+        const std::uint64_t all = ~std::uint64_t(0);
+        for (long y = bounds_.lo[1]; y <= bounds_.hi[1]; ++y) {
+            const std::uint64_t* row = row_words(static_cast<long>(z), y);
+            std::size_t k = 0;
+            std::uint64_t word = row[0];
+            while (true) {
+                while (word == 0 && ++k < words_per_row_) {
+                    word = row[k];
+                }
+                if (k >= words_per_row_) {
+                    break;
+                }
+                const int first = lowest_bit64(word);
+                const std::size_t x_begin = (first_word_ + k) * 64 + first;
+                // Tìm bit 0 đầu tiên sau first (có thể ở các từ kế tiếp)
+                std::uint64_t gaps = ~word & (all << first);
+                while (gaps == 0 && ++k < words_per_row_) {
+                    gaps = ~row[k];
+                }
+                if (k >= words_per_row_) {
+                    f(z, static_cast<std::size_t>(y), x_begin, (first_word_ + words_per_row_) * 64);
+                    break;
+                }
+                const int last = lowest_bit64(gaps);
+                f(z, static_cast<std::size_t>(y), x_begin, (first_word_ + k) * 64 + last);
+                word = row[k] & (all << last);
+            }
+        }
+    }
+
+    // Gọi f(chỉ số tuyến tính) cho mỗi voxel của cấu trúc, theo thứ tự bộ nhớ
+    template <typename F>
+    void for_each_voxel(F f) const {
+        for_each_run([&](std::size_t z, std::size_t y, std::size_t x_begin, std::size_t x_end) {
+            const std::size_t base = (z * height_ + y) * width_;
+            for (std::size_t x = x_begin; x < x_end; ++x) {
+                f(base + x);
+            }
+        });
+    }
+
+    // Danh sách chỉ số tuyến tính của các voxel (thứ tự bộ nhớ)
+    std::vector<std::uint32_t> voxels() const {
+        std::vector<std::uint32_t> result;
+        result.reserve(count_);
+        for_each_voxel([&result](std::size_t i) { result.push_back(static_cast<std::uint32_t>(i)); });
+        return result;
+    }
+
+    // Tổng values trên các voxel của cấu trúc (values cùng kích thước lưới)
+    template <typename T>
+    double sum(const Volume3D<T>& values) const {
+        if (!same_shape(values)) {
+            throw std::invalid_argument("Kích thước lưới không khớp với mặt nạ cấu trúc");
+        }
+        double total = 0.0;
+        for_each_run([&](std::size_t z, std::size_t y, std::size_t x_begin, std::size_t x_end) {
+            const T* row = values.row(z, y);
+            for (std::size_t x = x_begin; x < x_end; ++x) {
+                total += row[x];
+            }
+        });
+        return total;
+    }
+
+    /**
+     * Số voxel chung của hai mặt nạ cùng lưới: AND rồi popcount trên các từ của phần
+     * giao hai hộp bao (mỗi hàng là một dãy từ liên tục nên vòng lặp vector hóa được).
+     */
+    std::size_t overlap(const StructureMask& other) const {
+        if (!same_shape(other)) {
+            throw std::invalid_argument("Hai mặt nạ cấu trúc không cùng lưới");
+        }
+        if (count_ == 0 || other.count_ == 0) {
+            return 0;
+        }
+        IndexBox common;
+        for (int a = 0; a < 3; ++a) {
+            common.lo[a] = std::max(bounds_.lo[a], other.bounds_.lo[a]);
+            common.hi[a] = std::min(bounds_.hi[a], other.bounds_.hi[a]);
+        }
+        if (common.empty()) {
+            return 0;
+        }
+        const std::size_t word_begin = static_cast<std::size_t>(common.lo[0]) / 64;
+        const std::size_t word_end = static_cast<std::size_t>(common.hi[0]) / 64 + 1;
+        std::size_t total = 0;
+        for (long z = common.lo[2]; z <= common.hi[2]; ++z) {
+            for (long y = common.lo[1]; y <= common.hi[1]; ++y) {
+                const std::uint64_t* a = row_words(z, y) + (word_begin - first_word_);
+                const std::uint64_t* b = other.row_words(z, y) + (word_begin - other.first_word_);
+                for (std::size_t k = 0; k < word_end - word_begin; ++k) {
+                    total += popcount64(a[k] & b[k]);
+                }
+            }
+        }
+        return total;
+    }
+
+    // Mở rộng lại thành MaskVolume 0/1 (cùng spacing/origin với lưới gốc)
+    MaskVolume to_volume() const {
+        MaskVolume mask(depth_, height_, width_, static_cast<std::uint8_t>(0), spacing_);
+        mask.set_origin(origin_);
+        for_each_run([&mask](std::size_t z, std::size_t y, std::size_t x_begin, std::size_t x_end) {
+            std::fill(mask.row(z, y) + x_begin, mask.row(z, y) + x_end, static_cast<std::uint8_t>(1));
+        });
+        return mask;
+    }
+
+private:
+    // Hai lượt: hộp bao trên cả lưới, rồi bitset chỉ trên hộp bao
+    template <typename V, typename Inside>
+    void build(const Volume3D<V>& volume, Inside inside) {
+        depth_ = volume.depth();
+        height_ = volume.height();
+        width_ = volume.width();
+        spacing_ = volume.spacing();
+        origin_ = volume.origin();
+        bounds_ = IndexBox();
+        for (std::size_t z = 0; z < depth_; ++z) {
+            for (std::size_t y = 0; y < height_; ++y) {
+                const V* row = volume.row(z, y);
+                std::size_t x = 0;
+                while (x < width_ && !inside(row[x])) {
+                    ++x;
+                }
+                if (x == width_) {
+                    continue;
+                }
+                std::size_t last = width_ - 1;
+                while (!inside(row[last])) {
+                    --last;
+                }
+                bounds_.include(static_cast<long>(x), static_cast<long>(y), static_cast<long>(z));
+                bounds_.include(static_cast<long>(last), static_cast<long>(y), static_cast<long>(z));
+            }
+        }
+        words_.clear();
+        count_ = 0;
+        if (bounds_.empty()) {
+            first_word_ = 0;
+            words_per_row_ = 0;
+            return;
+        }
+
+        first_word_ = static_cast<std::size_t>(bounds_.lo[0]) / 64;
+        words_per_row_ = static_cast<std::size_t>(bounds_.hi[0]) / 64 + 1 - first_word_;
+        const std::size_t rows = static_cast<std::size_t>(bounds_.hi[1] - bounds_.lo[1] + 1) *
+                                 static_cast<std::size_t>(bounds_.hi[2] - bounds_.lo[2] + 1);
+        words_.assign(rows * words_per_row_, 0);
+        for (long z = bounds_.lo[2]; z <= bounds_.hi[2]; ++z) {
+            for (long y = bounds_.lo[1]; y <= bounds_.hi[1]; ++y) {
+                const V* row = volume.row(z, y);
+                std::uint64_t* bits = &words_[row_offset(z, y)];
+                for (long x = bounds_.lo[0]; x <= bounds_.hi[0]; ++x) {
+                    if (inside(row[x])) {
+                        bits[x / 64 - first_word_] |= std::uint64_t(1) << (x % 64);
+                        ++count_;
+                    }
+                }
+            }
+        }
+    }
+
+    bool in_bounds(std::size_t z, std::size_t y, std::size_t x) const {
+        return count_ > 0 &&
+               static_cast<long>(x) >= bounds_.lo[0] && static_cast<long>(x) <= bounds_.hi[0] &&
+               static_cast<long>(y) >= bounds_.lo[1] && static_cast<long>(y) <= bounds_.hi[1] &&
+               static_cast<long>(z) >= bounds_.lo[2] && static_cast<long>(z) <= bounds_.hi[2];
+    }
+
+    std::size_t row_offset(long z, long y) const {
+        const std::size_t rows_per_slice = static_cast<std::size_t>(bounds_.hi[1] - bounds_.lo[1] + 1);
+        return (static_cast<std::size_t>(z - bounds_.lo[2]) * rows_per_slice +
+                static_cast<std::size_t>(y - bounds_.lo[1])) * words_per_row_;
+    }
+
+    const std::uint64_t* row_words(long z, long y) const {
+        return &words_[row_offset(z, y)];
+    }
+
+    std::size_t depth_ = 0;
+    std::size_t height_ = 0;
+    std::size_t width_ = 0;
+    std::array<double, 3> spacing_ = {1.0, 1.0, 1.0};
+    std::array<double, 3> origin_ = {0.0, 0.0, 0.0};
+    IndexBox bounds_;
+    std::size_t first_word_ = 0;      // Từ đầu tiên (theo x tuyệt đối) của mỗi hàng
+    std::size_t words_per_row_ = 0;
+    std::size_t count_ = 0;
+    std::vector<std::uint64_t> words_;
+};
+
+// Nén mọi mặt nạ cấu trúc, một lần khi dựng optimizer (mặt nạ gốc không cần giữ lại sau đó)
+inline std::map<std::string, StructureMask> compress_masks(const std::map<std::string, MaskVolume>& masks) {
+    std::map<std::string, StructureMask> result;
+    for (const auto& entry : masks) {
+        result.emplace(entry.first, StructureMask(entry.second));
+    }
+    return result;
+}
+
+/**
+ * Chỉ số Paddick CI = TV_PIV² / (TV · PIV): TV là thể tích đích, PIV thể tích đồng liều
+ * kê toa và TV_PIV phần giao của hai thể tích (AND + popcount). 0 nếu một thể tích rỗng.
+ */
+inline double paddick_conformity(const StructureMask& target, const StructureMask& prescription_isodose) {
+    const std::size_t tv = target.count();
+    const std::size_t piv = prescription_isodose.count();
+    if (tv == 0 || piv == 0) {
+        return 0.0;
+    }
+    const double tv_piv = static_cast<double>(target.overlap(prescription_isodose));
+    return tv_piv * tv_piv / (static_cast<double>(tv) * piv);
+}
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_STRUCTURE_MASK_H
@@ -0,0 +1,420 @@
+#ifndef QUANGSTATION_VOLUME3D_H
+#define QUANGSTATION_VOLUME3D_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace quangstation {
+
+// Bộ cấp phát căn chỉnh bộ nhớ (mặc định 64 byte = một cache line / thanh ghi AVX-512)
+template <typename T, std::size_t Alignment = 64>
+struct AlignedAllocator {
+    using value_type = T;
+    
+    template <typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+    
+    AlignedAllocator() noexcept = default;
+    
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept {}
+    
+    T* allocate(std::size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        // Làm tròn kích thước lên bội số của alignment
+        std::size_t bytes = ((n * sizeof(T) + Alignment - 1) / Alignment) * Alignment;
+        void* ptr = nullptr;
+#if defined(_MSC_VER)
+        ptr = _aligned_malloc(bytes, Alignment);
+#else
+        if (posix_memalign(&ptr, Alignment, bytes) != 0) {
+            ptr = nullptr;
+        }
+#endif
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+    
+    void deallocate(T* ptr, std::size_t) noexcept {
+#if defined(_MSC_VER)
+        _aligned_free(ptr);
+#else
+        std::free(ptr);
+#endif
+    }
+    
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const noexcept { return true; }
+    
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const noexcept { return false; }
+};
+
+/**
+ * Lưới 3D liên tục trong bộ nhớ, dùng chung cho cả dose engine và optimizer.
+ *
+ * Bố cục theo thứ tự C của NumPy: chỉ số [z][y][x], x thay đổi nhanh nhất,
+ * index = z * slice_stride + y * row_stride + x. Spacing và origin lưu theo
+ * thứ tự (x, y, z) giống voxel_size trong các thuật toán tính liều.
+ *
+ * Lưới có thể sở hữu bộ nhớ (cấp phát căn chỉnh 64 byte) hoặc chỉ là view
+ * trên bộ nhớ bên ngoài (ví dụ buffer NumPy) mà không sao chép.
+ */
+template <typename T>
+class Volume3D {
+public:
+    using value_type = T;
+    using storage_type = std::vector<T, AlignedAllocator<T>>;
+    
+    Volume3D() = default;
+    
+    Volume3D(std::size_t depth, std::size_t height, std::size_t width, T value = T(),
+             const std::array<double, 3>& spacing = {1.0, 1.0, 1.0},
+             const std::array<double, 3>& origin = {0.0, 0.0, 0.0})
+        : depth_(depth), height_(height), width_(width),
+          row_stride_(width), slice_stride_(width * height),
+          spacing_(spacing), origin_(origin),
+          storage_(depth * height * width, value) {
+        data_ = storage_.data();
+    }
+    
+    // Lưới trên buffer có sẵn (ví dụ lấy từ GridPool), buffer phải có đúng depth·height·width phần tử
+    Volume3D(storage_type&& storage, std::size_t depth, std::size_t height, std::size_t width,
+             const std::array<double, 3>& spacing = {1.0, 1.0, 1.0},
+             const std::array<double, 3>& origin = {0.0, 0.0, 0.0})
+        : depth_(depth), height_(height), width_(width),
+          row_stride_(width), slice_stride_(width * height),
+          spacing_(spacing), origin_(origin),
+          storage_(std::move(storage)) {
+        if (storage_.size() != depth * height * width) {
+            throw std::invalid_argument("Volume3D: kích thước buffer không khớp với lưới");
+        }
+        data_ = storage_.data();
+    }
+    
+    Volume3D(const Volume3D& other)
+        : depth_(other.depth_), height_(other.height_), width_(other.width_),
+          row_stride_(other.row_stride_), slice_stride_(other.slice_stride_),
+          spacing_(other.spacing_), origin_(other.origin_),
+          storage_(other.storage_) {
+        // View thì sao chép con trỏ, lưới sở hữu thì trỏ vào bản sao mới
+        data_ = other.owns_data() ? storage_.data() : other.data_;
+    }
+    
+    Volume3D(Volume3D&& other) noexcept
+        : depth_(other.depth_), height_(other.height_), width_(other.width_),
+          row_stride_(other.row_stride_), slice_stride_(other.slice_stride_),
+          spacing_(other.spacing_), origin_(other.origin_),
+          storage_(std::move(other.storage_)), data_(other.data_) {
+        other.reset_shape();
+    }
+    
+    Volume3D& operator=(const Volume3D& other) {
+        if (this != &other) {
+            Volume3D tmp(other);
+            *this = std::move(tmp);
+        }
+        return *this;
+    }
+    
+    Volume3D& operator=(Volume3D&& other) noexcept {
+        if (this != &other) {
+            depth_ = other.depth_;
+            height_ = other.height_;
+            width_ = other.width_;
+            row_stride_ = other.row_stride_;
+            slice_stride_ = other.slice_stride_;
+            spacing_ = other.spacing_;
+            origin_ = other.origin_;
+            storage_ = std::move(other.storage_);
+            data_ = other.data_;
+            other.reset_shape();
+        }
+        return *this;
+    }
+    
+    // Tạo view không sở hữu trên bộ nhớ liên tục bên ngoài (không sao chép)
+    static Volume3D view(T* data, std::size_t depth, std::size_t height, std::size_t width,
+                         const std::array<double, 3>& spacing = {1.0, 1.0, 1.0},
+                         const std::array<double, 3>& origin = {0.0, 0.0, 0.0}) {
+        Volume3D v;
+        v.depth_ = depth;
+        v.height_ = height;
+        v.width_ = width;
+        v.row_stride_ = width;
+        v.slice_stride_ = width * height;
+        v.spacing_ = spacing;
+        v.origin_ = origin;
+        v.data_ = data;
+        return v;
+    }
+    
+    // Chuyển từ mảng lồng nhau cũ sang lưới liên tục (dùng trong giai đoạn chuyển đổi)
+    template <typename U>
+    static Volume3D from_nested(const std::vector<std::vector<std::vector<U>>>& nested,
+                                const std::array<double, 3>& spacing = {1.0, 1.0, 1.0},
+                                const std::array<double, 3>& origin = {0.0, 0.0, 0.0}) {
+        std::size_t depth = nested.size();
+        std::size_t height = depth > 0 ? nested[0].size() : 0;
+        std::size_t width = height > 0 ? nested[0][0].size() : 0;
+        
+        Volume3D v(depth, height, width, T(), spacing, origin);
+        for (std::size_t z = 0; z < depth; ++z) {
+            std::size_t rows = std::min(height, nested[z].size());
+            for (std::size_t y = 0; y < rows; ++y) {
+                const auto& src = nested[z][y];
+                T* dst = v.row(z, y);
+                std::size_t cols = std::min(width, src.size());
+                for (std::size_t x = 0; x < cols; ++x) {
+                    dst[x] = static_cast<T>(src[x]);
+                }
+            }
+        }
+        return v;
+    }
+    
+    // Chuyển ngược về mảng lồng nhau cho các API cũ
+    std::vector<std::vector<std::vector<T>>> to_nested() const {
+        std::vector<std::vector<std::vector<T>>> nested(
+            depth_, std::vector<std::vector<T>>(height_, std::vector<T>(width_))
+        );
+        for (std::size_t z = 0; z < depth_; ++z) {
+            for (std::size_t y = 0; y < height_; ++y) {
+                const T* src = row(z, y);
+                std::copy(src, src + width_, nested[z][y].begin());
+            }
+        }
+        return nested;
+    }
+    
+    // Tạo lưới mới cùng kích thước và metadata, khởi tạo bằng value
+    template <typename U>
+    static Volume3D like(const Volume3D<U>& other, T value = T()) {
+        return Volume3D(other.depth(), other.height(), other.width(), value,
+                        other.spacing(), other.origin());
+    }
+    
+    // Sao chép sâu (kể cả khi là view) thành lưới sở hữu bộ nhớ
+    Volume3D clone() const {
+        Volume3D v(depth_, height_, width_, T(), spacing_, origin_);
+        for (std::size_t z = 0; z < depth_; ++z) {
+            for (std::size_t y = 0; y < height_; ++y) {
+                const T* src = row(z, y);
+                std::copy(src, src + width_, v.row(z, y));
+            }
+        }
+        return v;
+    }
+    
+    // Lấy buffer của lưới sở hữu ra ngoài (lưới trở thành rỗng); view trả về buffer rỗng
+    storage_type release_storage() noexcept {
+        storage_type storage;
+        if (owns_data()) {
+            storage.swap(storage_);
+        }
+        reset_shape();
+        return storage;
+    }
+    
+    void resize(std::size_t depth, std::size_t height, std::size_t width, T value = T()) {
+        *this = Volume3D(depth, height, width, value, spacing_, origin_);
+    }
+    
+    // Kích thước
+    std::size_t depth() const { return depth_; }
+    std::size_t height() const { return height_; }
+    std::size_t width() const { return width_; }
+    std::size_t size() const { return depth_ * height_ * width_; }
+    bool empty() const { return size() == 0; }
+    std::array<std::size_t, 3> shape() const { return {depth_, height_, width_}; }
+    
+    // Bước nhảy tính theo số phần tử
+    std::size_t row_stride() const { return row_stride_; }
+    std::size_t slice_stride() const { return slice_stride_; }
+    bool is_contiguous() const {
+        return row_stride_ == width_ && slice_stride_ == width_ * height_;
+    }
+    
+    // Metadata hình học (mm), thứ tự (x, y, z)
+    const std::array<double, 3>& spacing() const { return spacing_; }
+    const std::array<double, 3>& origin() const { return origin_; }
+    void set_spacing(const std::array<double, 3>& spacing) { spacing_ = spacing; }
+    void set_origin(const std::array<double, 3>& origin) { origin_ = origin; }
+    
+    // Tọa độ thế giới (mm) của tâm voxel
+    double x_position(std::size_t x) const { return origin_[0] + x * spacing_[0]; }
+    double y_position(std::size_t y) const { return origin_[1] + y * spacing_[1]; }
+    double z_position(std::size_t z) const { return origin_[2] + z * spacing_[2]; }
+    
+    // Truy cập dữ liệu
+    T* data() { return data_; }
+    const T* data() const { return data_; }
+    T* begin() { return data_; }
+    T* end() { return data_ + size(); }
+    const T* begin() const { return data_; }
+    const T* end() const { return data_ + size(); }
+    
+    bool owns_data() const { return data_ == nullptr || data_ == storage_.data(); }
+    
+    std::size_t index(std::size_t z, std::size_t y, std::size_t x) const {
+        return z * slice_stride_ + y * row_stride_ + x;
+    }
+    
+    T& operator()(std::size_t z, std::size_t y, std::size_t x) { return data_[index(z, y, x)]; }
+    const T& operator()(std::size_t z, std::size_t y, std::size_t x) const { return data_[index(z, y, x)]; }
+    
+    T& operator[](std::size_t i) { return data_[i]; }
+    const T& operator[](std::size_t i) const { return data_[i]; }
+    
+    // Con trỏ tới đầu một hàng (x chạy liên tục), dùng cho vòng lặp trong cùng
+    T* row(std::size_t z, std::size_t y) { return data_ + z * slice_stride_ + y * row_stride_; }
+    const T* row(std::size_t z, std::size_t y) const { return data_ + z * slice_stride_ + y * row_stride_; }
+    
+    T* slice(std::size_t z) { return data_ + z * slice_stride_; }
+    const T* slice(std::size_t z) const { return data_ + z * slice_stride_; }
+    
+    bool contains(long z, long y, long x) const {
+        return z >= 0 && y >= 0 && x >= 0 &&
+               static_cast<std::size_t>(z) < depth_ &&
+               static_cast<std::size_t>(y) < height_ &&
+               static_cast<std::size_t>(x) < width_;
+    }
+    
+    template <typename U>
+    bool same_shape(const Volume3D<U>& other) const {
+        return depth_ == other.depth() && height_ == other.height() && width_ == other.width();
+    }
+    
+    void fill(T value) {
+        std::size_t n = size();
+        for (std::size_t i = 0; i < n; ++i) {
+            data_[i] = value;
+        }
+    }
+    
+    // this += scale * other (cùng kích thước), vòng lặp tuyến tính để vector hóa
+    template <typename U>
+    void add_scaled(const Volume3D<U>& other, double scale = 1.0) {
+        if (!same_shape(other)) {
+            throw std::invalid_argument("Volume3D::add_scaled: kích thước không khớp");
+        }
+        std::size_t n = size();
+        T* dst = data_;
+        const U* src = other.data();
+        for (std::size_t i = 0; i < n; ++i) {
+            dst[i] += static_cast<T>(scale * src[i]);
+        }
+    }
+    
+    void scale(double factor) {
+        std::size_t n = size();
+        for (std::size_t i = 0; i < n; ++i) {
+            data_[i] = static_cast<T>(data_[i] * factor);
+        }
+    }
+    
+private:
+    void reset_shape() {
+        depth_ = height_ = width_ = 0;
+        row_stride_ = slice_stride_ = 0;
+        data_ = nullptr;
+    }
+    
+    std::size_t depth_ = 0;
+    std::size_t height_ = 0;
+    std::size_t width_ = 0;
+    std::size_t row_stride_ = 0;
+    std::size_t slice_stride_ = 0;
+    std::array<double, 3> spacing_ = {1.0, 1.0, 1.0};
+    std::array<double, 3> origin_ = {0.0, 0.0, 0.0};
+    storage_type storage_;
+    T* data_ = nullptr;
+};
+
+/**
+ * Băm nội dung lưới (kích thước, spacing, origin và dữ liệu) thành 64 bit.
+ * Dùng làm khóa cho các bộ đệm kết quả tính toán phụ thuộc vào lưới.
+ */
+template <typename T>
+inline std::uint64_t content_hash(const Volume3D<T>& volume) {
+    const std::uint64_t prime = 0x100000001b3ULL;
+    std::uint64_t h = 0xcbf29ce484222325ULL;
+    auto mix = [&h, prime](std::uint64_t v) {
+        h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        h *= prime;
+    };
+    auto mix_double = [&mix](double d) {
+        std::uint64_t bits = 0;
+        std::memcpy(&bits, &d, sizeof(double));
+        mix(bits);
+    };
+    
+    mix(volume.depth());
+    mix(volume.height());
+    mix(volume.width());
+    for (int i = 0; i < 3; ++i) {
+        mix_double(volume.spacing()[i]);
+        mix_double(volume.origin()[i]);
+    }
+    
+    for (std::size_t z = 0; z < volume.depth(); ++z) {
+        for (std::size_t y = 0; y < volume.height(); ++y) {
+            const T* row = volume.row(z, y);
+            for (std::size_t x = 0; x < volume.width(); ++x) {
+                std::uint64_t bits = 0;
+                std::memcpy(&bits, &row[x], sizeof(T) < sizeof(bits) ? sizeof(T) : sizeof(bits));
+                mix(bits);
+            }
+        }
+    }
+    return h;
+}
+
+/**
+ * Chuyển lưới sang kiểu phần tử U (giữ kích thước, spacing, origin). Với rvalue
+ * cùng kiểu thì chuyển luôn bộ nhớ, không sao chép.
+ */
+template <typename U, typename T>
+inline Volume3D<U> volume_cast(const Volume3D<T>& volume) {
+    Volume3D<U> out = Volume3D<U>::like(volume);
+    for (std::size_t z = 0; z < volume.depth(); ++z) {
+        for (std::size_t y = 0; y < volume.height(); ++y) {
+            const T* src = volume.row(z, y);
+            U* dst = out.row(z, y);
+            for (std::size_t x = 0; x < volume.width(); ++x) {
+                dst[x] = static_cast<U>(src[x]);
+            }
+        }
+    }
+    return out;
+}
+
+template <typename T>
+inline Volume3D<T> volume_cast(Volume3D<T>&& volume) {
+    return std::move(volume);
+}
+
+// Các kiểu lưới dùng chung
+using CTVolume = Volume3D<std::int16_t>;   // HU
+using DensityVolume = Volume3D<double>;    // Mật độ điện tử tương đối
+using DoseVolume = Volume3D<double>;       // Liều (Gy)
+using MaskVolume = Volume3D<std::uint8_t>; // Mặt nạ cấu trúc (0/1)
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_VOLUME3D_H
@@ -0,0 +1,234 @@
+#ifndef QUANGSTATION_ARC_SAMPLING_H
+#define QUANGSTATION_ARC_SAMPLING_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "beam_eye_view.h"
+
+namespace quangstation {
+
+// Lấy mẫu góc gantry của cung VMAT (độ)
+struct ArcSampling {
+    double gantry_step = 2.0;               // Bề rộng sector: hướng, depth, TERMA và vận chuyển dùng chung
+    double optimization_gantry_step = 6.0;  // Bề rộng sector khi dựng ma trận ảnh hưởng cho tối ưu hóa
+    double aperture_step = 0.5;             // Khoảng cách giữa các khẩu độ MLC nội suy trong một sector
+};
+
+// Một mẫu của cung: góc gantry, khẩu độ MLC nội suy tại góc đó và trọng số
+struct ArcSample {
+    double gantry_angle;
+    std::vector<double> mlc_positions;
+    double weight;
+};
+
+/**
+ * Khẩu độ MLC tại vị trí t ∈ [0, 1] dọc cung: nội suy tuyến tính giữa hai control
+ * point kề nhau (control point chia đều theo góc). Hai control point khác số lá thì
+ * lấy control point gần hơn.
+ */
+inline std::vector<double> interpolate_aperture(const std::vector<std::vector<double>>& control_points, double t) {
+    const double position = std::min(std::max(t, 0.0), 1.0) * (control_points.size() - 1);
+    const std::size_t i = std::min(static_cast<std::size_t>(position), control_points.size() - 1);
+    const std::size_t j = std::min(i + 1, control_points.size() - 1);
+    const double f = position - i;
+    if (control_points[i].size() != control_points[j].size()) {
+        return f < 0.5 ? control_points[i] : control_points[j];
+    }
+    std::vector<double> result(control_points[i].size());
+    for (std::size_t k = 0; k < result.size(); ++k) {
+        result[k] = control_points[i][k] + f * (control_points[j][k] - control_points[i][k]);
+    }
+    return result;
+}
+
+// Trọng số control point tại vị trí t ∈ [0, 1] dọc cung (nội suy tuyến tính)
+inline double interpolate_weight(const std::vector<double>& weights, double t) {
+    const double position = std::min(std::max(t, 0.0), 1.0) * (weights.size() - 1);
+    const std::size_t i = std::min(static_cast<std::size_t>(position), weights.size() - 1);
+    const std::size_t j = std::min(i + 1, weights.size() - 1);
+    return weights[i] + (position - i) * (weights[j] - weights[i]);
+}
+
+/**
+ * Chia cung thành các đoạn bằng nhau không rộng quá step độ, mỗi đoạn một mẫu ở
+ * giữa đoạn (góc = start + (stop - start) · t · direction như trước). Khẩu độ và
+ * trọng số nội suy giữa các control point; trọng số nhân với số control point / số
+ * mẫu nên tổng trọng số của cung không phụ thuộc bước lấy mẫu.
+ */
+inline std::vector<ArcSample> sample_arc(double start_angle, double stop_angle, double direction,
+                                         const std::vector<std::vector<double>>& control_points,
+                                         const std::vector<double>& weights,
+                                         double step) {
+    std::vector<ArcSample> samples;
+    if (control_points.empty() || weights.empty()) {
+        return samples;
+    }
+    const double span = stop_angle - start_angle;
+    const std::size_t count = std::max<std::size_t>(
+        1, static_cast<std::size_t>(std::ceil(std::abs(span) / std::max(step, 1e-3) - 1e-9)));
+    const double weight_scale = static_cast<double>(weights.size()) / count;
+    samples.reserve(count);
+    for (std::size_t k = 0; k < count; ++k) {
+        const double t = (k + 0.5) / count;
+        samples.push_back({
+            start_angle + span * t * direction,
+            interpolate_aperture(control_points, t),
+            interpolate_weight(weights, t) * weight_scale
+        });
+    }
+    return samples;
+}
+
+/**
+ * Fluence tích lũy của nhiều khẩu độ MLC chiếu trong cùng một hình học chùm tia:
+ * tổng trọng số của các khẩu độ chứa điểm (u, v) trên mặt phẳng isocenter. Cùng mô
+ * hình lá với CollapsedConeConvolution::is_inside_aperture: trường 100 × 100 mm,
+ * cặp lá [trái, phải] chia đều theo v, khẩu độ rỗng là trường mở. Mỗi cặp lá lưu
+ * các mép lá đã sắp xếp và fluence trên từng khoảng giữa hai mép, nên tra cứu là
+ * một tìm kiếm nhị phân bất kể đã cộng bao nhiêu khẩu độ.
+ */
+class ApertureFluence {
+public:
+    // num_leaves: số cặp lá của mọi khẩu độ sẽ cộng vào (0: trường mở)
+    explicit ApertureFluence(std::size_t num_leaves = 0)
+        : num_leaves_(num_leaves), events_(std::max<std::size_t>(num_leaves, 1)),
+          bounds_{std::numeric_limits<double>::max(), -std::numeric_limits<double>::max(),
+                  std::numeric_limits<double>::max(), -std::numeric_limits<double>::max()} {}
+    
+    std::size_t num_leaves() const { return num_leaves_; }
+    
+    // Cộng một khẩu độ (mlc_positions.size() / 2 phải bằng num_leaves) với trọng số weight
+    void add(const std::vector<double>& mlc_positions, double weight) {
+        if (num_leaves_ == 0) {
+            add_leaf(0, -field_size / 2, field_size / 2, weight, -field_size / 2, field_size / 2);
+            return;
+        }
+        const double leaf_width = field_size / num_leaves_;
+        for (std::size_t leaf = 0; leaf < num_leaves_; ++leaf) {
+            // Lá đầu tiên phủ thêm một bề rộng lá phía dưới (chỉ số lá làm tròn về 0)
+            const double v_min = (leaf == 0) ? -field_size / 2 - leaf_width : -field_size / 2 + leaf * leaf_width;
+            add_leaf(leaf, mlc_positions[2 * leaf], mlc_positions[2 * leaf + 1], weight,
+                     v_min, -field_size / 2 + (leaf + 1) * leaf_width);
+        }
+    }
+    
+    // Sắp xếp các mép lá; gọi một lần sau khi đã cộng mọi khẩu độ, trước value
+    void finalize() {
+        edges_.assign(events_.size(), std::vector<double>());
+        levels_.assign(events_.size(), std::vector<double>());
+        for (std::size_t leaf = 0; leaf < events_.size(); ++leaf) {
+            std::vector<std::pair<double, double>>& events = events_[leaf];
+            std::sort(events.begin(), events.end());
+            double level = 0.0;
+            for (std::size_t k = 0; k < events.size(); ++k) {
+                level += events[k].second;
+                if (k + 1 < events.size() && events[k + 1].first == events[k].first) {
+                    continue;
+                }
+                edges_[leaf].push_back(events[k].first);
+                levels_[leaf].push_back(level);
+            }
+        }
+    }
+    
+    // Fluence tại (u, v) mm trên mặt phẳng isocenter
+    double value(double u, double v) const {
+        std::size_t leaf = 0;
+        if (num_leaves_ == 0) {
+            if (std::abs(v) > field_size / 2) {
+                return 0.0;
+            }
+        } else {
+            const int index = static_cast<int>((v + field_size / 2) / (field_size / num_leaves_));
+            if (index < 0 || static_cast<std::size_t>(index) >= num_leaves_) {
+                return 0.0;
+            }
+            leaf = static_cast<std::size_t>(index);
+        }
+        const std::vector<double>& edges = edges_[leaf];
+        auto it = std::upper_bound(edges.begin(), edges.end(), u);
+        if (it == edges.begin()) {
+            return 0.0;
+        }
+        return levels_[leaf][static_cast<std::size_t>(it - edges.begin()) - 1];
+    }
+    
+    // Hình chữ nhật bao mọi khẩu độ đã cộng (rỗng nếu không có lá nào mở)
+    const FieldRect& bounds() const { return bounds_; }
+    
+private:
+    static constexpr double field_size = 100.0;  // mm, như is_inside_aperture
+    
+    void add_leaf(std::size_t leaf, double left, double right, double weight, double v_min, double v_max) {
+        if (!(right > left) || weight == 0.0) {
+            return;
+        }
+        events_[leaf].emplace_back(left, weight);
+        events_[leaf].emplace_back(right, -weight);
+        bounds_.u_min = std::min(bounds_.u_min, left);
+        bounds_.u_max = std::max(bounds_.u_max, right);
+        bounds_.v_min = std::min(bounds_.v_min, v_min);
+        bounds_.v_max = std::max(bounds_.v_max, v_max);
+    }
+    
+    std::size_t num_leaves_;
+    std::vector<std::vector<std::pair<double, double>>> events_;  // (mép lá, ±trọng số) theo cặp lá
+    std::vector<std::vector<double>> edges_;
+    std::vector<std::vector<double>> levels_;                      // Fluence trên [edges[k], edges[k + 1])
+    FieldRect bounds_;
+};
+
+// Các mẫu của cung có chung một sector gantry: tính như một control point với fluence tích lũy
+struct ArcSector {
+    double gantry_angle;                             // Tâm sector (độ, trong [0, 360))
+    std::shared_ptr<const ApertureFluence> fluence;  // Đã finalize, trọng số mẫu đã nhân vào
+    std::size_t num_samples;
+};
+
+/**
+ * Gộp các mẫu liên tiếp cùng sector gantry [k·width, (k + 1)·width) (góc quy về
+ * [0, 360)) và cùng số cặp lá. Tâm sector cố định theo width chứ không theo cung,
+ * nên các cung, lần tính và bước tối ưu cùng hình học dùng lại radiological depth
+ * đã đệm theo góc gantry.
+ */
+inline std::vector<ArcSector> group_arc_sectors(const std::vector<ArcSample>& samples, double width) {
+    width = std::max(width, 1e-3);
+    std::vector<ArcSector> sectors;
+    std::shared_ptr<ApertureFluence> current;
+    long current_index = 0;
+    auto flush = [&]() {
+        if (current) {
+            current->finalize();
+            sectors.back().fluence = current;
+            current.reset();
+        }
+    };
+    for (const ArcSample& sample : samples) {
+        double angle = std::fmod(sample.gantry_angle, 360.0);
+        if (angle < 0.0) {
+            angle += 360.0;
+        }
+        const long index = static_cast<long>(std::floor(angle / width));
+        const std::size_t num_leaves = sample.mlc_positions.size() / 2;
+        if (!current || index != current_index || num_leaves != current->num_leaves()) {
+            flush();
+            current = std::make_shared<ApertureFluence>(num_leaves);
+            current_index = index;
+            sectors.push_back({std::fmod((index + 0.5) * width, 360.0), nullptr, 0});
+        }
+        current->add(sample.mlc_positions, sample.weight);
+        ++sectors.back().num_samples;
+    }
+    flush();
+    return sectors;
+}
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_ARC_SAMPLING_H
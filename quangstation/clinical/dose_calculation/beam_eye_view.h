@@ -0,0 +1,133 @@
+#ifndef QUANGSTATION_BEAM_EYE_VIEW_H
+#define QUANGSTATION_BEAM_EYE_VIEW_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+
+#include "ray_tracer.h"
+
+namespace quangstation {
+
+// Hình chữ nhật trên mặt phẳng isocenter (mm) theo hai trục vuông góc của chùm tia
+struct FieldRect {
+    double u_min, u_max;
+    double v_min, v_max;
+    
+    bool empty() const { return u_min > u_max || v_min > v_max; }
+    
+    FieldRect expanded(double margin) const {
+        return {u_min - margin, u_max + margin, v_min - margin, v_max + margin};
+    }
+};
+
+/**
+ * Phép chiếu beam's-eye-view của lưới voxel lên mặt phẳng isocenter.
+ *
+ * Với w = (p - c)·direction, tọa độ chiếu của voxel p là
+ *   u = (p - c)·perp_x · m,  v = (p - c)·perp_y · m
+ * trong đó m = SAD / (SAD + w) với chùm phân kỳ và m = 1 với chùm song song
+ * (SAD = 0). Trên một hàng voxel (z, y), u·(SAD + w) và w đều tuyến tính theo
+ * x, nên tập voxel có (u, v) nằm trong một FieldRect là một đoạn liên tục:
+ * row_span tính đoạn này trực tiếp, các kernel chỉ duyệt voxel trong trường.
+ */
+class BeamsEyeView {
+public:
+    BeamsEyeView(const std::array<double, 3>& center,
+                 const std::array<double, 3>& direction,
+                 const std::array<double, 3>& spacing,
+                 double source_axis_distance = 0.0)
+        : center_(center), direction_(direction), spacing_(spacing),
+          source_axis_distance_(source_axis_distance) {
+        RayTracer::perpendicular_basis(direction_, perp_x_, perp_y_);
+    }
+    
+    const std::array<double, 3>& perp_x() const { return perp_x_; }
+    const std::array<double, 3>& perp_y() const { return perp_y_; }
+    
+    /**
+     * Đoạn [x_begin, x_end) của hàng (z, y) có hình chiếu nằm trong rect và
+     * w >= w_min. Chùm phân kỳ luôn đòi hỏi voxel nằm trước nguồn (SAD + w > 0).
+     * Trả về false nếu đoạn rỗng. Đoạn được nới một chút nên có thể thừa tối đa
+     * một voxel ở mỗi đầu; hàm kiểm tra chính xác vẫn do kernel quyết định.
+     */
+    bool row_span(long z, long y, long width, const FieldRect& rect,
+                  long& x_begin, long& x_end,
+                  double w_min = -std::numeric_limits<double>::infinity()) const {
+        if (rect.empty() || width <= 0) {
+            return false;
+        }
+        
+        // Vector (p - c) tại x = 0 và độ tăng khi x tăng một voxel
+        const double ry = y * spacing_[1] - center_[1];
+        const double rz = z * spacing_[2] - center_[2];
+        const double rx = -center_[0];
+        const double step = spacing_[0];
+        
+        const double w0 = rx * direction_[0] + ry * direction_[1] + rz * direction_[2];
+        const double w1 = step * direction_[0];
+        const double u0 = rx * perp_x_[0] + ry * perp_x_[1] + rz * perp_x_[2];
+        const double u1 = step * perp_x_[0];
+        const double v0 = rx * perp_y_[0] + ry * perp_y_[1] + rz * perp_y_[2];
+        const double v1 = step * perp_y_[0];
+        
+        // Hệ số phóng đại nghịch đảo s = (SAD + w) / SAD (bằng 1 với chùm song song)
+        double s0 = 1.0, s1 = 0.0;
+        if (source_axis_distance_ > 0.0) {
+            s0 = 1.0 + w0 / source_axis_distance_;
+            s1 = w1 / source_axis_distance_;
+        }
+        
+        double t_lo = 0.0;
+        double t_hi = static_cast<double>(width - 1);
+        
+        // Mỗi ràng buộc có dạng a + b·x >= 0
+        auto clip = [&t_lo, &t_hi](double a, double b) {
+            if (std::abs(b) < 1e-12) {
+                if (a < -1e-9) {
+                    t_lo = 1.0;
+                    t_hi = 0.0;
+                }
+                return;
+            }
+            double root = -a / b;
+            if (b > 0.0) {
+                t_lo = std::max(t_lo, root);
+            } else {
+                t_hi = std::min(t_hi, root);
+            }
+        };
+        
+        if (source_axis_distance_ > 0.0) {
+            clip(s0, s1);
+            w_min = std::max(w_min, -source_axis_distance_);
+        }
+        if (std::isfinite(w_min)) {
+            clip(w0 - w_min, w1);
+        }
+        clip(u0 - rect.u_min * s0, u1 - rect.u_min * s1);
+        clip(rect.u_max * s0 - u0, rect.u_max * s1 - u1);
+        clip(v0 - rect.v_min * s0, v1 - rect.v_min * s1);
+        clip(rect.v_max * s0 - v0, rect.v_max * s1 - v1);
+        
+        if (t_lo > t_hi + 1e-6) {
+            return false;
+        }
+        x_begin = std::max(0L, static_cast<long>(std::ceil(t_lo - 1e-6)));
+        x_end = std::min(width, static_cast<long>(std::floor(t_hi + 1e-6)) + 1);
+        return x_begin < x_end;
+    }
+    
+private:
+    std::array<double, 3> center_;
+    std::array<double, 3> direction_;
+    std::array<double, 3> spacing_;
+    double source_axis_distance_;
+    std::array<double, 3> perp_x_;
+    std::array<double, 3> perp_y_;
+};
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_BEAM_EYE_VIEW_H
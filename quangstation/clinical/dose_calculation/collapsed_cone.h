@@ -0,0 +1,239 @@
+#ifndef QUANGSTATION_COLLAPSED_CONE_H
+#define QUANGSTATION_COLLAPSED_CONE_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#include "volume3d.h"
+
+namespace quangstation {
+
+/**
+ * Một hướng cone và lưới đường thẳng song song theo hướng đó.
+ *
+ * Trục chủ đạo `axis` là trục có |direction| lớn nhất. Mỗi đường cắt mọi lát
+ * vuông góc với trục này đúng một lần: tại lát k, đường có gốc (i, j) đi qua
+ * voxel (i + shift_b[k], j + shift_c[k]) theo hai trục còn lại, nên mỗi voxel
+ * thuộc đúng một đường của mỗi hướng.
+ */
+struct ConeDirection {
+    std::array<double, 3> direction;  // Vector đơn vị (x, y, z)
+    double solid_angle;               // Phần góc khối (tổng các hướng = 1)
+    int axis;                         // Trục chủ đạo (0 = x, 1 = y, 2 = z)
+    int axis_b;
+    int axis_c;
+    double step_length;               // Quãng đường hình học giữa hai lát (mm)
+    std::vector<long> shift_b;
+    std::vector<long> shift_c;
+    long origin_b_min, origin_b_max;  // Phạm vi gốc đường theo trục b
+    long origin_c_min, origin_c_max;  // Phạm vi gốc đường theo trục c
+};
+
+/**
+ * Tập hướng cone (phân bố Fibonacci trên mặt cầu, góc khối bằng nhau) và lưới
+ * đường tương ứng cho một hình học lưới. Chỉ phụ thuộc kích thước, spacing và
+ * số cone nên được dựng một lần rồi dùng lại cho mọi beam và control point.
+ */
+class ConeLattice {
+public:
+    ConeLattice(const std::array<std::size_t, 3>& dims, const std::array<double, 3>& spacing, int num_cones)
+        : dims_(dims), spacing_(spacing), num_cones_(std::max(1, num_cones)) {
+        const double golden_angle = M_PI * (3.0 - std::sqrt(5.0));
+        for (int m = 0; m < num_cones_; ++m) {
+            double cz = 1.0 - (2.0 * m + 1.0) / num_cones_;
+            double radius = std::sqrt(std::max(0.0, 1.0 - cz * cz));
+            double phi = golden_angle * m;
+            directions_.push_back(build_direction({radius * std::cos(phi), radius * std::sin(phi), cz}));
+        }
+    }
+    
+    // Lưới có dùng được cho hình học (dims, spacing, num_cones) này không
+    bool matches(const std::array<std::size_t, 3>& dims, const std::array<double, 3>& spacing, int num_cones) const {
+        return dims == dims_ && spacing == spacing_ && std::max(1, num_cones) == num_cones_;
+    }
+    
+    const std::vector<ConeDirection>& directions() const { return directions_; }
+    const std::array<std::size_t, 3>& dims() const { return dims_; }
+    
+private:
+    ConeDirection build_direction(const std::array<double, 3>& u) const {
+        ConeDirection cone;
+        cone.direction = u;
+        cone.solid_angle = 1.0 / num_cones_;
+        
+        int axis = 0;
+        for (int a = 1; a < 3; ++a) {
+            if (std::abs(u[a]) > std::abs(u[axis])) {
+                axis = a;
+            }
+        }
+        cone.axis = axis;
+        cone.axis_b = (axis + 1) % 3;
+        cone.axis_c = (axis + 2) % 3;
+        cone.step_length = spacing_[axis] / std::abs(u[axis]);
+        
+        // Độ dịch (theo số voxel) của đường khi sang lát tiếp theo trên trục chủ đạo
+        double tb = spacing_[axis] * u[cone.axis_b] / (u[axis] * spacing_[cone.axis_b]);
+        double tc = spacing_[axis] * u[cone.axis_c] / (u[axis] * spacing_[cone.axis_c]);
+        
+        const long n = static_cast<long>(dims_[axis]);
+        cone.shift_b.resize(n);
+        cone.shift_c.resize(n);
+        long b_lo = 0, b_hi = 0, c_lo = 0, c_hi = 0;
+        for (long k = 0; k < n; ++k) {
+            cone.shift_b[k] = static_cast<long>(std::lround(k * tb));
+            cone.shift_c[k] = static_cast<long>(std::lround(k * tc));
+            b_lo = std::min(b_lo, cone.shift_b[k]);
+            b_hi = std::max(b_hi, cone.shift_b[k]);
+            c_lo = std::min(c_lo, cone.shift_c[k]);
+            c_hi = std::max(c_hi, cone.shift_c[k]);
+        }
+        cone.origin_b_min = -b_hi;
+        cone.origin_b_max = static_cast<long>(dims_[cone.axis_b]) - 1 - b_lo;
+        cone.origin_c_min = -c_hi;
+        cone.origin_c_max = static_cast<long>(dims_[cone.axis_c]) - 1 - c_lo;
+        return cone;
+    }
+    
+    std::array<std::size_t, 3> dims_;     // (x, y, z)
+    std::array<double, 3> spacing_;
+    int num_cones_;
+    std::vector<ConeDirection> directions_;
+};
+
+/**
+ * Kernel điểm polyenergetic dạng hai hàm mũ theo radiological distance r (mm):
+ *   h(r, θ) ∝ w(θ) · [f · a · e^{-a r} + (1 - f) · b · e^{-b r}]
+ * a: thành phần sơ cấp (tầm ngắn), b: tán xạ (tầm xa), w(θ) ∝ 1 + g·cos θ
+ * mô tả mức hướng về phía trước so với hướng chùm tia.
+ */
+struct ConeKernel {
+    double primary_fraction;
+    double primary_attenuation;  // a (1/mm)
+    double scatter_attenuation;  // b (1/mm)
+    double forward_anisotropy;   // g
+    
+    // Tham số đơn giản hóa cho photon theo năng lượng danh định (MV)
+    static ConeKernel for_photon(double energy) {
+        ConeKernel k;
+        k.primary_fraction = 0.75;
+        k.primary_attenuation = 1.0 / (1.0 + 0.15 * energy);
+        k.scatter_attenuation = 1.0 / (25.0 + 2.5 * energy);
+        k.forward_anisotropy = std::min(0.9, 0.4 + 0.04 * energy);
+        return k;
+    }
+};
+
+/**
+ * Vận chuyển năng lượng TERMA theo các đường của lưới cone bằng tích phân
+ * truy hồi (Ahnesjö): với R là năng lượng mang theo đường và T là TERMA,
+ * dR/dr = T - a·R, liều lắng đọng trên mỗi đơn vị r bằng a·R. Với T và ρ
+ * không đổi trong một voxel, nghiệm giải tích cho:
+ *   R_out = R_in·e^{-aΔr} + (T/a)(1 - e^{-aΔr})
+ *   D     = T + (R_in - T/a)(1 - e^{-aΔr}) / Δr,   Δr = ρ·Δs
+ * Độ phức tạp O(N · số cone). Mật độ và TERMA có thể lưu double hoặc float
+ * (T); năng lượng mang theo đường và liều luôn tính bằng double.
+ */
+class CollapsedConeTransport {
+public:
+    // dose += scale · Σ_cone w · D, beam_direction dùng cho trọng số bất đẳng hướng
+    template <typename T>
+    static void transport(const Volume3D<T>& density,
+                          const Volume3D<T>& terma,
+                          const ConeLattice& lattice,
+                          const ConeKernel& kernel,
+                          const std::array<double, 3>& beam_direction,
+                          DoseVolume& dose,
+                          double scale = 1.0) {
+        const auto& cones = lattice.directions();
+        
+        // Trọng số hướng, chuẩn hóa để bảo toàn năng lượng
+        std::vector<double> weights(cones.size());
+        double total = 0.0;
+        for (std::size_t m = 0; m < cones.size(); ++m) {
+            const auto& u = cones[m].direction;
+            double cos_theta = u[0] * beam_direction[0] + u[1] * beam_direction[1] + u[2] * beam_direction[2];
+            weights[m] = cones[m].solid_angle * (1.0 + kernel.forward_anisotropy * cos_theta);
+            total += weights[m];
+        }
+        if (total <= 0.0) {
+            return;
+        }
+        
+        for (std::size_t m = 0; m < cones.size(); ++m) {
+            transport_direction(density, terma, cones[m], kernel, dose, scale * weights[m] / total);
+        }
+    }
+    
+private:
+    // Liều trung bình trong một voxel cho một thành phần kernel, cập nhật R
+    static double deposit(double& energy, double terma, double delta_r, double attenuation) {
+        if (delta_r <= 1e-12) {
+            return attenuation * energy;
+        }
+        double e = std::exp(-attenuation * delta_r);
+        double released = terma / attenuation;
+        double dose = terma + (energy - released) * (1.0 - e) / delta_r;
+        energy = energy * e + released * (1.0 - e);
+        return dose;
+    }
+    
+    template <typename T>
+    static void transport_direction(const Volume3D<T>& density,
+                                    const Volume3D<T>& terma,
+                                    const ConeDirection& cone,
+                                    const ConeKernel& kernel,
+                                    DoseVolume& dose,
+                                    double weight) {
+        const std::array<long, 3> dims = {
+            static_cast<long>(density.width()),
+            static_cast<long>(density.height()),
+            static_cast<long>(density.depth())
+        };
+        const std::array<long, 3> strides = {
+            1,
+            static_cast<long>(density.row_stride()),
+            static_cast<long>(density.slice_stride())
+        };
+        const long n = dims[cone.axis];
+        const long nb = dims[cone.axis_b];
+        const long nc = dims[cone.axis_c];
+        const bool forward = cone.direction[cone.axis] > 0.0;
+        
+        const double fp = kernel.primary_fraction * weight;
+        const double fs = (1.0 - kernel.primary_fraction) * weight;
+        
+        const T* rho = density.data();
+        const T* t = terma.data();
+        double* out = dose.data();
+        
+        // Mỗi voxel thuộc đúng một đường của hướng này: các đường ghi vào vùng nhớ rời nhau
+        #pragma omp parallel for collapse(2) schedule(dynamic, 16)
+        for (long oc = cone.origin_c_min; oc <= cone.origin_c_max; ++oc) {
+            for (long ob = cone.origin_b_min; ob <= cone.origin_b_max; ++ob) {
+                double energy_p = 0.0;
+                double energy_s = 0.0;
+                for (long step = 0; step < n; ++step) {
+                    long k = forward ? step : n - 1 - step;
+                    long b = ob + cone.shift_b[k];
+                    long c = oc + cone.shift_c[k];
+                    if (b < 0 || b >= nb || c < 0 || c >= nc) {
+                        continue;
+                    }
+                    long idx = k * strides[cone.axis] + b * strides[cone.axis_b] + c * strides[cone.axis_c];
+                    double delta_r = rho[idx] * cone.step_length;
+                    double d = fp * deposit(energy_p, t[idx], delta_r, kernel.primary_attenuation) +
+                               fs * deposit(energy_s, t[idx], delta_r, kernel.scatter_attenuation);
+                    out[idx] += d;
+                }
+            }
+        }
+    }
+};
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_COLLAPSED_CONE_H
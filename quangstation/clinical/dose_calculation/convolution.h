@@ -0,0 +1,500 @@
+#ifndef QUANGSTATION_CONVOLUTION_H
+#define QUANGSTATION_CONVOLUTION_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "fft.h"
+#include "volume3d.h"
+#include "grid_pool.h"
+
+namespace quangstation {
+
+// Phương pháp tính tích chập kernel liều
+enum class ConvolutionMode {
+    Auto,       // Tách được -> Separable, kernel lớn -> FFT, còn lại -> Direct
+    Direct,     // Tổng trực tiếp O(N·w³)
+    Separable,  // Ba lượt 1D O(N·3w), chỉ cho kernel hạng 1
+    FFT         // Nhân phổ O(N·log N), phổ kernel được đệm lại
+};
+
+inline const char* to_string(ConvolutionMode mode) {
+    switch (mode) {
+        case ConvolutionMode::Direct: return "direct";
+        case ConvolutionMode::Separable: return "separable";
+        case ConvolutionMode::FFT: return "fft";
+        default: return "auto";
+    }
+}
+
+inline ConvolutionMode convolution_mode_from_string(const std::string& name) {
+    std::string key = name;
+    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+    if (key == "auto") return ConvolutionMode::Auto;
+    if (key == "direct") return ConvolutionMode::Direct;
+    if (key == "separable") return ConvolutionMode::Separable;
+    if (key == "fft") return ConvolutionMode::FFT;
+    throw std::invalid_argument("Chế độ tích chập không hợp lệ: " + name);
+}
+
+/**
+ * Phân tích kernel hạng 1: K(z, y, x) = kz(z) * ky(y) * kx(x)
+ * trên cửa sổ [c - half, c + half]³ quanh tâm c của kernel.
+ */
+struct SeparableKernel {
+    bool valid = false;
+    std::vector<double> kx, ky, kz;
+    
+    static SeparableKernel factorize(const Volume3D<double>& kernel, int half, double tolerance = 1e-9) {
+        SeparableKernel result;
+        const int center = static_cast<int>(kernel.depth()) / 2;
+        const int n = 2 * half + 1;
+        
+        // Chọn phần tử trụ có trị tuyệt đối lớn nhất
+        int pz = 0, py = 0, px = 0;
+        double pivot = 0.0;
+        for (int k = 0; k < n; ++k) {
+            for (int j = 0; j < n; ++j) {
+                for (int i = 0; i < n; ++i) {
+                    double v = kernel(center - half + k, center - half + j, center - half + i);
+                    if (std::abs(v) > std::abs(pivot)) {
+                        pivot = v;
+                        pz = k; py = j; px = i;
+                    }
+                }
+            }
+        }
+        if (pivot == 0.0) {
+            result.valid = true;
+            result.kx.assign(n, 0.0);
+            result.ky.assign(n, 0.0);
+            result.kz.assign(n, 0.0);
+            return result;
+        }
+        
+        result.kx.resize(n);
+        result.ky.resize(n);
+        result.kz.resize(n);
+        for (int i = 0; i < n; ++i) {
+            result.kx[i] = kernel(center - half + pz, center - half + py, center - half + i) / pivot;
+            result.ky[i] = kernel(center - half + pz, center - half + i, center - half + px) / pivot;
+            result.kz[i] = kernel(center - half + i, center - half + py, center - half + px);
+        }
+        
+        // Kiểm tra sai số tái tạo
+        double max_error = 0.0;
+        for (int k = 0; k < n; ++k) {
+            for (int j = 0; j < n; ++j) {
+                for (int i = 0; i < n; ++i) {
+                    double v = kernel(center - half + k, center - half + j, center - half + i);
+                    double approx = result.kz[k] * result.ky[j] * result.kx[i];
+                    max_error = std::max(max_error, std::abs(v - approx));
+                }
+            }
+        }
+        result.valid = max_error <= tolerance * std::abs(pivot);
+        return result;
+    }
+};
+
+/**
+ * Kernel cùng các dữ liệu dẫn xuất dùng lại giữa các lần tích chập: hash nội
+ * dung, phân tích hạng 1 và phổ FFT theo cửa sổ. Dữ liệu dẫn xuất được tính
+ * lần đầu cần đến rồi giữ lại (phổ: theo kích thước đệm, giữ vài phổ gần nhất);
+ * dùng chung được giữa nhiều luồng và nhiều thuật toán.
+ */
+class PreparedKernel {
+public:
+    using Spectrum = GridPool::Buffer<std::complex<double>>;
+    using SpectrumKey = std::tuple<int, std::size_t, std::size_t, std::size_t>;
+    
+    explicit PreparedKernel(Volume3D<double> kernel, std::size_t max_spectra = 2)
+        : kernel_(std::move(kernel)), hash_(content_hash(kernel_)), max_spectra_(max_spectra) {
+        if (kernel_.depth() != kernel_.height() || kernel_.depth() != kernel_.width() || kernel_.depth() % 2 == 0) {
+            throw std::invalid_argument("PreparedKernel: kernel phải là khối lập phương kích thước lẻ");
+        }
+    }
+    
+    const Volume3D<double>& kernel() const { return kernel_; }
+    std::uint64_t hash() const { return hash_; }
+    int max_half() const { return static_cast<int>(kernel_.depth()) / 2; }
+    
+    // Phân tích hạng 1 trên cửa sổ half (valid = false nếu không tách được)
+    const SeparableKernel& factors(int half) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = factors_.find(half);
+        if (it == factors_.end()) {
+            it = factors_.emplace(half, SeparableKernel::factorize(kernel_, half)).first;
+        }
+        return it->second;
+    }
+    
+    std::shared_ptr<const Spectrum> find_spectrum(const SpectrumKey& key) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& entry : spectra_) {
+            if (entry.first == key) {
+                return entry.second;
+            }
+        }
+        return nullptr;
+    }
+    
+    void store_spectrum(const SpectrumKey& key, std::shared_ptr<const Spectrum> spectrum) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& entry : spectra_) {
+            if (entry.first == key) {
+                return;
+            }
+        }
+        spectra_.emplace_back(key, std::move(spectrum));
+        while (spectra_.size() > max_spectra_) {
+            spectra_.pop_front();
+        }
+    }
+    
+private:
+    Volume3D<double> kernel_;
+    std::uint64_t hash_;
+    std::size_t max_spectra_;
+    mutable std::mutex mutex_;
+    mutable std::map<int, SeparableKernel> factors_;
+    mutable std::deque<std::pair<SpectrumKey, std::shared_ptr<const Spectrum>>> spectra_;
+};
+
+/**
+ * Tương quan mật độ với dose kernel:
+ *   out(p) = Σ_{|d|∞ <= half} K(c + d) · ρ(p + d),  ρ = 0 ngoài lưới
+ * với c là tâm kernel (kích thước kernel lẻ). Ba backend cho cùng kết quả
+ * (sai khác làm tròn), chọn lúc chạy để so sánh hiệu năng. Với pool khác null,
+ * lưới kết quả và các buffer trung gian (lượt 1D, buffer FFT) lấy từ pool; người
+ * gọi trả lưới kết quả về pool khi dùng xong.
+ */
+class KernelConvolver {
+public:
+    explicit KernelConvolver(ConvolutionMode mode = ConvolutionMode::Auto) : mode_(mode) {}
+    
+    void set_mode(ConvolutionMode mode) { mode_ = mode; }
+    ConvolutionMode mode() const { return mode_; }
+    
+    // Kích thước cửa sổ từ đó Auto chuyển sang FFT với kernel không tách được
+    void set_fft_threshold(int window) { fft_threshold_ = window; }
+    
+    // Backend thực sự được dùng cho kernel này
+    ConvolutionMode resolve_mode(const Volume3D<double>& kernel, int half) const {
+        if (mode_ != ConvolutionMode::Auto) {
+            return mode_;
+        }
+        if (SeparableKernel::factorize(kernel, half).valid) {
+            return ConvolutionMode::Separable;
+        }
+        return (2 * half + 1 >= fft_threshold_) ? ConvolutionMode::FFT : ConvolutionMode::Direct;
+    }
+    
+    ConvolutionMode resolve_mode(const PreparedKernel& kernel, int half) const {
+        if (mode_ != ConvolutionMode::Auto) {
+            return mode_;
+        }
+        if (kernel.factors(half).valid) {
+            return ConvolutionMode::Separable;
+        }
+        return (2 * half + 1 >= fft_threshold_) ? ConvolutionMode::FFT : ConvolutionMode::Direct;
+    }
+    
+    DensityVolume correlate(const DensityVolume& density, const Volume3D<double>& kernel, int half,
+                            GridPool* pool = nullptr) {
+        if (kernel.depth() != kernel.height() || kernel.depth() != kernel.width() || kernel.depth() % 2 == 0) {
+            throw std::invalid_argument("KernelConvolver: kernel phải là khối lập phương kích thước lẻ");
+        }
+        half = std::max(0, std::min(half, static_cast<int>(kernel.depth()) / 2));
+        
+        switch (resolve_mode(kernel, half)) {
+            case ConvolutionMode::Separable: {
+                SeparableKernel factors = SeparableKernel::factorize(kernel, half);
+                if (!factors.valid) {
+                    throw std::invalid_argument("KernelConvolver: kernel không tách được, không dùng được chế độ separable");
+                }
+                return correlate_separable(density, factors, half, pool);
+            }
+            case ConvolutionMode::FFT:
+                return correlate_fft(density, kernel, half, pool);
+            default:
+                return correlate_direct(density, kernel, half, pool);
+        }
+    }
+    
+    // Như trên, dùng phân tích hạng 1 và phổ đã giữ trong kernel
+    DensityVolume correlate(const DensityVolume& density, const PreparedKernel& kernel, int half,
+                            GridPool* pool = nullptr) {
+        half = std::max(0, std::min(half, kernel.max_half()));
+        
+        switch (resolve_mode(kernel, half)) {
+            case ConvolutionMode::Separable: {
+                const SeparableKernel& factors = kernel.factors(half);
+                if (!factors.valid) {
+                    throw std::invalid_argument("KernelConvolver: kernel không tách được, không dùng được chế độ separable");
+                }
+                return correlate_separable(density, factors, half, pool);
+            }
+            case ConvolutionMode::FFT: {
+                const std::array<std::size_t, 3> dims = padded_dims(density, half);
+                const PreparedKernel::SpectrumKey key(half, dims[0], dims[1], dims[2]);
+                auto spectrum = kernel.find_spectrum(key);
+                if (!spectrum) {
+                    spectrum = build_spectrum(kernel.kernel(), half, dims);
+                    kernel.store_spectrum(key, spectrum);
+                }
+                return correlate_spectrum(density, *spectrum, dims, pool);
+            }
+            default:
+                return correlate_direct(density, kernel.kernel(), half, pool);
+        }
+    }
+    
+    void clear_cache() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        spectra_.clear();
+    }
+    
+private:
+    using Complex = std::complex<double>;
+    using Spectrum = PreparedKernel::Spectrum;
+    using SpectrumKey = std::tuple<std::uint64_t, int, std::size_t, std::size_t, std::size_t>;
+    
+    static DensityVolume correlate_direct(const DensityVolume& density, const Volume3D<double>& kernel, int half,
+                                          GridPool* pool) {
+        const long depth = static_cast<long>(density.depth());
+        const long height = static_cast<long>(density.height());
+        const long width = static_cast<long>(density.width());
+        const int kernel_center = static_cast<int>(kernel.depth()) / 2;
+        
+        DensityVolume out = pool_acquire_like<double>(pool, density, 0.0);
+        
+        #pragma omp parallel for collapse(2)
+        for (long z = 0; z < depth; ++z) {
+            for (long y = 0; y < height; ++y) {
+                double* out_row = out.row(z, y);
+                for (long x = 0; x < width; ++x) {
+                    double sum = 0.0;
+                    long x_lo = std::max(0L, x - half);
+                    long x_hi = std::min(width - 1, x + half);
+                    
+                    for (int kz = kernel_center - half; kz <= kernel_center + half; ++kz) {
+                        long nz = z + (kz - kernel_center);
+                        if (nz < 0 || nz >= depth) continue;
+                        
+                        for (int ky = kernel_center - half; ky <= kernel_center + half; ++ky) {
+                            long ny = y + (ky - kernel_center);
+                            if (ny < 0 || ny >= height) continue;
+                            
+                            const double* kernel_row = kernel.row(kz, ky) + (kernel_center - x);
+                            const double* density_row = density.row(nz, ny);
+                            for (long nx = x_lo; nx <= x_hi; ++nx) {
+                                sum += kernel_row[nx] * density_row[nx];
+                            }
+                        }
+                    }
+                    out_row[x] = sum;
+                }
+            }
+        }
+        return out;
+    }
+    
+    // Tương quan 1D theo một trục (0 = x, 1 = y, 2 = z) với biên bằng 0
+    static void correlate_axis(const DensityVolume& in, DensityVolume& out,
+                               const std::vector<double>& k, int half, int axis) {
+        const long depth = static_cast<long>(in.depth());
+        const long height = static_cast<long>(in.height());
+        const long width = static_cast<long>(in.width());
+        const long n = (axis == 0) ? width : (axis == 1) ? height : depth;
+        const long stride = (axis == 0) ? 1
+                          : (axis == 1) ? static_cast<long>(in.row_stride())
+                          : static_cast<long>(in.slice_stride());
+        
+        #pragma omp parallel for collapse(2)
+        for (long z = 0; z < depth; ++z) {
+            for (long y = 0; y < height; ++y) {
+                const double* src_row = in.row(z, y);
+                double* dst_row = out.row(z, y);
+                for (long x = 0; x < width; ++x) {
+                    long pos = (axis == 0) ? x : (axis == 1) ? y : z;
+                    long lo = std::max(-static_cast<long>(half), -pos);
+                    long hi = std::min(static_cast<long>(half), n - 1 - pos);
+                    const double* src = src_row + x;
+                    double sum = 0.0;
+                    for (long d = lo; d <= hi; ++d) {
+                        sum += k[d + half] * src[d * stride];
+                    }
+                    dst_row[x] = sum;
+                }
+            }
+        }
+    }
+    
+    static DensityVolume correlate_separable(const DensityVolume& density, const SeparableKernel& factors, int half,
+                                             GridPool* pool) {
+        DensityVolume pass_x = pool_acquire_like<double>(pool, density, 0.0);
+        DensityVolume pass_y = pool_acquire_like<double>(pool, density, 0.0);
+        correlate_axis(density, pass_x, factors.kx, half, 0);
+        correlate_axis(pass_x, pass_y, factors.ky, half, 1);
+        correlate_axis(pass_y, pass_x, factors.kz, half, 2);
+        pool_release(pool, pass_y);
+        return pass_x;
+    }
+    
+    // FFT theo một trục của buffer phức kích thước dims (x, y, z), bố cục [z][y][x]
+    static void fft_axis(Spectrum& data, const std::array<std::size_t, 3>& dims, int axis, bool inverse) {
+        const std::size_t n = dims[axis];
+        const std::size_t stride = (axis == 0) ? 1 : (axis == 1) ? dims[0] : dims[0] * dims[1];
+        const std::size_t other_a = dims[(axis + 1) % 3];
+        const std::size_t other_b = dims[(axis + 2) % 3];
+        const std::array<std::size_t, 3> strides = {1, dims[0], dims[0] * dims[1]};
+        const std::size_t stride_a = strides[(axis + 1) % 3];
+        const std::size_t stride_b = strides[(axis + 2) % 3];
+        const long num_lines = static_cast<long>(other_a * other_b);
+        
+        FFT plan(n);
+        
+        #pragma omp parallel
+        {
+            std::vector<Complex> line(n), result(n);
+            
+            #pragma omp for
+            for (long l = 0; l < num_lines; ++l) {
+                std::size_t a = static_cast<std::size_t>(l) % other_a;
+                std::size_t b = static_cast<std::size_t>(l) / other_a;
+                Complex* base = data.data() + a * stride_a + b * stride_b;
+                for (std::size_t i = 0; i < n; ++i) {
+                    line[i] = base[i * stride];
+                }
+                if (inverse) {
+                    plan.inverse(line.data(), result.data());
+                } else {
+                    plan.forward(line.data(), result.data());
+                }
+                for (std::size_t i = 0; i < n; ++i) {
+                    base[i * stride] = result[i];
+                }
+            }
+        }
+    }
+    
+    static void fft_3d(Spectrum& data, const std::array<std::size_t, 3>& dims, bool inverse) {
+        for (int axis = 0; axis < 3; ++axis) {
+            fft_axis(data, dims, axis, inverse);
+        }
+    }
+    
+    // Phổ của kernel đã lật: g(s) = K(c - s), s ∈ [-half, half]³, đặt vòng quanh gốc
+    static std::shared_ptr<const Spectrum> build_spectrum(const Volume3D<double>& kernel, int half,
+                                                          const std::array<std::size_t, 3>& dims) {
+        const int center = static_cast<int>(kernel.depth()) / 2;
+        auto spectrum = std::make_shared<Spectrum>(dims[0] * dims[1] * dims[2], Complex(0.0, 0.0));
+        for (int sz = -half; sz <= half; ++sz) {
+            std::size_t iz = static_cast<std::size_t>((sz + static_cast<long>(dims[2])) % static_cast<long>(dims[2]));
+            for (int sy = -half; sy <= half; ++sy) {
+                std::size_t iy = static_cast<std::size_t>((sy + static_cast<long>(dims[1])) % static_cast<long>(dims[1]));
+                for (int sx = -half; sx <= half; ++sx) {
+                    std::size_t ix = static_cast<std::size_t>((sx + static_cast<long>(dims[0])) % static_cast<long>(dims[0]));
+                    (*spectrum)[(iz * dims[1] + iy) * dims[0] + ix] =
+                        kernel(center - sz, center - sy, center - sx);
+                }
+            }
+        }
+        fft_3d(*spectrum, dims, false);
+        return spectrum;
+    }
+    
+    // Phổ kernel đệm theo (hash kernel, half, kích thước đệm)
+    std::shared_ptr<const Spectrum> kernel_spectrum(const Volume3D<double>& kernel, int half,
+                                                    const std::array<std::size_t, 3>& dims) {
+        SpectrumKey key(content_hash(kernel), half, dims[0], dims[1], dims[2]);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = spectra_.find(key);
+            if (it != spectra_.end()) {
+                return it->second;
+            }
+        }
+        
+        auto spectrum = build_spectrum(kernel, half, dims);
+        
+        std::lock_guard<std::mutex> lock(mutex_);
+        spectra_[key] = spectrum;
+        return spectrum;
+    }
+    
+    // Đệm tối thiểu N + half theo mỗi trục để tránh chồng lấn vòng
+    static std::array<std::size_t, 3> padded_dims(const DensityVolume& density, int half) {
+        return {
+            FFT::good_size(density.width() + half),
+            FFT::good_size(density.height() + half),
+            FFT::good_size(density.depth() + half)
+        };
+    }
+    
+    DensityVolume correlate_fft(const DensityVolume& density, const Volume3D<double>& kernel, int half,
+                                GridPool* pool) {
+        const std::array<std::size_t, 3> dims = padded_dims(density, half);
+        auto spectrum = kernel_spectrum(kernel, half, dims);
+        return correlate_spectrum(density, *spectrum, dims, pool);
+    }
+    
+    static DensityVolume correlate_spectrum(const DensityVolume& density, const Spectrum& spectrum,
+                                            const std::array<std::size_t, 3>& dims, GridPool* pool) {
+        const std::size_t total = dims[0] * dims[1] * dims[2];
+        Spectrum data = pool ? pool->acquire_buffer<Complex>(total, Complex(0.0, 0.0))
+                             : Spectrum(total, Complex(0.0, 0.0));
+        for (std::size_t z = 0; z < density.depth(); ++z) {
+            for (std::size_t y = 0; y < density.height(); ++y) {
+                const double* row = density.row(z, y);
+                Complex* dst = data.data() + (z * dims[1] + y) * dims[0];
+                for (std::size_t x = 0; x < density.width(); ++x) {
+                    dst[x] = row[x];
+                }
+            }
+        }
+        
+        fft_3d(data, dims, false);
+        for (std::size_t i = 0; i < total; ++i) {
+            data[i] *= spectrum[i];
+        }
+        fft_3d(data, dims, true);
+        
+        DensityVolume out = pool_acquire_like<double>(pool, density, 0.0);
+        for (std::size_t z = 0; z < density.depth(); ++z) {
+            for (std::size_t y = 0; y < density.height(); ++y) {
+                double* row = out.row(z, y);
+                const Complex* src = data.data() + (z * dims[1] + y) * dims[0];
+                for (std::size_t x = 0; x < density.width(); ++x) {
+                    row[x] = src[x].real();
+                }
+            }
+        }
+        if (pool) {
+            pool->release_buffer(std::move(data));
+        }
+        return out;
+    }
+    
+    ConvolutionMode mode_;
+    int fft_threshold_ = 9;
+    std::mutex mutex_;
+    std::map<SpectrumKey, std::shared_ptr<const Spectrum>> spectra_;
+};
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_CONVOLUTION_H
@@ -0,0 +1,87 @@
+#ifndef QUANGSTATION_DEPTH_DOSE_H
+#define QUANGSTATION_DEPTH_DOSE_H
+
+#include <string>
+
+#include "fast_math.h"
+
+namespace quangstation {
+
+// Loại hạt của chùm tia, xác định một lần cho mỗi chùm tia thay vì so sánh chuỗi ở từng voxel
+enum class ParticleType {
+    Photon,
+    Electron,
+    Proton,
+    Other
+};
+
+inline ParticleType particle_type_from_string(const std::string& type) {
+    if (type == "photon") return ParticleType::Photon;
+    if (type == "electron") return ParticleType::Electron;
+    if (type == "proton") return ParticleType::Proton;
+    return ParticleType::Other;
+}
+
+/**
+ * Đường cong liều theo radiological depth (mm) đơn giản hóa của pencil beam.
+ * Hằng số theo năng lượng được tính khi dựng; operator() không rẽ nhánh
+ * (điều kiện viết dạng chọn giá trị) để vòng lặp voxel vector hóa được.
+ */
+template <ParticleType P>
+struct DepthDoseCurve;
+
+// Photon: PDD suy giảm hàm mũ
+template <>
+struct DepthDoseCurve<ParticleType::Photon> {
+    explicit DepthDoseCurve(double /*energy*/) {}
+    
+    double operator()(double depth) const {
+        return fast_exp(-0.005 * depth);
+    }
+};
+
+// Electron: giảm về 0 tại phạm vi thực tế r_p (0.9 · độ sâu tối đa, độ sâu tối đa = 0.5 · E cm)
+template <>
+struct DepthDoseCurve<ParticleType::Electron> {
+    explicit DepthDoseCurve(double energy)
+        : r_p(0.9 * (0.5 * energy * 10.0)), inv_r_p(1.0 / r_p) {}
+    
+    double operator()(double depth) const {
+        const double u = (depth - r_p) * inv_r_p;
+        const double value = (1.0 - depth * inv_r_p) * fast_exp(-4.0 * u * u);
+        return depth < r_p ? value : 0.0;
+    }
+    
+    double r_p;
+    double inv_r_p;
+};
+
+// Proton: đỉnh Bragg tại phạm vi 0.3 · E cm, bằng 0 sau phạm vi
+template <>
+struct DepthDoseCurve<ParticleType::Proton> {
+    explicit DepthDoseCurve(double energy)
+        : range_mm(0.3 * energy * 10.0), inv_range(1.0 / range_mm) {}
+    
+    double operator()(double depth) const {
+        const double u = (depth - range_mm) * inv_range;
+        const double value = 0.8 + 5.0 * fast_exp(-20.0 * u * u);
+        return depth <= range_mm ? value : 0.0;
+    }
+    
+    double range_mm;
+    double inv_range;
+};
+
+// Loại hạt không hỗ trợ: không đóng góp liều
+template <>
+struct DepthDoseCurve<ParticleType::Other> {
+    explicit DepthDoseCurve(double /*energy*/) {}
+    
+    double operator()(double /*depth*/) const {
+        return 0.0;
+    }
+};
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_DEPTH_DOSE_H
@@ -1,1406 +1,698 @@
-#include <iostream>
-#include <vector>
-#include <string>
-#include <cmath>
-#include <memory>
-#include <algorithm>
-#include <unordered_map>
-#include <fstream>
-#include <sstream>
-#include <iomanip>
+// Module Python _dose_engine: binding pybind11 cho các thuật toán tính liều
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
 
-// Cấu trúc dữ liệu cho vật liệu
-struct Material {
-    std::string name;
-    double density;                  // g/cm3
-    double electron_density_relative; // Tương đối so với nước
-    
-    Material(const std::string& n, double d, double edr) 
-        : name(n), density(d), electron_density_relative(edr) {}
-};
-
-// Bảng chuyển đổi HU sang mật độ điện tử
-class HUtoEDConverter {
-private:
-    std::vector<std::pair<int, double>> conversion_table;
-    
-public:
-    HUtoEDConverter() {
-        // Giá trị mặc định
-        conversion_table = {
-            {-1000, 0.001},  // Không khí
-            {-950, 0.001},   // Không khí
-            {-700, 0.25},    // Phổi
-            {-100, 0.9},     // Mỡ
-            {0, 1.0},        // Nước
-            {50, 1.05},      // Mô mềm
-            {300, 1.5},      // Xương
-            {1000, 2.0},     // Kim loại
-            {3000, 3.0}      // Kim loại cứng
-        };
-    }
-    
-    void load_from_file(const std::string& filename) {
-        std::ifstream file(filename);
-        if (!file.is_open()) {
-            std::cerr << "Không thể mở file HU-ED: " << filename << std::endl;
-            return;
-        }
-        
-        conversion_table.clear();
-        std::string line;
-        while (std::getline(file, line)) {
-            std::istringstream iss(line);
-            int hu;
-            double ed;
-            if (iss >> hu >> ed) {
-                conversion_table.push_back({hu, ed});
-            }
-        }
-        
-        // Sắp xếp bảng theo HU tăng dần
-        std::sort(conversion_table.begin(), conversion_table.end());
-        file.close();
-    }
-    
-    double convert(int hu) const {
-        // Nếu HU nhỏ hơn giá trị nhỏ nhất trong bảng
-        if (hu <= conversion_table.front().first) {
-            return conversion_table.front().second;
-        }
-        
-        // Nếu HU lớn hơn giá trị lớn nhất trong bảng
-        if (hu >= conversion_table.back().first) {
-            return conversion_table.back().second;
-        }
-        
-        // Nội suy tuyến tính
-        for (size_t i = 0; i < conversion_table.size() - 1; ++i) {
-            if (hu >= conversion_table[i].first && hu < conversion_table[i + 1].first) {
-                double hu1 = conversion_table[i].first;
-                double hu2 = conversion_table[i + 1].first;
-                double ed1 = conversion_table[i].second;
-                double ed2 = conversion_table[i + 1].second;
-                
-                return ed1 + (ed2 - ed1) * (hu - hu1) / (hu2 - hu1);
-            }
-        }
-        
-        // Mặc định trả về mật độ nước
-        return 1.0;
-    }
-};
+#include "dose_engine.h"
+#include "pybind_volume.h"
 
-// Cấu trúc dữ liệu cho beam
-struct Beam {
-    std::string id;
-    std::string type;           // "photon", "electron", "proton"
-    double energy;              // MV hoặc MeV
-    double gantry_angle;        // độ
-    double collimator_angle;    // độ
-    double couch_angle;         // độ
-    std::vector<std::vector<double>> mlc_positions; // Vị trí MLC (mm) cho từng control point
-    std::vector<double> weights;  // Trọng số cho từng control point
-    double ssd;                 // Source-Surface Distance (mm)
-    std::array<double, 3> isocenter; // Tọa độ tâm (mm)
-    
-    // Thông số cho VMAT
-    bool is_arc;
-    double arc_start_angle;
-    double arc_stop_angle;
-    double arc_direction;       // 1 CW, -1 CCW
-    
-    // Thông số cho wedge
-    bool has_wedge;
-    std::string wedge_type;     // "physical", "enhanced", "virtual"
-    double wedge_angle;
-    double wedge_orientation;
-    
-    // Constructor
-    Beam(const std::string& bid, const std::string& btype, double e) 
-        : id(bid), type(btype), energy(e), gantry_angle(0), collimator_angle(0), 
-          couch_angle(0), ssd(1000), is_arc(false), 
-          arc_start_angle(0), arc_stop_angle(0), arc_direction(1),
-          has_wedge(false), wedge_angle(0), wedge_orientation(0) {
-        isocenter = {0, 0, 0};
-    }
-};
+namespace py = pybind11;
+using quangstation::pyutil::BufferKeeper;
+using quangstation::pyutil::PyJob;
+using quangstation::pyutil::bind_job;
+using quangstation::pyutil::borrow_volume;
+using quangstation::pyutil::to_numpy;
+using quangstation::pyutil::stack_to_numpy;
+using quangstation::pyutil::to_dict;
+using quangstation::pyutil::to_spacing;
 
-// Cấu trúc dữ liệu cho kế hoạch
-struct Plan {
-    std::string id;
-    std::string technique;      // "3DCRT", "IMRT", "VMAT", "SBRT", "SRS"
-    double prescribed_dose;     // Gy
-    int fractions;
-    std::vector<std::shared_ptr<Beam>> beams;
-    
-    Plan(const std::string& pid, const std::string& tech, double dose, int frac) 
-        : id(pid), technique(tech), prescribed_dose(dose), fractions(frac) {}
-};
+namespace {
 
-// Thông số vật lý cho tính toán liều
-struct PhysicalParameters {
-    double alpha_beta_ratio;    // Tỷ số alpha/beta cho mô (Gy)
-    double rbe;                 // Hiệu quả sinh học tương đối
-};
+// Đọc giá trị từ dict với giá trị mặc định
+template <typename T>
+T dict_get(const py::dict& d, const char* key, const T& default_value) {
+    if (d.contains(key) && !d[key].is_none()) {
+        return d[key].cast<T>();
+    }
+    return default_value;
+}
 
-// Cấu trúc cho DVH (Dose Volume Histogram)
-struct DVH {
-    std::string structure_name;
-    std::vector<double> dose_bins;  // Giá trị liều (Gy)
-    std::vector<double> volume;     // Thể tích tích lũy (%)
-    
-    // Thông số thống kê liều
-    double d_min;   // Liều tối thiểu
-    double d_max;   // Liều tối đa
-    double d_mean;  // Liều trung bình
-    double v95;     // Thể tích nhận 95% liều
-    double v100;    // Thể tích nhận 100% liều
-    double d95;     // Liều tại 95% thể tích
-    double d50;     // Liều tại 50% thể tích
-    double d2cc;    // Liều tại 2cc thể tích
+// Chuyển mô tả chùm tia (dict từ DoseCalculator) sang Beam
+std::shared_ptr<Beam> beam_from_dict(const py::dict& d) {
+    auto beam = std::make_shared<Beam>(
+        dict_get<std::string>(d, "id", ""),
+        dict_get<std::string>(d, "type", "photon"),
+        dict_get<double>(d, "energy", 6.0)
+    );
     
-    DVH(const std::string& name) : structure_name(name), d_min(0), d_max(0), 
-          d_mean(0), v95(0), v100(0), d95(0), d50(0), d2cc(0) {}
-};
-
-// Lớp cơ sở cho các thuật toán tính liều
-class DoseAlgorithm {
-public:
-    virtual ~DoseAlgorithm() = default;
+    beam->gantry_angle = dict_get<double>(d, "gantry_angle", 0.0);
+    beam->collimator_angle = dict_get<double>(d, "collimator_angle", 0.0);
+    beam->couch_angle = dict_get<double>(d, "couch_angle", 0.0);
+    beam->ssd = dict_get<double>(d, "ssd", 1000.0);
     
-    virtual std::vector<std::vector<std::vector<double>>> calculateDose(
-        const std::vector<std::vector<std::vector<int>>>& ct_data,
-        const std::array<double, 3>& voxel_size,
-        const std::vector<std::vector<std::vector<int>>>& structure_masks,
-        const Plan& plan) = 0;
-        
-    virtual std::string getName() const = 0;
-};
-
-// Thuật toán Collapsed Cone Convolution
-class CollapsedConeConvolution : public DoseAlgorithm {
-private:
-    int num_cones;
-    double dose_grid_resolution;
-    HUtoEDConverter hu_to_ed;
-    
-public:
-    CollapsedConeConvolution(int cones = 24, double resolution = 2.5)
-        : num_cones(cones), dose_grid_resolution(resolution) {}
-    
-    void set_hu_to_ed_conversion_file(const std::string& filename) {
-        hu_to_ed.load_from_file(filename);
-    }
-    
-    std::vector<std::vector<std::vector<double>>> calculateDose(
-        const std::vector<std::vector<std::vector<int>>>& ct_data,
-        const std::array<double, 3>& voxel_size,
-        const std::vector<std::vector<std::vector<int>>>& structure_masks,
-        const Plan& plan) override {
-        
-        // Kích thước dữ liệu CT
-        size_t depth = ct_data.size();
-        size_t height = ct_data[0].size();
-        size_t width = ct_data[0][0].size();
-        
-        // Khởi tạo ma trận liều
-        std::vector<std::vector<std::vector<double>>> dose(
-            depth, std::vector<std::vector<double>>(
-                height, std::vector<double>(width, 0.0)
-            )
-        );
-        
-        // Chuyển đổi CT thành mật độ điện tử
-        std::vector<std::vector<std::vector<double>>> electron_density(
-            depth, std::vector<std::vector<double>>(
-                height, std::vector<double>(width, 0.0)
-            )
-        );
-        
-        for (size_t z = 0; z < depth; ++z) {
-            for (size_t y = 0; y < height; ++y) {
-                for (size_t x = 0; x < width; ++x) {
-                    // Chuyển đổi HU thành mật độ điện tử tương đối
-                    electron_density[z][y][x] = hu_to_ed.convert(ct_data[z][y][x]);
-                }
-            }
-        }
-        
-        // Tính toán liều cho từng beam
-        for (const auto& beam : plan.beams) {
-            std::vector<std::vector<std::vector<double>>> beam_dose(
-                depth, std::vector<std::vector<double>>(
-                    height, std::vector<double>(width, 0.0)
-                )
-            );
-            
-            // Tính toán dose kernel
-            auto kernel = generate_dose_kernel(beam->energy, beam->type);
-            
-            // Tính hướng chùm tia dựa trên góc
-            auto beam_direction = calculate_beam_direction(
-                beam->gantry_angle, beam->couch_angle
-            );
-            
-            if (beam->is_arc) {
-                // Tính toán liều cho VMAT với nhiều control points
-                int num_control_points = static_cast<int>(
-                    std::abs(beam->arc_stop_angle - beam->arc_start_angle) / 2.0
-                );
-                
-                for (int cp = 0; cp < num_control_points; ++cp) {
-                    double angle = beam->arc_start_angle + 
-                        (beam->arc_stop_angle - beam->arc_start_angle) * cp / 
-                        (num_control_points - 1) * beam->arc_direction;
-                    
-                    // Tính hướng cho control point hiện tại
-                    auto cp_direction = calculate_beam_direction(angle, beam->couch_angle);
-                    
-                    // Lấy vị trí MLC cho control point hiện tại
-                    auto mlc_pos = beam->mlc_positions[cp % beam->mlc_positions.size()];
-                    
-                    // Tính trọng số cho control point hiện tại
-                    double weight = beam->weights[cp % beam->weights.size()];
-                    
-                    // Tính liều từ control point hiện tại
-                    calculate_control_point_dose(
-                        beam_dose, electron_density, kernel, 
-                        cp_direction, beam->isocenter,
-                        mlc_pos, voxel_size, weight
-                    );
-                }
-            } else {
-                // Tính toán liều cho IMRT hoặc 3DCRT
-                for (size_t cp = 0; cp < beam->mlc_positions.size(); ++cp) {
-                    auto mlc_pos = beam->mlc_positions[cp];
-                    double weight = beam->weights[cp];
-                    
-                    calculate_control_point_dose(
-                        beam_dose, electron_density, kernel, 
-                        beam_direction, beam->isocenter,
-                        mlc_pos, voxel_size, weight
-                    );
-                    
-                    // Áp dụng wedge nếu có
-                    if (beam->has_wedge) {
-                        apply_wedge_modulation(
-                            beam_dose, beam_direction, beam->isocenter,
-                            beam->wedge_angle, beam->wedge_orientation,
-                            voxel_size
-                        );
-                    }
-                }
-            }
-            
-            // Cộng liều từ beam vào tổng liều
-            for (size_t z = 0; z < depth; ++z) {
-                for (size_t y = 0; y < height; ++y) {
-                    for (size_t x = 0; x < width; ++x) {
-                        dose[z][y][x] += beam_dose[z][y][x];
-                    }
-                }
-            }
-        }
-        
-        // Chuẩn hóa liều theo liều kê toa
-        normalize_dose(dose, structure_masks, plan.prescribed_dose);
-        
-        return dose;
+    std::vector<double> iso = dict_get<std::vector<double>>(d, "isocenter", {0.0, 0.0, 0.0});
+    if (iso.size() != 3) {
+        throw py::value_error("isocenter phải có 3 phần tử (mm)");
     }
+    beam->isocenter = {iso[0], iso[1], iso[2]};
     
-    std::string getName() const override {
-        return "Collapsed Cone Convolution";
-    }
+    beam->is_arc = dict_get<bool>(d, "is_arc", false);
+    beam->arc_start_angle = dict_get<double>(d, "arc_start_angle", 0.0);
+    beam->arc_stop_angle = dict_get<double>(d, "arc_stop_angle", 0.0);
+    beam->arc_direction = dict_get<double>(d, "arc_direction", 1.0);
     
-private:
-    // Chuyển đổi HU thành mật độ điện tử tương đối (đã được thay thế bằng HUtoEDConverter)
-    double hounsfield_to_electron_density(int hu) {
-        return hu_to_ed.convert(hu);
-    }
+    beam->has_wedge = dict_get<bool>(d, "has_wedge", false);
+    beam->wedge_type = dict_get<std::string>(d, "wedge_type", "");
+    beam->wedge_angle = dict_get<double>(d, "wedge_angle", 0.0);
+    beam->wedge_orientation = dict_get<double>(d, "wedge_orientation", 0.0);
     
-    // Sinh dose kernel dựa trên loại và năng lượng chùm tia
-    std::vector<std::vector<std::vector<double>>> generate_dose_kernel(
-        double energy, const std::string& beam_type) {
-        
-        // Kích thước kernel (đơn giản hóa cho ví dụ)
-        int kernel_size = 11;
-        std::vector<std::vector<std::vector<double>>> kernel(
-            kernel_size, std::vector<std::vector<double>>(
-                kernel_size, std::vector<double>(kernel_size, 0.0)
-            )
-        );
-        
-        int center = kernel_size / 2;
-        
-        // Tham số cho kernel dựa trên loại và năng lượng chùm tia
-        double sigma = 0;
-        if (beam_type == "photon") {
-            sigma = 0.5 + energy * 0.1;  // Đơn giản hóa cho ví dụ
-        } else if (beam_type == "electron") {
-            sigma = 0.3 + energy * 0.05;
-        } else if (beam_type == "proton") {
-            // Cho proton, tạo kernel Bragg peak
-            double range = energy * 0.3; // Đơn giản hóa: phạm vi (cm) = 0.3 * E(MeV)
-            double sigma_r = 0.03 * range;
-            
-            for (int z = 0; z < kernel_size; ++z) {
-                for (int y = 0; y < kernel_size; ++y) {
-                    for (int x = 0; x < kernel_size; ++x) {
-                        double r2 = pow(x - center, 2) + pow(y - center, 2);
-                        double depth = z - center;
-                        
-                        // Mô phỏng đường cong Bragg đơn giản
-                        if (depth <= range) {
-                            double bragg = 1.0 + 5.0 * exp(-20.0 * pow(depth - range, 2));
-                            kernel[z][y][x] = bragg * exp(-r2 / (2 * sigma_r * sigma_r));
-                        }
-                    }
-                }
-            }
-            
-            // Chuẩn hóa kernel
-            double sum = 0.0;
-            for (int z = 0; z < kernel_size; ++z) {
-                for (int y = 0; y < kernel_size; ++y) {
-                    for (int x = 0; x < kernel_size; ++x) {
-                        sum += kernel[z][y][x];
-                    }
-                }
-            }
-            
-            if (sum > 0) {
-                for (int z = 0; z < kernel_size; ++z) {
-                    for (int y = 0; y < kernel_size; ++y) {
-                        for (int x = 0; x < kernel_size; ++x) {
-                            kernel[z][y][x] /= sum;
-                        }
-                    }
-                }
-            }
-            
-            return kernel;
-        }
-        
-        // Tính toán kernel cho photon/electron
-        double sum = 0.0;
-        for (int z = 0; z < kernel_size; ++z) {
-            for (int y = 0; y < kernel_size; ++y) {
-                for (int x = 0; x < kernel_size; ++x) {
-                    double r2 = pow(x - center, 2) + pow(y - center, 2) + pow(z - center, 2);
-                    kernel[z][y][x] = exp(-r2 / (2 * sigma * sigma));
-                    sum += kernel[z][y][x];
-                }
-            }
+    // mlc_positions có thể là danh sách phẳng (một control point) hoặc danh sách các control point
+    if (d.contains("mlc_positions") && !d["mlc_positions"].is_none()) {
+        py::sequence mlc = d["mlc_positions"].cast<py::sequence>();
+        if (py::len(mlc) > 0 && py::isinstance<py::sequence>(mlc[0])) {
+            beam->mlc_positions = mlc.cast<std::vector<std::vector<double>>>();
+        } else if (py::len(mlc) > 0) {
+            beam->mlc_positions.push_back(mlc.cast<std::vector<double>>());
         }
-        
-        // Chuẩn hóa kernel
-        if (sum > 0) {
-            for (int z = 0; z < kernel_size; ++z) {
-                for (int y = 0; y < kernel_size; ++y) {
-                    for (int x = 0; x < kernel_size; ++x) {
-                        kernel[z][y][x] /= sum;
-                    }
-                }
-            }
-        }
-        
-        return kernel;
     }
-    
-    // Tính hướng chùm tia dựa trên góc gantry và couch
-    std::array<double, 3> calculate_beam_direction(double gantry_angle, double couch_angle) {
-        double gantry_rad = gantry_angle * M_PI / 180.0;
-        double couch_rad = couch_angle * M_PI / 180.0;
-        
-        std::array<double, 3> direction;
-        direction[0] = sin(gantry_rad) * cos(couch_rad);
-        direction[1] = cos(gantry_rad);
-        direction[2] = sin(gantry_rad) * sin(couch_rad);
-        
-        // Chuẩn hóa vector hướng
-        double magnitude = sqrt(direction[0] * direction[0] + 
-                               direction[1] * direction[1] + 
-                               direction[2] * direction[2]);
-        
-        if (magnitude > 0) {
-            direction[0] /= magnitude;
-            direction[1] /= magnitude;
-            direction[2] /= magnitude;
-        }
-        
-        return direction;
+    // Không có MLC: một control point với trường mở mặc định
+    if (beam->mlc_positions.empty()) {
+        beam->mlc_positions.push_back(std::vector<double>());
     }
     
-    // Áp dụng hiệu ứng wedge
-    void apply_wedge_modulation(
-        std::vector<std::vector<std::vector<double>>>& beam_dose,
-        const std::array<double, 3>& beam_direction,
-        const std::array<double, 3>& isocenter,
-        double wedge_angle,
-        double wedge_orientation,
-        const std::array<double, 3>& voxel_size
-    ) {
-        // Chuyển đổi góc wedge từ độ sang radian
-        double wedge_rad = wedge_angle * M_PI / 180.0;
-        double orientation_rad = wedge_orientation * M_PI / 180.0;
-        
-        // Tính hướng wedge
-        std::array<double, 3> wedge_direction = {
-            cos(orientation_rad),
-            0,
-            sin(orientation_rad)
-        };
-        
-        // Kích thước dữ liệu
-        size_t depth = beam_dose.size();
-        size_t height = beam_dose[0].size();
-        size_t width = beam_dose[0][0].size();
-        
-        // Tính hệ số wedge cho từng voxel
-        for (size_t z = 0; z < depth; ++z) {
-            for (size_t y = 0; y < height; ++y) {
-                for (size_t x = 0; x < width; ++x) {
-                    // Tính tọa độ voxel trong không gian thực (mm)
-                    double voxel_x = x * voxel_size[0];
-                    double voxel_y = y * voxel_size[1];
-                    double voxel_z = z * voxel_size[2];
-                    
-                    // Tính vector từ isocenter đến voxel
-                    double dx = voxel_x - isocenter[0];
-                    double dy = voxel_y - isocenter[1];
-                    double dz = voxel_z - isocenter[2];
-                    
-                    // Chiếu vector này lên hướng wedge
-                    double projection = dx * wedge_direction[0] + 
-                                       dy * wedge_direction[1] + 
-                                       dz * wedge_direction[2];
-                    
-                    // Tính hệ số wedge (đơn giản hóa)
-                    double max_distance = 100.0; // mm
-                    double normalized_position = projection / max_distance;
-                    
-                    // Hệ số wedge từ 1.0 đến cos(wedge_angle)
-                    double wedge_factor = 1.0 - (1.0 - cos(wedge_rad)) * normalized_position;
-                    
-                    // Đảm bảo hệ số wedge không âm
-                    wedge_factor = std::max(0.1, wedge_factor);
-                    
-                    // Áp dụng hệ số wedge
-                    beam_dose[z][y][x] *= wedge_factor;
-                }
-            }
-        }
+    if (d.contains("weights") && !d["weights"].is_none()) {
+        beam->weights = d["weights"].cast<std::vector<double>>();
     }
-    
-    // Tính liều từ một control point
-    void calculate_control_point_dose(
-        std::vector<std::vector<std::vector<double>>>& beam_dose,
-        const std::vector<std::vector<std::vector<double>>>& electron_density,
-        const std::vector<std::vector<std::vector<double>>>& kernel,
-        const std::array<double, 3>& beam_direction,
-        const std::array<double, 3>& isocenter,
-        const std::vector<double>& mlc_positions,
-        const std::array<double, 3>& voxel_size,
-        double weight
-    ) {
-        // Kích thước dữ liệu
-        size_t depth = electron_density.size();
-        size_t height = electron_density[0].size();
-        size_t width = electron_density[0][0].size();
-        
-        // Kích thước kernel
-        size_t kernel_size = kernel.size();
-        int kernel_center = kernel_size / 2;
-        
-        // Tính toán liều cho từng voxel
-        #pragma omp parallel for collapse(3)
-        for (size_t z = 0; z < depth; ++z) {
-            for (size_t y = 0; y < height; ++y) {
-                for (size_t x = 0; x < width; ++x) {
-                    // Kiểm tra xem voxel có trong trường chiếu không (đơn giản hóa)
-                    if (is_inside_field(x, y, z, mlc_positions, beam_direction, isocenter, voxel_size)) {
-                        // Tính khoảng cách từ voxel đến isocenter dọc theo hướng chùm tia
-                        double distance = calculate_distance(
-                            x, y, z, isocenter, beam_direction, voxel_size
-                        );
-                        
-                        // Tính tổng liều từ kernel
-                        double voxel_dose = 0.0;
-                        
-                        // Giới hạn duyệt kernel để tối ưu hiệu suất
-                        int half_kernel = kernel_center / 2;
-                        
-                        for (int kz = kernel_center - half_kernel; kz <= kernel_center + half_kernel; ++kz) {
-                            for (int ky = kernel_center - half_kernel; ky <= kernel_center + half_kernel; ++ky) {
-                                for (int kx = kernel_center - half_kernel; kx <= kernel_center + half_kernel; ++kx) {
-                                    // Tính vị trí voxel mới
-                                    int nx = x + (kx - kernel_center);
-                                    int ny = y + (ky - kernel_center);
-                                    int nz = z + (kz - kernel_center);
-                                    
-                                    // Kiểm tra biên
-                                    if (nx >= 0 && nx < width && ny >= 0 && ny < height && nz >= 0 && nz < depth) {
-                                        voxel_dose += kernel[kz][ky][kx] * electron_density[nz][ny][nx];
-                                    }
-                                }
-                            }
-                        }
-                        
-                        // Áp dụng hiệu ứng giảm liều theo khoảng cách (inverse square law)
-                        // và hiệu ứng suy giảm theo độ sâu
-                        double source_distance = 1000.0; // SSD mặc định (mm)
-                        double depth_factor = exp(-0.005 * distance); // Đơn giản hóa
-                        double inverse_square = pow(source_distance / (source_distance + distance), 2);
-                        
-                        voxel_dose *= depth_factor * inverse_square * weight;
-                        
-                        // Thêm vào beam dose
-                        beam_dose[z][y][x] += voxel_dose;
-                    }
-                }
-            }
-        }
+    if (beam->weights.empty()) {
+        beam->weights.assign(beam->mlc_positions.size(), dict_get<double>(d, "weight", 1.0));
     }
     
-    // Kiểm tra voxel có trong trường chiếu không
-    bool is_inside_field(
-        size_t x, size_t y, size_t z,
-        const std::vector<double>& mlc_positions,
-        const std::array<double, 3>& beam_direction,
-        const std::array<double, 3>& isocenter,
-        const std::array<double, 3>& voxel_size
-    ) {
-        // Tính tọa độ voxel trong không gian thực (mm)
-        double voxel_x = x * voxel_size[0];
-        double voxel_y = y * voxel_size[1];
-        double voxel_z = z * voxel_size[2];
-        
-        // Tính vector từ isocenter đến voxel
-        double dx = voxel_x - isocenter[0];
-        double dy = voxel_y - isocenter[1];
-        double dz = voxel_z - isocenter[2];
-        
-        // Tính khoảng cách dọc theo hướng chùm tia
-        double proj = dx * beam_direction[0] + dy * beam_direction[1] + dz * beam_direction[2];
-        
-        // Nếu voxel nằm sau nguồn, bỏ qua
-        if (proj < 0) {
-            return false;
-        }
-        
-        // Tính tọa độ của voxel trên mặt phẳng vuông góc với chùm tia
-        // (đơn giản hóa)
-        double field_x = dx - proj * beam_direction[0];
-        double field_y = dy - proj * beam_direction[1];
-        
-        // Tính hướng vuông góc với chùm tia
-        std::array<double, 3> perp_x = {0, 0, 0};
-        std::array<double, 3> perp_y = {0, 0, 0};
-        
-        // Tính vector vuông góc thứ nhất (nằm trên mặt phẳng ngang)
-        perp_x[0] = -beam_direction[2];
-        perp_x[2] = beam_direction[0];
-        double magnitude_x = sqrt(perp_x[0] * perp_x[0] + perp_x[2] * perp_x[2]);
-        
-        if (magnitude_x > 0) {
-            perp_x[0] /= magnitude_x;
-            perp_x[2] /= magnitude_x;
-        } else {
-            // Trường hợp chùm tia nằm dọc trục Y
-            perp_x[0] = 1.0;
-            perp_x[2] = 0.0;
-        }
-        
-        // Tính vector vuông góc thứ hai (vuông góc với cả beam_direction và perp_x)
-        perp_y[0] = beam_direction[1] * perp_x[2] - beam_direction[2] * perp_x[1];
-        perp_y[1] = beam_direction[2] * perp_x[0] - beam_direction[0] * perp_x[2];
-        perp_y[2] = beam_direction[0] * perp_x[1] - beam_direction[1] * perp_x[0];
-        // Chuẩn hóa vector
-        double magnitude_y = sqrt(perp_y[0] * perp_y[0] + perp_y[1] * perp_y[1] + perp_y[2] * perp_y[2]);
-        
-        if (magnitude_y > 0) {
-            perp_y[0] /= magnitude_y;
-            perp_y[1] /= magnitude_y;
-            perp_y[2] /= magnitude_y;
-        }
-        // Chiếu vector từ isocenter đến voxel lên các hướng vuông góc
-        double proj_x = dx * perp_x[0] + dy * perp_x[1] + dz * perp_x[2];
-        double proj_y = dx * perp_y[0] + dy * perp_y[1] + dz * perp_y[2];
-        
-        // Đơn giản hóa: kiểm tra voxel có nằm trong hình chữ nhật giới hạn bởi MLC không
-        // Giả sử mlc_positions chứa: [x1_left, x1_right, x2_left, x2_right, ...] cho các cặp lá MLC
-        
-        // Đơn giản hóa: kiểm tra với kích thước trường cố định
-        double field_width = 100.0;  // mm
-        double field_height = 100.0; // mm
+    return beam;
+}
 
-        // Nếu có thông tin MLC, kiểm tra chi tiết hơn
-        if (!mlc_positions.empty()) {
-            // Giả định: số phần tử chẵn với cặp [left, right] cho mỗi lá MLC
-            size_t num_leaves = mlc_positions.size() / 2;
-            
-            // Xác định voxel nằm ở lá thứ mấy
-            double leaf_width = field_height / num_leaves;
-            int leaf_index = static_cast<int>((proj_y + field_height / 2) / leaf_width);
-            
-            // Kiểm tra giới hạn
-            if (leaf_index >= 0 && leaf_index < num_leaves) {
-                double left = mlc_positions[2 * leaf_index];
-                double right = mlc_positions[2 * leaf_index + 1];
-                
-                return (proj_x >= left && proj_x <= right);
-            }
-            
-            return false;
+// Mặt nạ PTV tùy chọn (None: rỗng), cùng kích thước với CT
+MaskVolume borrow_target_mask(const py::object& target_mask, const CTVolume& ct, py::object& holder) {
+    MaskVolume mask;
+    if (!target_mask.is_none()) {
+        mask = borrow_volume<std::uint8_t>(target_mask.cast<py::array>(), ct.spacing(), holder, "target_mask");
+        if (!mask.same_shape(ct)) {
+            throw py::value_error("Kích thước target_mask không khớp với CT");
         }
-        // Nếu không có thông tin MLC, sử dụng kích thước trường mặc định
-        return (std::abs(proj_x) <= field_width / 2 && std::abs(proj_y) <= field_height / 2);
     }
-    
-    // Tính khoảng cách từ voxel đến isocenter dọc theo hướng chùm tia
-    double calculate_distance(
-        size_t x, size_t y, size_t z,
-        const std::array<double, 3>& isocenter,
-        const std::array<double, 3>& beam_direction,
-        const std::array<double, 3>& voxel_size
-    ) {
-        // Tính tọa độ voxel trong không gian thực (mm)
-        double voxel_x = x * voxel_size[0];
-        double voxel_y = y * voxel_size[1];
-        double voxel_z = z * voxel_size[2];
-        
-        // Tính vector từ isocenter đến voxel
-        double dx = voxel_x - isocenter[0];
-        double dy = voxel_y - isocenter[1];
-        double dz = voxel_z - isocenter[2];
-        
-        // Chiếu vector này lên hướng chùm tia
-        return std::abs(dx * beam_direction[0] + dy * beam_direction[1] + dz * beam_direction[2]);
-    }
-    
-    // Chuẩn hóa liều theo liều kê toa
-    void normalize_dose(
-        std::vector<std::vector<std::vector<double>>>& dose,
-        const std::vector<std::vector<std::vector<int>>>& structure_masks,
-        double prescribed_dose) {
-        
-        double total_dose = 0.0;
-        int num_voxels = 0;
-        
-        // Phương pháp đơn giản: duyệt qua tất cả phần tử trong dose và kiểm tra vị trí tương ứng trong ptv_mask
-        try {
-            for (size_t z = 0; z < dose.size(); ++z) {
-                for (size_t y = 0; y < dose[z].size(); ++y) {
-                    for (size_t x = 0; x < dose[z][y].size(); ++x) {
-                        // Kiểm tra nếu vị trí này nằm trong ptv_mask
-                        if (z < structure_masks.size() && y < structure_masks[z].size() && x < structure_masks[z][y].size()) {
-                            // Kiểm tra nếu điểm này là một phần của PTV
-                            if (structure_masks[z][y][x] > 0) {
-                                total_dose += dose[z][y][x];
-                                ++num_voxels;
-                            }
-                        }
-                    }
-                }
-            }
-        } catch (const std::exception& e) {
-            // Xử lý ngoại lệ nếu có
-            std::cerr << "Lỗi khi truy cập ptv_mask: " << e.what() << std::endl;
-            return;
-        }
-        
-        if (num_voxels == 0) {
-            return;
-        }
-        
-        double mean_dose = total_dose / num_voxels;
-        double scale_factor = prescribed_dose / mean_dose;
-        
-        // Chuẩn hóa tất cả các voxel
-        for (size_t z = 0; z < dose.size(); ++z) {
-            for (size_t y = 0; y < dose[0].size(); ++y) {
-                for (size_t x = 0; x < dose[0][0].size(); ++x) {
-                    dose[z][y][x] *= scale_factor;
-                }
-            }
-        }
-    }
-};
+    return mask;
+}
 
-// Thuật toán Pencil Beam
-class PencilBeam : public DoseAlgorithm {
-private:
-    double dose_grid_resolution;
-    HUtoEDConverter hu_to_ed;
-    
-public:
-    PencilBeam(double resolution = 2.5) : dose_grid_resolution(resolution) {}
-    
-    void set_hu_to_ed_conversion_file(const std::string& filename) {
-        hu_to_ed.load_from_file(filename);
-    }
-    
-    std::vector<std::vector<std::vector<double>>> calculateDose(
-        const std::vector<std::vector<std::vector<int>>>& ct_data,
-        const std::array<double, 3>& voxel_size,
-        const std::vector<std::vector<std::vector<int>>>& structure_masks,
-        const Plan& plan) override {
-        
-        // Kích thước dữ liệu CT
-        size_t depth = ct_data.size();
-        size_t height = ct_data[0].size();
-        size_t width = ct_data[0][0].size();
-        
-        // Khởi tạo ma trận liều
-        std::vector<std::vector<std::vector<double>>> dose(
-            depth, std::vector<std::vector<double>>(
-                height, std::vector<double>(width, 0.0)
-            )
-        );
-        
-        // Chuyển đổi CT thành mật độ điện tử
-        std::vector<std::vector<std::vector<double>>> electron_density(
-            depth, std::vector<std::vector<double>>(
-                height, std::vector<double>(width, 0.0)
-            )
-        );
-        
-        for (size_t z = 0; z < depth; ++z) {
-            for (size_t y = 0; y < height; ++y) {
-                for (size_t x = 0; x < width; ++x) {
-                    electron_density[z][y][x] = hu_to_ed.convert(ct_data[z][y][x]);
-                }
-            }
-        }
-        
-        // Tính toán liều cho từng beam
-        for (const auto& beam : plan.beams) {
-            // Tính hướng chùm tia
-            auto beam_direction = calculate_beam_direction(beam->gantry_angle, beam->couch_angle);
-            
-            // Tính ma trận ray trace
-            auto ray_trace = calculate_ray_trace(electron_density, beam_direction, beam->isocenter, voxel_size);
-            
-            // Tính liều từ beam hiện tại
-            std::vector<std::vector<std::vector<double>>> beam_dose = 
-                calculate_pencil_beam_dose(ray_trace, electron_density, beam, voxel_size);
-            
-            // Cộng liều từ beam vào tổng liều
-            for (size_t z = 0; z < depth; ++z) {
-                for (size_t y = 0; y < height; ++y) {
-                    for (size_t x = 0; x < width; ++x) {
-                        dose[z][y][x] += beam_dose[z][y][x];
-                    }
-                }
-            }
-        }
-        
-        // Chuẩn hóa liều theo liều kê toa
-        normalize_dose(dose, structure_masks, plan.prescribed_dose);
-        
-        return dose;
-    }
-    
-    std::string getName() const override {
-        return "Pencil Beam";
-    }
-    
-private:
-    // Tính hướng chùm tia dựa trên góc gantry và couch
-    std::array<double, 3> calculate_beam_direction(double gantry_angle, double couch_angle) {
-        double gantry_rad = gantry_angle * M_PI / 180.0;
-        double couch_rad = couch_angle * M_PI / 180.0;
-        
-        std::array<double, 3> direction;
-        direction[0] = sin(gantry_rad) * cos(couch_rad);
-        direction[1] = cos(gantry_rad);
-        direction[2] = sin(gantry_rad) * sin(couch_rad);
-        
-        // Chuẩn hóa vector hướng
-        double magnitude = sqrt(direction[0] * direction[0] + 
-                               direction[1] * direction[1] + 
-                               direction[2] * direction[2]);
-        
-        if (magnitude > 0) {
-            direction[0] /= magnitude;
-            direction[1] /= magnitude;
-            direction[2] /= magnitude;
-        }
-        
-        return direction;
-    }
-    
-    // Tính ma trận ray trace (radiological depth)
-    std::vector<std::vector<std::vector<double>>> calculate_ray_trace(
-        const std::vector<std::vector<std::vector<double>>>& electron_density,
-        const std::array<double, 3>& beam_direction,
-        const std::array<double, 3>& isocenter,
-        const std::array<double, 3>& voxel_size
-    ) {
-        size_t depth = electron_density.size();
-        size_t height = electron_density[0].size();
-        size_t width = electron_density[0][0].size();
-        
-        // Khởi tạo ma trận ray trace
-        std::vector<std::vector<std::vector<double>>> ray_trace(
-            depth, std::vector<std::vector<double>>(
-                height, std::vector<double>(width, 0.0)
-            )
-        );
-        
-        // Tính bước dịch chuyển dọc theo hướng chùm tia
-        double step_size = std::min(std::min(voxel_size[0], voxel_size[1]), voxel_size[2]) / 2.0;
-        
-        // Tính ray trace cho từng voxel
-        #pragma omp parallel for collapse(3)
-        for (size_t z = 0; z < depth; ++z) {
-            for (size_t y = 0; y < height; ++y) {
-                for (size_t x = 0; x < width; ++x) {
-                    // Tính tọa độ voxel trong không gian thực (mm)
-                    double voxel_x = x * voxel_size[0];
-                    double voxel_y = y * voxel_size[1];
-                    double voxel_z = z * voxel_size[2];
-                    
-                    // Điểm bắt đầu ray trace (từ bề mặt phantom theo hướng chùm tia)
-                    double start_x = voxel_x - 1000.0 * beam_direction[0];
-                    double start_y = voxel_y - 1000.0 * beam_direction[1];
-                    double start_z = voxel_z - 1000.0 * beam_direction[2];
-                    
-                    // Kiểm tra xem điểm bắt đầu có nằm ngoài phantom không
-                    if (start_x < 0 || start_x >= width * voxel_size[0] ||
-                        start_y < 0 || start_y >= height * voxel_size[1] ||
-                        start_z < 0 || start_z >= depth * voxel_size[2]) {
-                        
-                        // Dịch chuyển điểm bắt đầu đến biên phantom
-                        double t_min = std::numeric_limits<double>::max();
-                        
-                        // Kiểm tra giao với các mặt phẳng biên
-                        if (beam_direction[0] != 0) {
-                            double t1 = -start_x / beam_direction[0];
-                            double t2 = (width * voxel_size[0] - start_x) / beam_direction[0];
-                            if (t1 > 0 && t1 < t_min) t_min = t1;
-                            if (t2 > 0 && t2 < t_min) t_min = t2;
-                        }
-                        
-                        if (beam_direction[1] != 0) {
-                            double t1 = -start_y / beam_direction[1];
-                            double t2 = (height * voxel_size[1] - start_y) / beam_direction[1];
-                            if (t1 > 0 && t1 < t_min) t_min = t1;
-                            if (t2 > 0 && t2 < t_min) t_min = t2;
-                        }
-                        
-                        if (beam_direction[2] != 0) {
-                            double t1 = -start_z / beam_direction[2];
-                            double t2 = (depth * voxel_size[2] - start_z) / beam_direction[2];
-                            if (t1 > 0 && t1 < t_min) t_min = t1;
-                            if (t2 > 0 && t2 < t_min) t_min = t2;
-                        }
-                        
-                        if (t_min != std::numeric_limits<double>::max()) {
-                            start_x += t_min * beam_direction[0];
-                            start_y += t_min * beam_direction[1];
-                            start_z += t_min * beam_direction[2];
-                        }
-                    }
-                    
-                    // Tính ray trace bằng cách tích phân mật độ điện tử dọc theo đường đi
-                    double radiological_depth = 0.0;
-                    double current_x = start_x;
-                    double current_y = start_y;
-                    double current_z = start_z;
-                    
-                    while (current_x >= 0 && current_x < width * voxel_size[0] &&
-                           current_y >= 0 && current_y < height * voxel_size[1] &&
-                           current_z >= 0 && current_z < depth * voxel_size[2]) {
-                        
-                        // Tính chỉ số voxel hiện tại
-                        int vx = static_cast<int>(current_x / voxel_size[0]);
-                        int vy = static_cast<int>(current_y / voxel_size[1]);
-                        int vz = static_cast<int>(current_z / voxel_size[2]);
-                        
-                        // Đảm bảo chỉ số nằm trong phạm vi
-                        vx = std::max(0, std::min(vx, static_cast<int>(width) - 1));
-                        vy = std::max(0, std::min(vy, static_cast<int>(height) - 1));
-                        vz = std::max(0, std::min(vz, static_cast<int>(depth) - 1));
-                        
-                        // Cộng dồn radiological depth
-                        radiological_depth += electron_density[vz][vy][vx] * step_size;
-                        
-                        // Nếu đã đến voxel đích, dừng ray trace
-                        if (vx == x && vy == y && vz == z) {
-                            break;
-                        }
-                        
-                        // Di chuyển đến vị trí tiếp theo
-                        current_x += step_size * beam_direction[0];
-                        current_y += step_size * beam_direction[1];
-                        current_z += step_size * beam_direction[2];
-                    }
-                    
-                    ray_trace[z][y][x] = radiological_depth;
-                }
-            }
-        }
-        
-        return ray_trace;
-    }
-    
-    // Tính liều từ pencil beam
-    std::vector<std::vector<std::vector<double>>> calculate_pencil_beam_dose(
-        const std::vector<std::vector<std::vector<double>>>& ray_trace,
-        const std::vector<std::vector<std::vector<double>>>& electron_density,
-        const std::shared_ptr<Beam>& beam,
-        const std::array<double, 3>& voxel_size
-    ) {
-        size_t depth = ray_trace.size();
-        size_t height = ray_trace[0].size();
-        size_t width = ray_trace[0][0].size();
-        
-        // Khởi tạo ma trận liều
-        std::vector<std::vector<std::vector<double>>> beam_dose(
-            depth, std::vector<std::vector<double>>(
-                height, std::vector<double>(width, 0.0)
-            )
-        );
-        
-        // Tính hướng chùm tia
-        auto beam_direction = calculate_beam_direction(beam->gantry_angle, beam->couch_angle);
-        
-        // Tính hướng vuông góc với chùm tia
-        std::array<double, 3> perp_x = {0, 0, 0};
-        std::array<double, 3> perp_y = {0, 0, 0};
-        
-        // Tính vector vuông góc thứ nhất (nằm trên mặt phẳng ngang)
-        perp_x[0] = -beam_direction[2];
-        perp_x[2] = beam_direction[0];
-        double magnitude_x = sqrt(perp_x[0] * perp_x[0] + perp_x[2] * perp_x[2]);
-        
-        if (magnitude_x > 0) {
-            perp_x[0] /= magnitude_x;
-            perp_x[2] /= magnitude_x;
-        } else {
-            // Trường hợp chùm tia nằm dọc trục Y
-            perp_x[0] = 1.0;
-            perp_x[2] = 0.0;
-        }
-        
-        // Tính vector vuông góc thứ hai (vuông góc với cả beam_direction và perp_x)
-        perp_y[0] = beam_direction[1] * perp_x[2] - beam_direction[2] * perp_x[1];
-        perp_y[1] = beam_direction[2] * perp_x[0] - beam_direction[0] * perp_x[2];
-        perp_y[2] = beam_direction[0] * perp_x[1] - beam_direction[1] * perp_x[0];
-        
-        // Chuẩn hóa vector
-        double magnitude_y = sqrt(perp_y[0] * perp_y[0] + perp_y[1] * perp_y[1] + perp_y[2] * perp_y[2]);
-        
-        if (magnitude_y > 0) {
-            perp_y[0] /= magnitude_y;
-            perp_y[1] /= magnitude_y;
-            perp_y[2] /= magnitude_y;
-        }
-        
-        // Phân chia trường chùm tia thành các pencil beam
-        double field_width = 100.0;  // mm
-        double field_height = 100.0; // mm
-        int num_pencils_x = 20;      // Số lượng pencil theo chiều X
-        int num_pencils_y = 20;      // Số lượng pencil theo chiều Y
-        double pencil_width = field_width / num_pencils_x;
-        double pencil_height = field_height / num_pencils_y;
-        
-        // Tính liều từ mỗi pencil beam
-        for (int py = 0; py < num_pencils_y; ++py) {
-            for (int px = 0; px < num_pencils_x; ++px) {
-                // Tính tọa độ tâm của pencil beam trong hệ tọa độ trường chùm tia
-                double pencil_center_x = (px + 0.5) * pencil_width - field_width / 2;
-                double pencil_center_y = (py + 0.5) * pencil_height - field_height / 2;
-                
-                // Tính tọa độ tâm pencil beam trong hệ tọa độ thế giới
-                std::array<double, 3> pencil_center = {
-                    beam->isocenter[0] + pencil_center_x * perp_x[0] + pencil_center_y * perp_y[0],
-                    beam->isocenter[1] + pencil_center_x * perp_x[1] + pencil_center_y * perp_y[1],
-                    beam->isocenter[2] + pencil_center_x * perp_x[2] + pencil_center_y * perp_y[2]
-                };
-                
-                // Tính liều từ pencil beam hiện tại cho tất cả các voxel
-                calculate_single_pencil_beam_dose(
-                    beam_dose, ray_trace, electron_density,
-                    beam, pencil_center, beam_direction, perp_x, perp_y,
-                    pencil_width, pencil_height, voxel_size
-                );
-            }
-        }
-        
-        return beam_dose;
-    }
-    
-    // Tính liều từ một pencil beam
-    void calculate_single_pencil_beam_dose(
-        std::vector<std::vector<std::vector<double>>>& beam_dose,
-        const std::vector<std::vector<std::vector<double>>>& ray_trace,
-        const std::vector<std::vector<std::vector<double>>>& electron_density,
-        const std::shared_ptr<Beam>& beam,
-        const std::array<double, 3>& pencil_center,
-        const std::array<double, 3>& beam_direction,
-        const std::array<double, 3>& perp_x,
-        const std::array<double, 3>& perp_y,
-        double pencil_width,
-        double pencil_height,
-        const std::array<double, 3>& voxel_size
-    ) {
-        size_t depth = beam_dose.size();
-        size_t height = beam_dose[0].size();
-        size_t width = beam_dose[0][0].size();
-        
-        // Tính các tham số kernel dựa trên loại và năng lượng chùm tia
-        double sigma_r = 3.0;  // mm, sigma cho phần bán kính của kernel
-        if (beam->type == "photon") {
-            sigma_r = 3.0 + 0.5 * beam->energy;  // Đơn giản hóa cho ví dụ
-        } else if (beam->type == "electron") {
-            sigma_r = 5.0 + 0.3 * beam->energy;
-        } else if (beam->type == "proton") {
-            sigma_r = 2.0 + 0.2 * beam->energy;
-        }
-        
-        // Tính liều cho từng voxel
-        #pragma omp parallel for collapse(3)
-        for (size_t z = 0; z < depth; ++z) {
-            for (size_t y = 0; y < height; ++y) {
-                for (size_t x = 0; x < width; ++x) {
-                    // Tính tọa độ voxel trong không gian thực (mm)
-                    double voxel_x = x * voxel_size[0];
-                    double voxel_y = y * voxel_size[1];
-                    double voxel_z = z * voxel_size[2];
-                    
-                    // Tính vector từ tâm pencil beam đến voxel
-                    double dx = voxel_x - pencil_center[0];
-                    double dy = voxel_y - pencil_center[1];
-                    double dz = voxel_z - pencil_center[2];
-                    
-                    // Chiếu vector này lên hướng chùm tia và các hướng vuông góc
-                    double proj_beam = dx * beam_direction[0] + dy * beam_direction[1] + dz * beam_direction[2];
-                    double proj_x = dx * perp_x[0] + dy * perp_x[1] + dz * perp_x[2];
-                    double proj_y = dx * perp_y[0] + dy * perp_y[1] + dz * perp_y[2];
-                    
-                    // Tính khoảng cách vuông góc từ voxel đến đường tâm pencil beam
-                    double r2 = proj_x * proj_x + proj_y * proj_y;
-                    
-                    // Tính hệ số pencil beam sử dụng hàm Gaussian
-                    double pencil_factor = exp(-r2 / (2 * sigma_r * sigma_r));
-                    
-                    // Tính đóng góp liều từ pencil beam này
-                    double dose_contribution = 0.0;
-                    
-                    if (beam->type == "photon") {
-                        // Với photon, sử dụng PDD (Percentage Depth Dose) theo radiological depth
-                        double rad_depth = ray_trace[z][y][x];
-                        
-                        // Mô phỏng đường cong PDD đơn giản hóa
-                        double pdd_factor = exp(-0.005 * rad_depth);
-                        
-                        dose_contribution = pencil_factor * pdd_factor;
-                    } else if (beam->type == "electron") {
-                        // Với electron, mô phỏng đường cong PDD với độ sâu tối đa
-                        double rad_depth = ray_trace[z][y][x];
-                        double r_max = 0.5 * beam->energy;  // Đơn giản hóa: độ sâu tối đa (cm) = 0.5 * E(MeV)
-                        double r_max_mm = r_max * 10.0;     // Chuyển sang mm
-                        double r_p = 0.9 * r_max_mm;        // Phạm vi thực tế
-                        
-                        // Đường cong PDD đơn giản hóa
-                        double pdd_factor = 0.0;
-                        if (rad_depth < r_p) {
-                            pdd_factor = (1.0 - rad_depth / r_p) * exp(-4.0 * (rad_depth - r_p) * (rad_depth - r_p) / (r_p * r_p));
-                        }
-                        
-                        dose_contribution = pencil_factor * pdd_factor;
-                    } else if (beam->type == "proton") {
-                        // Với proton, mô phỏng đỉnh Bragg
-                        double rad_depth = ray_trace[z][y][x];
-                        double range = 0.3 * beam->energy;  // Đơn giản hóa: phạm vi (cm) = 0.3 * E(MeV)
-                        double range_mm = range * 10.0;     // Chuyển sang mm
-                        
-                        // Mô phỏng đường cong Bragg đơn giản
-                        double bragg_factor = 0.0;
-                        if (rad_depth <= range_mm) {
-                            bragg_factor = 0.8 + 5.0 * exp(-20.0 * pow(rad_depth - range_mm, 2) / (range_mm * range_mm));
-                        }
-                        
-                        dose_contribution = pencil_factor * bragg_factor;
-                    }
-                    
-                    // Áp dụng hiệu ứng giảm liều theo khoảng cách (inverse square law)
-                    double source_distance = 1000.0; // SSD mặc định (mm)
-                    double inverse_square = pow(source_distance / (source_distance + proj_beam), 2);
-                    
-                    dose_contribution *= inverse_square;
-                    
-                    // Thêm vào beam dose
-                    beam_dose[z][y][x] += dose_contribution;
-                }
-            }
-        }
+Plan plan_from_beams(const py::list& beams, double prescribed_dose, int fractions) {
+    Plan plan("", "", prescribed_dose, fractions);
+    for (const auto& item : beams) {
+        plan.beams.push_back(beam_from_dict(item.cast<py::dict>()));
     }
+    return plan;
+}
 
-    // Chuẩn hóa liều theo liều kê toa
-    void normalize_dose(
-        std::vector<std::vector<std::vector<double>>>& dose,
-        const std::vector<std::vector<std::vector<int>>>& structure_masks,
-        double prescribed_dose
-    ) {
-        // Tìm cấu trúc PTV (Planning Target Volume)
-        // Giả sử structure_masks[0] là mặt nạ cho PTV
-        if (structure_masks.empty() || dose.empty()) {
-            std::cerr << "Không có dữ liệu cấu trúc hoặc liều để chuẩn hóa" << std::endl;
-            return;
-        }
-        
-        // Tính liều trung bình trong PTV
-        double total_dose = 0.0;
-        int num_voxels = 0;
-        
-        // Lặp qua từng voxel trong không gian liều
-        size_t z_max = std::min(dose.size(), structure_masks.size());
-        for (size_t z = 0; z < z_max; ++z) {
-            size_t y_max = std::min(dose[z].size(), structure_masks[z].size());
-            for (size_t y = 0; y < y_max; ++y) {
-                size_t x_max = std::min(dose[z][y].size(), structure_masks[z][y].size());
-                for (size_t x = 0; x < x_max; ++x) {
-                    // Nếu voxel thuộc PTV (giá trị > 0 trong structure_masks)
-                    int mask_value = structure_masks[z][y][x];
-                    if (mask_value > 0) {
-                        total_dose += dose[z][y][x];
-                        ++num_voxels;
-                    }
-                }
-            }
-        }
-        
-        // Nếu không có voxel nào trong PTV, trả về
-        if (num_voxels == 0) {
-            std::cerr << "Không có voxel nào thuộc PTV để chuẩn hóa liều" << std::endl;
-            return;
-        }
-        
-        // Tính liều trung bình trong PTV
-        double mean_dose = total_dose / num_voxels;
-        
-        // Tính hệ số tỷ lệ để chuẩn hóa
-        double scale_factor = prescribed_dose / mean_dose;
-        
-        // Chuẩn hóa tất cả các voxel
-        for (auto& slice : dose) {
-            for (auto& row : slice) {
-                for (auto& voxel : row) {
-                    voxel *= scale_factor;
-                }
-            }
-        }
-        
-        std::cout << "Đã chuẩn hóa liều: liều trung bình PTV = " 
-                  << mean_dose << " -> " << prescribed_dose << " Gy" << std::endl;
-    }
-};
+// Tính liều trực tiếp trên buffer NumPy, nhả GIL trong lúc tính
+py::array_t<double> calculate_from_numpy(
+    DoseAlgorithm& algorithm,
+    const py::array& ct_array,
+    const py::sequence& spacing,
+    const py::list& beams,
+    double prescribed_dose,
+    int fractions,
+    const py::object& target_mask
+) {
+    std::array<double, 3> voxel_size = to_spacing(spacing);
+    
+    py::object ct_holder;
+    CTVolume ct = borrow_volume<std::int16_t>(ct_array, voxel_size, ct_holder, "ct");
+    
+    py::object mask_holder;
+    MaskVolume mask = borrow_target_mask(target_mask, ct, mask_holder);
+    Plan plan = plan_from_beams(beams, prescribed_dose, fractions);
+    
+    DoseVolume dose;
+    {
+        py::gil_scoped_release release;
+        dose = algorithm.calculate(ct, mask, plan);
+    }
+    
+    return to_numpy(std::move(dose));
+}
 
-// Thêm khai báo lớp AAA và AcurosXB sau phần AcurosXB
-class AAA : public DoseAlgorithm {
-private:
-    double dose_grid_resolution;
-    HUtoEDConverter hu_to_ed;
-    bool heterogeneity_correction;
-    int num_photons;
-    double max_scatter_radius;
-    double beta_param; // Scatter kernel beta parameter
-    int num_threads;
+// Liều của nhiều kế hoạch {beams, prescribed_dose, fractions} trên cùng CT, mảng (N, z, y, x)
+py::array_t<double> calculate_plans_from_numpy(
+    DoseAlgorithm& algorithm,
+    const py::array& ct_array,
+    const py::sequence& spacing,
+    const py::list& plans,
+    const py::object& target_mask
+) {
+    std::array<double, 3> voxel_size = to_spacing(spacing);
+    
+    py::object ct_holder;
+    CTVolume ct = borrow_volume<std::int16_t>(ct_array, voxel_size, ct_holder, "ct");
+    
+    py::object mask_holder;
+    MaskVolume mask = borrow_target_mask(target_mask, ct, mask_holder);
+    std::vector<Plan> scenarios;
+    for (const auto& item : plans) {
+        py::dict d = item.cast<py::dict>();
+        if (!d.contains("beams")) {
+            throw py::value_error("Mỗi kế hoạch cần khóa 'beams'");
+        }
+        scenarios.push_back(plan_from_beams(d["beams"].cast<py::list>(),
+                                            dict_get<double>(d, "prescribed_dose", 0.0),
+                                            dict_get<int>(d, "fractions", 1)));
+    }
+    
+    std::vector<DoseVolume> doses;
+    {
+        py::gil_scoped_release release;
+        doses = algorithm.calculate_plans(ct, mask, scenarios);
+    }
+    
+    return stack_to_numpy(std::move(doses));
+}
 
-public:
-    AAA(double resolution = 2.5) 
-        : dose_grid_resolution(resolution), 
-          heterogeneity_correction(true),
-          num_photons(1000000),
-          max_scatter_radius(50.0),  // mm
-          beta_param(0.0067),        // typical value
-          num_threads(4) {}
-    
-    void set_hu_to_ed_conversion_file(const std::string& filename) {
-        hu_to_ed.load_from_file(filename);
-    }
-    
-    void set_heterogeneity_correction(bool enable) {
-        heterogeneity_correction = enable;
-    }
-    
-    void set_num_photons(int num) {
-        num_photons = num;
-    }
-    
-    void set_max_scatter_radius(double radius) {
-        max_scatter_radius = radius;
-    }
-    
-    void set_beta_param(double beta) {
-        beta_param = beta;
-    }
-    
-    void set_num_threads(int num) {
-        num_threads = num;
-    }
-    
-    // Khớp chính xác với khai báo của lớp cơ sở
-    std::vector<std::vector<std::vector<double>>> calculateDose(
-        const std::vector<std::vector<std::vector<int>>>& ct_data,
-        const std::array<double, 3>& voxel_size,
-        const std::vector<std::vector<std::vector<int>>>& structure_masks,
-        const Plan& plan) override {
-        
-        // Chuyển đổi từ tham số mới sang tham số cũ
-        std::vector<double> spacing = {voxel_size[0], voxel_size[1], voxel_size[2]};
-        
-        // Tạo ma trận liều kết quả
-        int depth = ct_data.size();
-        int height = ct_data[0].size();
-        int width = ct_data[0][0].size();
-        
-        std::vector<std::vector<std::vector<double>>> dose_matrix(
-            depth, std::vector<std::vector<double>>(
-                height, std::vector<double>(width, 0.0)
-            )
-        );
-        
-        // Tính toán liều cho mỗi chùm tia trong kế hoạch
-        for (const auto& beam : plan.beams) {
-            // Tính hướng chùm tia
-            std::array<double, 3> beam_direction = calculate_beam_direction(
-                beam->gantry_angle, beam->couch_angle
-            );
-            
-            // Tính toán liều và thêm vào ma trận kết quả
-            // ... code xử lý ...
-        }
-        
-        return dose_matrix;
-    }
+// Liều của cùng kế hoạch với các dịch chuyển bệnh nhân (mm, x y z), mảng (N, z, y, x)
+py::array_t<double> calculate_shifted_from_numpy(
+    DoseAlgorithm& algorithm,
+    const py::array& ct_array,
+    const py::sequence& spacing,
+    const py::list& beams,
+    double prescribed_dose,
+    int fractions,
+    const py::list& shifts,
+    const py::object& target_mask,
+    bool recalculate
+) {
+    std::array<double, 3> voxel_size = to_spacing(spacing);
+    
+    py::object ct_holder;
+    CTVolume ct = borrow_volume<std::int16_t>(ct_array, voxel_size, ct_holder, "ct");
+    
+    py::object mask_holder;
+    MaskVolume mask = borrow_target_mask(target_mask, ct, mask_holder);
+    Plan plan = plan_from_beams(beams, prescribed_dose, fractions);
+    std::vector<std::array<double, 3>> offsets;
+    for (const auto& item : shifts) {
+        py::sequence shift = item.cast<py::sequence>();
+        if (py::len(shift) != 3) {
+            throw py::value_error("Mỗi dịch chuyển phải có 3 phần tử (x, y, z) mm");
+        }
+        offsets.push_back({shift[0].cast<double>(), shift[1].cast<double>(), shift[2].cast<double>()});
+    }
+    
+    std::vector<DoseVolume> doses;
+    {
+        py::gil_scoped_release release;
+        doses = algorithm.calculate_shifted(ct, mask, plan, offsets, recalculate);
+    }
+    
+    return stack_to_numpy(std::move(doses));
+}
 
-    std::string getName() const override {
-        return "AAA";
-    }
-    
-private:
-    // Định nghĩa hàm calculate_beam_direction thiếu
-    std::array<double, 3> calculate_beam_direction(double gantry_angle, double couch_angle) {
-        // Chuyển đổi góc từ độ sang radian
-        double gantry_rad = gantry_angle * M_PI / 180.0;
-        double couch_rad = couch_angle * M_PI / 180.0;
-        
-        // Tính toán vector hướng
-        double x = sin(gantry_rad) * cos(couch_rad);
-        double y = -cos(gantry_rad) * cos(couch_rad);
-        double z = sin(couch_rad);
-        
-        return {x, y, z};
-    }
+using DoseJob = PyJob<DoseVolume>;
 
-    std::vector<std::vector<std::vector<double>>> calculate_primary_dose(
-        const std::vector<std::vector<std::vector<int>>>& ct_data,
-        const std::vector<double>& spacing,
-        const std::shared_ptr<Beam>& beam) {
-        
-        // ... existing code ...
-        return std::vector<std::vector<std::vector<double>>>();
-    }
+// Bắt đầu tính liều trên luồng nền (calculate_incremental), trả về ngay
+DoseJob* start_calculation_from_numpy(
+    DoseAlgorithm& algorithm,
+    const py::array& ct_array,
+    const py::sequence& spacing,
+    const py::list& beams,
+    double prescribed_dose,
+    int fractions,
+    const py::object& target_mask,
+    const py::object& progress
+) {
+    std::array<double, 3> voxel_size = to_spacing(spacing);
+    
+    BufferKeeper keeper;
+    py::object ct_holder;
+    CTVolume ct = borrow_volume<std::int16_t>(ct_array, voxel_size, ct_holder, "ct");
+    keeper.keep(ct_holder);
+    
+    py::object mask_holder;
+    MaskVolume mask = borrow_target_mask(target_mask, ct, mask_holder);
+    keeper.keep(mask_holder);
+    auto plan = std::make_shared<Plan>(plan_from_beams(beams, prescribed_dose, fractions));
+    
+    DoseAlgorithm* engine = &algorithm;
+    return new DoseJob(std::move(keeper),
+                       [engine, ct, mask, plan](JobControl& control) {
+                           return engine->calculate_incremental(ct, mask, *plan, control);
+                       },
+                       progress,
+                       [](DoseVolume&& dose) -> py::object { return to_numpy(std::move(dose)); });
+}
 
-    std::vector<std::vector<std::vector<double>>> calculate_scatter_dose(
-        const std::vector<std::vector<std::vector<double>>>& primary_dose,
-        const std::vector<std::vector<std::vector<int>>>& ct_data,
-        const std::vector<double>& spacing,
-        const std::shared_ptr<Beam>& beam) {
-        
-        // Khởi tạo ma trận dose_scatter
-        int depth = ct_data.size();
-        int height = ct_data[0].size();
-        int width = ct_data[0][0].size();
-        
-        std::vector<std::vector<std::vector<double>>> scatter_dose(
-            depth, std::vector<std::vector<double>>(
-                height, std::vector<double>(width, 0.0)
-            )
-        );
-        
-        // Tính toán vùng tán xạ tối đa bằng voxel
-        int max_radius_voxels_x = static_cast<int>(max_scatter_radius / spacing[0]) + 1;
-        int max_radius_voxels_y = static_cast<int>(max_scatter_radius / spacing[1]) + 1;
-        int max_radius_voxels_z = static_cast<int>(max_scatter_radius / spacing[2]) + 1;
-        
-        // Lấy vector hướng chùm tia
-        std::array<double, 3> beam_direction = calculate_beam_direction(beam->gantry_angle, beam->couch_angle);
-        
-        // Tính toán liều tán xạ
-        for (int z = 0; z < depth; z++) {
-            for (int y = 0; y < height; y++) {
-                for (int x = 0; x < width; x++) {
-                    if (primary_dose[z][y][x] > 0) {
-                        // Tính liều tán xạ từ voxel này đến các voxel lân cận
-                        for (int kz = std::max(0, z - max_radius_voxels_z); 
-                             kz < std::min(depth, z + max_radius_voxels_z + 1); kz++) {
-                            for (int ky = std::max(0, y - max_radius_voxels_y); 
-                                 ky < std::min(height, y + max_radius_voxels_y + 1); ky++) {
-                                for (int kx = std::max(0, x - max_radius_voxels_x); 
-                                     kx < std::min(width, x + max_radius_voxels_x + 1); kx++) {
-                                    
-                                    // Tính liều tán xạ từ voxel này đến voxel lân cận
-                                    double scatter_value = primary_dose[z][y][x] * calculate_scatter_kernel(
-                                        x, y, z, kx, ky, kz, beam_direction, spacing
-                                    );
-                                    
-                                    // Thêm vào ma trận liều tán xạ
-                                    scatter_dose[kz][ky][kx] += scatter_value;
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-        }
-        
-        return scatter_dose;
-    }
+// Tính cùng kế hoạch với lưu trữ double và float32, trả về sai khác lớn nhất và thời gian
+py::dict validate_precision_from_numpy(
+    DoseAlgorithm& algorithm,
+    const py::array& ct_array,
+    const py::sequence& spacing,
+    const py::list& beams,
+    double prescribed_dose,
+    int fractions,
+    const py::object& target_mask
+) {
+    std::array<double, 3> voxel_size = to_spacing(spacing);
+    
+    py::object ct_holder;
+    CTVolume ct = borrow_volume<std::int16_t>(ct_array, voxel_size, ct_holder, "ct");
+    
+    py::object mask_holder;
+    MaskVolume mask = borrow_target_mask(target_mask, ct, mask_holder);
+    Plan plan = plan_from_beams(beams, prescribed_dose, fractions);
+    
+    DoseAlgorithm::PrecisionReport report;
+    {
+        py::gil_scoped_release release;
+        report = algorithm.validate_precision(ct, mask, plan);
+    }
+    
+    py::dict result;
+    result["max_abs_difference"] = report.max_abs_difference;
+    result["max_relative_difference"] = report.max_relative_difference;
+    result["max_dose"] = report.max_dose;
+    result["double_seconds"] = report.double_seconds;
+    result["float32_seconds"] = report.float32_seconds;
+    return result;
+}
 
-    double calculate_scatter_kernel(
-        int x, int y, int z,
-        int kx, int ky, int kz,
-        const std::array<double, 3>& beam_direction,
-        const std::vector<double>& spacing) {
-        
-        // Tính khoảng cách giữa hai voxel
-        double dist_x = (kx - x) * spacing[0];
-        double dist_y = (ky - y) * spacing[1];
-        double dist_z = (kz - z) * spacing[2];
-        
-        double distance = std::sqrt(dist_x*dist_x + dist_y*dist_y + dist_z*dist_z);
-        
-        // Áp dụng công thức kernel tán xạ
-        if (distance < max_scatter_radius) {
-            return exp(-beta_param * distance);
-        }
-        
-        return 0.0;
-    }
+// View trên các mặt nạ cấu trúc (phải cùng kích thước với grid: CT hoặc lưới liều), giữ tham chiếu buffer trong holders
+template <typename T>
+std::map<std::string, MaskVolume> borrow_structures(const py::dict& structures, const Volume3D<T>& grid,
+                                                    std::vector<py::object>& holders, const char* grid_name = "CT") {
+    std::map<std::string, MaskVolume> masks;
+    for (const auto& item : structures) {
+        py::object holder;
+        std::string name = item.first.cast<std::string>();
+        MaskVolume mask = borrow_volume<std::uint8_t>(item.second.cast<py::array>(), grid.spacing(), holder, name.c_str());
+        if (!mask.same_shape(grid)) {
+            throw py::value_error("Kích thước mặt nạ " + name + " không khớp với " + grid_name);
+        }
+        masks.emplace(name, mask);
+        holders.push_back(holder);
+    }
+    return masks;
+}
 
-    double calculate_pdd(double depth_mm, double energy) {
-        // Triển khai hàm tính phần trăm liều sâu (Percent Depth Dose)
-        // Đây là cách đơn giản, trong thực tế có thể phức tạp hơn
-        double d0 = 10.0;  // độ sâu tham chiếu
-        double mu = 0.005 * energy + 0.05;  // hệ số suy giảm
-        
-        return exp(-mu * (depth_mm - d0));
-    }
+// Ma trận ảnh hưởng CSC (mỗi cột một chùm tia) chỉ trên voxel thuộc các cấu trúc
+py::dict calculate_influence_matrix_from_numpy(
+    DoseAlgorithm& algorithm,
+    const py::array& ct_array,
+    const py::sequence& spacing,
+    const py::list& beams,
+    const py::dict& structures,
+    int outside_stride,
+    double threshold,
+    double resolution,
+    bool on_dose_grid
+) {
+    std::array<double, 3> voxel_size = to_spacing(spacing);
+    
+    py::object ct_holder;
+    CTVolume ct = borrow_volume<std::int16_t>(ct_array, voxel_size, ct_holder, "ct");
+    std::vector<py::object> mask_holders;
+    std::map<std::string, MaskVolume> masks = borrow_structures(structures, ct, mask_holders);
+    Plan plan = plan_from_beams(beams, 0.0, 1);
+    
+    DoseInfluenceMatrix matrix;
+    {
+        py::gil_scoped_release release;
+        MaskVolume keep = masks.empty()
+            ? MaskVolume()
+            : DoseInfluenceMatrix::structure_union(ct, masks, outside_stride);
+        matrix = algorithm.calculate_influence_matrix(ct, plan, keep, threshold, resolution, on_dose_grid);
+    }
+    
+    py::dict result;
+    const auto& col_ptr = matrix.col_ptr();
+    py::array_t<std::uint64_t> col_ptr_array(col_ptr.size());
+    std::copy(col_ptr.begin(), col_ptr.end(), col_ptr_array.mutable_data());
+    result["col_ptr"] = col_ptr_array;
+    result["row_index"] = py::array_t<std::uint32_t>(matrix.row_index().size(), matrix.row_index().data());
+    result["values"] = py::array_t<float>(matrix.values().size(), matrix.values().data());
+    const auto shape = matrix.shape();
+    result["shape"] = py::make_tuple(shape[0], shape[1], shape[2]);
+    result["spacing"] = matrix.spacing();
+    result["origin"] = matrix.origin();
+    return result;
+}
 
-    double calculate_oar(double radial_dist, double depth_mm, double energy) {
-        // Triển khai hàm tính tỷ lệ không khí ngoài trục (Off-Axis Ratio)
-        double sigma = 5.0 + 0.5 * depth_mm / 10.0;  // độ rộng gaussian
-        return exp(-radial_dist * radial_dist / (2 * sigma * sigma));
-    }
+// Như trên nhưng ghi từng cột vào tệp ánh xạ được, chỉ tính các chùm tia chưa có trong tệp
+py::dict calculate_influence_matrix_file_from_numpy(
+    DoseAlgorithm& algorithm,
+    const py::array& ct_array,
+    const py::sequence& spacing,
+    const py::list& beams,
+    const py::dict& structures,
+    const std::string& path,
+    int outside_stride,
+    double threshold,
+    double resolution,
+    bool resume
+) {
+    std::array<double, 3> voxel_size = to_spacing(spacing);
+    
+    py::object ct_holder;
+    CTVolume ct = borrow_volume<std::int16_t>(ct_array, voxel_size, ct_holder, "ct");
+    std::vector<py::object> mask_holders;
+    std::map<std::string, MaskVolume> masks = borrow_structures(structures, ct, mask_holders);
+    Plan plan = plan_from_beams(beams, 0.0, 1);
+    
+    DoseInfluenceMatrix matrix;
+    std::vector<std::string> computed;
+    {
+        py::gil_scoped_release release;
+        MaskVolume keep = masks.empty()
+            ? MaskVolume()
+            : DoseInfluenceMatrix::structure_union(ct, masks, outside_stride);
+        matrix = algorithm.calculate_influence_matrix_file(ct, plan, keep, path, threshold, resolution,
+                                                           resume, &computed);
+    }
+    
+    py::dict result;
+    result["path"] = path;
+    result["column_ids"] = quangstation::read_dose_matrix_file_info(path).column_ids();
+    result["computed"] = computed;
+    result["nnz"] = matrix.nnz();
+    result["shape"] = py::make_tuple(ct.depth(), ct.height(), ct.width());
+    return result;
+}
 
-    void normalize_dose(std::vector<std::vector<std::vector<double>>>& dose) {
-        // Chuẩn hóa ma trận liều
-        // ... existing code ...
-    }
-};
\ No newline at end of file
+// DVH của mọi cấu trúc trong một lượt duyệt lưới liều; đường DVH trả về không sao chép
+py::dict calculate_dvhs_from_numpy(
+    const py::array& dose_array,
+    const py::sequence& spacing,
+    const py::dict& structures,
+    std::size_t bins,
+    double dose_max,
+    double prescribed_dose,
+    const std::vector<double>& dose_levels,
+    const std::vector<double>& volume_levels
+) {
+    py::object dose_holder;
+    DoseVolume dose = borrow_volume<double>(dose_array, to_spacing(spacing), dose_holder, "dose");
+    std::vector<py::object> mask_holders;
+    std::map<std::string, MaskVolume> masks = borrow_structures(structures, dose, mask_holders, "lưới liều");
+    
+    DVHOptions options;
+    options.bins = bins;
+    options.dose_max = dose_max;
+    options.prescribed_dose = prescribed_dose;
+    std::vector<DVH> dvhs;
+    {
+        py::gil_scoped_release release;
+        dvhs = quangstation::calculate_dvhs(dose, masks, options);
+    }
+    
+    py::dict result;
+    for (DVH& dvh : dvhs) {
+        py::dict entry;
+        entry["voxel_count"] = dvh.voxel_count;
+        entry["volume_cc"] = dvh.volume_cc;
+        entry["d_min"] = dvh.d_min;
+        entry["d_max"] = dvh.d_max;
+        entry["d_mean"] = dvh.d_mean;
+        entry["v95"] = dvh.v95;
+        entry["v100"] = dvh.v100;
+        entry["d95"] = dvh.d95;
+        entry["d50"] = dvh.d50;
+        entry["d2cc"] = dvh.d2cc;
+        py::dict dose_at, volume_at;
+        for (double level : volume_levels) {
+            dose_at[py::float_(level)] = quangstation::dose_at_volume(dvh, level);
+        }
+        for (double level : dose_levels) {
+            volume_at[py::float_(level)] = quangstation::volume_at_dose(dvh, level);
+        }
+        entry["D"] = dose_at;
+        entry["V"] = volume_at;
+        entry["dose"] = to_numpy(std::move(dvh.dose_bins));
+        entry["volume"] = to_numpy(std::move(dvh.volume));
+        result[py::str(dvh.structure_name)] = entry;
+    }
+    return result;
+}
+
+// Histogram liều và thống kê thứ hạng của mọi cấu trúc theo quy ước NumPy của dvh.py
+py::dict calculate_dose_histograms_from_numpy(
+    const py::array& dose_array,
+    const py::sequence& spacing,
+    const py::dict& structures,
+    std::size_t bins,
+    double dose_max,
+    const std::vector<double>& volume_levels
+) {
+    py::object dose_holder;
+    DoseVolume dose = borrow_volume<double>(dose_array, to_spacing(spacing), dose_holder, "dose");
+    std::vector<py::object> mask_holders;
+    std::map<std::string, StructureMask> masks =
+        quangstation::compress_masks(borrow_structures(structures, dose, mask_holders, "lưới liều"));
+    
+    std::vector<DoseHistogram> histograms;
+    {
+        py::gil_scoped_release release;
+        histograms = quangstation::calculate_dose_histograms(dose, masks, bins, dose_max, volume_levels);
+    }
+    
+    py::dict result;
+    for (DoseHistogram& histogram : histograms) {
+        py::dict entry;
+        entry["voxel_count"] = histogram.voxel_count;
+        entry["d_min"] = histogram.d_min;
+        entry["d_max"] = histogram.d_max;
+        entry["d_mean"] = histogram.d_mean;
+        entry["d_median"] = histogram.d_median;
+        py::dict dose_at;
+        for (std::size_t k = 0; k < volume_levels.size(); ++k) {
+            dose_at[py::float_(volume_levels[k])] = histogram.dose_at_volume[k];
+        }
+        entry["D"] = dose_at;
+        entry["counts"] = to_numpy(std::move(histogram.counts));
+        result[py::str(histogram.structure_name)] = entry;
+    }
+    return result;
+}
+
+} // namespace
+
+PYBIND11_MODULE(_dose_engine, m) {
+    m.doc() = "Các thuật toán tính liều C++ của QuangStation";
+    
+    // Dựng sẵn kernel của các chùm tia đã commissioning trên lưới liều mặc định 2.5 mm
+    quangstation::DoseKernelCache::instance().prewarm({2.5, 2.5, 2.5});
+    
+    m.def("prewarm_kernel_cache", [](const py::sequence& spacing) {
+              quangstation::DoseKernelCache::instance().prewarm(to_spacing(spacing));
+          },
+          py::arg("spacing"),
+          "Dựng sẵn dose kernel của các chùm tia đã commissioning (6X, 10X, 6FFF, electron) cho spacing (x, y, z) mm");
+    m.def("calculate_dvhs", &calculate_dvhs_from_numpy,
+          py::arg("dose"), py::arg("spacing"), py::arg("structures"),
+          py::arg("bins") = 1000, py::arg("dose_max") = 0.0, py::arg("prescribed_dose") = 0.0,
+          py::arg("dose_levels") = std::vector<double>(), py::arg("volume_levels") = std::vector<double>(),
+          "DVH tích lũy của mọi cấu trúc {tên: mask} trong một lượt duyệt lưới liều (Gy, [z][y][x]). "
+          "Mỗi cấu trúc: {voxel_count, volume_cc, d_min, d_max, d_mean, v95, v100, d95, d50, d2cc, "
+          "dose (cạnh bin, Gy), volume (%), D {x%: Gy}, V {Gy: %}}. dose_max <= 0: liều lớn nhất; "
+          "V95/V100 theo prescribed_dose (<= 0: dose_max).");
+    m.def("calculate_dose_histograms", &calculate_dose_histograms_from_numpy,
+          py::arg("dose"), py::arg("spacing"), py::arg("structures"), py::arg("bins"), py::arg("dose_max"),
+          py::arg("volume_levels") = std::vector<double>(),
+          "Histogram liều của mọi cấu trúc {tên: mask} như numpy.histogram(values, bins, range=(0, dose_max)). "
+          "Mỗi cấu trúc: {voxel_count, d_min, d_max, d_mean, d_median, counts (bins), "
+          "D {x%: liều tại thứ hạng round(n·(100 - x)/100) như DVHCalculator.calculate_dose_metrics}}.");
+    py::register_exception<quangstation::JobCancelled>(m, "JobCancelled", PyExc_RuntimeError);
+    bind_job<DoseVolume>(m, "DoseJob")
+        .def("partial_dose", [](const DoseJob& job) -> py::object {
+                 std::shared_ptr<const DoseVolume> dose = job.control().partial_dose();
+                 if (!dose) {
+                     return py::none();
+                 }
+                 return to_numpy(DoseVolume(*dose));
+             }, "Bản sao liều cộng dồn (chưa chuẩn hóa) của các chùm tia đã tính; None nếu chưa có");
+    m.def("clear_kernel_cache", []() { quangstation::DoseKernelCache::instance().clear(); });
+    m.def("kernel_cache_size", []() { return quangstation::DoseKernelCache::instance().size(); });
+    m.def("dose_matrix_file_info", [](const std::string& path) {
+              quangstation::DoseMatrixFileInfo info = quangstation::read_dose_matrix_file_info(path);
+              std::size_t nnz = 0;
+              for (const auto& chunk : info.chunks) {
+                  nnz += chunk.count;
+              }
+              py::dict result;
+              result["shape"] = py::make_tuple(info.shape[0], info.shape[1], info.shape[2]);
+              result["spacing"] = info.spacing;
+              result["origin"] = info.origin;
+              result["ct_hash"] = info.ct_hash;
+              result["column_ids"] = info.column_ids();
+              result["nnz"] = nnz;
+              return result;
+          },
+          py::arg("path"),
+          "Thông tin tệp ma trận liều: shape, spacing, origin, ct_hash, column_ids, nnz");
+    
+    py::class_<DoseAlgorithm>(m, "DoseAlgorithm")
+        .def("get_name", &DoseAlgorithm::getName)
+        .def("set_num_threads", &DoseAlgorithm::set_num_threads, py::arg("num"),
+             "Số luồng cho các chùm tia/control point (<= 0: mặc định của OpenMP)")
+        .def("get_num_threads", &DoseAlgorithm::get_num_threads)
+        .def("set_precision", &DoseAlgorithm::set_precision, py::arg("precision"),
+             "Kiểu lưu lưới trung gian: \"double\" (mặc định) hoặc \"float32\"; liều luôn cộng dồn bằng double")
+        .def("get_precision", &DoseAlgorithm::get_precision)
+        .def("set_hu_to_ed_conversion_file", &DoseAlgorithm::set_hu_to_ed_conversion_file,
+             "Mỗi dòng: HU ED [mật độ khối [tên vật liệu]]")
+        .def("set_density_cache_size", &DoseAlgorithm::set_density_cache_size, py::arg("max_entries"),
+             "Số lưới mật độ (mỗi loại, mỗi kiểu lưu trữ) giữ lại trong bộ đệm dùng chung của tiến trình (0 = tắt)")
+        .def("clear_density_cache", &DoseAlgorithm::clear_density_cache)
+        .def("set_dose_grid_resolution", &DoseAlgorithm::set_dose_grid_resolution, py::arg("resolution"),
+             "Spacing lưới liều (mm); trục CT thô hơn giữ spacing CT, <= 0: tính trên lưới CT")
+        .def("get_dose_grid_resolution", &DoseAlgorithm::get_dose_grid_resolution)
+        .def("set_dose_grid", [](DoseAlgorithm& algorithm, const py::sequence& shape,
+                                 const py::sequence& spacing, const py::sequence& origin) {
+                 std::vector<std::size_t> dims = shape.cast<std::vector<std::size_t>>();
+                 if (dims.size() != 3) {
+                     throw py::value_error("shape phải có 3 phần tử (z, y, x)");
+                 }
+                 GridGeometry grid;
+                 grid.depth = dims[0];
+                 grid.height = dims[1];
+                 grid.width = dims[2];
+                 grid.spacing = to_spacing(spacing);
+                 grid.origin = to_spacing(origin);
+                 algorithm.set_dose_grid(grid);
+             },
+             py::arg("shape"), py::arg("spacing"), py::arg("origin"),
+             "Lưới liều cố định: shape (z, y, x), spacing và origin (x, y, z) mm theo hệ tọa độ CT")
+        .def("clear_dose_grid", &DoseAlgorithm::clear_dose_grid)
+        .def("get_dose_grid", [](const DoseAlgorithm& algorithm, const py::sequence& ct_shape,
+                                 const py::sequence& spacing, const py::sequence& origin) {
+                 std::vector<std::size_t> dims = ct_shape.cast<std::vector<std::size_t>>();
+                 if (dims.size() != 3) {
+                     throw py::value_error("ct_shape phải có 3 phần tử (z, y, x)");
+                 }
+                 GridGeometry ct_grid;
+                 ct_grid.depth = dims[0];
+                 ct_grid.height = dims[1];
+                 ct_grid.width = dims[2];
+                 ct_grid.spacing = to_spacing(spacing);
+                 ct_grid.origin = to_spacing(origin);
+                 const GridGeometry grid = algorithm.dose_grid_for(ct_grid);
+                 py::dict result;
+                 result["shape"] = py::make_tuple(grid.depth, grid.height, grid.width);
+                 result["spacing"] = grid.spacing;
+                 result["origin"] = grid.origin;
+                 return result;
+             },
+             py::arg("ct_shape"), py::arg("spacing"), py::arg("origin") = std::vector<double>{0.0, 0.0, 0.0},
+             "Lưới liều mà lần tính trên CT shape (z, y, x), spacing (x, y, z) mm sẽ dùng: shape, spacing, origin")
+        .def("set_adaptive_refinement", &DoseAlgorithm::set_adaptive_refinement,
+             py::arg("enable"), py::arg("gradient_threshold") = 0.3, py::arg("margin") = 10.0,
+             "Tính lại ở độ phân giải CT quanh PTV và vùng gradient liều > gradient_threshold · max")
+        .def("get_adaptive_refinement", &DoseAlgorithm::get_adaptive_refinement)
+        .def("set_arc_sampling", &DoseAlgorithm::set_arc_sampling,
+             py::arg("gantry_step") = 2.0, py::arg("optimization_gantry_step") = 6.0,
+             py::arg("aperture_step") = 0.5,
+             "Cung VMAT: sector gantry (độ) dùng chung hướng, depth và vận chuyển liều khi tính liều "
+             "cuối và khi dựng ma trận ảnh hưởng; khẩu độ MLC nội suy mỗi aperture_step độ trong sector")
+        .def("get_arc_sampling", [](const DoseAlgorithm& algorithm) {
+                 const quangstation::ArcSampling& sampling = algorithm.get_arc_sampling();
+                 py::dict result;
+                 result["gantry_step"] = sampling.gantry_step;
+                 result["optimization_gantry_step"] = sampling.optimization_gantry_step;
+                 result["aperture_step"] = sampling.aperture_step;
+                 return result;
+             })
+        .def("get_allocation_stats", [](const DoseAlgorithm& algorithm) {
+                 return to_dict(algorithm.get_allocation_stats());
+             },
+             "Thống kê pool lưới trung gian {allocations, reuses, bytes_allocated, pooled_buffers, "
+             "pooled_bytes}; allocations không tăng qua các lần tính cùng hình học (trừ lưới trả về)")
+        .def("reset_allocation_stats", &DoseAlgorithm::reset_allocation_stats)
+        .def("get_profile_stats", [](const DoseAlgorithm& algorithm) {
+                 return to_dict(algorithm.get_profile_stats());
+             },
+             "Thời gian và bộ đếm của lần tính gần nhất: {total_seconds, phases: {tên: {seconds, calls, "
+             "voxels}}, counters (cache hit/miss, cấp phát lưới, ...), beams: [{beam_id, seconds, tasks}], "
+             "iterations}. Thời gian giai đoạn cộng qua các luồng và có thể lồng nhau")
+        .def("set_grid_pool_max_bytes", &DoseAlgorithm::set_grid_pool_max_bytes, py::arg("max_bytes"),
+             "Dung lượng tối đa pool lưới trung gian giữ lại giữa các lần tính")
+        .def("clear_grid_pool", &DoseAlgorithm::clear_grid_pool)
+        .def("calculate_from_numpy", &calculate_from_numpy,
+             py::arg("ct"), py::arg("spacing"), py::arg("beams"),
+             py::arg("prescribed_dose") = 0.0, py::arg("fractions") = 1,
+             py::arg("target_mask") = py::none(),
+             "Tính liều trên mảng CT (HU, [z][y][x]). Trả về mảng liều sở hữu buffer C++.")
+        .def("calculate_plans", &calculate_plans_from_numpy,
+             py::arg("ct"), py::arg("spacing"), py::arg("plans"), py::arg("target_mask") = py::none(),
+             "Liều của nhiều kế hoạch [{beams, prescribed_dose, fractions}] trên cùng CT, mảng "
+             "(N, z, y, x); mỗi kế hoạch như calculate_from_numpy, mật độ, kernel và depth map "
+             "của chùm tia cùng hình học được dùng chung")
+        .def("calculate_shifted", &calculate_shifted_from_numpy,
+             py::arg("ct"), py::arg("spacing"), py::arg("beams"), py::arg("prescribed_dose"),
+             py::arg("fractions"), py::arg("shifts"), py::arg("target_mask") = py::none(),
+             py::arg("recalculate") = true,
+             "Liều khi bệnh nhân dịch chuyển cứng từng shifts[i] = (x, y, z) mm so với máy, mảng "
+             "(N, z, y, x); mọi kịch bản dùng hệ số chuẩn hóa của kịch bản không dịch chuyển. "
+             "recalculate=False: dời liều danh định thay vì tính lại (xấp xỉ dose cloud, nhanh)")
+        .def("start_calculation", &start_calculation_from_numpy,
+             py::arg("ct"), py::arg("spacing"), py::arg("beams"),
+             py::arg("prescribed_dose"), py::arg("fractions"), py::arg("target_mask") = py::none(),
+             py::arg("progress") = py::none(), py::keep_alive<0, 1>(),
+             "Như calculate_from_numpy nhưng chạy nền, từng chùm tia một; trả về DoseJob ngay. "
+             "progress(dict) được gọi (trên luồng nền) sau mỗi chùm tia; DoseJob.partial_dose() "
+             "cho liều đã cộng dồn, cancel() dừng trước chùm tia kế tiếp (result() ném JobCancelled). "
+             "Không dùng thuật toán cho việc khác khi công việc đang chạy")
+        .def("validate_precision", &validate_precision_from_numpy,
+             py::arg("ct"), py::arg("spacing"), py::arg("beams"),
+             py::arg("prescribed_dose") = 0.0, py::arg("fractions") = 1,
+             py::arg("target_mask") = py::none(),
+             "Tính với cả double và float32, trả về {max_abs_difference, max_relative_difference, "
+             "max_dose, double_seconds, float32_seconds}.")
+        .def("calculate_influence_matrix", &calculate_influence_matrix_from_numpy,
+             py::arg("ct"), py::arg("spacing"), py::arg("beams"), py::arg("structures"),
+             py::arg("outside_stride") = 0, py::arg("threshold") = 0.0, py::arg("resolution") = -1.0,
+             py::arg("on_dose_grid") = false,
+             "Ma trận ảnh hưởng thưa dạng CSC {col_ptr, row_index, values, shape, spacing, origin}, "
+             "mỗi cột là liều của một chùm tia, chỉ trên voxel thuộc các cấu trúc. "
+             "resolution > 0 tính trên lưới liều thô đó (ví dụ 4-5 mm khi tối ưu), 0 trên lưới CT, < 0 dùng lưới đã đặt. "
+             "on_dose_grid giữ các cột trên lưới liều thay vì nội suy về lưới CT (spacing, origin theo x, y, z).")
+        .def("calculate_influence_matrix_file", &calculate_influence_matrix_file_from_numpy,
+             py::arg("ct"), py::arg("spacing"), py::arg("beams"), py::arg("structures"), py::arg("path"),
+             py::arg("outside_stride") = 0, py::arg("threshold") = 0.0, py::arg("resolution") = -1.0,
+             py::arg("resume") = true,
+             "Ghi từng cột (theo id chùm tia) vào tệp ma trận liều ánh xạ được; resume chỉ tính các "
+             "chùm tia chưa có trong tệp. Trả về {path, column_ids, computed, nnz, shape}; "
+             "optimizer đọc tệp bằng load_influence_matrix_file.");
+    
+    py::class_<CollapsedConeConvolution, DoseAlgorithm>(m, "CollapsedConeConvolution")
+        .def(py::init<int, double>(), py::arg("cones") = 24, py::arg("resolution") = 0.0)
+        .def("set_convolution_mode", &CollapsedConeConvolution::set_convolution_mode,
+             "Backend tích chập: 'auto', 'direct', 'separable' hoặc 'fft'")
+        .def("get_convolution_mode", &CollapsedConeConvolution::get_convolution_mode)
+        .def("set_num_cones", &CollapsedConeConvolution::set_num_cones)
+        .def("get_num_cones", &CollapsedConeConvolution::get_num_cones)
+        .def("set_transport_mode", &CollapsedConeConvolution::set_transport_mode,
+             "Photon: 'cone' (collapsed-cone) hoặc 'kernel' (tích chập kernel cục bộ)")
+        .def("get_transport_mode", &CollapsedConeConvolution::get_transport_mode);
+    
+    py::class_<PencilBeam, DoseAlgorithm>(m, "PencilBeam")
+        .def(py::init<double>(), py::arg("resolution") = 0.0)
+        .def("set_ray_trace_cache_size", &PencilBeam::set_ray_trace_cache_size)
+        .def("clear_ray_trace_cache", &PencilBeam::clear_ray_trace_cache);
+    
+    py::class_<AAA, DoseAlgorithm>(m, "AAA")
+        .def(py::init<double>(), py::arg("resolution") = 0.0)
+        .def("set_heterogeneity_correction", &AAA::set_heterogeneity_correction)
+        .def("set_num_photons", &AAA::set_num_photons)
+        .def("set_max_scatter_radius", &AAA::set_max_scatter_radius)
+        .def("set_beta_param", &AAA::set_beta_param);
+    
+    py::class_<MonteCarlo, DoseAlgorithm>(m, "MonteCarlo")
+        .def(py::init<double>(), py::arg("resolution") = 0.0)
+        .def("set_num_histories", &MonteCarlo::set_num_histories,
+             "Số history tối đa của một lần tính, chia đều cho các lô")
+        .def("get_num_histories", &MonteCarlo::get_num_histories)
+        .def("set_num_photons", &MonteCarlo::set_num_photons)
+        .def("set_num_batches", &MonteCarlo::set_num_batches)
+        .def("set_target_uncertainty", &MonteCarlo::set_target_uncertainty,
+             "Độ không chắc chắn tương đối mục tiêu (0.02 = 2%), <= 0: chạy hết số history")
+        .def("set_seed", &MonteCarlo::set_seed)
+        .def("set_variance_reduction", &MonteCarlo::set_variance_reduction,
+             py::arg("photon_splitting"), py::arg("roulette_survival") = -1.0,
+             "Splitting photon sơ cấp và Russian roulette photon thứ cấp (< 0: 1 / photon_splitting)")
+        .def("set_cutoffs", &MonteCarlo::set_cutoffs, py::arg("photon_cutoff"), py::arg("electron_cutoff"))
+        .def("get_last_uncertainty", &MonteCarlo::get_last_uncertainty)
+        .def("get_last_histories", &MonteCarlo::get_last_histories)
+        .def("get_last_batches", &MonteCarlo::get_last_batches);
+}
@@ -0,0 +1,2872 @@
+#ifndef QUANGSTATION_DOSE_ENGINE_H
+#define QUANGSTATION_DOSE_ENGINE_H
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <array>
+#include <limits>
+#include <chrono>
+#include <set>
+#include <tuple>
+#include <map>
+#include <mutex>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "volume3d.h"
+#include "resample.h"
+#include "grid_pool.h"
+#include "profiler.h"
+#include "structure_mask.h"
+#include "influence_matrix.h"
+#include "dose_matrix_file.h"
+#include "dvh.h"
+#include "job.h"
+#include "ray_tracer.h"
+#include "convolution.h"
+#include "collapsed_cone.h"
+#include "beam_eye_view.h"
+#include "arc_sampling.h"
+#include "dose_scheduler.h"
+#include "depth_dose.h"
+#include "hu_conversion.h"
+#include "kernel_cache.h"
+#include "monte_carlo.h"
+
+using quangstation::Volume3D;
+using quangstation::CTVolume;
+using quangstation::DensityVolume;
+using quangstation::DoseVolume;
+using quangstation::MaskVolume;
+using quangstation::GridGeometry;
+using quangstation::GridPool;
+using quangstation::GridPoolStats;
+using quangstation::PooledVolume;
+using quangstation::Profiler;
+using quangstation::ProfileStats;
+using quangstation::ScopedProfileSession;
+using quangstation::StructureMask;
+using quangstation::DoseInfluenceMatrix;
+using quangstation::DoseMatrixFileWriter;
+using quangstation::DVH;
+using quangstation::DVHOptions;
+using quangstation::DoseHistogram;
+using quangstation::JobControl;
+using quangstation::JobProgress;
+using quangstation::RayTracer;
+using quangstation::RadiologicalDepthCache;
+using quangstation::RadiologicalDepthCaches;
+using quangstation::KernelConvolver;
+using quangstation::ConvolutionMode;
+using quangstation::ConeLattice;
+using quangstation::ConeKernel;
+using quangstation::CollapsedConeTransport;
+using quangstation::FieldRect;
+using quangstation::BeamsEyeView;
+using quangstation::ArcSampling;
+using quangstation::ArcSample;
+using quangstation::ArcSector;
+using quangstation::ApertureFluence;
+using quangstation::ParticleType;
+using quangstation::DepthDoseCurve;
+using quangstation::Material;
+using quangstation::HUtoEDConverter;
+using quangstation::PhiloxStream;
+using quangstation::MonteCarloOptions;
+using quangstation::MonteCarloParticle;
+using quangstation::MonteCarloTransport;
+
+// Đặt số luồng OpenMP trong một phạm vi, khôi phục giá trị cũ khi ra khỏi phạm vi
+class ScopedThreadCount {
+public:
+    explicit ScopedThreadCount(int num_threads) {
+#ifdef _OPENMP
+        previous_ = omp_get_max_threads();
+        if (num_threads > 0) {
+            omp_set_num_threads(num_threads);
+        }
+#else
+        (void)num_threads;
+#endif
+    }
+    
+    ~ScopedThreadCount() {
+#ifdef _OPENMP
+        omp_set_num_threads(previous_);
+#endif
+    }
+    
+private:
+    int previous_ = 1;
+};
+
+// Kiểu lưu các lưới trung gian (mật độ, radiological depth, TERMA, liều sơ cấp).
+// Float32 giảm một nửa bộ nhớ và băng thông; liều luôn được cộng dồn bằng double.
+enum class StoragePrecision {
+    Double,
+    Float32
+};
+
+inline StoragePrecision storage_precision_from_string(const std::string& name) {
+    if (name == "double" || name == "float64") return StoragePrecision::Double;
+    if (name == "float32" || name == "float") return StoragePrecision::Float32;
+    throw std::invalid_argument("Độ chính xác lưu trữ không hợp lệ: " + name);
+}
+
+inline std::string storage_precision_to_string(StoragePrecision precision) {
+    return precision == StoragePrecision::Float32 ? "float32" : "double";
+}
+
+// Cấu trúc dữ liệu cho beam
+struct Beam {
+    std::string id;
+    std::string type;           // "photon", "electron", "proton"
+    double energy;              // MV hoặc MeV
+    double gantry_angle;        // độ
+    double collimator_angle;    // độ
+    double couch_angle;         // độ
+    std::vector<std::vector<double>> mlc_positions; // Vị trí MLC (mm) cho từng control point
+    std::vector<double> weights;  // Trọng số cho từng control point
+    double ssd;                 // Source-Surface Distance (mm)
+    std::array<double, 3> isocenter; // Tọa độ tâm (mm)
+    
+    // Thông số cho VMAT
+    bool is_arc;
+    double arc_start_angle;
+    double arc_stop_angle;
+    double arc_direction;       // 1 CW, -1 CCW
+    
+    // Thông số cho wedge
+    bool has_wedge;
+    std::string wedge_type;     // "physical", "enhanced", "virtual"
+    double wedge_angle;
+    double wedge_orientation;
+    
+    // Constructor
+    Beam(const std::string& bid, const std::string& btype, double e) 
+        : id(bid), type(btype), energy(e), gantry_angle(0), collimator_angle(0), 
+          couch_angle(0), ssd(1000), is_arc(false), 
+          arc_start_angle(0), arc_stop_angle(0), arc_direction(1),
+          has_wedge(false), wedge_angle(0), wedge_orientation(0) {
+        isocenter = {0, 0, 0};
+    }
+};
+
+// Cấu trúc dữ liệu cho kế hoạch
+struct Plan {
+    std::string id;
+    std::string technique;      // "3DCRT", "IMRT", "VMAT", "SBRT", "SRS"
+    double prescribed_dose;     // Gy
+    int fractions;
+    std::vector<std::shared_ptr<Beam>> beams;
+    
+    Plan(const std::string& pid, const std::string& tech, double dose, int frac) 
+        : id(pid), technique(tech), prescribed_dose(dose), fractions(frac) {}
+};
+
+// Thông số vật lý cho tính toán liều
+struct PhysicalParameters {
+    double alpha_beta_ratio;    // Tỷ số alpha/beta cho mô (Gy)
+    double rbe;                 // Hiệu quả sinh học tương đối
+};
+
+// Lớp cơ sở cho các thuật toán tính liều
+class DoseAlgorithm {
+public:
+    virtual ~DoseAlgorithm() = default;
+    
+    // Số luồng cho một lần tính (chùm tia/control point chạy song song), <= 0: dùng mặc định của OpenMP
+    void set_num_threads(int num) {
+        num_threads = num;
+    }
+    
+    int get_num_threads() const {
+        return num_threads;
+    }
+    
+    // "double" (mặc định) hoặc "float32": kiểu lưu các lưới trung gian của lần tính
+    void set_precision(const std::string& name) {
+        precision = storage_precision_from_string(name);
+    }
+    
+    std::string get_precision() const {
+        return storage_precision_to_string(precision);
+    }
+    
+    // Bảng HU-ED mới đổi khóa của lưới mật độ: các lưới đã đệm với bảng cũ không bị dùng nhầm
+    void set_hu_to_ed_conversion_file(const std::string& filename) {
+        hu_to_ed.load_from_file(filename);
+    }
+    
+    // Số lưới mật độ (mỗi loại, mỗi kiểu lưu trữ) của bộ đệm dùng chung cả tiến trình (0 = tắt)
+    void set_density_cache_size(std::size_t max_entries) {
+        quangstation::DensityCaches::instance().set_max_entries(max_entries);
+    }
+    
+    void clear_density_cache() {
+        quangstation::DensityCaches::instance().clear();
+    }
+    
+    // Spacing (mm) của lưới liều: mỗi trục max(resolution, spacing CT), cùng origin và vùng
+    // phủ với CT; liều được nội suy tam tuyến tính về lưới CT. <= 0: tính trên lưới CT
+    void set_dose_grid_resolution(double resolution) {
+        dose_grid_resolution = resolution;
+    }
+    
+    double get_dose_grid_resolution() const {
+        return dose_grid_resolution;
+    }
+    
+    // Lưới liều cố định với origin, spacing và kích thước riêng (ưu tiên hơn resolution)
+    void set_dose_grid(const GridGeometry& grid) {
+        fixed_dose_grid = grid;
+    }
+    
+    void clear_dose_grid() {
+        fixed_dose_grid = GridGeometry();
+    }
+    
+    // Lưới liều của lần tính trên CT có lưới ct_grid (lưới cố định nếu có, nếu không thì lưới thô)
+    GridGeometry dose_grid_for(const GridGeometry& ct_grid) const {
+        if (!fixed_dose_grid.empty()) {
+            return fixed_dose_grid;
+        }
+        return quangstation::coarsened(ct_grid, dose_grid_resolution);
+    }
+    
+    /**
+     * Tinh chỉnh thích nghi khi lưới liều thô hơn CT: các ô của lưới CT quanh PTV và quanh
+     * voxel có gradient liều > gradient_threshold · gradient cực đại (trong margin mm) được
+     * tính lại ở độ phân giải CT. Liều trong mỗi vùng được cộng thêm hiệu liều mịn - liều
+     * thô tính trên cùng vùng cắt ra (nới margin), nên ảnh hưởng của phần mô ngoài vùng
+     * (thiếu trong cả hai lần tính) phần lớn triệt tiêu. Lưới liều thô là tùy chọn: mặc
+     * định resolution = 0 tính trực tiếp trên lưới CT.
+     */
+    void set_adaptive_refinement(bool enable, double gradient_threshold = 0.3, double margin = 10.0) {
+        refinement.enabled = enable;
+        refinement.gradient_threshold = gradient_threshold;
+        refinement.margin = margin;
+    }
+    
+    bool get_adaptive_refinement() const {
+        return refinement.enabled;
+    }
+    
+    /**
+     * Lấy mẫu cung VMAT: hướng chùm tia, radiological depth và vận chuyển liều tính
+     * một lần cho mỗi sector gantry_step độ (optimization_gantry_step khi dựng ma
+     * trận ảnh hưởng); trong sector các khẩu độ MLC nội suy giữa control point mỗi
+     * aperture_step độ được cộng thành một fluence. Thuật toán không gộp sector (AAA)
+     * lấy một mẫu mỗi gantry_step độ.
+     */
+    void set_arc_sampling(double gantry_step = 2.0, double optimization_gantry_step = 6.0,
+                          double aperture_step = 0.5) {
+        if (!(gantry_step > 0.0) || !(optimization_gantry_step > 0.0) || !(aperture_step > 0.0)) {
+            throw std::invalid_argument("Bước lấy mẫu cung phải dương");
+        }
+        arc_sampling.gantry_step = gantry_step;
+        arc_sampling.optimization_gantry_step = optimization_gantry_step;
+        arc_sampling.aperture_step = aperture_step;
+    }
+    
+    const ArcSampling& get_arc_sampling() const {
+        return arc_sampling;
+    }
+    
+    /**
+     * Các lưới trung gian (lưới riêng của luồng, TERMA, liều chùm tia có wedge, mật độ
+     * đã tích chập, liều trên lưới liều thô...) mượn từ một pool của thuật toán và dùng
+     * lại qua các chùm tia và các lần tính. allocations trong thống kê là số lần phải
+     * cấp phát lưới mới: khi hình học không đổi nó chỉ tăng ở lần tính đầu và theo lưới
+     * kết quả trả về người gọi (ma trận ảnh hưởng trả lại cả lưới đó vào pool).
+     */
+    GridPoolStats get_allocation_stats() const {
+        return grid_pool.stats();
+    }
+    
+    void reset_allocation_stats() {
+        grid_pool.reset_stats();
+    }
+    
+    // Dung lượng tối đa (byte) pool giữ lại giữa các lần tính
+    void set_grid_pool_max_bytes(std::size_t max_bytes) {
+        grid_pool.set_max_bytes(max_bytes);
+    }
+    
+    void clear_grid_pool() {
+        grid_pool.clear();
+    }
+    
+    /**
+     * Thời gian theo giai đoạn (hu_to_ed, ray_trace, kernel_convolution, terma,
+     * cone_transport, dose_deposition, scatter_convolution, transport, resample,
+     * refinement, normalize...), theo chùm tia và các bộ đếm (hit/miss của bộ đệm mật
+     * độ và depth map, cấp phát lưới) của lần gọi công khai gần nhất: calculate,
+     * calculate_plans, calculate_influence_matrix... Mỗi lần gọi mới xóa thống kê cũ.
+     */
+    ProfileStats get_profile_stats() const {
+        return profiler.stats();
+    }
+    
+    // Giao diện chính trên lưới liên tục. Liều tính trên lưới liều (xem set_dose_grid_resolution)
+    // và trả về trên lưới CT; target_mask là mặt nạ PTV dùng để chuẩn hóa (có thể rỗng).
+    virtual DoseVolume calculate(
+        const CTVolume& ct,
+        const MaskVolume& target_mask,
+        const Plan& plan) = 0;
+    
+    // Giao diện cũ với mảng lồng nhau, giữ lại để tương thích trong giai đoạn chuyển đổi
+    std::vector<std::vector<std::vector<double>>> calculateDose(
+        const std::vector<std::vector<std::vector<int>>>& ct_data,
+        const std::array<double, 3>& voxel_size,
+        const std::vector<std::vector<std::vector<int>>>& structure_masks,
+        const Plan& plan) {
+        
+        CTVolume ct = CTVolume::from_nested(ct_data, voxel_size);
+        MaskVolume mask = MaskVolume::from_nested(structure_masks, voxel_size);
+        return calculate(ct, mask, plan).to_nested();
+    }
+    
+    /**
+     * Như calculate nhưng tính lần lượt từng chùm tia (qua calculate_beam) để theo dõi
+     * và hủy được khi chạy nền (AsyncJob): trước mỗi chùm tia kiểm tra yêu cầu hủy
+     * (ném JobCancelled), sau mỗi chùm tia công bố liều cộng dồn trên lưới CT (chưa
+     * chuẩn hóa) và tiến trình {"dose", số chùm tia đã xong, tổng số}. Mỗi chùm tia được
+     * nội suy về lưới CT như calculate; tổng được chuẩn hóa bằng cùng bước trên lưới CT
+     * (normalize_ct_dose), nên kết quả khớp calculate.
+     */
+    DoseVolume calculate_incremental(
+        const CTVolume& ct,
+        const MaskVolume& target_mask,
+        const Plan& plan,
+        JobControl& control) {
+        
+        ScopedProfileSession profile(profiler, grid_pool);
+        const int num_beams = static_cast<int>(plan.beams.size());
+        DoseVolume dose = DoseVolume::like(ct, 0.0);
+        control.report({"dose", 0, num_beams});
+        for (int b = 0; b < num_beams; ++b) {
+            control.throw_if_cancelled();
+            DoseVolume beam_dose = calculate_beam(ct, plan, plan.beams[b]);
+            dose.add_scaled(beam_dose);
+            grid_pool.release(beam_dose);
+            control.publish_dose(std::make_shared<const DoseVolume>(dose));
+            control.report({"dose", b + 1, num_beams});
+        }
+        normalize_ct_dose(dose, StructureMask(target_mask), plan.prescribed_dose);
+        return dose;
+    }
+    
+    /**
+     * Liều của nhiều kế hoạch trên cùng một CT (so sánh kế hoạch), mỗi kế hoạch như
+     * calculate. Mật độ điện tử, kernel và lưới trung gian dùng chung qua các kế hoạch;
+     * khi có chùm tia cùng hình học (gantry, couch, isocenter) ở nhiều kế hoạch, bộ đệm
+     * radiological depth được nới trong lúc tính để giữ đủ depth map của cả loạt (tối
+     * đa kScenarioDepthBudget byte), nên các chùm tia đó chỉ dò tia một lần.
+     */
+    std::vector<DoseVolume> calculate_plans(
+        const CTVolume& ct,
+        const MaskVolume& target_mask,
+        const std::vector<Plan>& plans) {
+        
+        ScopedProfileSession profile(profiler, grid_pool);
+        ScopedDepthCacheCapacity capacity(depth_caches, scenario_depth_maps(ct, plans));
+        std::vector<DoseVolume> doses;
+        doses.reserve(plans.size());
+        for (const Plan& plan : plans) {
+            doses.push_back(calculate(ct, target_mask, plan));
+        }
+        return doses;
+    }
+    
+    /**
+     * Liều của plan khi bệnh nhân dịch chuyển cứng shifts[i] (mm, theo trục x, y, z của
+     * CT) so với máy, cho đánh giá độ bền với sai số đặt bệnh nhân: trong tọa độ CT mọi
+     * isocenter dời -shifts[i]. MU giữ theo kế hoạch danh định: mọi kịch bản nhân cùng
+     * hệ số chuẩn hóa của kịch bản không dịch chuyển (tính thêm nếu shifts không có
+     * (0, 0, 0)), nên sai lệch liều trong target_mask do dịch chuyển được giữ nguyên.
+     *
+     * Mỗi kịch bản tính lại đầy đủ tốn gần bằng một lần calculate, vì dò tia, TERMA và
+     * vận chuyển đều phụ thuộc vị trí isocenter. recalculate = false dùng xấp xỉ "dose
+     * cloud": chỉ tính liều danh định rồi dời nó theo từng dịch chuyển (nội suy tam
+     * tuyến tính, ngoài lưới lấy giá trị biên), bỏ qua thay đổi của bất đồng nhất mật
+     * độ trên đường chùm tia; phù hợp để sàng lọc nhanh nhiều kịch bản.
+     */
+    std::vector<DoseVolume> calculate_shifted(
+        const CTVolume& ct,
+        const MaskVolume& target_mask,
+        const Plan& plan,
+        const std::vector<std::array<double, 3>>& shifts,
+        bool recalculate = true) {
+        
+        ScopedProfileSession profile(profiler, grid_pool);
+        const std::array<double, 3> no_shift = {0.0, 0.0, 0.0};
+        const bool normalize = plan.prescribed_dose > 0.0 && target_mask.same_shape(ct);
+        const StructureMask target = normalize ? StructureMask(target_mask) : StructureMask();
+        if (!recalculate) {
+            DoseVolume nominal = calculate(ct, target_mask, plan_with_offset(plan, no_shift));
+            if (normalize) {
+                nominal.scale(prescription_scale(nominal, target, plan.prescribed_dose));
+            }
+            // Liều tại p của kịch bản dịch chuyển s là liều danh định tại p + s
+            const std::array<double, 3> origin = nominal.origin();
+            std::vector<DoseVolume> doses;
+            for (const auto& shift : shifts) {
+                DoseVolume moved = DoseVolume::like(nominal, 0.0);
+                nominal.set_origin({origin[0] - shift[0], origin[1] - shift[1], origin[2] - shift[2]});
+                quangstation::resample_trilinear_into(nominal, moved);
+                doses.push_back(std::move(moved));
+            }
+            return doses;
+        }
+        
+        std::vector<Plan> scenarios;
+        size_t nominal = shifts.size();
+        for (size_t i = 0; i < shifts.size(); ++i) {
+            if (nominal == shifts.size() && shifts[i] == no_shift) {
+                nominal = i;
+            }
+            scenarios.push_back(plan_with_offset(plan, {-shifts[i][0], -shifts[i][1], -shifts[i][2]}));
+        }
+        if (normalize && nominal == shifts.size()) {
+            scenarios.push_back(plan_with_offset(plan, no_shift));
+        }
+        
+        std::vector<DoseVolume> doses = calculate_plans(ct, target_mask, scenarios);
+        if (normalize) {
+            const double scale = prescription_scale(doses[nominal], target, plan.prescribed_dose);
+            doses.resize(shifts.size());
+            for (DoseVolume& dose : doses) {
+                dose.scale(scale);
+            }
+        }
+        return doses;
+    }
+    
+    /**
+     * Ma trận ảnh hưởng thưa cho tối ưu hóa: mỗi cột là liều (chưa chuẩn hóa) của
+     * một chùm tia với trọng số control point của kế hoạch. Chỉ lưu voxel có
+     * keep_mask > 0 (rỗng: mọi voxel) và liều > threshold, nên không bao giờ giữ
+     * đồng thời nhiều lưới liều dày.
+     *
+     * on_dose_grid = true giữ các cột trên chính lưới liều (spacing, origin của ma
+     * trận là của lưới liều) thay vì nội suy về lưới CT, còn keep_mask được lấy mẫu
+     * lại lên lưới đó: số hàng giảm theo lập phương tỷ lệ spacing, dùng cho giai đoạn
+     * thô của tối ưu đa độ phân giải (GradientOptimizer::optimize_multiresolution).
+     */
+    DoseInfluenceMatrix calculate_influence_matrix(
+        const CTVolume& ct,
+        const Plan& plan,
+        const MaskVolume& keep_mask,
+        double threshold = 0.0,
+        double resolution = -1.0,
+        bool on_dose_grid = false) {
+        
+        ScopedProfileSession profile(profiler, grid_pool);
+        ScopedDoseGridResolution scoped(*this, resolution, on_dose_grid);
+        ScopedOptimizationSampling sampling(*this);
+        const GridGeometry grid = on_dose_grid ? dose_grid_for(ct) : GridGeometry::of(ct);
+        DoseInfluenceMatrix matrix(MaskVolume::view(nullptr, grid.depth, grid.height, grid.width,
+                                                    grid.spacing, grid.origin));
+        if (on_dose_grid && !keep_mask.empty() && grid != GridGeometry::of(ct)) {
+            // Voxel thô phủ một phần cấu trúc cũng được giữ
+            matrix.set_voxel_mask(quangstation::resample_mask(keep_mask, GridGeometry::of(ct), grid, 1e-6));
+        } else {
+            matrix.set_voxel_mask(keep_mask);
+        }
+        for (const auto& beam : plan.beams) {
+            DoseVolume beam_dose = calculate_beam(ct, plan, beam);
+            matrix.add_column(beam_dose, threshold);
+            grid_pool.release(beam_dose);
+        }
+        return matrix;
+    }
+    
+    /**
+     * Như calculate_influence_matrix nhưng mỗi cột được ghi ngay vào tệp path (xem
+     * dose_matrix_file.h) thay vì giữ trong bộ nhớ, rồi trả về ma trận ánh xạ từ tệp
+     * với các cột theo thứ tự chùm tia của plan. Cột được nhận diện bằng id chùm tia
+     * (id rỗng: "beam_<chỉ số>"). resume = true và tệp đã có cùng CT, cùng lưới thì
+     * chỉ tính các chùm tia chưa có trong tệp: tối ưu lại hoặc chạy tiếp sau khi bị
+     * ngắt không phải tính lại. Tệp không ghi cấu hình thuật toán: đổi thuật toán,
+     * tham số hay hình học chùm tia thì dùng tệp khác hoặc resume = false.
+     * computed (nếu có) nhận id các cột vừa tính.
+     */
+    DoseInfluenceMatrix calculate_influence_matrix_file(
+        const CTVolume& ct,
+        const Plan& plan,
+        const MaskVolume& keep_mask,
+        const std::string& path,
+        double threshold = 0.0,
+        double resolution = -1.0,
+        bool resume = true,
+        std::vector<std::string>* computed = nullptr) {
+        
+        ScopedProfileSession profile(profiler, grid_pool);
+        std::vector<std::string> ids;
+        for (std::size_t i = 0; i < plan.beams.size(); ++i) {
+            ids.push_back(plan.beams[i]->id.empty() ? "beam_" + std::to_string(i) : plan.beams[i]->id);
+            if (std::find(ids.begin(), ids.end() - 1, ids.back()) != ids.end() - 1) {
+                throw std::invalid_argument("ID chùm tia trùng lặp trong kế hoạch: " + ids.back());
+            }
+        }
+        
+        const std::uint64_t ct_hash = ct_content_hash(ct);
+        {
+            ScopedDoseGridResolution scoped(*this, resolution);
+            ScopedOptimizationSampling sampling(*this);
+            DoseMatrixFileWriter writer(path, ct, ct_hash, resume);
+            DoseInfluenceMatrix column(ct);
+            column.set_voxel_mask(keep_mask);
+            for (std::size_t i = 0; i < plan.beams.size(); ++i) {
+                if (writer.contains(ids[i])) {
+                    continue;
+                }
+                column.clear_columns();
+                DoseVolume beam_dose = calculate_beam(ct, plan, plan.beams[i]);
+                column.add_column(beam_dose, threshold);
+                grid_pool.release(beam_dose);
+                writer.append(ids[i], column.column(0));
+                if (computed) {
+                    computed->push_back(ids[i]);
+                }
+            }
+        }
+        return quangstation::open_dose_matrix_file(path, ids, ct_hash);
+    }
+    
+    // Sai khác giữa liều tính với lưu trữ float32 và với double
+    struct PrecisionReport {
+        double max_abs_difference = 0.0;
+        double max_relative_difference = 0.0; // So với liều cực đại của đường double
+        double max_dose = 0.0;
+        double double_seconds = 0.0;
+        double float32_seconds = 0.0;
+    };
+    
+    // Tính cùng kế hoạch ở cả hai chế độ lưu trữ (khôi phục chế độ hiện tại sau đó)
+    PrecisionReport validate_precision(
+        const CTVolume& ct,
+        const MaskVolume& target_mask,
+        const Plan& plan) {
+        
+        ScopedProfileSession profile(profiler, grid_pool);
+        const StoragePrecision saved = precision;
+        DoseVolume reference, reduced;
+        PrecisionReport report;
+        try {
+            auto start = std::chrono::steady_clock::now();
+            precision = StoragePrecision::Double;
+            reference = calculate(ct, target_mask, plan);
+            auto middle = std::chrono::steady_clock::now();
+            precision = StoragePrecision::Float32;
+            reduced = calculate(ct, target_mask, plan);
+            auto end = std::chrono::steady_clock::now();
+            report.double_seconds = std::chrono::duration<double>(middle - start).count();
+            report.float32_seconds = std::chrono::duration<double>(end - middle).count();
+        } catch (...) {
+            precision = saved;
+            throw;
+        }
+        precision = saved;
+        
+        const size_t n = reference.size();
+        const double* a = reference.data();
+        const double* b = reduced.data();
+        for (size_t i = 0; i < n; ++i) {
+            report.max_dose = std::max(report.max_dose, a[i]);
+            report.max_abs_difference = std::max(report.max_abs_difference, std::abs(a[i] - b[i]));
+        }
+        if (report.max_dose > 0.0) {
+            report.max_relative_difference = report.max_abs_difference / report.max_dose;
+        }
+        return report;
+    }
+    
+    virtual std::string getName() const = 0;
+    
+protected:
+    struct AdaptiveRefinement {
+        bool enabled = false;
+        double gradient_threshold = 0.3;  // Tỷ lệ so với gradient cực đại
+        double margin = 10.0;             // mm
+    };
+    
+    int num_threads = 0;
+    StoragePrecision precision = StoragePrecision::Double;
+    double dose_grid_resolution = 0.0;  // mm, <= 0: lưới CT
+    GridGeometry fixed_dose_grid;       // Rỗng: suy ra từ dose_grid_resolution
+    bool keep_dose_grid = false;        // calculate trả liều trên lưới liều (không nội suy về CT)
+    AdaptiveRefinement refinement;
+    ArcSampling arc_sampling;
+    bool optimization_sampling = false; // Đang dựng ma trận ảnh hưởng: lấy mẫu cung thô
+    HUtoEDConverter hu_to_ed;
+    RadiologicalDepthCaches depth_caches; // Radiological depth theo (CT, gantry, couch, isocenter)
+    GridPool grid_pool;                   // Lưới trung gian dùng lại giữa các chùm tia và lần tính
+    Profiler profiler;                    // Thời gian/bộ đếm của lần gọi công khai gần nhất
+    
+    /**
+     * content_hash của CT, tính một lần cho mỗi lời gọi công khai: lưới liều khác lưới CT,
+     * tinh chỉnh thích nghi và Monte Carlo tra bộ đệm mật độ nhiều lần trên cùng CT. Chỉ
+     * dùng lại trong cùng phiên của profiler nên CT sửa tại chỗ giữa hai lần gọi vẫn được
+     * băm lại. Bản sao bắt đầu rỗng.
+     */
+    class CTHashMemo {
+    public:
+        CTHashMemo() = default;
+        CTHashMemo(const CTHashMemo&) {}
+        CTHashMemo& operator=(const CTHashMemo&) { return *this; }
+        
+        std::uint64_t get(const CTVolume& ct, std::uint64_t session) {
+            const GridGeometry grid = GridGeometry::of(ct);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (session != 0 && session == session_ && ct.data() == data_ && grid == grid_) {
+                    return hash_;
+                }
+            }
+            const std::uint64_t hash = quangstation::content_hash(ct);
+            std::lock_guard<std::mutex> lock(mutex_);
+            session_ = session;
+            data_ = ct.data();
+            grid_ = grid;
+            hash_ = hash;
+            return hash;
+        }
+        
+    private:
+        std::mutex mutex_;
+        std::uint64_t session_ = 0;
+        const std::int16_t* data_ = nullptr;
+        GridGeometry grid_;
+        std::uint64_t hash_ = 0;
+    };
+    CTHashMemo ct_hash_memo;
+    
+    std::uint64_t ct_content_hash(const CTVolume& ct) {
+        return ct_hash_memo.get(ct, profiler.session());
+    }
+    
+    DoseAlgorithm() = default;
+    explicit DoseAlgorithm(double resolution) : dose_grid_resolution(resolution) {}
+    
+    // resolution >= 0: lưới liều riêng trong một phạm vi (ví dụ 4-5 mm khi dựng ma trận
+    // ảnh hưởng cho tối ưu hóa), khôi phục lưới cũ khi ra khỏi phạm vi; keep_dose_grid
+    // giữ liều trên lưới liều trong phạm vi đó
+    class ScopedDoseGridResolution {
+    public:
+        ScopedDoseGridResolution(DoseAlgorithm& algorithm, double resolution, bool keep_dose_grid = false)
+            : algorithm_(algorithm),
+              saved_resolution_(algorithm.dose_grid_resolution),
+              saved_grid_(algorithm.fixed_dose_grid),
+              saved_keep_(algorithm.keep_dose_grid) {
+            if (resolution >= 0.0) {
+                algorithm.dose_grid_resolution = resolution;
+                algorithm.fixed_dose_grid = GridGeometry();
+            }
+            algorithm.keep_dose_grid = keep_dose_grid;
+        }
+        
+        ~ScopedDoseGridResolution() {
+            algorithm_.dose_grid_resolution = saved_resolution_;
+            algorithm_.fixed_dose_grid = saved_grid_;
+            algorithm_.keep_dose_grid = saved_keep_;
+        }
+        
+    private:
+        DoseAlgorithm& algorithm_;
+        double saved_resolution_;
+        GridGeometry saved_grid_;
+        bool saved_keep_;
+    };
+    
+    // Lấy mẫu cung thô (optimization_gantry_step) trong một phạm vi
+    class ScopedOptimizationSampling {
+    public:
+        explicit ScopedOptimizationSampling(DoseAlgorithm& algorithm)
+            : algorithm_(algorithm), saved_(algorithm.optimization_sampling) {
+            algorithm.optimization_sampling = true;
+        }
+        
+        ~ScopedOptimizationSampling() {
+            algorithm_.optimization_sampling = saved_;
+        }
+        
+    private:
+        DoseAlgorithm& algorithm_;
+        bool saved_;
+    };
+    
+    // Bề rộng sector gantry (độ) của lần tính hiện tại
+    double arc_gantry_step() const {
+        return optimization_sampling ? arc_sampling.optimization_gantry_step : arc_sampling.gantry_step;
+    }
+    
+    // Mẫu của cung VMAT mỗi step độ, khẩu độ và trọng số nội suy giữa các control point
+    static std::vector<ArcSample> arc_samples(const Beam& beam, double step) {
+        return quangstation::sample_arc(beam.arc_start_angle, beam.arc_stop_angle, beam.arc_direction,
+                                        beam.mlc_positions, beam.weights, step);
+    }
+    
+    // Liều (chưa chuẩn hóa) của một chùm tia với trọng số control point của kế hoạch
+    DoseVolume calculate_beam(const CTVolume& ct, const Plan& plan, const std::shared_ptr<Beam>& beam) {
+        Plan single_beam(plan.id, plan.technique, 0.0, plan.fractions);
+        single_beam.beams.push_back(beam);
+        return calculate(ct, MaskVolume(), single_beam);
+    }
+    
+    GridGeometry dose_grid_for(const CTVolume& ct) const {
+        return dose_grid_for(GridGeometry::of(ct));
+    }
+    
+    /**
+     * Khung tính chung cho mọi thuật toán: compute(grid, target, plan) trả về liều thô
+     * (plan không có liều kê toa) trên lưới grid, với isocenter của plan đã đổi sang tọa
+     * độ của lưới đó. Lưới liều khác lưới CT thì liều được nội suy về lưới CT và tinh
+     * chỉnh thích nghi nếu bật; mọi đường tính đều chuẩn hóa một lần trên lưới CT
+     * (normalize_ct_dose), như calculate_incremental.
+     * Trong phạm vi keep_dose_grid liều thô (chưa chuẩn hóa) được trả về nguyên.
+     * target_mask được nén một lần (StructureMask) cho mọi bước chuẩn hóa của lần tính.
+     */
+    template <typename Compute>
+    DoseVolume calculate_on_dose_grid(
+        const CTVolume& ct,
+        const MaskVolume& target_mask,
+        const Plan& plan,
+        const Compute& compute) {
+        
+        const GridGeometry ct_grid = GridGeometry::of(ct);
+        const GridGeometry grid = dose_grid_for(ct);
+        StructureMask target;
+        if (target_mask.same_shape(ct) && plan.prescribed_dose > 0.0) {
+            Profiler::ScopedTimer timer(profiler, "structure_mask", target_mask.size());
+            target = StructureMask(target_mask);
+        }
+        if (grid == ct_grid) {
+            DoseVolume dose = compute(ct_grid, target, plan_on_grid(plan, ct_grid, ct_grid));
+            normalize_ct_dose(dose, target, plan.prescribed_dose);
+            return dose;
+        }
+        if (keep_dose_grid) {
+            return compute(grid, StructureMask(), plan_on_grid(plan, ct_grid, grid));
+        }
+        
+        PooledVolume<double> coarse(grid_pool, compute(grid, StructureMask(), plan_on_grid(plan, ct_grid, grid)));
+        DoseVolume dose = grid_pool.acquire<double>(ct_grid);
+        {
+            Profiler::ScopedTimer timer(profiler, "resample", dose.size());
+            quangstation::resample_trilinear_into(*coarse, dose);
+        }
+        if (refinement.enabled) {
+            Profiler::ScopedTimer timer(profiler, "refinement");
+            refine_dose(ct_grid, target, plan, *coarse, dose, compute);
+        }
+        normalize_ct_dose(dose, target, plan.prescribed_dose);
+        return dose;
+    }
+    
+    // Bước chuẩn hóa chung của liều trên lưới CT (calculate_on_dose_grid, calculate_incremental)
+    void normalize_ct_dose(DoseVolume& dose, const StructureMask& target, double prescribed_dose) {
+        Profiler::ScopedTimer timer(profiler, "normalize", dose.size());
+        normalize_to_prescription(dose, target, prescribed_dose);
+    }
+    
+    // Bản sao kế hoạch không có liều kê toa, isocenter đổi từ tọa độ lưới from sang lưới to
+    static Plan plan_on_grid(const Plan& plan, const GridGeometry& from, const GridGeometry& to) {
+        return plan_with_offset(plan, {from.origin[0] - to.origin[0], from.origin[1] - to.origin[1],
+                                       from.origin[2] - to.origin[2]});
+    }
+    
+    // Bản sao kế hoạch không có liều kê toa, isocenter mọi chùm tia dời offset (mm)
+    static Plan plan_with_offset(const Plan& plan, const std::array<double, 3>& offset) {
+        Plan result(plan.id, plan.technique, 0.0, plan.fractions);
+        for (const auto& beam : plan.beams) {
+            auto shifted = std::make_shared<Beam>(*beam);
+            for (int a = 0; a < 3; ++a) {
+                shifted->isocenter[a] += offset[a];
+            }
+            result.beams.push_back(shifted);
+        }
+        return result;
+    }
+    
+    // Bộ nhớ tối đa cho depth map giữ lại trong calculate_plans (như ngân sách của DoseTaskScheduler)
+    static constexpr std::size_t kScenarioDepthBudget = std::size_t(1) << 30;
+    
+    /**
+     * Số depth map cần giữ để các kế hoạch dùng lại depth map của nhau: số hình học
+     * chùm tia khác nhau (cung VMAT: mỗi mẫu gantry một hình học), giới hạn theo
+     * kScenarioDepthBudget. Trả về 0 nếu không có hình học nào xuất hiện ở hai kế hoạch.
+     */
+    std::size_t scenario_depth_maps(const CTVolume& ct, const std::vector<Plan>& plans) const {
+        using Geometry = std::tuple<double, double, std::array<double, 3>>;
+        std::set<Geometry> seen;
+        bool shared = false;
+        for (const Plan& plan : plans) {
+            std::set<Geometry> own;
+            for (const auto& beam : plan.beams) {
+                if (beam->is_arc) {
+                    for (const ArcSample& sample : arc_samples(*beam, arc_gantry_step())) {
+                        own.insert(Geometry(sample.gantry_angle, beam->couch_angle, beam->isocenter));
+                    }
+                } else {
+                    own.insert(Geometry(beam->gantry_angle, beam->couch_angle, beam->isocenter));
+                }
+            }
+            for (const Geometry& geometry : own) {
+                shared = !seen.insert(geometry).second || shared;
+            }
+        }
+        if (!shared) {
+            return 0;
+        }
+        const std::size_t map_bytes = std::max<std::size_t>(1, dose_grid_for(ct).size() * sizeof(double));
+        return std::min(seen.size(), std::max<std::size_t>(1, kScenarioDepthBudget / map_bytes));
+    }
+    
+    // Nới giới hạn số mục của bộ đệm depth map trong một phạm vi (0: giữ nguyên)
+    class ScopedDepthCacheCapacity {
+    public:
+        ScopedDepthCacheCapacity(RadiologicalDepthCaches& caches, std::size_t entries)
+            : caches_(caches), saved_(caches.max_entries()) {
+            if (entries > saved_) {
+                caches_.set_max_entries(entries);
+            }
+        }
+        ~ScopedDepthCacheCapacity() {
+            caches_.set_max_entries(saved_);
+        }
+        
+        ScopedDepthCacheCapacity(const ScopedDepthCacheCapacity&) = delete;
+        ScopedDepthCacheCapacity& operator=(const ScopedDepthCacheCapacity&) = delete;
+        
+    private:
+        RadiologicalDepthCaches& caches_;
+        std::size_t saved_;
+    };
+    
+    /**
+     * Tính lại các vùng cần tinh chỉnh ở độ phân giải CT và hiệu chỉnh dose (trên lưới CT)
+     * theo hiệu mịn - thô. Lưới CT được chia thành các ô (mỗi cạnh 3 · margin, tối thiểu
+     * 8 voxel); chỉ các ô chạm tới PTV hoặc voxel gradient cao (nới margin) được tinh chỉnh,
+     * gộp thành các đoạn ô liên tiếp theo x. Mỗi đoạn là một lõi: liều mịn và thô được tính
+     * trên lõi nới thêm margin (mô xung quanh góp tán xạ) nhưng chỉ cộng vào trong lõi, nên
+     * các lõi rời nhau không hiệu chỉnh chồng và penumbra của các trường giao nhau không kéo
+     * theo cả hộp bao chung. Chỉ khi tổng các vùng tính quá nửa lưới mới tính mịn toàn bộ.
+     */
+    template <typename Compute>
+    void refine_dose(
+        const GridGeometry& ct_grid,
+        const StructureMask& target_mask,
+        const Plan& plan,
+        const DoseVolume& coarse,
+        DoseVolume& dose,
+        const Compute& compute) {
+        
+        std::array<long, 3> margin, tile, tiles;
+        for (int a = 0; a < 3; ++a) {
+            margin[a] = static_cast<long>(std::ceil(refinement.margin / ct_grid.spacing[a]));
+            tile[a] = std::max(8L, 3 * margin[a]);
+            tiles[a] = (static_cast<long>(ct_grid.extent(a)) + tile[a] - 1) / tile[a];
+        }
+        std::vector<std::uint8_t> flagged(static_cast<std::size_t>(tiles[0] * tiles[1] * tiles[2]), 0);
+        auto flag = [&](quangstation::IndexBox box) {
+            box.dilate(margin, ct_grid);
+            if (box.empty()) {
+                return;
+            }
+            for (long tz = box.lo[2] / tile[2]; tz <= box.hi[2] / tile[2]; ++tz) {
+                for (long ty = box.lo[1] / tile[1]; ty <= box.hi[1] / tile[1]; ++ty) {
+                    for (long tx = box.lo[0] / tile[0]; tx <= box.hi[0] / tile[0]; ++tx) {
+                        flagged[(tz * tiles[1] + ty) * tiles[0] + tx] = 1;
+                    }
+                }
+            }
+        };
+        if (target_mask.same_shape(ct_grid)) {
+            flag(target_mask.bounds());
+        }
+        flag_high_gradient(coarse, ct_grid, refinement.gradient_threshold, grid_pool, flag);
+        
+        // Lõi: đoạn ô liên tiếp theo x; vùng tính: lõi nới margin
+        std::vector<std::pair<quangstation::IndexBox, quangstation::IndexBox>> regions;
+        std::size_t computed = 0;
+        for (long tz = 0; tz < tiles[2]; ++tz) {
+            for (long ty = 0; ty < tiles[1]; ++ty) {
+                for (long tx = 0; tx < tiles[0]; ++tx) {
+                    if (!flagged[(tz * tiles[1] + ty) * tiles[0] + tx]) {
+                        continue;
+                    }
+                    const long first = tx;
+                    while (tx + 1 < tiles[0] && flagged[(tz * tiles[1] + ty) * tiles[0] + tx + 1]) {
+                        ++tx;
+                    }
+                    quangstation::IndexBox core;
+                    core.lo = {first * tile[0], ty * tile[1], tz * tile[2]};
+                    core.hi = {std::min((tx + 1) * tile[0], static_cast<long>(ct_grid.width)) - 1,
+                               std::min((ty + 1) * tile[1], static_cast<long>(ct_grid.height)) - 1,
+                               std::min((tz + 1) * tile[2], static_cast<long>(ct_grid.depth)) - 1};
+                    quangstation::IndexBox halo = core;
+                    halo.dilate(margin, ct_grid);
+                    computed += halo.size();
+                    regions.emplace_back(core, halo);
+                }
+            }
+        }
+        if (regions.empty()) {
+            return;
+        }
+        profiler.count("refinement_regions", regions.size());
+        if (2 * computed > ct_grid.size()) {
+            // Các vùng chiếm quá nửa lưới: tính mịn toàn bộ rẻ hơn thêm các lượt thô trên vùng
+            grid_pool.release(dose);
+            dose = compute(ct_grid, StructureMask(), plan);
+            return;
+        }
+        for (const auto& region : regions) {
+            refine_region(ct_grid, region.first, region.second, plan, coarse, dose, compute);
+        }
+    }
+    
+    // Tính liều mịn và thô trên halo (chỉ số lưới CT), cộng (mịn - thô) vào dose trong core
+    template <typename Compute>
+    void refine_region(
+        const GridGeometry& ct_grid,
+        const quangstation::IndexBox& core,
+        const quangstation::IndexBox& halo,
+        const Plan& plan,
+        const DoseVolume& coarse,
+        DoseVolume& dose,
+        const Compute& compute) {
+        
+        const GridGeometry fine = halo.crop(ct_grid);
+        PooledVolume<double> fine_lease(grid_pool, compute(fine, StructureMask(), plan_on_grid(plan, ct_grid, fine)));
+        
+        const GridGeometry coarse_box = quangstation::coarsened(fine, coarse.spacing());
+        PooledVolume<double> box_coarse = grid_pool.lease<double>(fine);
+        {
+            PooledVolume<double> coarse_dose(
+                grid_pool, compute(coarse_box, StructureMask(), plan_on_grid(plan, ct_grid, coarse_box)));
+            quangstation::resample_trilinear_into(*coarse_dose, *box_coarse);
+        }
+        
+        const long depth = core.hi[2] - core.lo[2] + 1;
+        const long height = core.hi[1] - core.lo[1] + 1;
+        const long width = core.hi[0] - core.lo[0] + 1;
+        const std::array<long, 3> offset = {core.lo[0] - halo.lo[0], core.lo[1] - halo.lo[1], core.lo[2] - halo.lo[2]};
+        #pragma omp parallel for collapse(2)
+        for (long z = 0; z < depth; ++z) {
+            for (long y = 0; y < height; ++y) {
+                const double* fine_row = fine_lease->row(z + offset[2], y + offset[1]) + offset[0];
+                const double* coarse_row = box_coarse->row(z + offset[2], y + offset[1]) + offset[0];
+                double* dose_row = dose.row(z + core.lo[2], y + core.lo[1]) + core.lo[0];
+                for (long x = 0; x < width; ++x) {
+                    dose_row[x] = std::max(0.0, dose_row[x] + fine_row[x] - coarse_row[x]);
+                }
+            }
+        }
+    }
+    
+    // Gọi flag(hộp chỉ số lưới CT của voxel) cho mỗi voxel của lưới liều có |∇D| > threshold · max |∇D|
+    template <typename Flag>
+    static void flag_high_gradient(
+        const DoseVolume& dose, const GridGeometry& ct_grid, double threshold, GridPool& pool, const Flag& flag) {
+        
+        const long depth = static_cast<long>(dose.depth());
+        const long height = static_cast<long>(dose.height());
+        const long width = static_cast<long>(dose.width());
+        if (dose.empty()) {
+            return;
+        }
+        
+        // Sai phân trung tâm (một phía ở biên), đơn vị Gy/mm
+        const std::array<double, 3>& spacing = dose.spacing();
+        PooledVolume<double> gradient = pool.lease_like<double>(dose, 0.0);
+        #pragma omp parallel for collapse(2)
+        for (long z = 0; z < depth; ++z) {
+            for (long y = 0; y < height; ++y) {
+                const long z0 = std::max(0L, z - 1), z1 = std::min(depth - 1, z + 1);
+                const long y0 = std::max(0L, y - 1), y1 = std::min(height - 1, y + 1);
+                const double* row = dose.row(z, y);
+                double* out = gradient->row(z, y);
+                for (long x = 0; x < width; ++x) {
+                    const long x0 = std::max(0L, x - 1), x1 = std::min(width - 1, x + 1);
+                    const double gx = x1 > x0 ? (row[x1] - row[x0]) / ((x1 - x0) * spacing[0]) : 0.0;
+                    const double gy = y1 > y0 ? (dose(z, y1, x) - dose(z, y0, x)) / ((y1 - y0) * spacing[1]) : 0.0;
+                    const double gz = z1 > z0 ? (dose(z1, y, x) - dose(z0, y, x)) / ((z1 - z0) * spacing[2]) : 0.0;
+                    out[x] = std::sqrt(gx * gx + gy * gy + gz * gz);
+                }
+            }
+        }
+        
+        double max_gradient = 0.0;
+        for (double value : *gradient) {
+            max_gradient = std::max(max_gradient, value);
+        }
+        if (max_gradient <= 0.0) {
+            return;
+        }
+        
+        // Voxel của lưới liều phủ các voxel CT trong nửa spacing liều quanh tâm của nó
+        auto to_ct = [&](double position, int a) {
+            const long index = std::lround((position - ct_grid.origin[a]) / ct_grid.spacing[a]);
+            return std::min(std::max(0L, index), static_cast<long>(ct_grid.extent(a)) - 1);
+        };
+        const double cutoff = threshold * max_gradient;
+        for (long z = 0; z < depth; ++z) {
+            for (long y = 0; y < height; ++y) {
+                const double* row = gradient->row(z, y);
+                for (long x = 0; x < width; ++x) {
+                    if (row[x] <= cutoff) {
+                        continue;
+                    }
+                    const std::array<long, 3> index = {x, y, z};
+                    quangstation::IndexBox box;
+                    for (int a = 0; a < 3; ++a) {
+                        const double center = dose.origin()[a] + index[a] * spacing[a];
+                        box.lo[a] = to_ct(center - 0.5 * spacing[a], a);
+                        box.hi[a] = to_ct(center + 0.5 * spacing[a], a);
+                    }
+                    flag(box);
+                }
+            }
+        }
+    }
+    
+    // Chuẩn hóa liều trung bình trong PTV về liều kê toa (mặt nạ phải cùng kích thước)
+    static void normalize_to_prescription(DoseVolume& dose, const StructureMask& target_mask, double prescribed_dose) {
+        const double scale = prescription_scale(dose, target_mask, prescribed_dose);
+        if (scale != 1.0) {
+            dose.scale(scale);
+        }
+    }
+    
+    // Hệ số đưa liều trung bình trong PTV về liều kê toa (1 nếu không chuẩn hóa được)
+    static double prescription_scale(const DoseVolume& dose, const StructureMask& target_mask, double prescribed_dose) {
+        if (!target_mask.same_shape(dose) || prescribed_dose <= 0.0) {
+            return 1.0;
+        }
+        const size_t num_voxels = target_mask.count();
+        const double total_dose = num_voxels > 0 ? target_mask.sum(dose) : 0.0;
+        if (num_voxels == 0 || total_dose <= 0.0) {
+            return 1.0;
+        }
+        return prescribed_dose / (total_dose / num_voxels);
+    }
+    
+    // Tương quan mật độ với kernel; lưới kết quả lấy từ grid_pool (người gọi trả lại)
+    DensityVolume correlate_density(KernelConvolver& convolver, const DensityVolume& density,
+                                    const quangstation::PreparedKernel& kernel, int half) {
+        Profiler::ScopedTimer timer(profiler, "kernel_convolution", density.size());
+        return convolver.correlate(density, kernel, half, &grid_pool);
+    }
+    
+    // Bộ tích chập kernel chỉ làm việc với double: lưới float được chuyển tạm sang double
+    Volume3D<float> correlate_density(KernelConvolver& convolver, const Volume3D<float>& density,
+                                      const quangstation::PreparedKernel& kernel, int half) {
+        Profiler::ScopedTimer timer(profiler, "kernel_convolution", density.size());
+        PooledVolume<double> wide = grid_pool.lease_like<double>(density);
+        std::copy(density.begin(), density.end(), wide->begin());
+        PooledVolume<double> result(grid_pool, convolver.correlate(*wide, kernel, half, &grid_pool));
+        Volume3D<float> narrow = grid_pool.acquire_like<float>(*result);
+        std::transform(result->begin(), result->end(), narrow.begin(),
+                       [](double value) { return static_cast<float>(value); });
+        return narrow;
+    }
+    
+    // Mật độ điện tử của ct trên lưới grid (nội suy tam tuyến tính nếu khác lưới CT), lưu kiểu T;
+    // dùng lại lưới đã đệm nếu cùng CT, bảng HU-ED và lưới. density_key nhận khóa của lưới,
+    // dùng làm ct_hash cho bộ đệm radiological depth. Lưới khác lưới CT (lưới liều, hộp tinh
+    // chỉnh) lấy mẫu lại từ mật độ trên lưới CT đã đệm, không chuyển đổi lại cả CT.
+    template <typename T>
+    std::shared_ptr<const Volume3D<T>> electron_density_of(
+        const CTVolume& ct, const GridGeometry& grid, std::uint64_t& density_key) {
+        
+        const GridGeometry ct_grid = GridGeometry::of(ct);
+        density_key = hu_to_ed.density_key(ct_content_hash(ct));
+        std::shared_ptr<const Volume3D<T>> source;
+        if (!(grid == ct_grid)) {
+            std::uint64_t ct_key = 0;
+            source = electron_density_of<T>(ct, ct_grid, ct_key);
+            density_key = (density_key ^ grid.hash()) * 0x100000001b3ULL;
+        }
+        auto& cache = quangstation::DensityCaches::instance().get<T>();
+        if (auto cached = cache.find(density_key)) {
+            profiler.count("density_cache_hits");
+            return cached;
+        }
+        profiler.count("density_cache_misses");
+        Profiler::ScopedTimer timer(profiler, "hu_to_ed", grid.size());
+        auto density = source
+            ? std::make_shared<const Volume3D<T>>(quangstation::resample_trilinear<T>(*source, grid))
+            : std::make_shared<const Volume3D<T>>(hu_to_ed.convert_volume<T>(ct));
+        cache.insert(density_key, density);
+        return density;
+    }
+    
+    // Hướng chùm tia (vector đơn vị) theo góc gantry và couch, dùng chung cho mọi thuật toán
+    static std::array<double, 3> calculate_beam_direction(double gantry_angle, double couch_angle) {
+        double gantry_rad = gantry_angle * M_PI / 180.0;
+        double couch_rad = couch_angle * M_PI / 180.0;
+        
+        double x = sin(gantry_rad) * cos(couch_rad);
+        double y = cos(gantry_rad);
+        double z = sin(gantry_rad) * sin(couch_rad);
+        
+        double magnitude = sqrt(x * x + y * y + z * z);
+        return {x / magnitude, y / magnitude, z / magnitude};
+    }
+    
+    // Radiological depth từ nguồn cách isocenter một khoảng sad, dùng lại kết quả đã đệm nếu có
+    template <typename T>
+    std::shared_ptr<const Volume3D<T>> radiological_depth(
+        const Volume3D<T>& electron_density,
+        std::uint64_t ct_hash,
+        double gantry_angle,
+        double couch_angle,
+        const std::array<double, 3>& isocenter,
+        const std::array<double, 3>& beam_direction,
+        double sad) {
+        
+        auto& cache = depth_caches.get<T>();
+        typename quangstation::BasicRadiologicalDepthCache<T>::Key key = {
+            ct_hash, gantry_angle, couch_angle, isocenter
+        };
+        if (auto cached = cache.find(key)) {
+            profiler.count("depth_cache_hits");
+            return cached;
+        }
+        profiler.count("depth_cache_misses");
+        Profiler::ScopedTimer timer(profiler, "ray_trace", electron_density.size());
+        
+        // Nguồn điểm cách isocenter một khoảng SAD ngược hướng chùm tia
+        std::array<double, 3> source = {
+            isocenter[0] - sad * beam_direction[0],
+            isocenter[1] - sad * beam_direction[1],
+            isocenter[2] - sad * beam_direction[2]
+        };
+        
+        // Tia cách nhau không quá một voxel ở mặt phẳng xa nhất (gần nguồn dày hơn)
+        const std::array<double, 3>& voxel_size = electron_density.spacing();
+        double ray_spacing = std::min(std::min(voxel_size[0], voxel_size[1]), voxel_size[2]);
+        
+        quangstation::BasicRayTracer<T> tracer(electron_density);
+        auto depth = std::make_shared<const Volume3D<T>>(
+            tracer.depth_map(source, beam_direction, ray_spacing));
+        cache.insert(key, depth);
+        return depth;
+    }
+    
+    // Hình học nguồn của một depth map (gantry, couch, isocenter và hướng chùm tia tương ứng)
+    struct DepthGeometry {
+        double gantry_angle;
+        double couch_angle;
+        std::array<double, 3> isocenter;
+        std::array<double, 3> direction;
+    };
+    
+    // Depth map giữ đồng thời cho các tác vụ của run_depth_tasks
+    static constexpr std::size_t kTaskDepthBudget = std::size_t(1) << 30;
+    
+    /**
+     * Chạy num_tasks tác vụ trên scheduler, task(t, accumulator, depth) nhận depth map của
+     * hình học geometry(t, g) (nullptr nếu geometry trả về false). Các depth map được dò tia
+     * tuần tự trước khi chia tác vụ cho các luồng (mỗi lần dò tia song song bên trong), nên
+     * các tác vụ cùng hình học chỉ đọc thay vì cùng lúc lỡ bộ đệm và dò tia lặp lại. Tác vụ
+     * được chia thành các đợt liên tiếp giữ không quá kTaskDepthBudget byte depth map.
+     */
+    template <typename T, typename Geometry, typename Task>
+    void run_depth_tasks(
+        const quangstation::DoseTaskScheduler& scheduler,
+        std::size_t num_tasks,
+        DoseVolume& dose,
+        const Volume3D<T>& electron_density,
+        std::uint64_t ct_hash,
+        double sad,
+        const Geometry& geometry,
+        const Task& task) {
+        
+        using Key = typename quangstation::BasicRadiologicalDepthCache<T>::Key;
+        const std::size_t map_bytes = std::max<std::size_t>(1, electron_density.size() * sizeof(T));
+        const std::size_t max_maps = std::max<std::size_t>(1, kTaskDepthBudget / map_bytes);
+        std::vector<std::shared_ptr<const Volume3D<T>>> depths(num_tasks);
+        std::size_t begin = 0;
+        while (begin < num_tasks) {
+            std::map<Key, std::shared_ptr<const Volume3D<T>>> maps;
+            std::size_t end = begin;
+            for (; end < num_tasks; ++end) {
+                DepthGeometry g;
+                if (!geometry(end, g)) {
+                    continue;
+                }
+                const Key key = {ct_hash, g.gantry_angle, g.couch_angle, g.isocenter};
+                auto it = maps.find(key);
+                if (it == maps.end()) {
+                    if (maps.size() == max_maps) {
+                        break;
+                    }
+                    it = maps.emplace(key, radiological_depth(electron_density, ct_hash, g.gantry_angle,
+                                                              g.couch_angle, g.isocenter, g.direction, sad)).first;
+                }
+                depths[end] = it->second;
+            }
+            scheduler.run(end - begin, dose, [&](std::size_t t, DoseVolume& accumulator) {
+                task(begin + t, accumulator, depths[begin + t].get());
+            });
+            for (std::size_t t = begin; t < end; ++t) {
+                depths[t].reset();
+            }
+            begin = end;
+        }
+    }
+};
+
+// Thuật toán Collapsed Cone Convolution
+class CollapsedConeConvolution : public DoseAlgorithm {
+private:
+    int num_cones;
+    KernelConvolver convolver; // Backend tích chập kernel (direct / separable / FFT)
+    bool use_cone_transport = true;                  // Photon: vận chuyển TERMA theo cone
+    double source_axis_distance = 1000.0;            // SAD (mm)
+    std::shared_ptr<const ConeLattice> cone_lattice; // Dùng lại khi hình học lưới không đổi
+    
+public:
+    CollapsedConeConvolution(int cones = 24, double resolution = 0.0)
+        : DoseAlgorithm(resolution), num_cones(cones) {}
+    
+    // Số hướng cone: nhiều hơn chính xác hơn, thời gian tính tỷ lệ tuyến tính
+    void set_num_cones(int cones) {
+        num_cones = std::max(1, cones);
+    }
+    
+    int get_num_cones() const {
+        return num_cones;
+    }
+    
+    // "cone": vận chuyển collapsed-cone cho photon, "kernel": tích chập kernel cục bộ
+    void set_transport_mode(const std::string& mode) {
+        if (mode == "cone") {
+            use_cone_transport = true;
+        } else if (mode == "kernel") {
+            use_cone_transport = false;
+        } else {
+            throw std::invalid_argument("Chế độ vận chuyển không hợp lệ: " + mode);
+        }
+    }
+    
+    std::string get_transport_mode() const {
+        return use_cone_transport ? "cone" : "kernel";
+    }
+    
+    // Chọn backend tích chập: "auto", "direct", "separable" hoặc "fft"
+    void set_convolution_mode(const std::string& mode) {
+        convolver.set_mode(quangstation::convolution_mode_from_string(mode));
+    }
+    
+    std::string get_convolution_mode() const {
+        return quangstation::to_string(convolver.mode());
+    }
+    
+    DoseVolume calculate(
+        const CTVolume& ct,
+        const MaskVolume& target_mask,
+        const Plan& plan) override {
+        
+        ScopedProfileSession profile(profiler, grid_pool);
+        ScopedThreadCount thread_guard(num_threads);
+        return calculate_on_dose_grid(ct, target_mask, plan,
+            [this, &ct](const GridGeometry& grid, const StructureMask&, const Plan& grid_plan) {
+                if (precision == StoragePrecision::Float32) {
+                    return calculate_with<float>(ct, grid, grid_plan);
+                }
+                return calculate_with<double>(ct, grid, grid_plan);
+            });
+    }
+    
+    std::string getName() const override {
+        return "Collapsed Cone Convolution";
+    }
+    
+private:
+    // Một đơn vị công việc: một control point, một sector gantry của cung (fluence tích lũy
+    // của các khẩu độ nội suy), hoặc cả chùm tia có wedge (wedge áp dụng lên tổng của chùm tia)
+    struct ControlPointTask {
+        size_t beam;
+        bool cone_beam;
+        bool whole_beam;
+        double gantry_angle;
+        std::array<double, 3> direction;
+        const std::vector<double>* mlc_positions;
+        double weight;
+        std::shared_ptr<const ApertureFluence> fluence; // Sector của cung (thay cho mlc_positions)
+    };
+    
+    // Khẩu độ MLC của một control point (fluence 0 hoặc 1), cùng giao diện với ApertureFluence
+    class ControlPointAperture {
+    public:
+        ControlPointAperture(const CollapsedConeConvolution& algorithm, const std::vector<double>& mlc_positions)
+            : algorithm_(algorithm), mlc_positions_(mlc_positions),
+              bounds_(algorithm.aperture_bounds(mlc_positions)) {}
+        
+        double value(double proj_x, double proj_y) const {
+            return algorithm_.is_inside_aperture(proj_x, proj_y, mlc_positions_) ? 1.0 : 0.0;
+        }
+        
+        const FieldRect& bounds() const { return bounds_; }
+        
+    private:
+        const CollapsedConeConvolution& algorithm_;
+        const std::vector<double>& mlc_positions_;
+        FieldRect bounds_;
+    };
+    
+    // Các lưới trung gian lưu kiểu T, liều cộng dồn bằng double
+    template <typename T>
+    DoseVolume calculate_with(
+        const CTVolume& ct,
+        const GridGeometry& grid,
+        const Plan& plan) {
+        
+        const std::array<double, 3>& voxel_size = grid.spacing;
+        
+        // Khởi tạo ma trận liều
+        DoseVolume dose = grid_pool.acquire<double>(grid, 0.0);
+        
+        // Chuyển đổi CT thành mật độ điện tử trên lưới liều (dùng lại nếu CT đã được tính trước đó)
+        std::uint64_t ct_hash = 0;
+        auto density = electron_density_of<T>(ct, grid, ct_hash);
+        const Volume3D<T>& electron_density = *density;
+        
+        // Chuẩn bị theo beam (tuần tự, song song hóa bên trong): lưới cone hoặc mật độ đã tích chập
+        std::vector<PooledVolume<T>> convolved;
+        convolved.reserve(plan.beams.size());
+        std::vector<ControlPointTask> tasks;
+        for (size_t b = 0; b < plan.beams.size(); ++b) {
+            const auto& beam = plan.beams[b];
+            
+            // Photon dùng vận chuyển collapsed-cone, các loại khác dùng tích chập kernel cục bộ
+            const bool cone_beam = use_cone_transport && beam->type == "photon";
+            
+            if (cone_beam) {
+                prepare_cone_lattice(electron_density);
+                convolved.emplace_back(grid_pool, Volume3D<T>());
+            } else {
+                // Dose kernel theo loại hạt, năng lượng và spacing (dùng chung qua bộ đệm kernel)
+                auto kernel = quangstation::DoseKernelCache::instance().dose_kernel(
+                    quangstation::particle_type_from_string(beam->type), beam->energy, voxel_size);
+                
+                // Tích chập kernel với mật độ không phụ thuộc control point: tính một lần cho mỗi beam
+                // (giới hạn cửa sổ kernel bằng một nửa bán kính để tối ưu hiệu suất)
+                const int half_kernel = kernel->max_half() / 2;
+                convolved.emplace_back(grid_pool, correlate_density(convolver, electron_density, *kernel, half_kernel));
+            }
+            
+            append_control_point_tasks(*beam, b, cone_beam, tasks);
+        }
+        
+        // Các control point độc lập: chia cho các luồng, mỗi luồng cộng vào lưới riêng
+        profiler.count("control_points", tasks.size());
+        Profiler::ScopedTimer deposition(profiler, "dose_deposition", grid.size() * tasks.size());
+        quangstation::DoseTaskScheduler scheduler(num_threads);
+        scheduler.set_grid_pool(&grid_pool);
+        auto geometry = [&](size_t t, DepthGeometry& g) {
+            const ControlPointTask& task = tasks[t];
+            const Beam& beam = *plan.beams[task.beam];
+            g = {task.gantry_angle, beam.couch_angle, beam.isocenter, task.direction};
+            return task.cone_beam;
+        };
+        run_depth_tasks(scheduler, tasks.size(), dose, electron_density, ct_hash, source_axis_distance, geometry,
+                        [&](size_t t, DoseVolume& accumulator, const Volume3D<T>* rad_depth) {
+            const ControlPointTask& task = tasks[t];
+            const Beam& beam = *plan.beams[task.beam];
+            Profiler::ScopedBeamTimer beam_timer(profiler, beam.id);
+            
+            if (!task.whole_beam) {
+                calculate_task_dose(accumulator, task, beam, electron_density, rad_depth,
+                                    *convolved[task.beam], voxel_size);
+                return;
+            }
+            
+            // Hệ số wedge chỉ phụ thuộc vị trí voxel: áp dụng một lần lên tổng các control point
+            PooledVolume<double> beam_dose = grid_pool.lease<double>(grid, 0.0);
+            for (size_t cp = 0; cp < beam.mlc_positions.size(); ++cp) {
+                ControlPointTask cp_task = task;
+                cp_task.mlc_positions = &beam.mlc_positions[cp];
+                cp_task.weight = beam.weights[cp];
+                calculate_task_dose(*beam_dose, cp_task, beam, electron_density, rad_depth,
+                                    *convolved[task.beam], voxel_size);
+            }
+            apply_wedge_modulation(
+                *beam_dose, beam.isocenter,
+                beam.wedge_angle, beam.wedge_orientation,
+                voxel_size
+            );
+            accumulator.add_scaled(*beam_dose);
+        });
+        
+        return dose;
+    }
+    
+    // Liệt kê control point của chùm tia. Cung VMAT: khẩu độ nội suy mỗi aperture_step độ,
+    // gộp theo sector gantry (xem set_arc_sampling), nên số lần tính TERMA và vận chuyển theo
+    // số sector chứ không theo số mẫu
+    void append_control_point_tasks(const Beam& beam, size_t beam_index, bool cone_beam,
+                                    std::vector<ControlPointTask>& tasks) {
+        if (beam.mlc_positions.empty() || beam.weights.empty()) {
+            return;
+        }
+        
+        if (beam.is_arc) {
+            const double sector_width = arc_gantry_step();
+            const std::vector<ArcSector> sectors = quangstation::group_arc_sectors(
+                arc_samples(beam, std::min(arc_sampling.aperture_step, sector_width)), sector_width);
+            for (const ArcSector& sector : sectors) {
+                if (sector.fluence->bounds().empty()) {
+                    continue;
+                }
+                tasks.push_back({
+                    beam_index, cone_beam, false, sector.gantry_angle,
+                    calculate_beam_direction(sector.gantry_angle, beam.couch_angle),
+                    nullptr, 1.0, sector.fluence
+                });
+            }
+        } else {
+            // IMRT hoặc 3DCRT
+            auto direction = calculate_beam_direction(beam.gantry_angle, beam.couch_angle);
+            if (beam.has_wedge) {
+                tasks.push_back({beam_index, cone_beam, true, beam.gantry_angle, direction, nullptr, 0.0, nullptr});
+                return;
+            }
+            for (size_t cp = 0; cp < beam.mlc_positions.size(); ++cp) {
+                tasks.push_back({
+                    beam_index, cone_beam, false, beam.gantry_angle, direction,
+                    &beam.mlc_positions[cp], beam.weights[cp], nullptr
+                });
+            }
+        }
+    }
+    
+    // Liều của một control point (hoặc sector của cung) cộng vào dose
+    template <typename T>
+    void calculate_task_dose(
+        DoseVolume& dose,
+        const ControlPointTask& task,
+        const Beam& beam,
+        const Volume3D<T>& electron_density,
+        const Volume3D<T>* rad_depth,
+        const Volume3D<T>& convolved,
+        const std::array<double, 3>& voxel_size
+    ) {
+        if (task.fluence) {
+            calculate_aperture_dose(dose, task, beam, electron_density, rad_depth, convolved,
+                                    voxel_size, *task.fluence);
+        } else {
+            calculate_aperture_dose(dose, task, beam, electron_density, rad_depth, convolved,
+                                    voxel_size, ControlPointAperture(*this, *task.mlc_positions));
+        }
+    }
+    
+    template <typename T, typename Aperture>
+    void calculate_aperture_dose(
+        DoseVolume& dose,
+        const ControlPointTask& task,
+        const Beam& beam,
+        const Volume3D<T>& electron_density,
+        const Volume3D<T>* rad_depth,
+        const Volume3D<T>& convolved,
+        const std::array<double, 3>& voxel_size,
+        const Aperture& aperture
+    ) {
+        if (task.cone_beam) {
+            calculate_cone_control_point_dose(
+                dose, electron_density, *rad_depth, beam,
+                task.direction, aperture, task.weight
+            );
+        } else {
+            calculate_control_point_dose(
+                dose, convolved,
+                task.direction, beam.isocenter,
+                aperture, voxel_size, task.weight
+            );
+        }
+    }
+    
+    
+    // Áp dụng hiệu ứng wedge
+    void apply_wedge_modulation(
+        DoseVolume& beam_dose,
+        const std::array<double, 3>& isocenter,
+        double wedge_angle,
+        double wedge_orientation,
+        const std::array<double, 3>& voxel_size
+    ) {
+        // Chuyển đổi góc wedge từ độ sang radian
+        double wedge_rad = wedge_angle * M_PI / 180.0;
+        double orientation_rad = wedge_orientation * M_PI / 180.0;
+        
+        // Tính hướng wedge
+        std::array<double, 3> wedge_direction = {
+            cos(orientation_rad),
+            0,
+            sin(orientation_rad)
+        };
+        
+        // Hệ số wedge từ 1.0 đến cos(wedge_angle) trên max_distance (đơn giản hóa)
+        const double cos_wedge = cos(wedge_rad);
+        const double max_distance = 100.0; // mm
+        
+        // Kích thước dữ liệu
+        const long depth = static_cast<long>(beam_dose.depth());
+        const long height = static_cast<long>(beam_dose.height());
+        const long width = static_cast<long>(beam_dose.width());
+        
+        // Tính hệ số wedge cho từng voxel
+        #pragma omp parallel for collapse(2)
+        for (long z = 0; z < depth; ++z) {
+            for (long y = 0; y < height; ++y) {
+                double* dose_row = beam_dose.row(z, y);
+                #pragma omp simd
+                for (int x = 0; x < static_cast<int>(width); ++x) {
+                    // Tính tọa độ voxel trong không gian thực (mm)
+                    double voxel_x = x * voxel_size[0];
+                    double voxel_y = y * voxel_size[1];
+                    double voxel_z = z * voxel_size[2];
+                    
+                    // Tính vector từ isocenter đến voxel
+                    double dx = voxel_x - isocenter[0];
+                    double dy = voxel_y - isocenter[1];
+                    double dz = voxel_z - isocenter[2];
+                    
+                    // Chiếu vector này lên hướng wedge
+                    double projection = dx * wedge_direction[0] + 
+                                       dy * wedge_direction[1] + 
+                                       dz * wedge_direction[2];
+                    
+                    // Tính hệ số wedge
+                    double normalized_position = projection / max_distance;
+                    double wedge_factor = 1.0 - (1.0 - cos_wedge) * normalized_position;
+                    
+                    // Đảm bảo hệ số wedge không âm
+                    wedge_factor = std::max(0.1, wedge_factor);
+                    
+                    // Áp dụng hệ số wedge
+                    dose_row[x] *= wedge_factor;
+                }
+            }
+        }
+    }
+    
+    // Tính liều từ một control point trên mật độ đã tích chập với kernel; aperture cho
+    // fluence tương đối tại hình chiếu song song lên mặt phẳng isocenter
+    template <typename T, typename Aperture>
+    void calculate_control_point_dose(
+        DoseVolume& beam_dose,
+        const Volume3D<T>& convolved,
+        const std::array<double, 3>& beam_direction,
+        const std::array<double, 3>& isocenter,
+        const Aperture& aperture,
+        const std::array<double, 3>& voxel_size,
+        double weight
+    ) {
+        // Kích thước dữ liệu
+        const long depth = static_cast<long>(convolved.depth());
+        const long height = static_cast<long>(convolved.height());
+        const long width = static_cast<long>(convolved.width());
+        
+        // Chỉ duyệt các voxel có hình chiếu nằm trong hình chữ nhật bao vùng mở MLC
+        const FieldRect& bounds = aperture.bounds();
+        if (bounds.empty()) {
+            return;
+        }
+        BeamsEyeView bev(isocenter, beam_direction, voxel_size);
+        const std::array<double, 3>& perp_x = bev.perp_x();
+        const std::array<double, 3>& perp_y = bev.perp_y();
+        
+        // Tính toán liều cho từng voxel
+        #pragma omp parallel for collapse(2)
+        for (long z = 0; z < depth; ++z) {
+            for (long y = 0; y < height; ++y) {
+                long x_begin, x_end;
+                if (!bev.row_span(z, y, width, bounds, x_begin, x_end, 0.0)) {
+                    continue;
+                }
+                double* dose_row = beam_dose.row(z, y);
+                const T* convolved_row = convolved.row(z, y);
+                for (long x = x_begin; x < x_end; ++x) {
+                    double dx = x * voxel_size[0] - isocenter[0];
+                    double dy = y * voxel_size[1] - isocenter[1];
+                    double dz = z * voxel_size[2] - isocenter[2];
+                    
+                    // Khoảng cách từ isocenter dọc theo hướng chùm tia; voxel sau isocenter bị bỏ qua
+                    double distance = dx * beam_direction[0] + dy * beam_direction[1] + dz * beam_direction[2];
+                    if (distance < 0) {
+                        continue;
+                    }
+                    
+                    // Fluence của khẩu độ tại hình chiếu voxel (đơn giản hóa: chiếu song song)
+                    double open = aperture.value(dx * perp_x[0] + dy * perp_x[1] + dz * perp_x[2],
+                                                 dx * perp_y[0] + dy * perp_y[1] + dz * perp_y[2]);
+                    if (open <= 0.0) {
+                        continue;
+                    }
+                    
+                    // Tổng liều từ kernel đã được tính sẵn
+                    double voxel_dose = convolved_row[x];
+                    
+                    // Áp dụng hiệu ứng giảm liều theo khoảng cách (inverse square law)
+                    // và hiệu ứng suy giảm theo độ sâu
+                    double source_distance = 1000.0; // SSD mặc định (mm)
+                    double depth_factor = quangstation::fast_exp(-0.005 * distance); // Đơn giản hóa
+                    double ratio = source_distance / (source_distance + distance);
+                    double inverse_square = ratio * ratio;
+                    
+                    voxel_dose *= depth_factor * inverse_square * weight * open;
+                    
+                    // Thêm vào beam dose
+                    dose_row[x] += voxel_dose;
+                }
+            }
+        }
+    }
+    
+    // Dựng (hoặc dùng lại) lưới đường cone cho hình học lưới hiện tại
+    template <typename T>
+    void prepare_cone_lattice(const Volume3D<T>& electron_density) {
+        std::array<std::size_t, 3> dims = {
+            electron_density.width(), electron_density.height(), electron_density.depth()
+        };
+        if (!cone_lattice || !cone_lattice->matches(dims, electron_density.spacing(), num_cones)) {
+            cone_lattice = std::make_shared<const ConeLattice>(dims, electron_density.spacing(), num_cones);
+        }
+    }
+    
+    // Liều một control point photon: TERMA theo chùm tia phân kỳ rồi vận chuyển theo các cone
+    template <typename T, typename Aperture>
+    void calculate_cone_control_point_dose(
+        DoseVolume& beam_dose,
+        const Volume3D<T>& electron_density,
+        const Volume3D<T>& rad_depth,
+        const Beam& beam,
+        const std::array<double, 3>& beam_direction,
+        const Aperture& aperture,
+        double weight
+    ) {
+        // rad_depth: radiological depth từ nguồn, dò tia trước khi chia tác vụ (run_depth_tasks)
+        PooledVolume<T> terma(grid_pool, Volume3D<T>());
+        {
+            Profiler::ScopedTimer timer(profiler, "terma", rad_depth.size());
+            *terma = calculate_terma(rad_depth, beam, beam_direction, aperture, weight);
+        }
+        
+        Profiler::ScopedTimer timer(profiler, "cone_transport", electron_density.size());
+        CollapsedConeTransport::transport(
+            electron_density, *terma, *cone_lattice,
+            ConeKernel::for_photon(beam.energy), beam_direction, beam_dose
+        );
+    }
+    
+    // TERMA = μ · Ψ, Ψ suy giảm theo radiological depth và luật bình phương nghịch đảo, tỷ lệ với
+    // fluence của aperture tại hình chiếu phân kỳ (lưới lấy từ grid_pool)
+    template <typename T, typename Aperture>
+    Volume3D<T> calculate_terma(
+        const Volume3D<T>& rad_depth,
+        const Beam& beam,
+        const std::array<double, 3>& beam_direction,
+        const Aperture& aperture,
+        double weight
+    ) {
+        const long depth = static_cast<long>(rad_depth.depth());
+        const long height = static_cast<long>(rad_depth.height());
+        const long width = static_cast<long>(rad_depth.width());
+        const std::array<double, 3>& voxel_size = rad_depth.spacing();
+        
+        // Hệ số suy giảm tuyến tính của nước (1/mm), ~0.0494/cm ở 6 MV
+        const double mu = 0.00494 * std::pow(6.0 / std::max(beam.energy, 0.1), 0.4);
+        
+        Volume3D<T> terma = grid_pool.acquire_like<T>(rad_depth, T(0));
+        
+        const FieldRect& bounds = aperture.bounds();
+        if (bounds.empty()) {
+            return terma;
+        }
+        
+        // Chiếu phân kỳ: chỉ duyệt đoạn voxel có hình chiếu nằm trong vùng mở MLC
+        BeamsEyeView bev(beam.isocenter, beam_direction, voxel_size, source_axis_distance);
+        const std::array<double, 3>& perp_x = bev.perp_x();
+        const std::array<double, 3>& perp_y = bev.perp_y();
+        
+        #pragma omp parallel for collapse(2)
+        for (long z = 0; z < depth; ++z) {
+            for (long y = 0; y < height; ++y) {
+                long x_begin, x_end;
+                if (!bev.row_span(z, y, width, bounds, x_begin, x_end)) {
+                    continue;
+                }
+                T* terma_row = terma.row(z, y);
+                const T* depth_row = rad_depth.row(z, y);
+                for (long x = x_begin; x < x_end; ++x) {
+                    double dx = x * voxel_size[0] - beam.isocenter[0];
+                    double dy = y * voxel_size[1] - beam.isocenter[1];
+                    double dz = z * voxel_size[2] - beam.isocenter[2];
+                    
+                    // Khoảng cách từ nguồn dọc trục chùm tia
+                    double axial = source_axis_distance +
+                        dx * beam_direction[0] + dy * beam_direction[1] + dz * beam_direction[2];
+                    if (axial <= 0.0) {
+                        continue;
+                    }
+                    
+                    // Chiếu phân kỳ về mặt phẳng isocenter để so với MLC
+                    double magnification = source_axis_distance / axial;
+                    double proj_x = (dx * perp_x[0] + dy * perp_x[1] + dz * perp_x[2]) * magnification;
+                    double proj_y = (dx * perp_y[0] + dy * perp_y[1] + dz * perp_y[2]) * magnification;
+                    double open = aperture.value(proj_x, proj_y);
+                    if (open <= 0.0) {
+                        continue;
+                    }
+                    
+                    double fluence = weight * open * magnification * magnification * std::exp(-mu * depth_row[x]);
+                    terma_row[x] = static_cast<T>(mu * fluence);
+                }
+            }
+        }
+        
+        return terma;
+    }
+    
+    // Kiểm tra điểm (proj_x, proj_y) trên mặt phẳng isocenter có nằm trong vùng mở MLC không
+    bool is_inside_aperture(double proj_x, double proj_y, const std::vector<double>& mlc_positions) const {
+        // Đơn giản hóa: kiểm tra voxel có nằm trong hình chữ nhật giới hạn bởi MLC không
+        // Giả sử mlc_positions chứa: [x1_left, x1_right, x2_left, x2_right, ...] cho các cặp lá MLC
+        
+        // Đơn giản hóa: kiểm tra với kích thước trường cố định
+        double field_width = 100.0;  // mm
+        double field_height = 100.0; // mm
+        
+        // Nếu có thông tin MLC, kiểm tra chi tiết hơn
+        if (!mlc_positions.empty()) {
+            // Giả định: số phần tử chẵn với cặp [left, right] cho mỗi lá MLC
+            size_t num_leaves = mlc_positions.size() / 2;
+            
+            // Xác định voxel nằm ở lá thứ mấy
+            double leaf_width = field_height / num_leaves;
+            int leaf_index = static_cast<int>((proj_y + field_height / 2) / leaf_width);
+            
+            // Kiểm tra giới hạn
+            if (leaf_index >= 0 && static_cast<size_t>(leaf_index) < num_leaves) {
+                double left = mlc_positions[2 * leaf_index];
+                double right = mlc_positions[2 * leaf_index + 1];
+                
+                return (proj_x >= left && proj_x <= right);
+            }
+            
+            return false;
+        }
+        // Nếu không có thông tin MLC, sử dụng kích thước trường mặc định
+        return (std::abs(proj_x) <= field_width / 2 && std::abs(proj_y) <= field_height / 2);
+    }
+    
+    // Hình chữ nhật bao vùng mở MLC trên mặt phẳng isocenter (cùng quy ước với is_inside_aperture)
+    FieldRect aperture_bounds(const std::vector<double>& mlc_positions) const {
+        double field_width = 100.0;  // mm
+        double field_height = 100.0; // mm
+        
+        if (mlc_positions.empty()) {
+            return {-field_width / 2, field_width / 2, -field_height / 2, field_height / 2};
+        }
+        
+        FieldRect bounds = {std::numeric_limits<double>::max(), -std::numeric_limits<double>::max(),
+                            std::numeric_limits<double>::max(), -std::numeric_limits<double>::max()};
+        size_t num_leaves = mlc_positions.size() / 2;
+        if (num_leaves == 0) {
+            return bounds;
+        }
+        double leaf_width = field_height / num_leaves;
+        for (size_t leaf = 0; leaf < num_leaves; ++leaf) {
+            double left = mlc_positions[2 * leaf];
+            double right = mlc_positions[2 * leaf + 1];
+            if (right < left) {
+                continue;
+            }
+            bounds.u_min = std::min(bounds.u_min, left);
+            bounds.u_max = std::max(bounds.u_max, right);
+            // is_inside_aperture làm tròn chỉ số lá về 0 nên lá đầu tiên phủ thêm một bề rộng lá phía dưới
+            double leaf_start = (leaf == 0) ? -field_height / 2 - leaf_width : -field_height / 2 + leaf * leaf_width;
+            bounds.v_min = std::min(bounds.v_min, leaf_start);
+            bounds.v_max = std::max(bounds.v_max, -field_height / 2 + (leaf + 1) * leaf_width);
+        }
+        return bounds;
+    }
+};
+
+// Thuật toán Pencil Beam
+class PencilBeam : public DoseAlgorithm {
+private:
+    double source_axis_distance = 1000.0; // SAD (mm)
+    
+public:
+    PencilBeam(double resolution = 0.0) : DoseAlgorithm(resolution) {}
+    
+    // Số chùm tia tối đa giữ trong bộ đệm ray trace (0 = tắt bộ đệm)
+    void set_ray_trace_cache_size(std::size_t max_entries) {
+        depth_caches.set_max_entries(max_entries);
+    }
+    
+    void clear_ray_trace_cache() {
+        depth_caches.clear();
+    }
+    
+    DoseVolume calculate(
+        const CTVolume& ct,
+        const MaskVolume& target_mask,
+        const Plan& plan) override {
+        
+        ScopedProfileSession profile(profiler, grid_pool);
+        ScopedThreadCount thread_guard(num_threads);
+        return calculate_on_dose_grid(ct, target_mask, plan,
+            [this, &ct](const GridGeometry& grid, const StructureMask&, const Plan& grid_plan) {
+                if (precision == StoragePrecision::Float32) {
+                    return calculate_with<float>(ct, grid, grid_plan);
+                }
+                return calculate_with<double>(ct, grid, grid_plan);
+            });
+    }
+    
+    std::string getName() const override {
+        return "Pencil Beam";
+    }
+    
+private:
+    // Mật độ và ray trace lưu kiểu T, liều cộng dồn bằng double
+    template <typename T>
+    DoseVolume calculate_with(
+        const CTVolume& ct,
+        const GridGeometry& grid,
+        const Plan& plan) {
+        
+        const std::array<double, 3>& voxel_size = grid.spacing;
+        
+        // Khởi tạo ma trận liều
+        DoseVolume dose = grid_pool.acquire<double>(grid, 0.0);
+        
+        // Chuyển đổi CT thành mật độ điện tử trên lưới liều (dùng lại nếu CT đã được tính trước đó)
+        std::uint64_t ct_hash = 0;
+        auto density = electron_density_of<T>(ct, grid, ct_hash);
+        const Volume3D<T>& electron_density = *density;
+        
+        // Tính ma trận ray trace cho từng beam (bỏ qua nếu hình học chùm tia đã có trong bộ đệm)
+        // Loại hạt được xác định một lần cho mỗi beam
+        std::vector<std::shared_ptr<const Volume3D<T>>> ray_traces;
+        std::vector<ParticleType> particles;
+        for (const auto& beam : plan.beams) {
+            auto beam_direction = calculate_beam_direction(beam->gantry_angle, beam->couch_angle);
+            ray_traces.push_back(calculate_ray_trace(electron_density, ct_hash, beam, beam_direction));
+            particles.push_back(quangstation::particle_type_from_string(beam->type));
+        }
+        
+        // Mỗi pencil của mỗi beam là một tác vụ, mỗi luồng cộng vào lưới riêng
+        const size_t pencils_per_beam = static_cast<size_t>(num_pencils_x * num_pencils_y);
+        profiler.count("pencils", plan.beams.size() * pencils_per_beam);
+        Profiler::ScopedTimer deposition(profiler, "dose_deposition", grid.size() * plan.beams.size());
+        quangstation::DoseTaskScheduler scheduler(num_threads);
+        scheduler.set_grid_pool(&grid_pool);
+        scheduler.run(plan.beams.size() * pencils_per_beam, dose, [&](size_t t, DoseVolume& accumulator) {
+            const size_t b = t / pencils_per_beam;
+            Profiler::ScopedBeamTimer beam_timer(profiler, plan.beams[b]->id);
+            calculate_pencil_dose(accumulator, *ray_traces[b], plan.beams[b],
+                                  particles[b], static_cast<int>(t % pencils_per_beam), voxel_size);
+        });
+        
+        return dose;
+    }
+    
+    // Tính ma trận ray trace (radiological depth) bằng Siddon, dùng lại kết quả đã đệm nếu có
+    template <typename T>
+    std::shared_ptr<const Volume3D<T>> calculate_ray_trace(
+        const Volume3D<T>& electron_density,
+        std::uint64_t ct_hash,
+        const std::shared_ptr<Beam>& beam,
+        const std::array<double, 3>& beam_direction
+    ) {
+        return radiological_depth(
+            electron_density, ct_hash, beam->gantry_angle, beam->couch_angle,
+            beam->isocenter, beam_direction, source_axis_distance
+        );
+    }
+    
+    // Phân chia trường chùm tia thành các pencil beam
+    static constexpr double field_width = 100.0;  // mm
+    static constexpr double field_height = 100.0; // mm
+    static constexpr int num_pencils_x = 20;      // Số lượng pencil theo chiều X
+    static constexpr int num_pencils_y = 20;      // Số lượng pencil theo chiều Y
+    
+    // Liều của pencil thứ pencil (theo hàng, px chạy nhanh) cộng vào beam_dose
+    template <typename T>
+    void calculate_pencil_dose(
+        DoseVolume& beam_dose,
+        const Volume3D<T>& ray_trace,
+        const std::shared_ptr<Beam>& beam,
+        ParticleType particle,
+        int pencil,
+        const std::array<double, 3>& voxel_size
+    ) {
+        // Tính hướng chùm tia
+        auto beam_direction = calculate_beam_direction(beam->gantry_angle, beam->couch_angle);
+        
+        // Hệ trục beam's-eye-view (chùm song song qua isocenter)
+        BeamsEyeView bev(beam->isocenter, beam_direction, voxel_size);
+        const std::array<double, 3>& perp_x = bev.perp_x();
+        const std::array<double, 3>& perp_y = bev.perp_y();
+        
+        // Bán kính kernel; mỗi pencil chỉ tác động trong 4·sigma quanh trục của nó
+        double sigma_r = pencil_sigma(*beam);
+        
+        double pencil_width = field_width / num_pencils_x;
+        double pencil_height = field_height / num_pencils_y;
+        int px = pencil % num_pencils_x;
+        int py = pencil / num_pencils_x;
+        
+        // Tính tọa độ tâm của pencil beam trong hệ tọa độ trường chùm tia
+        double pencil_center_x = (px + 0.5) * pencil_width - field_width / 2;
+        double pencil_center_y = (py + 0.5) * pencil_height - field_height / 2;
+        
+        // Tính tọa độ tâm pencil beam trong hệ tọa độ thế giới
+        std::array<double, 3> pencil_center = {
+            beam->isocenter[0] + pencil_center_x * perp_x[0] + pencil_center_y * perp_y[0],
+            beam->isocenter[1] + pencil_center_x * perp_x[1] + pencil_center_y * perp_y[1],
+            beam->isocenter[2] + pencil_center_x * perp_x[2] + pencil_center_y * perp_y[2]
+        };
+        
+        FieldRect footprint = {
+            pencil_center_x, pencil_center_x, pencil_center_y, pencil_center_y
+        };
+        
+        // Tính liều từ pencil beam hiện tại cho các voxel trong footprint
+        calculate_single_pencil_beam_dose(
+            beam_dose, ray_trace,
+            beam, particle, pencil_center, beam_direction, perp_x, perp_y,
+            sigma_r, bev, footprint.expanded(4.0 * sigma_r), voxel_size
+        );
+    }
+    
+    // Sigma (mm) phần bán kính của kernel theo loại và năng lượng chùm tia
+    double pencil_sigma(const Beam& beam) const {
+        if (beam.type == "photon") {
+            return 3.0 + 0.5 * beam.energy;  // Đơn giản hóa cho ví dụ
+        } else if (beam.type == "electron") {
+            return 5.0 + 0.3 * beam.energy;
+        } else if (beam.type == "proton") {
+            return 2.0 + 0.2 * beam.energy;
+        }
+        return 3.0;
+    }
+    
+    // Tính liều từ một pencil beam: chọn đường cong độ sâu theo loại hạt rồi chạy vòng lặp voxel chuyên biệt
+    template <typename T>
+    void calculate_single_pencil_beam_dose(
+        DoseVolume& beam_dose,
+        const Volume3D<T>& ray_trace,
+        const std::shared_ptr<Beam>& beam,
+        ParticleType particle,
+        const std::array<double, 3>& pencil_center,
+        const std::array<double, 3>& beam_direction,
+        const std::array<double, 3>& perp_x,
+        const std::array<double, 3>& perp_y,
+        double sigma_r,
+        const BeamsEyeView& bev,
+        const FieldRect& footprint,
+        const std::array<double, 3>& voxel_size
+    ) {
+        switch (particle) {
+            case ParticleType::Photon:
+                accumulate_pencil_dose(beam_dose, ray_trace, DepthDoseCurve<ParticleType::Photon>(beam->energy),
+                                       pencil_center, beam_direction, perp_x, perp_y,
+                                       sigma_r, bev, footprint, voxel_size);
+                break;
+            case ParticleType::Electron:
+                accumulate_pencil_dose(beam_dose, ray_trace, DepthDoseCurve<ParticleType::Electron>(beam->energy),
+                                       pencil_center, beam_direction, perp_x, perp_y,
+                                       sigma_r, bev, footprint, voxel_size);
+                break;
+            case ParticleType::Proton:
+                accumulate_pencil_dose(beam_dose, ray_trace, DepthDoseCurve<ParticleType::Proton>(beam->energy),
+                                       pencil_center, beam_direction, perp_x, perp_y,
+                                       sigma_r, bev, footprint, voxel_size);
+                break;
+            case ParticleType::Other:
+                // Loại hạt không hỗ trợ không đóng góp liều
+                break;
+        }
+    }
+    
+    /**
+     * Liều = Gaussian theo khoảng cách tới trục pencil × đường cong độ sâu × bình
+     * phương nghịch đảo, cộng vào các voxel trong footprint. Vòng lặp trong cùng
+     * không rẽ nhánh và dùng fast_exp nên được vector hóa (omp simd).
+     */
+    template <typename Curve, typename T>
+    void accumulate_pencil_dose(
+        DoseVolume& beam_dose,
+        const Volume3D<T>& ray_trace,
+        const Curve& depth_dose,
+        const std::array<double, 3>& pencil_center,
+        const std::array<double, 3>& beam_direction,
+        const std::array<double, 3>& perp_x,
+        const std::array<double, 3>& perp_y,
+        double sigma_r,
+        const BeamsEyeView& bev,
+        const FieldRect& footprint,
+        const std::array<double, 3>& voxel_size
+    ) {
+        const long depth = static_cast<long>(beam_dose.depth());
+        const long height = static_cast<long>(beam_dose.height());
+        const long width = static_cast<long>(beam_dose.width());
+        
+        const double inv_two_sigma2 = 1.0 / (2 * sigma_r * sigma_r);
+        const double source_distance = 1000.0; // SSD mặc định (mm)
+        
+        // Tính liều cho từng voxel trong footprint của pencil
+        #pragma omp parallel for collapse(2)
+        for (long z = 0; z < depth; ++z) {
+            for (long y = 0; y < height; ++y) {
+                long x_begin, x_end;
+                if (!bev.row_span(z, y, width, footprint, x_begin, x_end)) {
+                    continue;
+                }
+                double* dose_row = beam_dose.row(z, y);
+                const T* trace_row = ray_trace.row(z, y);
+                
+                // Vector từ tâm pencil beam đến voxel: phần chiếu của thành phần y, z cố định trên hàng
+                const double dy = y * voxel_size[1] - pencil_center[1];
+                const double dz = z * voxel_size[2] - pencil_center[2];
+                const double beam_yz = dy * beam_direction[1] + dz * beam_direction[2];
+                const double perp_x_yz = dy * perp_x[1] + dz * perp_x[2];
+                const double perp_y_yz = dy * perp_y[1] + dz * perp_y[2];
+                
+                // Hằng số của hàng đưa vào biến cục bộ để vòng lặp vector hóa được
+                const double spacing_x = voxel_size[0];
+                const double center_x = pencil_center[0];
+                const double beam_x = beam_direction[0];
+                const double perp_x_x = perp_x[0];
+                const double perp_y_x = perp_y[0];
+                const Curve curve = depth_dose;
+                
+                // Chỉ số int: SSE2/AVX2 chỉ có lệnh chuyển int32 -> double dạng vector
+                const int first = static_cast<int>(x_begin);
+                const int last = static_cast<int>(x_end);
+                #pragma omp simd
+                for (int x = first; x < last; ++x) {
+                    const double dx = x * spacing_x - center_x;
+                    
+                    // Chiếu lên hướng chùm tia và các hướng vuông góc
+                    const double proj_beam = dx * beam_x + beam_yz;
+                    const double proj_x = dx * perp_x_x + perp_x_yz;
+                    const double proj_y = dx * perp_y_x + perp_y_yz;
+                    
+                    // Hệ số Gaussian theo khoảng cách vuông góc tới trục pencil
+                    const double r2 = proj_x * proj_x + proj_y * proj_y;
+                    const double pencil_factor = quangstation::fast_exp(-r2 * inv_two_sigma2);
+                    
+                    // Luật bình phương nghịch đảo
+                    const double ratio = source_distance / (source_distance + proj_beam);
+                    
+                    dose_row[x] += pencil_factor * curve(trace_row[x]) * (ratio * ratio);
+                }
+            }
+        }
+    }
+};
+
+// Thuật toán AAA (Anisotropic Analytical Algorithm): liều sơ cấp theo PDD/OAR cộng tích chập tán xạ
+class AAA : public DoseAlgorithm {
+private:
+    bool heterogeneity_correction;
+    int num_photons;
+    double max_scatter_radius;
+    double beta_param; // Scatter kernel beta parameter
+    
+public:
+    AAA(double resolution = 0.0) 
+        : DoseAlgorithm(resolution),
+          heterogeneity_correction(true),
+          num_photons(1000000),
+          max_scatter_radius(50.0),  // mm
+          beta_param(0.0067) {}      // typical value
+    
+    void set_heterogeneity_correction(bool enable) {
+        heterogeneity_correction = enable;
+    }
+    
+    // Hệ số fluence tuyến tính num / 1e6 của liều sơ cấp (và tán xạ). Chuẩn hóa theo liều kê
+    // toa triệt tiêu hệ số này; nó chỉ đổi liều chưa chuẩn hóa (không kê toa, ma trận ảnh hưởng)
+    void set_num_photons(int num) {
+        num_photons = num;
+    }
+    
+    void set_max_scatter_radius(double radius) {
+        max_scatter_radius = radius;
+    }
+    
+    void set_beta_param(double beta) {
+        beta_param = beta;
+    }
+    
+    DoseVolume calculate(
+        const CTVolume& ct,
+        const MaskVolume& target_mask,
+        const Plan& plan) override {
+        
+        // Giới hạn số luồng OpenMP theo num_threads trong suốt lần tính
+        ScopedProfileSession profile(profiler, grid_pool);
+        ScopedThreadCount thread_guard(num_threads);
+        return calculate_on_dose_grid(ct, target_mask, plan,
+            [this, &ct](const GridGeometry& grid, const StructureMask&, const Plan& grid_plan) {
+                if (precision == StoragePrecision::Float32) {
+                    return calculate_with<float>(ct, grid, grid_plan);
+                }
+                return calculate_with<double>(ct, grid, grid_plan);
+            });
+    }
+    
+    std::string getName() const override {
+        return "AAA";
+    }
+    
+private:
+    // Một control point: góc gantry, vị trí MLC và trọng số
+    struct ControlPoint {
+        double gantry_angle;
+        std::vector<double> mlc_positions;
+        double weight;
+    };
+    
+    double source_axis_distance = 1000.0; // SAD (mm)
+    double scatter_fraction = 0.3;        // Tỷ lệ năng lượng tán xạ so với sơ cấp
+    KernelConvolver convolver;
+    
+    // Khóa mật độ của lưới nước đồng nhất (trộn với hash của lưới)
+    static constexpr std::uint64_t kWaterDensityKey = 0x7761746572ULL;  // "water"
+    
+    // Mật độ, depth map và liều sơ cấp từng control point lưu kiểu T; liều cộng dồn bằng double
+    template <typename T>
+    DoseVolume calculate_with(
+        const CTVolume& ct,
+        const GridGeometry& grid,
+        const Plan& plan) {
+        
+        // Mật độ điện tử; tắt hiệu chỉnh không đồng nhất thì coi toàn bộ là nước, khóa bộ đệm
+        // depth map suy ra từ hình học lưới (không cần băm nội dung lưới nước)
+        std::uint64_t ct_hash = 0;
+        std::shared_ptr<const Volume3D<T>> density;
+        PooledVolume<T> water = grid_pool.lease<T>(heterogeneity_correction ? GridGeometry() : grid, T(1));
+        if (heterogeneity_correction) {
+            density = electron_density_of<T>(ct, grid, ct_hash);
+        } else {
+            ct_hash = (kWaterDensityKey ^ grid.hash()) * 0x100000001b3ULL;
+        }
+        const Volume3D<T>& electron_density = heterogeneity_correction ? *density : *water;
+        
+        // Liều sơ cấp cộng dồn qua mọi chùm tia và control point
+        PooledVolume<double> primary_dose = grid_pool.lease<double>(grid, 0.0);
+        
+        std::vector<std::pair<const Beam*, ControlPoint>> tasks;
+        for (const auto& beam : plan.beams) {
+            for (auto& cp : control_points(*beam)) {
+                tasks.emplace_back(beam.get(), std::move(cp));
+            }
+        }
+        
+        // Control point độc lập: chia cho các luồng, mỗi luồng cộng vào lưới riêng
+        profiler.count("control_points", tasks.size());
+        {
+            Profiler::ScopedTimer deposition(profiler, "primary_dose", grid.size() * tasks.size());
+            quangstation::DoseTaskScheduler scheduler(num_threads);
+            scheduler.set_grid_pool(&grid_pool);
+            auto geometry = [&](size_t t, DepthGeometry& g) {
+                const Beam& beam = *tasks[t].first;
+                const double gantry_angle = tasks[t].second.gantry_angle;
+                g = {gantry_angle, beam.couch_angle, beam.isocenter,
+                     calculate_beam_direction(gantry_angle, beam.couch_angle)};
+                return true;
+            };
+            run_depth_tasks(scheduler, tasks.size(), *primary_dose, electron_density, ct_hash,
+                            source_axis_distance, geometry,
+                            [&](size_t t, DoseVolume& accumulator, const Volume3D<T>* rad_depth) {
+                const Beam& beam = *tasks[t].first;
+                const ControlPoint& cp = tasks[t].second;
+                Profiler::ScopedBeamTimer beam_timer(profiler, beam.id);
+                PooledVolume<T> cp_primary(grid_pool, calculate_primary_dose(
+                    electron_density, *rad_depth, beam, cp.gantry_angle, cp.mlc_positions
+                ));
+                accumulator.add_scaled(*cp_primary, cp.weight);
+            });
+        }
+        
+        // Kernel tán xạ không phụ thuộc chùm tia: một lượt tích chập cho toàn bộ kế hoạch
+        DoseVolume dose_matrix;
+        {
+            Profiler::ScopedTimer timer(profiler, "scatter_convolution", primary_dose->size());
+            dose_matrix = calculate_scatter_dose(*primary_dose, electron_density);
+        }
+        dose_matrix.add_scaled(*primary_dose);
+        
+        return dose_matrix;
+    }
+    
+    // Danh sách control point của chùm tia (cung VMAT: một mẫu nội suy mỗi gantry_step độ)
+    std::vector<ControlPoint> control_points(const Beam& beam) const {
+        std::vector<ControlPoint> points;
+        if (beam.mlc_positions.empty() || beam.weights.empty()) {
+            return points;
+        }
+        
+        if (beam.is_arc) {
+            for (ArcSample& sample : arc_samples(beam, arc_gantry_step())) {
+                points.push_back({sample.gantry_angle, std::move(sample.mlc_positions), sample.weight});
+            }
+        } else {
+            for (size_t cp = 0; cp < beam.mlc_positions.size(); ++cp) {
+                points.push_back({
+                    beam.gantry_angle,
+                    beam.mlc_positions[cp],
+                    beam.weights[cp % beam.weights.size()]
+                });
+            }
+        }
+        return points;
+    }
+    
+    // Liều sơ cấp của một control point: PDD theo radiological depth, OAR theo khoảng cách ra mép trường
+    // (lưới lấy từ grid_pool; rad_depth dò tia trước khi chia tác vụ, xem run_depth_tasks)
+    template <typename T>
+    Volume3D<T> calculate_primary_dose(
+        const Volume3D<T>& electron_density,
+        const Volume3D<T>& rad_depth,
+        const Beam& beam,
+        double gantry_angle,
+        const std::vector<double>& mlc_positions) {
+        
+        const long depth = static_cast<long>(electron_density.depth());
+        const long height = static_cast<long>(electron_density.height());
+        const long width = static_cast<long>(electron_density.width());
+        const std::array<double, 3>& voxel_size = electron_density.spacing();
+        
+        std::array<double, 3> beam_direction = calculate_beam_direction(gantry_angle, beam.couch_angle);
+        
+        std::array<double, 3> perp_x, perp_y;
+        RayTracer::perpendicular_basis(beam_direction, perp_x, perp_y);
+        
+        // Fluence tương đối theo số photon nguồn (tham chiếu 1e6 photon)
+        const double fluence = num_photons / 1.0e6;
+        
+        Volume3D<T> primary = grid_pool.acquire_like<T>(electron_density, T(0));
+        
+        #pragma omp parallel for collapse(2)
+        for (long z = 0; z < depth; ++z) {
+            for (long y = 0; y < height; ++y) {
+                T* primary_row = primary.row(z, y);
+                const T* depth_row = rad_depth.row(z, y);
+                for (long x = 0; x < width; ++x) {
+                    double dx = x * voxel_size[0] - beam.isocenter[0];
+                    double dy = y * voxel_size[1] - beam.isocenter[1];
+                    double dz = z * voxel_size[2] - beam.isocenter[2];
+                    
+                    double axial = source_axis_distance +
+                        dx * beam_direction[0] + dy * beam_direction[1] + dz * beam_direction[2];
+                    if (axial <= 0.0 || depth_row[x] <= 0.0) {
+                        continue;
+                    }
+                    
+                    // Chiếu phân kỳ về mặt phẳng isocenter
+                    double magnification = source_axis_distance / axial;
+                    double proj_x = (dx * perp_x[0] + dy * perp_x[1] + dz * perp_x[2]) * magnification;
+                    double proj_y = (dx * perp_y[0] + dy * perp_y[1] + dz * perp_y[2]) * magnification;
+                    
+                    double edge_distance = distance_outside_aperture(proj_x, proj_y, mlc_positions);
+                    double oar = calculate_oar(edge_distance, depth_row[x]);
+                    if (oar < 1e-6) {
+                        continue;
+                    }
+                    
+                    primary_row[x] = static_cast<T>(fluence * magnification * magnification *
+                        calculate_pdd(depth_row[x], beam.energy) * oar);
+                }
+            }
+        }
+        
+        return primary;
+    }
+    
+    /**
+     * Liều tán xạ: tích chập liều sơ cấp với kernel exp(-beta·r), r < max_scatter_radius.
+     * Kernel không tách được nên dùng FFT (phổ giữ cùng kernel trong bộ đệm kernel); chỉ vùng
+     * bao quanh các voxel sơ cấp khác 0 (mở rộng thêm bán kính tán xạ) được tính.
+     */
+    template <typename T>
+    DoseVolume calculate_scatter_dose(
+        const DoseVolume& primary_dose,
+        const Volume3D<T>& electron_density) {
+        
+        DoseVolume scatter_dose = grid_pool.acquire_like<double>(primary_dose, 0.0);
+        const std::array<double, 3>& spacing = primary_dose.spacing();
+        
+        // Hộp bao các voxel sơ cấp khác 0
+        const long depth = static_cast<long>(primary_dose.depth());
+        const long height = static_cast<long>(primary_dose.height());
+        const long width = static_cast<long>(primary_dose.width());
+        std::array<long, 3> lo = {width, height, depth};
+        std::array<long, 3> hi = {-1, -1, -1};
+        for (long z = 0; z < depth; ++z) {
+            for (long y = 0; y < height; ++y) {
+                const double* row = primary_dose.row(z, y);
+                for (long x = 0; x < width; ++x) {
+                    if (row[x] > 0.0) {
+                        lo = {std::min(lo[0], x), std::min(lo[1], y), std::min(lo[2], z)};
+                        hi = {std::max(hi[0], x), std::max(hi[1], y), std::max(hi[2], z)};
+                    }
+                }
+            }
+        }
+        if (hi[0] < 0 || scatter_fraction <= 0.0) {
+            return scatter_dose;
+        }
+        
+        // Kernel lập phương, nửa cạnh đủ phủ max_scatter_radius theo trục có spacing nhỏ nhất
+        double min_spacing = std::min(std::min(spacing[0], spacing[1]), spacing[2]);
+        int half = std::max(1, static_cast<int>(std::ceil(max_scatter_radius / min_spacing)));
+        auto kernel = quangstation::DoseKernelCache::instance().scatter_kernel(
+            spacing, max_scatter_radius, beta_param, scatter_fraction);
+        
+        // Mở rộng hộp bao theo bán kính tán xạ (theo số voxel của từng trục)
+        std::array<long, 3> reach;
+        for (int a = 0; a < 3; ++a) {
+            reach[a] = std::min(static_cast<long>(half),
+                                static_cast<long>(std::ceil(max_scatter_radius / spacing[a])));
+        }
+        std::array<long, 3> dims = {width, height, depth};
+        for (int a = 0; a < 3; ++a) {
+            lo[a] = std::max(0L, lo[a] - reach[a]);
+            hi[a] = std::min(dims[a] - 1, hi[a] + reach[a]);
+        }
+        
+        // Nguồn tán xạ trong vùng con; hiệu chỉnh không đồng nhất: năng lượng tán xạ tỷ lệ mật độ
+        PooledVolume<double> source(grid_pool, grid_pool.acquire<double>(
+            hi[2] - lo[2] + 1, hi[1] - lo[1] + 1, hi[0] - lo[0] + 1, 0.0, spacing));
+        #pragma omp parallel for collapse(2)
+        for (long z = lo[2]; z <= hi[2]; ++z) {
+            for (long y = lo[1]; y <= hi[1]; ++y) {
+                const double* primary_row = primary_dose.row(z, y);
+                const T* density_row = electron_density.row(z, y);
+                double* source_row = source->row(z - lo[2], y - lo[1]);
+                for (long x = lo[0]; x <= hi[0]; ++x) {
+                    double value = primary_row[x];
+                    if (heterogeneity_correction) {
+                        value *= density_row[x];
+                    }
+                    source_row[x - lo[0]] = value;
+                }
+            }
+        }
+        
+        PooledVolume<double> scattered(grid_pool, convolver.correlate(*source, *kernel, half, &grid_pool));
+        
+        for (long z = lo[2]; z <= hi[2]; ++z) {
+            for (long y = lo[1]; y <= hi[1]; ++y) {
+                double* scatter_row = scatter_dose.row(z, y);
+                const double* src_row = scattered->row(z - lo[2], y - lo[1]);
+                for (long x = lo[0]; x <= hi[0]; ++x) {
+                    scatter_row[x] = src_row[x - lo[0]];
+                }
+            }
+        }
+        
+        return scatter_dose;
+    }
+    
+    double calculate_pdd(double depth_mm, double energy) {
+        // Triển khai hàm tính phần trăm liều sâu (Percent Depth Dose)
+        // Đây là cách đơn giản, trong thực tế có thể phức tạp hơn
+        double d0 = 10.0;  // độ sâu tham chiếu (mm)
+        double mu = 0.005 * energy + 0.05;  // hệ số suy giảm (1/cm)
+        
+        return exp(-mu * (depth_mm - d0) / 10.0);
+    }
+    
+    double calculate_oar(double radial_dist, double depth_mm) {
+        // Triển khai hàm tính tỷ lệ không khí ngoài trục (Off-Axis Ratio)
+        // radial_dist: khoảng cách ra ngoài mép trường (0 trong trường)
+        double sigma = 5.0 + 0.5 * depth_mm / 10.0;  // độ rộng gaussian
+        return exp(-radial_dist * radial_dist / (2 * sigma * sigma));
+    }
+    
+    // Khoảng cách (mm, mặt phẳng isocenter) từ điểm tới vùng mở MLC, 0 nếu nằm trong
+    double distance_outside_aperture(double proj_x, double proj_y, const std::vector<double>& mlc_positions) const {
+        double field_width = 100.0;  // mm
+        double field_height = 100.0; // mm
+        
+        auto interval_distance = [](double v, double lo, double hi) {
+            return (v < lo) ? lo - v : (v > hi) ? v - hi : 0.0;
+        };
+        
+        if (mlc_positions.size() < 2) {
+            double ddx = interval_distance(proj_x, -field_width / 2, field_width / 2);
+            double ddy = interval_distance(proj_y, -field_height / 2, field_height / 2);
+            return std::sqrt(ddx * ddx + ddy * ddy);
+        }
+        
+        // Cặp lá [left, right], xếp đều theo trục y của trường
+        size_t num_leaves = mlc_positions.size() / 2;
+        double leaf_width = field_height / num_leaves;
+        long leaf_index = static_cast<long>(std::floor((proj_y + field_height / 2) / leaf_width));
+        long nearest = std::max(0L, std::min(leaf_index, static_cast<long>(num_leaves) - 1));
+        
+        double ddy = interval_distance(proj_y, -field_height / 2, field_height / 2);
+        double left = mlc_positions[2 * nearest];
+        double right = mlc_positions[2 * nearest + 1];
+        double ddx = (right > left) ? interval_distance(proj_x, left, right) : field_width;
+        return std::sqrt(ddx * ddx + ddy * ddy);
+    }
+};
+
+/**
+ * Monte Carlo: vận chuyển từng history photon/electron trên lưới mật độ điện tử và
+ * mật độ khối của bảng HU-ED (xem MonteCarloTransport). Các history chạy song song
+ * theo lô; mỗi history có dòng số ngẫu nhiên Philox riêng theo (seed, chỉ số history)
+ * nên cùng seed và cùng số history cho cùng kết quả với mọi số luồng (sai khác chỉ ở
+ * thứ tự cộng số thực). Sau mỗi lô, độ không chắc chắn tương đối của liều trung bình
+ * được ước lượng từ phương sai giữa các lô trên các voxel của PTV (không có PTV: các
+ * voxel >= 50% liều cực đại); dừng sớm khi đạt target_uncertainty.
+ *
+ * Nguồn điểm cách isocenter SAD; vị trí trên mặt phẳng isocenter lấy mẫu đều trong
+ * hình chữ nhật bao khẩu độ, trọng số history là fluence tại điểm đó (cùng mô hình lá
+ * với ApertureFluence, wedge như hệ số fluence của apply_wedge_modulation). Phổ photon
+ * tam giác giảm dần trên [0.2 MeV, năng lượng danh định], electron đơn năng. Liều cho
+ * môi trường (Gy) với trọng số 1 tương ứng photons_per_mm2 hạt/mm² tại isocenter; voxel
+ * không khí không được tính liều.
+ */
+class MonteCarlo : public DoseAlgorithm {
+public:
+    MonteCarlo(double resolution = 0.0) : DoseAlgorithm(resolution) {}
+    
+    // Số history tối đa của một lần tính, chia đều cho các lô
+    void set_num_histories(std::uint64_t histories) {
+        if (histories == 0) {
+            throw std::invalid_argument("Số history phải dương");
+        }
+        num_histories = histories;
+    }
+    
+    std::uint64_t get_num_histories() const {
+        return num_histories;
+    }
+    
+    // Cùng tên với AAA để dose_engine_wrapper đặt được qua tùy chọn num_photons
+    void set_num_photons(int num) {
+        set_num_histories(static_cast<std::uint64_t>(std::max(num, 1)));
+    }
+    
+    // Số lô (ít nhất 2 để ước lượng được phương sai)
+    void set_num_batches(int batches) {
+        if (batches < 2) {
+            throw std::invalid_argument("Số lô Monte Carlo phải ít nhất là 2");
+        }
+        num_batches = batches;
+    }
+    
+    // Độ không chắc chắn tương đối mục tiêu (0.02 = 2%); <= 0: luôn chạy hết số history
+    void set_target_uncertainty(double uncertainty) {
+        target_uncertainty = uncertainty;
+    }
+    
+    void set_seed(std::uint64_t value) {
+        seed = value;
+    }
+    
+    /**
+     * photon_splitting bản sao cho mỗi photon sơ cấp; photon thứ cấp của các bản sao
+     * qua Russian roulette với xác suất sống roulette_survival (< 0: 1 / photon_splitting).
+     * (1, 1) tắt giảm phương sai.
+     */
+    void set_variance_reduction(int photon_splitting, double roulette_survival = -1.0) {
+        if (photon_splitting < 1) {
+            throw std::invalid_argument("Số bản sao photon phải ít nhất là 1");
+        }
+        if (roulette_survival < 0.0) {
+            roulette_survival = 1.0 / photon_splitting;
+        }
+        if (!(roulette_survival > 0.0) || roulette_survival > 1.0) {
+            throw std::invalid_argument("Xác suất sống của Russian roulette phải trong (0, 1]");
+        }
+        transport_options.photon_splitting = photon_splitting;
+        transport_options.roulette_survival = roulette_survival;
+    }
+    
+    // Ngưỡng năng lượng (MeV) dưới đó photon / electron lắng đọng tại chỗ
+    void set_cutoffs(double photon_cutoff, double electron_cutoff) {
+        if (!(photon_cutoff > 0.0) || !(electron_cutoff > 0.0)) {
+            throw std::invalid_argument("Ngưỡng năng lượng phải dương");
+        }
+        transport_options.photon_cutoff = photon_cutoff;
+        transport_options.electron_cutoff = electron_cutoff;
+    }
+    
+    // Độ không chắc chắn tương đối, số history và số lô của lần tính gần nhất
+    double get_last_uncertainty() const {
+        return last_uncertainty;
+    }
+    
+    std::uint64_t get_last_histories() const {
+        return last_histories;
+    }
+    
+    int get_last_batches() const {
+        return last_batches;
+    }
+    
+    DoseVolume calculate(
+        const CTVolume& ct,
+        const MaskVolume& target_mask,
+        const Plan& plan) override {
+        
+        ScopedProfileSession profile(profiler, grid_pool);
+        ScopedThreadCount thread_guard(num_threads);
+        return calculate_on_dose_grid(ct, target_mask, plan,
+            [this, &ct](const GridGeometry& grid, const StructureMask& grid_mask, const Plan& grid_plan) {
+                if (precision == StoragePrecision::Float32) {
+                    return calculate_with<float>(ct, grid, grid_mask, grid_plan);
+                }
+                return calculate_with<double>(ct, grid, grid_mask, grid_plan);
+            });
+    }
+    
+    std::string getName() const override {
+        return "Monte Carlo";
+    }
+    
+private:
+    // Một nguồn: một chùm tia tĩnh (fluence cộng mọi control point) hoặc một mẫu của cung
+    struct Source {
+        bool electron;
+        double energy;                      // MV (photon) hoặc MeV (electron)
+        std::array<double, 3> position;     // Nguồn điểm (mm, tọa độ lưới liều)
+        std::array<double, 3> isocenter;
+        std::array<double, 3> perp_x, perp_y;
+        std::shared_ptr<const ApertureFluence> fluence;
+        double fluence_max;                 // Cận trên của fluence (tổng |trọng số|)
+        bool has_wedge;
+        std::array<double, 3> wedge_direction;
+        double cos_wedge;
+    };
+    
+    static constexpr double source_axis_distance = 1000.0;  // SAD (mm)
+    static constexpr double photons_per_mm2 = 1.0e9;       // Hạt/mm² tại isocenter cho trọng số 1
+    static constexpr std::size_t histories_per_task = 1024;
+    
+    std::uint64_t num_histories = 10000000;
+    int num_batches = 10;
+    double target_uncertainty = 0.02;
+    std::uint64_t seed = 1;
+    MonteCarloOptions transport_options;
+    double last_uncertainty = 0.0;
+    std::uint64_t last_histories = 0;
+    int last_batches = 0;
+    
+    template <typename T>
+    DoseVolume calculate_with(
+        const CTVolume& ct,
+        const GridGeometry& grid,
+        const StructureMask& target_mask,
+        const Plan& plan) {
+        
+        DoseVolume dose = grid_pool.acquire<double>(grid, 0.0);
+        last_uncertainty = 0.0;
+        last_histories = 0;
+        last_batches = 0;
+        
+        // Chọn nguồn theo cường độ (diện tích hình chữ nhật bao × cận trên fluence)
+        std::vector<Source> sources = build_sources(plan);
+        std::vector<double> cumulative;
+        double total_strength = 0.0;
+        for (const Source& source : sources) {
+            const FieldRect& bounds = source.fluence->bounds();
+            total_strength += (bounds.u_max - bounds.u_min) * (bounds.v_max - bounds.v_min) * source.fluence_max;
+            cumulative.push_back(total_strength);
+        }
+        if (sources.empty() || !(total_strength > 0.0)) {
+            return dose;
+        }
+        
+        std::uint64_t ct_hash = 0;
+        auto electron_density = electron_density_of<T>(ct, grid, ct_hash);
+        auto mass_density = mass_density_of<T>(ct, grid, ct_hash);
+        const MonteCarloTransport<T> transport(*electron_density, *mass_density, transport_options);
+        
+        // Năng lượng (MeV) của một lô -> liều (Gy): 1.602e-13 J/MeV / (ρ · V · 1e-6 kg)
+        const std::uint64_t batch_histories = (num_histories + num_batches - 1) / num_batches;
+        PooledVolume<double> to_dose = grid_pool.lease<double>(grid, 0.0);
+        {
+            const double voxel_volume = grid.spacing[0] * grid.spacing[1] * grid.spacing[2];
+            const double fluence_scale = total_strength * photons_per_mm2 / batch_histories;
+            const T* rho = mass_density->data();
+            double* factor = to_dose->data();
+            const long n = static_cast<long>(grid.size());
+            #pragma omp parallel for schedule(static)
+            for (long i = 0; i < n; ++i) {
+                if (rho[i] >= MonteCarloTransport<T>::min_scoring_density) {
+                    factor[i] = fluence_scale * 1.602176634e-7 / (rho[i] * voxel_volume);
+                }
+            }
+        }
+        
+        PooledVolume<double> sum_sq = grid_pool.lease<double>(grid, 0.0);
+        PooledVolume<double> batch = grid_pool.lease<double>(grid, 0.0);
+        const std::size_t num_tasks = static_cast<std::size_t>(
+            (batch_histories + histories_per_task - 1) / histories_per_task);
+        quangstation::DoseTaskScheduler scheduler(num_threads);
+        scheduler.set_grid_pool(&grid_pool);
+        
+        int batches = 0;
+        for (int b = 0; b < num_batches; ++b) {
+            std::fill(batch->begin(), batch->end(), 0.0);
+            const std::uint64_t first = static_cast<std::uint64_t>(b) * batch_histories;
+            {
+                Profiler::ScopedTimer timer(profiler, "transport");
+                scheduler.run(num_tasks, *batch, [&](size_t t, DoseVolume& accumulator) {
+                    std::vector<MonteCarloParticle> stack;
+                    const std::uint64_t begin = t * histories_per_task;
+                    const std::uint64_t end = std::min<std::uint64_t>(begin + histories_per_task, batch_histories);
+                    for (std::uint64_t h = begin; h < end; ++h) {
+                        PhiloxStream rng(seed, first + h);
+                        MonteCarloParticle particle;
+                        if (sample_primary(sources, cumulative, rng, particle)) {
+                            transport.transport(particle, rng, accumulator, stack);
+                        }
+                    }
+                });
+            }
+            
+            // Năng lượng -> liều, cộng vào tổng và tổng bình phương của các lô
+            Profiler::ScopedTimer scoring(profiler, "scoring", grid.size());
+            const long n = static_cast<long>(grid.size());
+            double* d = dose.data();
+            double* d2 = sum_sq->data();
+            double* e = batch->data();
+            const double* factor = to_dose->data();
+            #pragma omp parallel for schedule(static)
+            for (long i = 0; i < n; ++i) {
+                const double value = e[i] * factor[i];
+                d[i] += value;
+                d2[i] += value * value;
+            }
+            batches = b + 1;
+            
+            if (target_uncertainty > 0.0 && batches >= std::min(4, num_batches)) {
+                last_uncertainty = relative_uncertainty(dose, *sum_sq, batches, target_mask);
+                if (last_uncertainty <= target_uncertainty) {
+                    break;
+                }
+            }
+        }
+        if (target_uncertainty <= 0.0 || batches < std::min(4, num_batches)) {
+            last_uncertainty = relative_uncertainty(dose, *sum_sq, batches, target_mask);
+        }
+        last_batches = batches;
+        last_histories = static_cast<std::uint64_t>(batches) * batch_histories;
+        profiler.count("batches", last_batches);
+        profiler.count("histories", last_histories);
+        
+        dose.scale(1.0 / batches);
+        return dose;
+    }
+    
+    // Danh sách nguồn của kế hoạch. Cung VMAT: mỗi mẫu aperture_step độ là một nguồn ở
+    // đúng góc gantry của nó (Monte Carlo không có depth map để dùng lại theo sector)
+    std::vector<Source> build_sources(const Plan& plan) const {
+        std::vector<Source> sources;
+        for (const auto& beam : plan.beams) {
+            const bool electron = beam->type == "electron";
+            if (!electron && beam->type != "photon") {
+                throw std::invalid_argument("Monte Carlo chỉ hỗ trợ chùm photon và electron: " + beam->type);
+            }
+            if (beam->mlc_positions.empty() || beam->weights.empty()) {
+                continue;
+            }
+            
+            if (beam->is_arc) {
+                for (const ArcSample& sample : arc_samples(*beam, arc_sampling.aperture_step)) {
+                    auto fluence = std::make_shared<ApertureFluence>(sample.mlc_positions.size() / 2);
+                    fluence->add(sample.mlc_positions, sample.weight);
+                    fluence->finalize();
+                    add_source(sources, *beam, electron, sample.gantry_angle, fluence, std::abs(sample.weight), false);
+                }
+                continue;
+            }
+            
+            // Chùm tia tĩnh: control point cùng số cặp lá cộng chung một fluence
+            std::map<std::size_t, std::pair<std::shared_ptr<ApertureFluence>, double>> by_leaves;
+            for (size_t cp = 0; cp < beam->mlc_positions.size(); ++cp) {
+                const std::vector<double>& mlc = beam->mlc_positions[cp];
+                const double weight = beam->weights[cp % beam->weights.size()];
+                auto& entry = by_leaves[mlc.size() / 2];
+                if (!entry.first) {
+                    entry.first = std::make_shared<ApertureFluence>(mlc.size() / 2);
+                }
+                entry.first->add(mlc, weight);
+                entry.second += std::abs(weight);
+            }
+            for (auto& entry : by_leaves) {
+                entry.second.first->finalize();
+                add_source(sources, *beam, electron, beam->gantry_angle, entry.second.first,
+                           entry.second.second, beam->has_wedge);
+            }
+        }
+        return sources;
+    }
+    
+    void add_source(std::vector<Source>& sources, const Beam& beam, bool electron, double gantry_angle,
+                    const std::shared_ptr<const ApertureFluence>& fluence, double fluence_max, bool has_wedge) const {
+        if (fluence->bounds().empty() || !(fluence_max > 0.0)) {
+            return;
+        }
+        Source source;
+        source.electron = electron;
+        source.energy = beam.energy;
+        const std::array<double, 3> direction = calculate_beam_direction(gantry_angle, beam.couch_angle);
+        for (int a = 0; a < 3; ++a) {
+            source.position[a] = beam.isocenter[a] - source_axis_distance * direction[a];
+        }
+        source.isocenter = beam.isocenter;
+        RayTracer::perpendicular_basis(direction, source.perp_x, source.perp_y);
+        source.fluence = fluence;
+        source.fluence_max = fluence_max;
+        source.has_wedge = has_wedge;
+        const double orientation_rad = beam.wedge_orientation * M_PI / 180.0;
+        source.wedge_direction = {cos(orientation_rad), 0.0, sin(orientation_rad)};
+        source.cos_wedge = cos(beam.wedge_angle * M_PI / 180.0);
+        sources.push_back(source);
+    }
+    
+    // Hạt nguồn của một history; false nếu điểm lấy mẫu nằm ngoài khẩu độ
+    bool sample_primary(const std::vector<Source>& sources, const std::vector<double>& cumulative,
+                        PhiloxStream& rng, MonteCarloParticle& particle) const {
+        const double pick = rng.uniform() * cumulative.back();
+        const std::size_t s = std::min<std::size_t>(
+            std::upper_bound(cumulative.begin(), cumulative.end(), pick) - cumulative.begin(), sources.size() - 1);
+        const Source& source = sources[s];
+        const FieldRect& bounds = source.fluence->bounds();
+        const double u = bounds.u_min + (bounds.u_max - bounds.u_min) * rng.uniform();
+        const double v = bounds.v_min + (bounds.v_max - bounds.v_min) * rng.uniform();
+        double weight = source.fluence->value(u, v) / source.fluence_max;
+        if (weight == 0.0) {
+            return false;
+        }
+        
+        std::array<double, 3> target;
+        for (int a = 0; a < 3; ++a) {
+            target[a] = source.isocenter[a] + u * source.perp_x[a] + v * source.perp_y[a];
+        }
+        if (source.has_wedge) {
+            // Như apply_wedge_modulation, tính tại điểm qua mặt phẳng isocenter
+            double projection = 0.0;
+            for (int a = 0; a < 3; ++a) {
+                projection += (target[a] - source.isocenter[a]) * source.wedge_direction[a];
+            }
+            weight *= std::max(0.1, 1.0 - (1.0 - source.cos_wedge) * projection / 100.0);
+        }
+        
+        std::array<double, 3> direction;
+        double magnitude = 0.0;
+        for (int a = 0; a < 3; ++a) {
+            direction[a] = target[a] - source.position[a];
+            magnitude += direction[a] * direction[a];
+        }
+        magnitude = std::sqrt(magnitude);
+        for (int a = 0; a < 3; ++a) {
+            direction[a] /= magnitude;
+        }
+        
+        double energy = source.energy;
+        if (!source.electron) {
+            // Phổ tam giác: mật độ xác suất giảm tuyến tính về 0 tại năng lượng danh định
+            const double low = std::min(0.2, 0.5 * source.energy);
+            energy = source.energy - (source.energy - low) * std::sqrt(rng.uniform());
+        }
+        particle = {source.electron, true, energy, weight, source.position, direction};
+        return true;
+    }
+    
+    // Trung bình độ không chắc chắn tương đối (độ lệch chuẩn của liều trung bình / liều) trên
+    // PTV, hoặc trên các voxel >= 50% liều cực đại nếu không có PTV; sum, sum_sq theo lô
+    double relative_uncertainty(const DoseVolume& sum, const DoseVolume& sum_sq, int batches,
+                                const StructureMask& target_mask) const {
+        if (batches < 2) {
+            return std::numeric_limits<double>::infinity();
+        }
+        const std::size_t n = sum.size();
+        const double* s = sum.data();
+        const double* s2 = sum_sq.data();
+        double total = 0.0;
+        std::size_t count = 0;
+        auto accumulate = [&](std::size_t i) {
+            if (s[i] <= 0.0) {
+                return;
+            }
+            const double mean = s[i] / batches;
+            const double variance = std::max(0.0, s2[i] / batches - mean * mean) / (batches - 1);
+            total += std::sqrt(variance) / mean;
+            ++count;
+        };
+        if (target_mask.same_shape(sum)) {
+            target_mask.for_each_voxel(accumulate);
+        } else {
+            double threshold = 0.0;
+            for (std::size_t i = 0; i < n; ++i) {
+                threshold = std::max(threshold, s[i]);
+            }
+            threshold *= 0.5;
+            for (std::size_t i = 0; i < n; ++i) {
+                if (s[i] >= threshold) {
+                    accumulate(i);
+                }
+            }
+        }
+        return count > 0 ? total / count : 0.0;
+    }
+    
+    // Mật độ khối của ct trên lưới grid, đệm riêng với mật độ điện tử theo cùng density_key
+    // (khóa của lưới, xem electron_density_of); lưới khác lưới CT lấy mẫu lại từ lưới CT
+    template <typename T>
+    std::shared_ptr<const Volume3D<T>> mass_density_of(
+        const CTVolume& ct, const GridGeometry& grid, std::uint64_t density_key) {
+        
+        auto& cache = quangstation::DensityCaches::instance().get<T>(quangstation::DensityKind::Mass);
+        if (auto cached = cache.find(density_key)) {
+            profiler.count("density_cache_hits");
+            return cached;
+        }
+        profiler.count("density_cache_misses");
+        const GridGeometry ct_grid = GridGeometry::of(ct);
+        std::shared_ptr<const Volume3D<T>> source;
+        if (!(grid == ct_grid)) {
+            source = mass_density_of<T>(ct, ct_grid, hu_to_ed.density_key(ct_content_hash(ct)));
+        }
+        Profiler::ScopedTimer timer(profiler, "hu_to_mass_density", grid.size());
+        auto density = source
+            ? std::make_shared<const Volume3D<T>>(quangstation::resample_trilinear<T>(*source, grid))
+            : std::make_shared<const Volume3D<T>>(hu_to_ed.mass_density_volume<T>(ct));
+        cache.insert(density_key, density);
+        return density;
+    }
+};
+
+#endif // QUANGSTATION_DOSE_ENGINE_H
@@ -17,7 +17,7 @@ from quangstation.core.utils.logging import get_logger
 logger = get_logger(__name__)
 
 try:
-    from quangstation.clinical.dose_calculation._dose_engine import CollapsedConeConvolution, PencilBeam, AAA, AcurosXB
+    from quangstation.clinical.dose_calculation._dose_engine import CollapsedConeConvolution, PencilBeam, AAA
     HAS_CPP_MODULE = True
 except ImportError:
     HAS_CPP_MODULE = False
@@ -36,6 +36,16 @@ class DoseCalculator:
     ALGO_MONTE_CARLO = "monte_carlo"
     ALGO_GRID_BASED = "grid_based"
     ALGO_CONVOLUTION = "convolution_superposition"
+
+    # Module C++ và lớp tương ứng với từng thuật toán; các thuật toán khác
+    # (acuros_xb, grid_based, convolution_superposition) chỉ có bản Python
+    CPP_MODULE = "quangstation.clinical.dose_calculation._dose_engine"
+    CPP_ALGORITHM_CLASSES = {
+        ALGO_COLLAPSED_CONE: "CollapsedConeConvolution",
+        ALGO_PENCIL_BEAM: "PencilBeam",
+        ALGO_AAA: "AAA",
+        ALGO_MONTE_CARLO: "MonteCarlo",
+    }
     
     def __init__(self, algorithm: str = ALGO_COLLAPSED_CONE, resolution_mm: float = 3.0):
         """
@@ -57,6 +67,12 @@ class DoseCalculator:
         self.options = {}
         self.advanced_algorithm = None
         self.use_cpp = True  # Mặc định sẽ cố gắng sử dụng module C++ nếu có
+        self.profile_stats = None  # Thời gian/bộ đếm của lần tính C++ gần nhất
+        self.calculation_info = {}
+        # Thuật toán C++ giữ lại giữa các lần tính (bộ đệm depth map, pool lưới),
+        # dựng lại khi đổi thuật toán hoặc lưới liều
+        self._cpp_algorithm = None
+        self._cpp_algorithm_key = None
         
         logger.info(f"Khởi tạo bộ tính toán liều với thuật toán {algorithm}, "
                     f"độ phân giải {resolution_mm} mm")
@@ -138,7 +154,7 @@ class DoseCalculator:
             beam_data: Thông tin chùm tia
         """
         getattr(self, "beams", {}).append(beam_data.copy())
-        logger.info(f"Đã thêm chùm tia {beam_data.get('id', len(getattr(self, "beams", {})))}")
+        logger.info(f"Đã thêm chùm tia {beam_data.get('id', len(self.beams))}")
         
         # Thêm chùm tia vào thuật toán tiên tiến nếu đã được khởi tạo
         if self.advanced_algorithm is not None:
@@ -267,35 +283,15 @@ class DoseCalculator:
         Returns:
             bool: True nếu có extension C++, False nếu không
         """
+        class_name = self.CPP_ALGORITHM_CLASSES.get(self.algorithm)
+        if class_name is None:
+            logger.info(f"Thuật toán {self.algorithm} chỉ có bản Python "
+                        f"(C++ hỗ trợ: {', '.join(self.CPP_ALGORITHM_CLASSES)}), sẽ sử dụng Python thuần túy")
+            return False
+
         try:
-            if self.algorithm == self.ALGO_COLLAPSED_CONE:
-                module_name = "quangstation.dose_calculation._dose_engine"
-                class_name = "CollapsedConeConvolution"
-            elif self.algorithm == self.ALGO_PENCIL_BEAM:
-                module_name = "quangstation.dose_calculation._dose_engine"
-                class_name = "PencilBeam"
-            elif self.algorithm == self.ALGO_AAA:
-                module_name = "quangstation.dose_calculation._dose_engine"
-                class_name = "AAA"
-            elif self.algorithm == self.ALGO_ACUROS_XB:
-                module_name = "quangstation.dose_calculation._dose_engine"
-                class_name = "AcurosXB"
-            elif self.algorithm == self.ALGO_MONTE_CARLO:
-                module_name = "quangstation.dose_calculation._dose_engine"
-                class_name = "MonteCarlo"
-            elif self.algorithm == self.ALGO_GRID_BASED:
-                module_name = "quangstation.dose_calculation._dose_engine"
-                class_name = "GridBased"
-            elif self.algorithm == self.ALGO_CONVOLUTION:
-                module_name = "quangstation.dose_calculation._dose_engine"
-                class_name = "ConvolutionSuperposition"
-            else:
-                logger.warning(f"Thuật toán không rõ: {self.algorithm}. Thử truy cập module base.")
-                module_name = "quangstation.dose_calculation._dose_engine"
-                class_name = "DoseAlgorithm"
-            
             # Thử import module và lớp
-            module = importlib.import_module(module_name)
+            module = importlib.import_module(self.CPP_MODULE)
             getattr(module, class_name)
             
             # Nếu không lỗi, có extension C++
@@ -321,22 +317,9 @@ class DoseCalculator:
         """
         try:
             # Kiểm tra module C++ tương ứng
-            if self.algorithm == self.ALGO_COLLAPSED_CONE:
-                module_name = "quangstation.dose_calculation._dose_engine"
-                class_name = "CollapsedConeConvolution"
-            elif self.algorithm == self.ALGO_PENCIL_BEAM:
-                module_name = "quangstation.dose_calculation._dose_engine"
-                class_name = "PencilBeam"
-            elif self.algorithm == self.ALGO_AAA:
-                module_name = "quangstation.dose_calculation._dose_engine"
-                class_name = "AAA"
-            elif self.algorithm == self.ALGO_ACUROS_XB:
-                module_name = "quangstation.dose_calculation._dose_engine"
-                class_name = "AcurosXB"
-            elif self.algorithm == self.ALGO_MONTE_CARLO:
-                module_name = "quangstation.dose_calculation._dose_engine"
-                class_name = "MonteCarlo"
-            else:
+            module_name = self.CPP_MODULE
+            class_name = self.CPP_ALGORITHM_CLASSES.get(self.algorithm)
+            if class_name is None:
                 raise ValueError(f"Thuật toán C++ không được hỗ trợ: {self.algorithm}")
             
             logger.info(f"Đang khởi tạo thuật toán C++ {class_name} từ module {module_name}")
@@ -354,8 +337,21 @@ class DoseCalculator:
             start_time = datetime.now()
             logger.info(f"Bắt đầu tính toán liều với thuật toán C++ {class_name} lúc {start_time.isoformat()}")
             
-            # Khởi tạo thuật toán
-            algo = algorithm_class(resolution=self.resolution_mm)
+            # Khởi tạo thuật toán (dùng lại đối tượng của lần tính trước nếu cùng cấu hình).
+            # Lưới liều có spacing resolution_mm (trục CT thô hơn giữ spacing CT); tùy chọn
+            # 'dose_grid_resolution' (mm) ghi đè, <= 0 tính trên lưới CT
+            dose_grid_resolution = float(self.options.get('dose_grid_resolution', self.resolution_mm))
+            algorithm_key = (class_name, dose_grid_resolution)
+            if self._cpp_algorithm is None or self._cpp_algorithm_key != algorithm_key:
+                self._cpp_algorithm = algorithm_class(resolution=dose_grid_resolution)
+                self._cpp_algorithm_key = algorithm_key
+            algo = self._cpp_algorithm
+            
+            dose_grid = algo.get_dose_grid(self.image_data.shape, self.spacing)
+            self.calculation_info['dose_grid_resolution'] = dose_grid_resolution
+            self.calculation_info['dose_grid_shape'] = tuple(dose_grid['shape'])
+            logger.info(f"Lưới liều {dose_grid['shape']}, spacing {dose_grid['spacing']} mm "
+                        f"(lưới CT {self.image_data.shape})")
             
             # Thiết lập file chuyển đổi HU nếu có
             if hasattr(algo, 'set_hu_to_ed_conversion_file') and self.hu_to_density_file:
@@ -370,9 +366,13 @@ class DoseCalculator:
             # Thiết lập các tùy chọn khác nếu có
             option_methods = {
                 'set_num_photons': 'num_photons',
+                'set_target_uncertainty': 'target_uncertainty',
                 'set_max_scatter_radius': 'max_scatter_radius',
                 'set_beta_param': 'beta_param',
-                'set_num_threads': 'num_threads'
+                'set_num_threads': 'num_threads',
+                'set_precision': 'precision',
+                'set_adaptive_refinement': 'adaptive_dose_grid',
+                'set_arc_sampling': 'arc_gantry_step'
             }
             
             for method, option_key in option_methods.items():
@@ -405,13 +405,25 @@ class DoseCalculator:
                 prescription = self.options.get('prescribed_dose', 0.0)
                 fractions = self.options.get('fractions', 1)
                 
-                return algo.calculate_from_numpy(
+                # Mặt nạ đích (hợp các PTV) dùng để chuẩn hóa liều trong C++
+                target_mask = None
+                for name, mask in self.structures.items():
+                    if 'PTV' in name.upper():
+                        target_mask = mask if target_mask is None else np.logical_or(target_mask, mask)
+                
+                # Mảng CT/mask C-contiguous đúng kiểu được truyền sang C++ không sao chép
+                dose = algo.calculate_from_numpy(
                     self.image_data, 
                     self.spacing, 
                     beams_data, 
                     prescription,
-                    fractions
+                    fractions,
+                    target_mask
                 )
+                if hasattr(algo, 'get_profile_stats'):
+                    self.profile_stats = algo.get_profile_stats()
+                    logger.log_profile(f"tính liều {self.algorithm}", self.profile_stats)
+                return dose
             else:
                 # Nếu không, cần chuyển đổi dữ liệu sang cấu trúc C++
                 # Đảm bảo mọi người đang sử dụng mã này đọc kỹ tài liệu API C++
@@ -434,10 +446,10 @@ class DoseCalculator:
             return dose_matrix
             
         # Tính toán liều cho từng chùm tia
-        logger.info(f"Tính toán liều cho {len(getattr(self, "beams", {}))} chùm tia")
+        logger.info(f"Tính toán liều cho {len(self.beams)} chùm tia")
         
         for i, beam in enumerate(getattr(self, "beams", {})):
-            logger.info(f"Tính toán liều cho chùm tia {i+1}/{len(getattr(self, "beams", {}))}")
+            logger.info(f"Tính toán liều cho chùm tia {i+1}/{len(self.beams)}")
             
             # Lấy thông số chùm tia
             gantry_angle = beam.get('gantry_angle', 0.0)
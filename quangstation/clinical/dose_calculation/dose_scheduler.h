@@ -0,0 +1,145 @@
+#ifndef QUANGSTATION_DOSE_SCHEDULER_H
+#define QUANGSTATION_DOSE_SCHEDULER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "volume3d.h"
+#include "grid_pool.h"
+
+namespace quangstation {
+
+/**
+ * Lập lịch các tác vụ tính liều độc lập (chùm tia, control point, pencil) lên
+ * các luồng OpenMP. Tác vụ được phát động theo hàng đợi chung (schedule
+ * dynamic, 1) nên luồng rảnh lấy tác vụ kế tiếp, cân bằng tải khi các control
+ * point có kích thước trường khác nhau.
+ *
+ * Mỗi luồng cộng vào một lưới liều riêng (luồng 0 dùng luôn lưới kết quả),
+ * cuối cùng các lưới được cộng theo cây nhị phân. Số luồng bị giới hạn bởi số
+ * tác vụ và ngân sách bộ nhớ cho lưới riêng. Trong lúc chạy, các vòng
+ * `omp parallel` lồng bên trong tác vụ chạy tuần tự; khi chỉ có một tác vụ
+ * hoặc một luồng, tác vụ chạy trực tiếp để song song hóa bên trong vẫn hoạt động.
+ * Với set_grid_pool, lưới riêng của các luồng được mượn từ pool và trả lại sau khi cộng.
+ */
+class DoseTaskScheduler {
+public:
+    // num_threads <= 0: dùng omp_get_max_threads()
+    explicit DoseTaskScheduler(int num_threads = 0,
+                               std::size_t memory_budget = std::size_t(1) << 30)
+        : num_threads_(num_threads), memory_budget_(memory_budget) {}
+    
+    // Pool cho lưới riêng của các luồng (nullptr: cấp phát mỗi lần chạy)
+    void set_grid_pool(GridPool* pool) {
+        pool_ = pool;
+    }
+    
+    // Số luồng sẽ dùng cho num_tasks tác vụ trên lưới grid_size voxel
+    int worker_count(std::size_t num_tasks, std::size_t grid_size) const {
+#ifdef _OPENMP
+        int threads = num_threads_ > 0 ? num_threads_ : omp_get_max_threads();
+#else
+        int threads = 1;
+#endif
+        const std::size_t grid_bytes = std::max<std::size_t>(1, grid_size * sizeof(double));
+        const std::size_t by_memory = 1 + memory_budget_ / grid_bytes;
+        std::size_t workers = std::min<std::size_t>(static_cast<std::size_t>(std::max(1, threads)), num_tasks);
+        workers = std::min(workers, by_memory);
+        return static_cast<int>(std::max<std::size_t>(1, workers));
+    }
+    
+    // Gọi task(i, accumulator) cho i = 0..num_tasks-1; tổng các accumulator được cộng vào result
+    template <typename Task>
+    void run(std::size_t num_tasks, DoseVolume& result, const Task& task) const {
+        const int workers = worker_count(num_tasks, result.size());
+        if (workers <= 1) {
+            for (std::size_t i = 0; i < num_tasks; ++i) {
+                task(i, result);
+            }
+            return;
+        }
+
+#ifdef _OPENMP
+        // Tắt song song lồng nhau trong lúc chạy: mỗi tác vụ dùng đúng một luồng
+        const int previous_levels = omp_get_max_active_levels();
+        omp_set_max_active_levels(1);
+#endif
+
+        std::vector<DoseVolume> partial(workers - 1);
+        std::exception_ptr error;
+        const long count = static_cast<long>(num_tasks);
+        
+        #pragma omp parallel num_threads(workers)
+        {
+#ifdef _OPENMP
+            const int thread_id = omp_get_thread_num();
+#else
+            const int thread_id = 0;
+#endif
+            DoseVolume* accumulator = &result;
+            if (thread_id > 0) {
+                partial[thread_id - 1] = pool_acquire_like<double>(pool_, result, 0.0);
+                accumulator = &partial[thread_id - 1];
+            }
+            
+            #pragma omp for schedule(dynamic, 1)
+            for (long i = 0; i < count; ++i) {
+                try {
+                    task(static_cast<std::size_t>(i), *accumulator);
+                } catch (...) {
+                    #pragma omp critical(dose_task_error)
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                }
+            }
+        }
+
+#ifdef _OPENMP
+        omp_set_max_active_levels(previous_levels);
+#endif
+        if (error) {
+            release_partials(partial);
+            std::rethrow_exception(error);
+        }
+        
+        // Cộng theo cây: bước stride cộng lưới i + stride vào lưới i
+        std::vector<DoseVolume*> grids(workers);
+        grids[0] = &result;
+        for (int t = 1; t < workers; ++t) {
+            grids[t] = &partial[t - 1];
+        }
+        for (int stride = 1; stride < workers; stride *= 2) {
+            const int pairs = (workers + 2 * stride - 1) / (2 * stride);
+            #pragma omp parallel for schedule(static)
+            for (int p = 0; p < pairs; ++p) {
+                const int target = p * 2 * stride;
+                if (target + stride < workers && !grids[target + stride]->empty()) {
+                    grids[target]->add_scaled(*grids[target + stride]);
+                }
+            }
+        }
+        release_partials(partial);
+    }
+    
+private:
+    void release_partials(std::vector<DoseVolume>& partial) const {
+        for (auto& grid : partial) {
+            pool_release(pool_, grid);
+        }
+    }
+    
+    int num_threads_;
+    std::size_t memory_budget_;
+    GridPool* pool_ = nullptr;
+};
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_DOSE_SCHEDULER_H
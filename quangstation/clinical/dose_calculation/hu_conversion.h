@@ -0,0 +1,387 @@
+#ifndef QUANGSTATION_HU_CONVERSION_H
+#define QUANGSTATION_HU_CONVERSION_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "volume3d.h"
+
+namespace quangstation {
+
+// Cấu trúc dữ liệu cho vật liệu
+struct Material {
+    std::string name;
+    double density;                  // g/cm3
+    double electron_density_relative; // Tương đối so với nước
+    
+    Material(const std::string& n, double d, double edr)
+        : name(n), density(d), electron_density_relative(edr) {}
+};
+
+/**
+ * Bảng chuyển đổi HU sang vật liệu (mật độ điện tử tương đối, mật độ khối).
+ * Giữa hai điểm của bảng nội suy tuyến tính, ngoài bảng lấy giá trị biên.
+ *
+ * Bảng tra dày (một phần tử cho mỗi HU trong [HU nhỏ nhất, HU lớn nhất] của
+ * bảng) được dựng một lần khi đổi bảng, nên chuyển đổi mỗi voxel chỉ là kẹp
+ * chỉ số rồi đọc bảng tra, vector hóa được.
+ */
+class HUtoEDConverter {
+public:
+    HUtoEDConverter() {
+        // Giá trị mặc định: (HU, vật liệu, mật độ khối g/cm3, mật độ điện tử tương đối)
+        set_materials({
+            {-1000, Material("Không khí", 0.0012, 0.001)},
+            {-950, Material("Không khí", 0.0012, 0.001)},
+            {-700, Material("Phổi", 0.26, 0.25)},
+            {-100, Material("Mỡ", 0.92, 0.9)},
+            {0, Material("Nước", 1.0, 1.0)},
+            {50, Material("Mô mềm", 1.06, 1.05)},
+            {300, Material("Xương", 1.6, 1.5)},
+            {1000, Material("Kim loại", 2.2, 2.0)},
+            {3000, Material("Kim loại cứng", 3.4, 3.0)}
+        });
+    }
+    
+    /**
+     * Mỗi dòng: "HU ED [mật_độ_khối [tên vật liệu]]". Thiếu mật độ khối thì lấy
+     * bằng mật độ điện tử (xấp xỉ của mô mềm). Dòng không đọc được bị bỏ qua;
+     * file không có dòng hợp lệ nào thì giữ bảng cũ.
+     */
+    void load_from_file(const std::string& filename) {
+        std::ifstream file(filename);
+        if (!file.is_open()) {
+            std::cerr << "Không thể mở file HU-ED: " << filename << std::endl;
+            return;
+        }
+        
+        std::vector<std::pair<int, Material>> points;
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream iss(line);
+            int hu;
+            double ed;
+            if (!(iss >> hu >> ed)) {
+                continue;
+            }
+            double mass_density = ed;
+            std::string name;
+            if (iss >> mass_density) {
+                std::getline(iss >> std::ws, name);
+            } else {
+                mass_density = ed;
+            }
+            points.emplace_back(hu, Material(name.empty() ? "HU " + std::to_string(hu) : name, mass_density, ed));
+        }
+        file.close();
+        
+        if (points.empty()) {
+            std::cerr << "File HU-ED không có dòng hợp lệ, giữ bảng hiện tại: " << filename << std::endl;
+            return;
+        }
+        set_materials(std::move(points));
+    }
+    
+    // Đặt bảng (HU, vật liệu); dựng lại bảng tra
+    void set_materials(std::vector<std::pair<int, Material>> points) {
+        if (points.empty()) {
+            throw std::invalid_argument("Bảng HU-ED phải có ít nhất một điểm");
+        }
+        
+        // Sắp xếp bảng theo HU tăng dần
+        std::stable_sort(points.begin(), points.end(),
+            [](const std::pair<int, Material>& a, const std::pair<int, Material>& b) { return a.first < b.first; });
+        
+        hu_points_.clear();
+        materials_.clear();
+        for (auto& point : points) {
+            hu_points_.push_back(point.first);
+            materials_.push_back(std::move(point.second));
+        }
+        build_lookup();
+    }
+    
+    double convert(int hu) const {
+        return electron_density_lut_[lut_index(hu)];
+    }
+    
+    double mass_density(int hu) const {
+        return mass_density_lut_[lut_index(hu)];
+    }
+    
+    // Vật liệu của đoạn bảng chứa hu (điểm có HU lớn nhất <= hu)
+    const Material& material(int hu) const {
+        return materials_[material_lut_[lut_index(hu)]];
+    }
+    
+    const std::vector<Material>& materials() const { return materials_; }
+    
+    // Chuyển đổi toàn bộ lưới CT thành lưới mật độ điện tử (giữ spacing/origin), lưu kiểu T
+    template <typename T = double>
+    Volume3D<T> convert_volume(const CTVolume& ct) const {
+        return lookup_volume<T>(ct, electron_density_lut_);
+    }
+    
+    // Lưới mật độ khối (g/cm3)
+    template <typename T = double>
+    Volume3D<T> mass_density_volume(const CTVolume& ct) const {
+        return lookup_volume<T>(ct, mass_density_lut_);
+    }
+    
+    // Chỉ số vật liệu (trong materials()) của từng voxel
+    Volume3D<std::uint8_t> material_volume(const CTVolume& ct) const {
+        if (materials_.size() > 256) {
+            throw std::length_error("Bảng HU-ED có quá 256 vật liệu cho lưới chỉ số 8 bit");
+        }
+        std::vector<std::uint8_t> lut(material_lut_.begin(), material_lut_.end());
+        return lookup_volume<std::uint8_t>(ct, lut);
+    }
+    
+    // Khóa cho lưới mật độ của CT có hash ct_hash với bảng hiện tại
+    std::uint64_t density_key(std::uint64_t ct_hash) const {
+        return (ct_hash ^ table_hash_) * 0x100000001b3ULL + table_hash_;
+    }
+    
+private:
+    std::size_t lut_index(int hu) const {
+        const int clamped = hu < lut_min_ ? lut_min_ : (hu > lut_max_ ? lut_max_ : hu);
+        return static_cast<std::size_t>(clamped - lut_min_);
+    }
+    
+    template <typename T, typename U>
+    Volume3D<T> lookup_volume(const CTVolume& ct, const std::vector<U>& lut) const {
+        Volume3D<T> out = Volume3D<T>::like(ct);
+        const long n = static_cast<long>(ct.size());
+        const std::int16_t* hu = ct.data();
+        T* values = out.data();
+        const U* table = lut.data();
+        const int lo = lut_min_;
+        const int hi = lut_max_;
+        #pragma omp parallel for simd schedule(static)
+        for (long i = 0; i < n; ++i) {
+            const int h = hu[i];
+            const int clamped = h < lo ? lo : (h > hi ? hi : h);
+            values[i] = static_cast<T>(table[clamped - lo]);
+        }
+        return out;
+    }
+    
+    // Nội suy tuyến tính trên bảng điểm (chỉ dùng khi dựng bảng tra)
+    double interpolate(int hu, double Material::*field) const {
+        if (hu <= hu_points_.front()) {
+            return materials_.front().*field;
+        }
+        if (hu >= hu_points_.back()) {
+            return materials_.back().*field;
+        }
+        for (size_t i = 0; i + 1 < hu_points_.size(); ++i) {
+            if (hu >= hu_points_[i] && hu < hu_points_[i + 1]) {
+                double hu1 = hu_points_[i];
+                double hu2 = hu_points_[i + 1];
+                double v1 = materials_[i].*field;
+                double v2 = materials_[i + 1].*field;
+                
+                return v1 + (v2 - v1) * (hu - hu1) / (hu2 - hu1);
+            }
+        }
+        
+        // Mặc định trả về mật độ nước
+        return 1.0;
+    }
+    
+    void build_lookup() {
+        // CT lưu HU 16 bit: bảng tra không cần vượt ra ngoài khoảng int16
+        lut_min_ = std::min(std::max(hu_points_.front(), -32768), 32767);
+        lut_max_ = std::min(std::max(hu_points_.back(), lut_min_), 32767);
+        const std::size_t size = static_cast<std::size_t>(lut_max_ - lut_min_) + 1;
+        electron_density_lut_.resize(size);
+        mass_density_lut_.resize(size);
+        material_lut_.resize(size);
+        
+        std::size_t segment = 0;
+        for (std::size_t i = 0; i < size; ++i) {
+            const int hu = lut_min_ + static_cast<int>(i);
+            electron_density_lut_[i] = interpolate(hu, &Material::electron_density_relative);
+            mass_density_lut_[i] = interpolate(hu, &Material::density);
+            while (segment + 1 < hu_points_.size() && hu_points_[segment + 1] <= hu) {
+                ++segment;
+            }
+            material_lut_[i] = static_cast<std::uint16_t>(segment);
+        }
+        
+        // Hash của bảng: đổi bảng thì đổi khóa của các lưới mật độ đã đệm
+        std::uint64_t h = 0xcbf29ce484222325ULL;
+        auto mix = [&h](std::uint64_t v) {
+            h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+            h *= 0x100000001b3ULL;
+        };
+        for (std::size_t i = 0; i < hu_points_.size(); ++i) {
+            std::uint64_t ed_bits, mass_bits;
+            std::memcpy(&ed_bits, &materials_[i].electron_density_relative, sizeof(double));
+            std::memcpy(&mass_bits, &materials_[i].density, sizeof(double));
+            mix(static_cast<std::uint64_t>(static_cast<std::int64_t>(hu_points_[i])));
+            mix(ed_bits);
+            mix(mass_bits);
+        }
+        table_hash_ = h;
+    }
+    
+    std::vector<int> hu_points_;
+    std::vector<Material> materials_;
+    int lut_min_ = 0;
+    int lut_max_ = 0;
+    std::vector<double> electron_density_lut_;
+    std::vector<double> mass_density_lut_;
+    std::vector<std::uint16_t> material_lut_;
+    std::uint64_t table_hash_ = 0;
+};
+
+/**
+ * Bộ đệm lưới mật độ điện tử theo khóa HUtoEDConverter::density_key (CT và bảng
+ * chuyển đổi): tính lại cùng bệnh nhân không phải chuyển đổi lại CT. An toàn khi
+ * gọi từ nhiều luồng; giữ tối đa max_entries lưới (bỏ lưới lâu không dùng nhất).
+ */
+template <typename T>
+class BasicDensityCache {
+public:
+    using Entry = std::shared_ptr<const Volume3D<T>>;
+    
+    explicit BasicDensityCache(std::size_t max_entries = 1) : max_entries_(max_entries) {}
+    
+    // Lưới vừa dùng chuyển về cuối (bỏ lưới lâu không dùng nhất trước)
+    Entry find(std::uint64_t key) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it->first == key) {
+                Entry value = it->second;
+                entries_.erase(it);
+                entries_.emplace_back(key, value);
+                return value;
+            }
+        }
+        return nullptr;
+    }
+    
+    void insert(std::uint64_t key, Entry value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (max_entries_ == 0) {
+            return;
+        }
+        for (auto& entry : entries_) {
+            if (entry.first == key) {
+                entry.second = std::move(value);
+                return;
+            }
+        }
+        entries_.emplace_back(key, std::move(value));
+        while (entries_.size() > max_entries_) {
+            entries_.pop_front();
+        }
+    }
+    
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+    }
+    
+    void set_max_entries(std::size_t max_entries) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        max_entries_ = max_entries;
+        while (entries_.size() > max_entries_) {
+            entries_.pop_front();
+        }
+    }
+    
+    std::size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.size();
+    }
+    
+private:
+    mutable std::mutex mutex_;
+    mutable std::deque<std::pair<std::uint64_t, Entry>> entries_;
+    std::size_t max_entries_;
+};
+
+// Loại lưới mật độ: mỗi loại một bộ đệm riêng để hai loại không đẩy nhau ra (Monte Carlo dùng cả hai)
+enum class DensityKind {
+    Electron,   // Mật độ điện tử tương đối
+    Mass        // Mật độ khối (g/cm3)
+};
+
+/**
+ * Bộ đệm lưới mật độ theo loại và kiểu lưu trữ (double và float32), dùng chung cho
+ * cả tiến trình như DoseKernelCache: wrapper Python dựng thuật toán mới cho mỗi lần
+ * tính nên bộ đệm của từng đối tượng không bao giờ trúng giữa các lần gọi. Khóa đã
+ * gồm hash của CT, bảng HU-ED và lưới nên các thuật toán dùng chung không lẫn nhau.
+ */
+class DensityCaches {
+public:
+    // Mỗi loại, mỗi kiểu lưu trữ: lưới CT, lưới liều và các hộp tinh chỉnh của một lần tính
+    static constexpr std::size_t kDefaultEntries = 4;
+    
+    DensityCaches() {
+        set_max_entries(kDefaultEntries);
+    }
+    
+    static DensityCaches& instance() {
+        static DensityCaches caches;
+        return caches;
+    }
+    
+    template <typename T>
+    BasicDensityCache<T>& get(DensityKind kind = DensityKind::Electron);
+    
+    void set_max_entries(std::size_t max_entries) {
+        for (int k = 0; k < kNumKinds; ++k) {
+            double_[k].set_max_entries(max_entries);
+            float_[k].set_max_entries(max_entries);
+        }
+    }
+    
+    void clear() {
+        for (int k = 0; k < kNumKinds; ++k) {
+            double_[k].clear();
+            float_[k].clear();
+        }
+    }
+    
+    std::size_t size() const {
+        std::size_t total = 0;
+        for (int k = 0; k < kNumKinds; ++k) {
+            total += double_[k].size() + float_[k].size();
+        }
+        return total;
+    }
+    
+private:
+    static constexpr int kNumKinds = 2;
+    BasicDensityCache<double> double_[kNumKinds];
+    BasicDensityCache<float> float_[kNumKinds];
+};
+
+template <>
+inline BasicDensityCache<double>& DensityCaches::get<double>(DensityKind kind) {
+    return double_[static_cast<int>(kind)];
+}
+
+template <>
+inline BasicDensityCache<float>& DensityCaches::get<float>(DensityKind kind) {
+    return float_[static_cast<int>(kind)];
+}
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_HU_CONVERSION_H
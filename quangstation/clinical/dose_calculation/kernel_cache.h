@@ -0,0 +1,228 @@
+#ifndef QUANGSTATION_KERNEL_CACHE_H
+#define QUANGSTATION_KERNEL_CACHE_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include "volume3d.h"
+#include "convolution.h"
+#include "depth_dose.h"
+
+namespace quangstation {
+
+// Các tham số đơn giản hóa của dose kernel (sigma, phạm vi) tính theo đơn vị voxel 2.5 mm:
+// trên lưới 2.5 mm đẳng hướng kernel trùng với kernel 11³ trước đây, trên lưới khác
+// kernel giữ nguyên kích thước vật lý
+constexpr double kDoseKernelReferenceSpacing = 2.5;   // mm
+constexpr double kDefaultDoseKernelRadius = 12.5;     // mm
+
+/**
+ * Dose kernel của loại hạt và năng lượng trên lưới spacing (x, y, z; mm), khối lập
+ * phương nửa cạnh ceil(radius / spacing nhỏ nhất) voxel, tổng bằng 1.
+ * Loại hạt không hỗ trợ cho kernel 0 (không đóng góp liều).
+ */
+inline Volume3D<double> make_dose_kernel(ParticleType particle, double energy,
+                                         const std::array<double, 3>& spacing, double radius) {
+    const double min_spacing = std::min(std::min(spacing[0], spacing[1]), spacing[2]);
+    const int half = std::max(1, static_cast<int>(std::ceil(radius / min_spacing)));
+    const int size = 2 * half + 1;
+    Volume3D<double> kernel(size, size, size, 0.0, spacing);
+    if (particle == ParticleType::Other) {
+        return kernel;
+    }
+    
+    // Khoảng cách tới tâm theo đơn vị tham chiếu
+    const std::array<double, 3> step = {
+        spacing[0] / kDoseKernelReferenceSpacing,
+        spacing[1] / kDoseKernelReferenceSpacing,
+        spacing[2] / kDoseKernelReferenceSpacing
+    };
+    
+    double sum = 0.0;
+    if (particle == ParticleType::Proton) {
+        // Bragg peak đơn giản: phạm vi (cm) = 0.3 * E(MeV)
+        const double range = energy * 0.3;
+        const double sigma_r = 0.03 * range;
+        for (int z = 0; z < size; ++z) {
+            const double depth = (z - half) * step[2];
+            for (int y = 0; y < size; ++y) {
+                const double dy = (y - half) * step[1];
+                double* row = kernel.row(z, y);
+                for (int x = 0; x < size; ++x) {
+                    const double dx = (x - half) * step[0];
+                    if (depth <= range) {
+                        double bragg = 1.0 + 5.0 * std::exp(-20.0 * (depth - range) * (depth - range));
+                        row[x] = bragg * std::exp(-(dx * dx + dy * dy) / (2 * sigma_r * sigma_r));
+                        sum += row[x];
+                    }
+                }
+            }
+        }
+    } else {
+        // Photon/electron: Gauss đẳng hướng
+        const double sigma = particle == ParticleType::Photon ? 0.5 + energy * 0.1 : 0.3 + energy * 0.05;
+        for (int z = 0; z < size; ++z) {
+            const double dz = (z - half) * step[2];
+            for (int y = 0; y < size; ++y) {
+                const double dy = (y - half) * step[1];
+                double* row = kernel.row(z, y);
+                for (int x = 0; x < size; ++x) {
+                    const double dx = (x - half) * step[0];
+                    row[x] = std::exp(-(dx * dx + dy * dy + dz * dz) / (2 * sigma * sigma));
+                    sum += row[x];
+                }
+            }
+        }
+    }
+    
+    if (sum > 0) {
+        kernel.scale(1.0 / sum);
+    }
+    return kernel;
+}
+
+// Kernel tán xạ exp(-beta·r), r < radius (mm), tổng bằng fraction
+inline Volume3D<double> make_scatter_kernel(const std::array<double, 3>& spacing, double radius,
+                                            double beta, double fraction) {
+    const double min_spacing = std::min(std::min(spacing[0], spacing[1]), spacing[2]);
+    const int half = std::max(1, static_cast<int>(std::ceil(radius / min_spacing)));
+    const int size = 2 * half + 1;
+    Volume3D<double> kernel(size, size, size, 0.0, spacing);
+    
+    double sum = 0.0;
+    for (int kz = 0; kz < size; ++kz) {
+        for (int ky = 0; ky < size; ++ky) {
+            double* row = kernel.row(kz, ky);
+            for (int kx = 0; kx < size; ++kx) {
+                double dist_x = (kx - half) * spacing[0];
+                double dist_y = (ky - half) * spacing[1];
+                double dist_z = (kz - half) * spacing[2];
+                double distance = std::sqrt(dist_x * dist_x + dist_y * dist_y + dist_z * dist_z);
+                row[kx] = distance < radius ? std::exp(-beta * distance) : 0.0;
+                sum += row[kx];
+            }
+        }
+    }
+    if (sum > 0) {
+        kernel.scale(fraction / sum);
+    }
+    return kernel;
+}
+
+// Chùm tia đã commissioning, dùng để dựng sẵn kernel khi nạp module
+struct CommissionedBeam {
+    const char* name;
+    ParticleType particle;
+    double energy;  // MV hoặc MeV
+};
+
+// 6FFF dùng chung kernel với 6X: kernel đơn giản hóa chỉ phụ thuộc năng lượng danh định
+inline const std::vector<CommissionedBeam>& commissioned_beams() {
+    static const std::vector<CommissionedBeam> beams = {
+        {"6X", ParticleType::Photon, 6.0},
+        {"10X", ParticleType::Photon, 10.0},
+        {"6FFF", ParticleType::Photon, 6.0},
+        {"6E", ParticleType::Electron, 6.0},
+        {"9E", ParticleType::Electron, 9.0},
+        {"12E", ParticleType::Electron, 12.0},
+        {"15E", ParticleType::Electron, 15.0}
+    };
+    return beams;
+}
+
+/**
+ * Bộ đệm kernel dùng chung cho cả tiến trình (mọi thuật toán và mọi đối tượng),
+ * khóa theo (loại kernel, loại hạt, năng lượng, spacing, bán kính, tham số).
+ * Mỗi kernel giữ kèm phân tích hạng 1 và phổ FFT của nó (PreparedKernel), nên
+ * các lần tính sau trên cùng lưới không phải dựng lại kernel hay biến đổi lại phổ.
+ */
+class DoseKernelCache {
+public:
+    enum class Kind {
+        Dose,
+        Scatter
+    };
+    
+    struct Key {
+        Kind kind;
+        ParticleType particle;
+        double energy;
+        std::array<double, 3> spacing;
+        double radius;
+        std::array<double, 2> parameters;
+        
+        bool operator<(const Key& other) const {
+            return std::tie(kind, particle, energy, spacing, radius, parameters) <
+                   std::tie(other.kind, other.particle, other.energy, other.spacing, other.radius, other.parameters);
+        }
+    };
+    
+    using Entry = std::shared_ptr<const PreparedKernel>;
+    
+    static DoseKernelCache& instance() {
+        static DoseKernelCache cache;
+        return cache;
+    }
+    
+    // Kernel theo khóa; chưa có thì build() dựng (ngoài khóa, các luồng không chờ nhau)
+    template <typename Builder>
+    Entry get(const Key& key, const Builder& build) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = entries_.find(key);
+            if (it != entries_.end()) {
+                return it->second;
+            }
+        }
+        
+        Entry kernel = std::make_shared<const PreparedKernel>(build());
+        
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.emplace(key, kernel).first->second;
+    }
+    
+    Entry dose_kernel(ParticleType particle, double energy, const std::array<double, 3>& spacing,
+                      double radius = kDefaultDoseKernelRadius) {
+        Key key = {Kind::Dose, particle, energy, spacing, radius, {0.0, 0.0}};
+        return get(key, [&]() { return make_dose_kernel(particle, energy, spacing, radius); });
+    }
+    
+    Entry scatter_kernel(const std::array<double, 3>& spacing, double radius, double beta, double fraction) {
+        Key key = {Kind::Scatter, ParticleType::Photon, 0.0, spacing, radius, {beta, fraction}};
+        return get(key, [&]() { return make_scatter_kernel(spacing, radius, beta, fraction); });
+    }
+    
+    // Dựng sẵn dose kernel của các chùm tia đã commissioning trên lưới spacing
+    void prewarm(const std::array<double, 3>& spacing, double radius = kDefaultDoseKernelRadius) {
+        for (const auto& beam : commissioned_beams()) {
+            dose_kernel(beam.particle, beam.energy, spacing, radius);
+        }
+    }
+    
+    std::size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.size();
+    }
+    
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+    }
+    
+private:
+    DoseKernelCache() = default;
+    
+    mutable std::mutex mutex_;
+    std::map<Key, Entry> entries_;
+};
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_KERNEL_CACHE_H
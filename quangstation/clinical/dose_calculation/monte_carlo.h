@@ -0,0 +1,483 @@
+#ifndef QUANGSTATION_MONTE_CARLO_H
+#define QUANGSTATION_MONTE_CARLO_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "volume3d.h"
+
+namespace quangstation {
+
+/**
+ * Dòng số ngẫu nhiên của một history: Philox4x32-10 (bộ sinh theo bộ đếm của
+ * Random123) với khóa là seed và bộ đếm (chỉ số history, chỉ số khối). Mỗi history
+ * có dòng riêng chỉ phụ thuộc (seed, chỉ số), nên kết quả không phụ thuộc số luồng
+ * hay thứ tự các history được chạy.
+ */
+class PhiloxStream {
+public:
+    PhiloxStream(std::uint64_t seed, std::uint64_t stream)
+        : key_{{static_cast<std::uint32_t>(seed), static_cast<std::uint32_t>(seed >> 32)}},
+          counter_{{static_cast<std::uint32_t>(stream), static_cast<std::uint32_t>(stream >> 32), 0, 0}} {}
+    
+    // Một khối 4 × 32 bit của bộ đếm counter với khóa key
+    static std::array<std::uint32_t, 4> block(std::array<std::uint32_t, 4> counter,
+                                              std::array<std::uint32_t, 2> key) {
+        for (int round = 0; round < 10; ++round) {
+            if (round > 0) {
+                key[0] += 0x9E3779B9u;
+                key[1] += 0xBB67AE85u;
+            }
+            const std::uint64_t p0 = 0xD2511F53ull * counter[0];
+            const std::uint64_t p1 = 0xCD9E8D57ull * counter[2];
+            counter = {{
+                static_cast<std::uint32_t>(p1 >> 32) ^ counter[1] ^ key[0],
+                static_cast<std::uint32_t>(p1),
+                static_cast<std::uint32_t>(p0 >> 32) ^ counter[3] ^ key[1],
+                static_cast<std::uint32_t>(p0)
+            }};
+        }
+        return counter;
+    }
+    
+    // Số ngẫu nhiên đều trên (0, 1), không bao giờ bằng 0 nên lấy log được
+    double uniform() {
+        if (index_ == 4) {
+            buffer_ = block(counter_, key_);
+            if (++counter_[2] == 0) {
+                ++counter_[3];
+            }
+            index_ = 0;
+        }
+        return (buffer_[index_++] + 0.5) * (1.0 / 4294967296.0);
+    }
+    
+private:
+    std::array<std::uint32_t, 2> key_;
+    std::array<std::uint32_t, 4> counter_;
+    std::array<std::uint32_t, 4> buffer_ = {{0, 0, 0, 0}};
+    int index_ = 4;
+};
+
+// Hằng số vật lý cho vận chuyển Monte Carlo
+constexpr double kElectronRestEnergy = 0.51099895;          // MeV
+constexpr double kClassicalElectronRadiusSquared = 7.9407877e-26;  // cm²
+constexpr double kWaterElectronsPerGram = 3.3428e23;        // e/g
+constexpr double kWaterRadiationLength = 36.08;             // g/cm²
+constexpr double kWaterEffectiveZ = 7.42;
+
+/**
+ * Hệ số suy giảm Compton (Klein-Nishina) của nước, 1/cm. Nhân với mật độ điện tử
+ * tương đối cho vật liệu khác: ở năng lượng MV tán xạ Compton chiếm phần lớn tương
+ * tác và tỷ lệ với mật độ điện tử.
+ */
+inline double compton_attenuation_water(double energy) {
+    const double k = energy / kElectronRestEnergy;
+    const double a = 1.0 + 2.0 * k;
+    const double log_a = std::log(a);
+    const double sigma = 2.0 * M_PI * kClassicalElectronRadiusSquared * (
+        (1.0 + k) / (k * k) * (2.0 * (1.0 + k) / a - log_a / k) +
+        log_a / (2.0 * k) - (1.0 + 3.0 * k) / (a * a));
+    return sigma * kWaterElectronsPerGram;
+}
+
+// Tạo cặp của nước, cm²/g (suy giảm toàn phần của NIST trừ Klein-Nishina), nội suy tuyến tính
+inline double pair_attenuation_water(double energy) {
+    static const double energies[] = {1.022, 1.25, 1.5, 2.0, 3.0, 4.0, 5.0, 6.0, 8.0, 10.0, 15.0, 20.0, 30.0, 50.0};
+    static const double values[] = {0.0, 0.00002, 0.0001, 0.00045, 0.0012, 0.00195, 0.00261,
+                                    0.00322, 0.00427, 0.00515, 0.0068, 0.00802, 0.00975, 0.01192};
+    const std::size_t n = sizeof(energies) / sizeof(energies[0]);
+    if (energy <= energies[0]) {
+        return 0.0;
+    }
+    if (energy >= energies[n - 1]) {
+        return values[n - 1];
+    }
+    std::size_t i = 0;
+    while (energies[i + 1] < energy) {
+        ++i;
+    }
+    return values[i] + (values[i + 1] - values[i]) * (energy - energies[i]) / (energies[i + 1] - energies[i]);
+}
+
+// Năng suất hãm va chạm của electron trong nước, MeV·cm²/g (ESTAR), nội suy theo log động năng
+inline double collision_stopping_power_water(double kinetic_energy) {
+    static const double energies[] = {0.01, 0.02, 0.05, 0.1, 0.2, 0.3, 0.5, 0.8, 1.0, 1.5, 2.0,
+                                      3.0, 4.0, 5.0, 6.0, 8.0, 10.0, 15.0, 20.0, 30.0, 50.0};
+    static const double values[] = {22.56, 13.17, 6.603, 4.115, 2.793, 2.355, 2.034, 1.888, 1.849, 1.814, 1.824,
+                                    1.859, 1.890, 1.911, 1.930, 1.955, 1.968, 2.000, 2.022, 2.051, 2.088};
+    const std::size_t n = sizeof(energies) / sizeof(energies[0]);
+    if (kinetic_energy <= energies[0]) {
+        return values[0];
+    }
+    if (kinetic_energy >= energies[n - 1]) {
+        return values[n - 1];
+    }
+    std::size_t i = 0;
+    while (energies[i + 1] < kinetic_energy) {
+        ++i;
+    }
+    const double f = std::log(kinetic_energy / energies[i]) / std::log(energies[i + 1] / energies[i]);
+    return values[i] + f * (values[i + 1] - values[i]);
+}
+
+// Quay hướng đơn vị direction một góc cực (cos_theta) và góc phương vị phi
+inline void rotate_direction(std::array<double, 3>& direction, double cos_theta, double phi) {
+    const double sin_theta = std::sqrt(std::max(0.0, 1.0 - cos_theta * cos_theta));
+    const double cos_phi = std::cos(phi);
+    const double sin_phi = std::sin(phi);
+    const double ux = direction[0], uy = direction[1], uz = direction[2];
+    const double perp = std::sqrt(std::max(0.0, 1.0 - uz * uz));
+    if (perp > 1e-6) {
+        direction[0] = sin_theta * (ux * uz * cos_phi - uy * sin_phi) / perp + ux * cos_theta;
+        direction[1] = sin_theta * (uy * uz * cos_phi + ux * sin_phi) / perp + uy * cos_theta;
+        direction[2] = -sin_theta * cos_phi * perp + uz * cos_theta;
+    } else {
+        direction[0] = sin_theta * cos_phi;
+        direction[1] = sin_theta * sin_phi;
+        direction[2] = (uz < 0.0 ? -1.0 : 1.0) * cos_theta;
+    }
+    const double magnitude = std::sqrt(direction[0] * direction[0] + direction[1] * direction[1] +
+                                       direction[2] * direction[2]);
+    for (int a = 0; a < 3; ++a) {
+        direction[a] /= magnitude;
+    }
+}
+
+// Tùy chọn của vận chuyển Monte Carlo
+struct MonteCarloOptions {
+    int photon_splitting = 4;         // Số bản sao của mỗi photon sơ cấp (1: tắt)
+    double roulette_survival = 0.25;  // Xác suất sống của photon thứ cấp (Russian roulette, 1: tắt)
+    double photon_cutoff = 0.05;      // MeV, photon dưới ngưỡng hấp thụ tại chỗ
+    double electron_cutoff = 0.2;     // MeV, electron dưới ngưỡng lắng đọng tại chỗ
+    double electron_step = 0.5;       // Bước electron tối đa, tính theo spacing nhỏ nhất
+    double max_energy_loss = 0.2;     // Phần động năng tối đa mất trên một bước electron
+};
+
+// Một hạt trong ngăn xếp của history
+struct MonteCarloParticle {
+    bool electron;
+    bool primary;                     // Photon chưa tương tác lần nào (chưa qua splitting/roulette)
+    double energy;                    // MeV (động năng với electron)
+    double weight;
+    std::array<double, 3> position;   // mm, tọa độ lưới (voxel i ở i · spacing)
+    std::array<double, 3> direction;
+};
+
+/**
+ * Vận chuyển photon và electron trên lưới mật độ (tọa độ lưới: tâm voxel i ở
+ * i · spacing).
+ *
+ * Photon: theo dõi Woodcock với hệ số suy giảm cực đại của lưới, tương tác Compton
+ * (lấy mẫu Klein-Nishina) tỷ lệ mật độ điện tử và tạo cặp tỷ lệ mật độ khối. Electron:
+ * lịch sử ngưng tụ với năng suất hãm va chạm của nước nhân mật độ điện tử, mất năng
+ * lượng bức xạ ước lượng T·Z/800 không lắng đọng tại chỗ, tán xạ nhiều lần theo
+ * công thức Highland. Giảm phương sai: photon sơ cấp tách thành photon_splitting bản
+ * sao (bản thứ i lấy quãng đường tự do đầu tiên theo tầng (i + u) / N), photon thứ cấp
+ * sinh ra từ các bản sao qua Russian roulette với xác suất sống roulette_survival;
+ * trọng số bù lại nên ước lượng không chệch.
+ *
+ * Năng lượng lắng đọng (MeV · trọng số) được cộng vào lưới energy; voxel có mật độ
+ * khối dưới min_scoring_density (không khí) không được cộng.
+ */
+template <typename T>
+class MonteCarloTransport {
+public:
+    static constexpr double min_scoring_density = 0.05;  // g/cm3
+    
+    MonteCarloTransport(const Volume3D<T>& electron_density, const Volume3D<T>& mass_density,
+                        const MonteCarloOptions& options)
+        : electron_density_(electron_density), mass_density_(mass_density), options_(options),
+          spacing_(electron_density.spacing()),
+          dims_{{static_cast<long>(electron_density.width()), static_cast<long>(electron_density.height()),
+                 static_cast<long>(electron_density.depth())}} {
+        for (const T value : electron_density) {
+            max_electron_density_ = std::max(max_electron_density_, static_cast<double>(value));
+        }
+        for (const T value : mass_density) {
+            max_mass_density_ = std::max(max_mass_density_, static_cast<double>(value));
+        }
+        for (int a = 0; a < 3; ++a) {
+            lower_[a] = -0.5 * spacing_[a];
+            upper_[a] = (dims_[a] - 0.5) * spacing_[a];
+        }
+        const double min_spacing = std::min(std::min(spacing_[0], spacing_[1]), spacing_[2]);
+        electron_step_ = std::max(1e-3, options_.electron_step * min_spacing);
+        options_.photon_splitting = std::max(1, options_.photon_splitting);
+        options_.roulette_survival = std::min(std::max(options_.roulette_survival, 1e-6), 1.0);
+    }
+    
+    // Vận chuyển hạt nguồn particle và mọi hạt thứ cấp; stack là bộ nhớ tạm dùng lại giữa các history
+    void transport(const MonteCarloParticle& particle, PhiloxStream& rng, DoseVolume& energy,
+                   std::vector<MonteCarloParticle>& stack) const {
+        stack.clear();
+        MonteCarloParticle source = particle;
+        if (!enter_grid(source.position, source.direction)) {
+            return;
+        }
+        if (!source.electron && source.primary && options_.photon_splitting > 1) {
+            const int copies = options_.photon_splitting;
+            source.weight /= copies;
+            for (int i = 0; i < copies; ++i) {
+                track_photon(source, (i + rng.uniform()) / copies, rng, energy, stack);
+            }
+        } else {
+            stack.push_back(source);
+        }
+        while (!stack.empty()) {
+            MonteCarloParticle p = stack.back();
+            stack.pop_back();
+            if (p.electron) {
+                track_electron(p, rng, energy);
+            } else {
+                track_photon(p, rng.uniform(), rng, energy, stack);
+            }
+        }
+    }
+    
+private:
+    // Đưa điểm về mặt biên lưới dọc theo direction; false nếu tia không cắt lưới
+    bool enter_grid(std::array<double, 3>& position, const std::array<double, 3>& direction) const {
+        double t_min = 0.0;
+        double t_max = std::numeric_limits<double>::max();
+        for (int a = 0; a < 3; ++a) {
+            if (std::abs(direction[a]) < 1e-12) {
+                if (position[a] < lower_[a] || position[a] > upper_[a]) {
+                    return false;
+                }
+                continue;
+            }
+            double t0 = (lower_[a] - position[a]) / direction[a];
+            double t1 = (upper_[a] - position[a]) / direction[a];
+            if (t0 > t1) {
+                std::swap(t0, t1);
+            }
+            t_min = std::max(t_min, t0);
+            t_max = std::min(t_max, t1);
+        }
+        if (t_min > t_max) {
+            return false;
+        }
+        // Lùi vào trong một chút để điểm vào thuộc voxel biên
+        t_min += 1e-6;
+        for (int a = 0; a < 3; ++a) {
+            position[a] += t_min * direction[a];
+        }
+        return true;
+    }
+    
+    // Chỉ số phẳng của voxel chứa position, false nếu ở ngoài lưới
+    bool voxel_of(const std::array<double, 3>& position, std::size_t& index) const {
+        long i[3];
+        for (int a = 0; a < 3; ++a) {
+            i[a] = static_cast<long>(std::floor(position[a] / spacing_[a] + 0.5));
+            if (i[a] < 0 || i[a] >= dims_[a]) {
+                return false;
+            }
+        }
+        index = (static_cast<std::size_t>(i[2]) * dims_[1] + i[1]) * dims_[0] + i[0];
+        return true;
+    }
+    
+    void deposit(DoseVolume& energy, std::size_t index, double value) const {
+        if (mass_density_.data()[index] >= min_scoring_density) {
+            energy.data()[index] += value;
+        }
+    }
+    
+    // Photon từ vị trí hiện tại; first_uniform cho quãng đường tự do đầu tiên (tầng của splitting)
+    void track_photon(MonteCarloParticle p, double first_uniform, PhiloxStream& rng, DoseVolume& energy,
+                      std::vector<MonteCarloParticle>& stack) const {
+        double uniform = first_uniform;
+        for (;;) {
+            std::size_t index = 0;
+            if (p.energy < options_.photon_cutoff) {
+                if (voxel_of(p.position, index)) {
+                    deposit(energy, index, p.energy * p.weight);
+                }
+                return;
+            }
+            
+            // Woodcock: bước theo hệ số cực đại, tương tác thật với xác suất mu / mu_max
+            const double mu_compton = compton_attenuation_water(p.energy) / 10.0;  // 1/mm
+            const double mu_pair = pair_attenuation_water(p.energy) / 10.0;
+            const double mu_max = mu_compton * max_electron_density_ + mu_pair * max_mass_density_;
+            if (!(mu_max > 0.0)) {
+                return;
+            }
+            const double distance = -std::log(uniform) / mu_max;
+            uniform = rng.uniform();
+            for (int a = 0; a < 3; ++a) {
+                p.position[a] += distance * p.direction[a];
+            }
+            if (!voxel_of(p.position, index)) {
+                return;
+            }
+            const double compton = mu_compton * electron_density_.data()[index];
+            const double pair = mu_pair * mass_density_.data()[index];
+            const double r = rng.uniform() * mu_max;
+            if (r >= compton + pair) {
+                continue;
+            }
+            
+            if (r < compton) {
+                compton_scatter(p, rng, stack);
+            } else {
+                pair_production(p, rng, stack);
+                return;
+            }
+            if (p.primary) {
+                // Photon tán xạ của bản sao: Russian roulette đưa trọng số về như trước splitting
+                p.primary = false;
+                if (options_.roulette_survival < 1.0) {
+                    if (rng.uniform() >= options_.roulette_survival) {
+                        return;
+                    }
+                    p.weight /= options_.roulette_survival;
+                }
+            }
+        }
+    }
+    
+    // Tán xạ Compton: lấy mẫu ε = E'/E theo Klein-Nishina (như G4KleinNishinaCompton), electron giật lùi vào stack
+    void compton_scatter(MonteCarloParticle& p, PhiloxStream& rng, std::vector<MonteCarloParticle>& stack) const {
+        const double k = p.energy / kElectronRestEnergy;
+        const double eps0 = 1.0 / (1.0 + 2.0 * k);
+        const double eps0_sq = eps0 * eps0;
+        const double alpha1 = -std::log(eps0);
+        const double alpha2 = alpha1 + 0.5 * (1.0 - eps0_sq);
+        double eps, one_minus_cos;
+        for (;;) {
+            double eps_sq;
+            if (alpha1 > alpha2 * rng.uniform()) {
+                eps = std::exp(-alpha1 * rng.uniform());
+                eps_sq = eps * eps;
+            } else {
+                eps_sq = eps0_sq + (1.0 - eps0_sq) * rng.uniform();
+                eps = std::sqrt(eps_sq);
+            }
+            one_minus_cos = (1.0 - eps) / (eps * k);
+            const double sin_sq = one_minus_cos * (2.0 - one_minus_cos);
+            if (1.0 - eps * sin_sq / (1.0 + eps_sq) >= rng.uniform()) {
+                break;
+            }
+        }
+        
+        const std::array<double, 3> incident = p.direction;
+        const double scattered_energy = eps * p.energy;
+        const double kinetic = p.energy - scattered_energy;
+        rotate_direction(p.direction, 1.0 - one_minus_cos, 2.0 * M_PI * rng.uniform());
+        
+        // Electron theo bảo toàn động lượng: p_e = E·u - E'·u'
+        MonteCarloParticle electron = {true, false, kinetic, p.weight, p.position, incident};
+        double magnitude = 0.0;
+        for (int a = 0; a < 3; ++a) {
+            electron.direction[a] = p.energy * incident[a] - scattered_energy * p.direction[a];
+            magnitude += electron.direction[a] * electron.direction[a];
+        }
+        magnitude = std::sqrt(magnitude);
+        if (magnitude > 0.0) {
+            for (int a = 0; a < 3; ++a) {
+                electron.direction[a] /= magnitude;
+            }
+        }
+        push_electron(electron, stack);
+        p.energy = scattered_energy;
+    }
+    
+    // Tạo cặp: động năng E - 2mc² chia đều cho hai hạt theo hướng photon (positron coi như electron),
+    // hai photon hủy cặp 0.511 MeV đẳng hướng ngược chiều nhau
+    void pair_production(const MonteCarloParticle& p, PhiloxStream& rng, std::vector<MonteCarloParticle>& stack) const {
+        const double kinetic = 0.5 * (p.energy - 2.0 * kElectronRestEnergy);
+        for (int k = 0; k < 2; ++k) {
+            push_electron({true, false, kinetic, p.weight, p.position, p.direction}, stack);
+        }
+        
+        double weight = p.weight;
+        if (p.primary && options_.roulette_survival < 1.0) {
+            if (rng.uniform() >= options_.roulette_survival) {
+                return;
+            }
+            weight /= options_.roulette_survival;
+        }
+        const double cos_theta = 2.0 * rng.uniform() - 1.0;
+        const double sin_theta = std::sqrt(std::max(0.0, 1.0 - cos_theta * cos_theta));
+        const double phi = 2.0 * M_PI * rng.uniform();
+        const std::array<double, 3> direction = {{sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta}};
+        stack.push_back({false, false, kElectronRestEnergy, weight, p.position, direction});
+        stack.push_back({false, false, kElectronRestEnergy, weight, p.position,
+                         {{-direction[0], -direction[1], -direction[2]}}});
+    }
+    
+    // Electron dưới ngưỡng lắng đọng ngay, còn lại vào stack
+    void push_electron(const MonteCarloParticle& electron, std::vector<MonteCarloParticle>& stack) const {
+        if (electron.energy <= 0.0) {
+            return;
+        }
+        stack.push_back(electron);
+    }
+    
+    // Lịch sử ngưng tụ: mỗi bước mất (S_col + S_rad)·ρ·ds, lắng đọng phần va chạm tại voxel đầu bước
+    void track_electron(MonteCarloParticle p, PhiloxStream& rng, DoseVolume& energy) const {
+        std::size_t index = 0;
+        if (!voxel_of(p.position, index) && !enter_grid(p.position, p.direction)) {
+            return;
+        }
+        while (p.energy > options_.electron_cutoff) {
+            if (!voxel_of(p.position, index)) {
+                return;
+            }
+            const double electron_density = std::max(static_cast<double>(electron_density_.data()[index]), 1e-4);
+            const double mass_density = std::max(static_cast<double>(mass_density_.data()[index]), 1e-4);
+            const double collision = collision_stopping_power_water(p.energy) * electron_density;  // MeV/cm
+            const double radiative = collision * p.energy * kWaterEffectiveZ / 800.0;
+            const double total = collision + radiative;
+            
+            double step = std::min(electron_step_ / 10.0, options_.max_energy_loss * p.energy / total);  // cm
+            double loss = total * step;
+            if (loss >= p.energy) {
+                loss = p.energy;
+                step = loss / total;
+            }
+            deposit(energy, index, loss * collision / total * p.weight);
+            
+            // Tán xạ nhiều lần (Highland) theo động năng giữa bước
+            const double mean_energy = p.energy - 0.5 * loss;
+            const double momentum = std::sqrt(mean_energy * (mean_energy + 2.0 * kElectronRestEnergy));
+            const double beta = momentum / (mean_energy + kElectronRestEnergy);
+            const double thickness = step * mass_density / kWaterRadiationLength;
+            const double theta0 = 13.6 / (beta * momentum) * std::sqrt(thickness) *
+                                  std::max(0.0, 1.0 + 0.038 * std::log(thickness));
+            
+            p.energy -= loss;
+            for (int a = 0; a < 3; ++a) {
+                p.position[a] += 10.0 * step * p.direction[a];
+            }
+            const double theta = theta0 * std::sqrt(-2.0 * std::log(rng.uniform()));
+            rotate_direction(p.direction, std::cos(theta), 2.0 * M_PI * rng.uniform());
+        }
+        if (p.energy > 0.0 && voxel_of(p.position, index)) {
+            deposit(energy, index, p.energy * p.weight);
+        }
+    }
+    
+    const Volume3D<T>& electron_density_;
+    const Volume3D<T>& mass_density_;
+    MonteCarloOptions options_;
+    std::array<double, 3> spacing_;
+    std::array<long, 3> dims_;
+    std::array<double, 3> lower_;
+    std::array<double, 3> upper_;
+    double max_electron_density_ = 0.0;
+    double max_mass_density_ = 0.0;
+    double electron_step_ = 1.0;
+};
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_MONTE_CARLO_H
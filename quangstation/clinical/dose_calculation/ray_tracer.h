@@ -0,0 +1,437 @@
+#ifndef QUANGSTATION_RAY_TRACER_H
+#define QUANGSTATION_RAY_TRACER_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+
+#include "volume3d.h"
+
+namespace quangstation {
+
+/**
+ * Ray tracer chính xác theo voxel (Siddon / Amanatides-Woo).
+ *
+ * Quy ước tọa độ giống engine tính liều: tâm voxel (z, y, x) nằm tại
+ * (x * spacing[0], y * spacing[1], z * spacing[2]) mm, mỗi voxel chiếm một
+ * hộp kích thước spacing quanh tâm. Radiological depth được tính từ điểm
+ * tia đi vào lưới, đơn vị mm nước tương đương.
+ *
+ * T là kiểu lưu trữ của mật độ và của depth map trả về (double hoặc float);
+ * mọi phép tính và cộng dồn dọc tia luôn dùng double.
+ */
+template <typename T>
+class BasicRayTracer {
+public:
+    explicit BasicRayTracer(const Volume3D<T>& density)
+        : density_(density), spacing_(density.spacing()) {
+        for (int a = 0; a < 3; ++a) {
+            lower_[a] = -0.5 * spacing_[a];
+        }
+        dims_ = {
+            static_cast<long>(density.width()),
+            static_cast<long>(density.height()),
+            static_cast<long>(density.depth())
+        };
+        for (int a = 0; a < 3; ++a) {
+            upper_[a] = lower_[a] + dims_[a] * spacing_[a];
+        }
+    }
+    
+    /**
+     * Duyệt tia source + t * direction (direction đã chuẩn hóa) qua lưới, t <= t_end.
+     * Với mỗi đoạn nằm trong một voxel gọi visit(x, y, z, t_in, t_out, depth_in, density),
+     * depth_in là radiological depth tích lũy tại t_in. Trả về depth tại điểm cuối.
+     */
+    template <typename Visitor>
+    double trace(const std::array<double, 3>& source,
+                 const std::array<double, 3>& direction,
+                 double t_end,
+                 Visitor&& visit) const {
+        double t_enter = 0.0;
+        double t_exit = t_end;
+        if (!clip(source, direction, t_enter, t_exit)) {
+            return 0.0;
+        }
+        
+        // Voxel chứa điểm tia đi vào lưới
+        std::array<long, 3> cell;
+        std::array<long, 3> step;
+        std::array<double, 3> t_max;
+        std::array<double, 3> t_delta;
+        double t_mid = 0.5 * (t_enter + std::min(t_exit, t_enter + 1e-6));
+        for (int a = 0; a < 3; ++a) {
+            double p = source[a] + t_mid * direction[a];
+            cell[a] = static_cast<long>(std::floor((p - lower_[a]) / spacing_[a]));
+            cell[a] = std::max(0L, std::min(cell[a], dims_[a] - 1));
+            
+            if (direction[a] > 0.0) {
+                step[a] = 1;
+                t_max[a] = (lower_[a] + (cell[a] + 1) * spacing_[a] - source[a]) / direction[a];
+                t_delta[a] = spacing_[a] / direction[a];
+            } else if (direction[a] < 0.0) {
+                step[a] = -1;
+                t_max[a] = (lower_[a] + cell[a] * spacing_[a] - source[a]) / direction[a];
+                t_delta[a] = -spacing_[a] / direction[a];
+            } else {
+                step[a] = 0;
+                t_max[a] = std::numeric_limits<double>::infinity();
+                t_delta[a] = std::numeric_limits<double>::infinity();
+            }
+        }
+        
+        double depth = 0.0;
+        double t = t_enter;
+        while (t < t_exit) {
+            int axis = (t_max[0] < t_max[1])
+                ? (t_max[0] < t_max[2] ? 0 : 2)
+                : (t_max[1] < t_max[2] ? 1 : 2);
+            double t_next = std::max(t, std::min(t_max[axis], t_exit));
+            
+            double rho = density_(cell[2], cell[1], cell[0]);
+            visit(cell[0], cell[1], cell[2], t, t_next, depth, rho);
+            depth += rho * (t_next - t);
+            t = t_next;
+            
+            cell[axis] += step[axis];
+            if (cell[axis] < 0 || cell[axis] >= dims_[axis]) {
+                break;
+            }
+            t_max[axis] += t_delta[axis];
+        }
+        return depth;
+    }
+    
+    // Radiological depth chính xác tại một điểm, dọc theo tia từ source
+    double radiological_depth(const std::array<double, 3>& source,
+                              const std::array<double, 3>& point) const {
+        std::array<double, 3> dir = {point[0] - source[0], point[1] - source[1], point[2] - source[2]};
+        double length = std::sqrt(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+        if (length <= 0.0) {
+            return 0.0;
+        }
+        for (int a = 0; a < 3; ++a) {
+            dir[a] /= length;
+        }
+        return trace(source, dir, length, [](long, long, long, double, double, double, double) {});
+    }
+    
+    /**
+     * Radiological depth của mọi voxel cho chùm tia phân kỳ từ nguồn điểm.
+     *
+     * Thay vì dò tia riêng cho từng voxel, một lưới tia hình quạt (mật độ không
+     * lớn hơn ray_spacing tại mặt phẳng xa nhất) được dò một lần; mỗi tia đóng góp
+     * depth tại hình chiếu tâm voxel lên tia cho các voxel nó đi qua, có trọng số
+     * theo khoảng cách vuông góc. Voxel không có tia nào đi qua được dò riêng.
+     */
+    Volume3D<T> depth_map(const std::array<double, 3>& source,
+                          const std::array<double, 3>& central_axis,
+                          double ray_spacing) const {
+        DensityVolume depth = DensityVolume::like(density_, 0.0);
+        if (density_.empty()) {
+            return volume_cast<T>(std::move(depth));
+        }
+        
+        std::array<double, 3> axis_u;
+        std::array<double, 3> axis_v;
+        perpendicular_basis(central_axis, axis_u, axis_v);
+        
+        // Hình chiếu 8 góc lưới lên mặt phẳng tan(góc) của trường quạt
+        double u_min = std::numeric_limits<double>::max(), u_max = -u_min;
+        double v_min = u_min, v_max = -u_min;
+        double axial_min = u_min, axial_max = 0.0;
+        for (int corner = 0; corner < 8; ++corner) {
+            std::array<double, 3> c = {
+                (corner & 1) ? upper_[0] : lower_[0],
+                (corner & 2) ? upper_[1] : lower_[1],
+                (corner & 4) ? upper_[2] : lower_[2]
+            };
+            std::array<double, 3> w = {c[0] - source[0], c[1] - source[1], c[2] - source[2]};
+            double axial = dot(w, central_axis);
+            axial_min = std::min(axial_min, axial);
+            axial_max = std::max(axial_max, axial);
+            if (axial > 0.0) {
+                u_min = std::min(u_min, dot(w, axis_u) / axial);
+                u_max = std::max(u_max, dot(w, axis_u) / axial);
+                v_min = std::min(v_min, dot(w, axis_v) / axial);
+                v_max = std::max(v_max, dot(w, axis_v) / axial);
+            }
+        }
+        
+        const long depth_n = static_cast<long>(depth.depth());
+        const long height_n = static_cast<long>(depth.height());
+        const long width_n = static_cast<long>(depth.width());
+        
+        // Nguồn nằm trong hoặc sau lưới: không dựng được trường quạt, dò riêng từng voxel
+        if (axial_min <= 0.0) {
+            #pragma omp parallel for collapse(2) schedule(dynamic)
+            for (long z = 0; z < depth_n; ++z) {
+                for (long y = 0; y < height_n; ++y) {
+                    double* row = depth.row(z, y);
+                    for (long x = 0; x < width_n; ++x) {
+                        row[x] = radiological_depth(source, voxel_center(x, y, z));
+                    }
+                }
+            }
+            return volume_cast<T>(std::move(depth));
+        }
+        
+        double step = ray_spacing / axial_max;
+        const long num_u = static_cast<long>(std::ceil((u_max - u_min) / step)) + 1;
+        const long num_v = static_cast<long>(std::ceil((v_max - v_min) / step)) + 1;
+        double t_far = std::numeric_limits<double>::max();
+        
+        DensityVolume weight = DensityVolume::like(density_, 0.0);
+        const double eps2 = 0.01 * ray_spacing * ray_spacing;
+        
+        #pragma omp parallel for collapse(2) schedule(dynamic)
+        for (long iv = 0; iv < num_v; ++iv) {
+            for (long iu = 0; iu < num_u; ++iu) {
+                double tu = u_min + iu * step;
+                double tv = v_min + iv * step;
+                std::array<double, 3> dir;
+                for (int a = 0; a < 3; ++a) {
+                    dir[a] = central_axis[a] + tu * axis_u[a] + tv * axis_v[a];
+                }
+                double norm = std::sqrt(dot(dir, dir));
+                for (int a = 0; a < 3; ++a) {
+                    dir[a] /= norm;
+                }
+                
+                trace(source, dir, t_far, [&](long x, long y, long z, double t_in, double t_out,
+                                              double depth_in, double rho) {
+                    std::array<double, 3> c = voxel_center(x, y, z);
+                    std::array<double, 3> w = {c[0] - source[0], c[1] - source[1], c[2] - source[2]};
+                    double t_center = dot(w, dir);
+                    double d2 = std::max(0.0, dot(w, w) - t_center * t_center);
+                    double t_clamped = std::max(t_in, std::min(t_center, t_out));
+                    double value = depth_in + rho * (t_clamped - t_in);
+                    double wgt = 1.0 / (d2 + eps2);
+                    
+                    std::size_t idx = depth.index(z, y, x);
+                    #pragma omp atomic
+                    depth[idx] += wgt * value;
+                    #pragma omp atomic
+                    weight[idx] += wgt;
+                });
+            }
+        }
+        
+        #pragma omp parallel for collapse(2) schedule(dynamic)
+        for (long z = 0; z < depth_n; ++z) {
+            for (long y = 0; y < height_n; ++y) {
+                double* row = depth.row(z, y);
+                const double* wrow = weight.row(z, y);
+                for (long x = 0; x < width_n; ++x) {
+                    row[x] = (wrow[x] > 0.0)
+                        ? row[x] / wrow[x]
+                        : radiological_depth(source, voxel_center(x, y, z));
+                }
+            }
+        }
+        
+        return volume_cast<T>(std::move(depth));
+    }
+    
+    // Hai vector đơn vị vuông góc với hướng chùm tia (cùng quy ước với PencilBeam)
+    static void perpendicular_basis(const std::array<double, 3>& direction,
+                                    std::array<double, 3>& perp_x,
+                                    std::array<double, 3>& perp_y) {
+        perp_x = {-direction[2], 0.0, direction[0]};
+        double magnitude_x = std::sqrt(perp_x[0] * perp_x[0] + perp_x[2] * perp_x[2]);
+        if (magnitude_x > 0) {
+            perp_x[0] /= magnitude_x;
+            perp_x[2] /= magnitude_x;
+        } else {
+            perp_x = {1.0, 0.0, 0.0};
+        }
+        
+        perp_y = {
+            direction[1] * perp_x[2] - direction[2] * perp_x[1],
+            direction[2] * perp_x[0] - direction[0] * perp_x[2],
+            direction[0] * perp_x[1] - direction[1] * perp_x[0]
+        };
+        double magnitude_y = std::sqrt(dot(perp_y, perp_y));
+        if (magnitude_y > 0) {
+            for (int a = 0; a < 3; ++a) {
+                perp_y[a] /= magnitude_y;
+            }
+        }
+    }
+    
+private:
+    static double dot(const std::array<double, 3>& a, const std::array<double, 3>& b) {
+        return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+    }
+    
+    std::array<double, 3> voxel_center(long x, long y, long z) const {
+        return {x * spacing_[0], y * spacing_[1], z * spacing_[2]};
+    }
+    
+    // Cắt tia với hộp bao của lưới (phương pháp slab), cập nhật [t_enter, t_exit]
+    bool clip(const std::array<double, 3>& source,
+              const std::array<double, 3>& direction,
+              double& t_enter, double& t_exit) const {
+        for (int a = 0; a < 3; ++a) {
+            if (direction[a] == 0.0) {
+                if (source[a] < lower_[a] || source[a] >= upper_[a]) {
+                    return false;
+                }
+                continue;
+            }
+            double t0 = (lower_[a] - source[a]) / direction[a];
+            double t1 = (upper_[a] - source[a]) / direction[a];
+            if (t0 > t1) {
+                std::swap(t0, t1);
+            }
+            t_enter = std::max(t_enter, t0);
+            t_exit = std::min(t_exit, t1);
+        }
+        return t_enter < t_exit;
+    }
+    
+    const Volume3D<T>& density_;
+    std::array<double, 3> spacing_;
+    std::array<double, 3> lower_;
+    std::array<double, 3> upper_;
+    std::array<long, 3> dims_;
+};
+
+using RayTracer = BasicRayTracer<double>;
+
+/**
+ * Bộ đệm radiological depth theo chùm tia, khóa (hash CT, gantry, couch, isocenter).
+ * Tính lại một chùm tia chỉ đổi MLC/trọng số sẽ dùng lại kết quả dò tia.
+ * An toàn khi gọi từ nhiều luồng; giữ tối đa max_entries mục (bỏ mục cũ nhất).
+ */
+template <typename T>
+class BasicRadiologicalDepthCache {
+public:
+    struct Key {
+        std::uint64_t ct_hash;
+        double gantry_angle;
+        double couch_angle;
+        std::array<double, 3> isocenter;
+        
+        bool operator<(const Key& other) const {
+            return std::tie(ct_hash, gantry_angle, couch_angle, isocenter) <
+                   std::tie(other.ct_hash, other.gantry_angle, other.couch_angle, other.isocenter);
+        }
+    };
+    
+    using Entry = std::shared_ptr<const Volume3D<T>>;
+    
+    explicit BasicRadiologicalDepthCache(std::size_t max_entries = 8) : max_entries_(max_entries) {}
+    
+    Entry find(const Key& key) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        if (it == entries_.end()) {
+            ++misses_;
+            return nullptr;
+        }
+        ++hits_;
+        return it->second;
+    }
+    
+    void insert(const Key& key, Entry value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (max_entries_ == 0) {
+            return;
+        }
+        if (entries_.find(key) == entries_.end()) {
+            order_.push_back(key);
+        }
+        entries_[key] = std::move(value);
+        while (entries_.size() > max_entries_) {
+            entries_.erase(order_.front());
+            order_.pop_front();
+        }
+    }
+    
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+        order_.clear();
+    }
+    
+    void set_max_entries(std::size_t max_entries) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        max_entries_ = max_entries;
+        while (entries_.size() > max_entries_) {
+            entries_.erase(order_.front());
+            order_.pop_front();
+        }
+    }
+    
+    std::size_t max_entries() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return max_entries_;
+    }
+    
+    std::size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.size();
+    }
+    
+    std::size_t hits() const { return hits_; }
+    std::size_t misses() const { return misses_; }
+    
+private:
+    mutable std::mutex mutex_;
+    std::map<Key, Entry> entries_;
+    std::deque<Key> order_;
+    std::size_t max_entries_;
+    mutable std::size_t hits_ = 0;
+    mutable std::size_t misses_ = 0;
+};
+
+using RadiologicalDepthCache = BasicRadiologicalDepthCache<double>;
+
+// Bộ đệm depth map cho cả hai kiểu lưu trữ (double và float32), cùng giới hạn số mục
+class RadiologicalDepthCaches {
+public:
+    template <typename T>
+    BasicRadiologicalDepthCache<T>& get();
+    
+    void set_max_entries(std::size_t max_entries) {
+        double_.set_max_entries(max_entries);
+        float_.set_max_entries(max_entries);
+    }
+    
+    void clear() {
+        double_.clear();
+        float_.clear();
+    }
+    
+    std::size_t max_entries() const { return double_.max_entries(); }
+    std::size_t size() const { return double_.size() + float_.size(); }
+    std::size_t hits() const { return double_.hits() + float_.hits(); }
+    std::size_t misses() const { return double_.misses() + float_.misses(); }
+    
+private:
+    BasicRadiologicalDepthCache<double> double_;
+    BasicRadiologicalDepthCache<float> float_;
+};
+
+template <>
+inline BasicRadiologicalDepthCache<double>& RadiologicalDepthCaches::get<double>() {
+    return double_;
+}
+
+template <>
+inline BasicRadiologicalDepthCache<float>& RadiologicalDepthCaches::get<float>() {
+    return float_;
+}
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_RAY_TRACER_H
@@ -0,0 +1,301 @@
+#ifndef QUANGSTATION_BOUNDED_SOLVER_H
+#define QUANGSTATION_BOUNDED_SOLVER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <deque>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace quangstation {
+
+// Thuật toán tối ưu trọng số của GradientOptimizer
+enum class SolverMethod {
+    GradientDescent,    // Bước cố định learning_rate, chuẩn hóa tổng trọng số = 1 (cách cũ)
+    ProjectedGradient,  // Gradient chiếu với bước Barzilai-Borwein và line search
+    LBFGSB              // Quasi-Newton L-BFGS có ràng buộc cận và line search
+};
+
+inline SolverMethod solver_method_from_string(const std::string& name) {
+    if (name == "gradient_descent" || name == "gd") return SolverMethod::GradientDescent;
+    if (name == "projected_gradient" || name == "pg") return SolverMethod::ProjectedGradient;
+    if (name == "lbfgsb" || name == "l-bfgs-b") return SolverMethod::LBFGSB;
+    throw std::invalid_argument("Thuật toán tối ưu không hợp lệ: " + name);
+}
+
+inline std::string solver_method_to_string(SolverMethod method) {
+    switch (method) {
+        case SolverMethod::ProjectedGradient: return "projected_gradient";
+        case SolverMethod::LBFGSB: return "lbfgsb";
+        default: return "gradient_descent";
+    }
+}
+
+struct BoundedSolverOptions {
+    SolverMethod method = SolverMethod::LBFGSB;
+    int max_iterations = 100;
+    int memory = 8;                             // Số cặp (s, y) giữ cho L-BFGS
+    double relative_tolerance = 1e-4;           // Dừng khi |Δf| <= tol · max(|f|, |f_trước|, 1)
+    double projected_gradient_tolerance = 1e-5; // Dừng khi ‖P(x - g) - x‖∞ <= tol · max(1, giá trị ban đầu)
+    double lower = 0.0;
+    double upper = std::numeric_limits<double>::infinity();
+    int max_line_search_steps = 30;
+    double armijo = 1e-4;                       // Hệ số giảm đủ của line search
+};
+
+// Kết quả một lần tối ưu
+struct SolverResult {
+    bool converged = false;
+    int iterations = 0;
+    int function_evaluations = 0;
+    int gradient_evaluations = 0;
+    double objective = 0.0;
+    double projected_gradient_norm = 0.0;
+    std::string message;                        // Lý do dừng
+};
+
+namespace detail {
+
+inline double dot(const std::vector<double>& a, const std::vector<double>& b) {
+    double sum = 0.0;
+    for (std::size_t i = 0; i < a.size(); ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+// ‖P(x - g) - x‖∞: bằng 0 đúng tại điểm dừng KKT của bài toán có cận
+inline double projected_gradient_norm(const std::vector<double>& x, const std::vector<double>& g,
+                                      double lower, double upper) {
+    double norm = 0.0;
+    for (std::size_t i = 0; i < x.size(); ++i) {
+        const double projected = std::min(std::max(x[i] - g[i], lower), upper);
+        norm = std::max(norm, std::abs(projected - x[i]));
+    }
+    return norm;
+}
+
+} // namespace detail
+
+/**
+ * Cực tiểu f(x) với lower <= x_i <= upper bằng phương pháp chiếu:
+ *
+ * - Biến nằm trên cận với gradient hướng ra ngoài được cố định trong bước (tập
+ *   hoạt động); hướng chỉ tính trên các biến tự do.
+ * - LBFGSB: hướng -H·g từ đệ quy hai vòng L-BFGS trên biến tự do, H₀ = (s·y / y·y) I.
+ *   ProjectedGradient: -α·g với α theo Barzilai-Borwein (s·s / s·y).
+ * - Line search lùi (Armijo) dọc cung chiếu x(α) = P(x + α·d):
+ *   f(x(α)) <= f(x) + c·g·(x(α) - x). Không tìm được bước thì bỏ bộ nhớ L-BFGS và
+ *   thử lại theo -g trước khi dừng.
+ * - Cặp (s, y) chỉ được giữ khi s·y > 0 đủ lớn, nên H luôn xác định dương.
+ *
+ * objective(x) trả về f(x); gradient(x, g) ghi ∇f(x) vào g, luôn được gọi ngay sau
+ * objective tại cùng x. progress(iteration, f) được gọi sau mỗi bước được chấp nhận và
+ * trả về false để dừng sớm (ví dụ khi công việc bị hủy).
+ * x là điểm xuất phát (warm start, được chiếu vào miền cận) và nhận nghiệm.
+ */
+template <typename Objective, typename Gradient, typename Progress>
+SolverResult minimize_bounded(std::vector<double>& x, const Objective& objective, const Gradient& gradient,
+                              const BoundedSolverOptions& options, const Progress& progress) {
+    const std::size_t n = x.size();
+    const double lower = options.lower;
+    const double upper = options.upper;
+    auto project = [lower, upper](std::vector<double>& v) {
+        for (double& value : v) {
+            value = std::min(std::max(value, lower), upper);
+        }
+    };
+    
+    SolverResult result;
+    project(x);
+    double f = objective(x);
+    std::vector<double> g(n, 0.0);
+    gradient(x, g);
+    ++result.function_evaluations;
+    ++result.gradient_evaluations;
+    
+    const double initial_norm = detail::projected_gradient_norm(x, g, lower, upper);
+    const double pg_tolerance = options.projected_gradient_tolerance * std::max(1.0, initial_norm);
+    
+    std::deque<std::vector<double>> s_history, y_history;
+    std::deque<double> rho_history;
+    double bb_step = 0.0;  // Bước Barzilai-Borwein của lần trước (0: chưa có)
+    
+    std::vector<double> d(n), trial(n), g_trial(n), q(n), alpha(options.memory > 0 ? options.memory : 1);
+    std::vector<char> free_variable(n);
+    
+    result.message = "Đạt số lần lặp tối đa";
+    bool stopped = false;
+    for (int iter = 0; iter < options.max_iterations; ++iter) {
+        result.projected_gradient_norm = detail::projected_gradient_norm(x, g, lower, upper);
+        if (result.projected_gradient_norm <= pg_tolerance) {
+            result.converged = true;
+            result.message = "Gradient chiếu nhỏ hơn ngưỡng";
+            break;
+        }
+        
+        // Tập biến tự do: không nằm trên cận với gradient đẩy ra ngoài miền
+        double g_free_norm = 0.0;
+        for (std::size_t i = 0; i < n; ++i) {
+            free_variable[i] = !((x[i] <= lower && g[i] > 0.0) || (x[i] >= upper && g[i] < 0.0));
+            if (free_variable[i]) {
+                g_free_norm = std::max(g_free_norm, std::abs(g[i]));
+            }
+        }
+        
+        // Bước đầu khi chưa có thông tin độ cong: thay đổi lớn nhất cỡ ‖x‖∞ (tối thiểu 1e-2)
+        double x_norm = 0.0;
+        for (double value : x) {
+            x_norm = std::max(x_norm, std::abs(value));
+        }
+        const double steepest_step = std::max(x_norm, 1e-2) / std::max(g_free_norm, 1e-300);
+        
+        bool accepted = false;
+        for (int attempt = 0; attempt < 2 && !accepted; ++attempt) {
+            const bool use_history = options.method == SolverMethod::LBFGSB && !s_history.empty() && attempt == 0;
+            if (use_history) {
+                // Đệ quy hai vòng trên các biến tự do
+                for (std::size_t i = 0; i < n; ++i) {
+                    q[i] = free_variable[i] ? g[i] : 0.0;
+                }
+                const std::size_t m = s_history.size();
+                for (std::size_t k = m; k-- > 0;) {
+                    double sq = 0.0;
+                    for (std::size_t i = 0; i < n; ++i) {
+                        if (free_variable[i]) {
+                            sq += s_history[k][i] * q[i];
+                        }
+                    }
+                    alpha[k] = rho_history[k] * sq;
+                    for (std::size_t i = 0; i < n; ++i) {
+                        if (free_variable[i]) {
+                            q[i] -= alpha[k] * y_history[k][i];
+                        }
+                    }
+                }
+                const double gamma = detail::dot(s_history.back(), y_history.back()) /
+                                     detail::dot(y_history.back(), y_history.back());
+                for (std::size_t i = 0; i < n; ++i) {
+                    q[i] *= gamma;
+                }
+                for (std::size_t k = 0; k < m; ++k) {
+                    double yq = 0.0;
+                    for (std::size_t i = 0; i < n; ++i) {
+                        if (free_variable[i]) {
+                            yq += y_history[k][i] * q[i];
+                        }
+                    }
+                    const double beta = rho_history[k] * yq;
+                    for (std::size_t i = 0; i < n; ++i) {
+                        if (free_variable[i]) {
+                            q[i] += (alpha[k] - beta) * s_history[k][i];
+                        }
+                    }
+                }
+                for (std::size_t i = 0; i < n; ++i) {
+                    d[i] = free_variable[i] ? -q[i] : 0.0;
+                }
+                // Không phải hướng giảm (độ cong sai lệch do tập hoạt động đổi): dùng -g
+                if (detail::dot(g, d) >= 0.0) {
+                    continue;
+                }
+            } else {
+                const double step = (options.method == SolverMethod::ProjectedGradient && bb_step > 0.0 && attempt == 0)
+                    ? bb_step : steepest_step;
+                for (std::size_t i = 0; i < n; ++i) {
+                    d[i] = free_variable[i] ? -step * g[i] : 0.0;
+                }
+            }
+            
+            // Line search lùi dọc cung chiếu
+            double step_length = 1.0;
+            for (int ls = 0; ls < options.max_line_search_steps; ++ls, step_length *= 0.5) {
+                double decrease = 0.0;
+                for (std::size_t i = 0; i < n; ++i) {
+                    trial[i] = std::min(std::max(x[i] + step_length * d[i], lower), upper);
+                    decrease += g[i] * (trial[i] - x[i]);
+                }
+                if (decrease >= 0.0) {
+                    continue;
+                }
+                const double f_trial = objective(trial);
+                ++result.function_evaluations;
+                if (f_trial <= f + options.armijo * decrease) {
+                    gradient(trial, g_trial);
+                    ++result.gradient_evaluations;
+                    
+                    // Cặp độ cong s = Δx, y = Δg
+                    std::vector<double> s(n), y(n);
+                    for (std::size_t i = 0; i < n; ++i) {
+                        s[i] = trial[i] - x[i];
+                        y[i] = g_trial[i] - g[i];
+                    }
+                    const double sy = detail::dot(s, y);
+                    const double yy = detail::dot(y, y);
+                    if (sy > 1e-12 * yy && sy > 0.0) {
+                        bb_step = detail::dot(s, s) / sy;
+                        if (options.memory > 0) {
+                            s_history.push_back(std::move(s));
+                            y_history.push_back(std::move(y));
+                            rho_history.push_back(1.0 / sy);
+                            if (s_history.size() > static_cast<std::size_t>(options.memory)) {
+                                s_history.pop_front();
+                                y_history.pop_front();
+                                rho_history.pop_front();
+                            }
+                        }
+                    }
+                    
+                    const double f_previous = f;
+                    x.swap(trial);
+                    g.swap(g_trial);
+                    f = f_trial;
+                    accepted = true;
+                    ++result.iterations;
+                    if (!progress(iter, f)) {
+                        stopped = true;
+                        result.message = "Đã hủy";
+                        break;
+                    }
+                    
+                    if (std::abs(f_previous - f) <=
+                        options.relative_tolerance * std::max(std::max(std::abs(f_previous), std::abs(f)), 1.0)) {
+                        result.converged = true;
+                        result.message = "Mức giảm hàm mục tiêu nhỏ hơn ngưỡng";
+                    }
+                    break;
+                }
+            }
+            if (!accepted) {
+                // Thông tin độ cong không còn đúng: bỏ và thử lại theo -g
+                s_history.clear();
+                y_history.clear();
+                rho_history.clear();
+                bb_step = 0.0;
+            }
+        }
+        
+        if (stopped) {
+            break;
+        }
+        if (!accepted) {
+            result.message = "Line search không tìm được bước giảm";
+            break;
+        }
+        if (result.converged) {
+            break;
+        }
+    }
+    
+    // Đưa trạng thái của bên gọi về nghiệm (lần đánh giá cuối có thể là điểm thử bị từ chối)
+    result.objective = objective(x);
+    result.projected_gradient_norm = detail::projected_gradient_norm(x, g, lower, upper);
+    return result;
+}
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_BOUNDED_SOLVER_H
@@ -0,0 +1,1633 @@
+#ifndef QUANGSTATION_OPTIMIZER_H
+#define QUANGSTATION_OPTIMIZER_H
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <chrono>
+#include <limits>
+#include <tuple>
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "volume3d.h"
+#include "grid_pool.h"
+#include "profiler.h"
+#include "structure_mask.h"
+#include "influence_matrix.h"
+#include "dose_matrix_file.h"
+#include "structure_dose.h"
+#include "running_dose.h"
+#include "bounded_solver.h"
+#include "job.h"
+
+using quangstation::DoseVolume;
+using quangstation::GridGeometry;
+using quangstation::GridPool;
+using quangstation::GridPoolStats;
+using quangstation::Profiler;
+using quangstation::ProfileStats;
+using quangstation::ScopedProfileSession;
+using quangstation::MaskVolume;
+using quangstation::StructureMask;
+using quangstation::DoseInfluenceMatrix;
+using quangstation::StructureVoxels;
+using quangstation::StructureDoseSample;
+using quangstation::StructureDoseCache;
+using quangstation::RunningDose;
+using quangstation::SolverMethod;
+using quangstation::SolverResult;
+using quangstation::BoundedSolverOptions;
+using quangstation::JobControl;
+using quangstation::JobProgress;
+
+// Cấu trúc để lưu các mục tiêu cho từng cấu trúc
+struct ObjectiveFunction {
+    enum Type {
+        MAX_DOSE,         // Liều tối đa
+        MIN_DOSE,         // Liều tối thiểu
+        MAX_DVH,          // Liều tối đa cho x% thể tích
+        MIN_DVH,          // Liều tối thiểu cho x% thể tích
+        MEAN_DOSE,        // Liều trung bình
+        CONFORMITY,       // Độ tương thích của liều với cấu trúc
+        HOMOGENEITY,      // Độ đồng nhất liều trong cấu trúc
+        UNIFORMITY        // Độ đều liều trong cấu trúc
+    };
+    
+    std::string structure_name;    // Tên cấu trúc
+    Type type;                     // Loại mục tiêu
+    double dose;                   // Giá trị liều mục tiêu (Gy)
+    double volume_percent;         // Phần trăm thể tích (cho DVH)
+    double weight;                 // Trọng số, càng cao càng quan trọng
+    
+    ObjectiveFunction(const std::string& name, Type t, double d, double vol = 0.0, double w = 1.0) 
+        : structure_name(name), type(t), dose(d), volume_percent(vol), weight(w) {}
+};
+
+// PIV của CONFORMITY đếm mọi voxel nhận liều kê toa, kể cả mô ngoài các cấu trúc:
+// khi có mục tiêu này ma trận ảnh hưởng (chế độ lấy mẫu tự động) giữ toàn bộ lưới
+inline bool needs_full_dose_grid(const std::vector<ObjectiveFunction>& objectives) {
+    return std::any_of(objectives.begin(), objectives.end(), [](const ObjectiveFunction& objective) {
+        return objective.type == ObjectiveFunction::CONFORMITY;
+    });
+}
+
+// Mặt nạ voxel cho cột đầu tiên của ma trận ảnh hưởng theo bước lấy mẫu (< 0: tự động)
+inline MaskVolume influence_voxel_mask(
+    const DoseVolume& beam_dose,
+    const std::map<std::string, StructureMask>& structure_masks,
+    const std::vector<ObjectiveFunction>& objectives,
+    int outside_voxel_stride) {
+    
+    if (structure_masks.empty() || (outside_voxel_stride < 0 && needs_full_dose_grid(objectives))) {
+        return MaskVolume();
+    }
+    return DoseInfluenceMatrix::structure_union(beam_dose, structure_masks, std::max(0, outside_voxel_stride));
+}
+
+// Mục tiêu CONFORMITY thêm sau khi ma trận ảnh hưởng đã bỏ voxel ngoài cấu trúc sẽ tính sai PIV
+inline void check_objective_grid(
+    const ObjectiveFunction& objective, const DoseInfluenceMatrix& matrix, int outside_voxel_stride) {
+    
+    if (objective.type == ObjectiveFunction::CONFORMITY && outside_voxel_stride < 0 &&
+        matrix.num_columns() > 0 && matrix.has_voxel_mask()) {
+        throw std::logic_error("Thêm mục tiêu CONFORMITY trước ma trận liều chùm tia "
+                               "(hoặc đặt set_outside_voxel_stride)");
+    }
+}
+
+// Lớp tối ưu hóa kế hoạch sử dụng thuật toán gradient descent
+class GradientOptimizer {
+private:
+    DoseVolume dose_matrix;                        // Ma trận liều
+    std::map<std::string, StructureMask> structure_masks; // Mặt nạ cấu trúc (nén, xem structure_mask.h)
+    std::map<std::string, StructureVoxels> structure_voxels; // Chỉ số voxel của từng cấu trúc
+    std::vector<ObjectiveFunction> objectives;     // Danh sách mục tiêu
+    std::vector<std::vector<double>> beam_weights; // Trọng số chùm tia
+    double learning_rate;                          // Tốc độ học
+    int max_iterations;                            // Số lần lặp tối đa
+    double convergence_threshold;                  // Ngưỡng hội tụ
+    
+    // Ma trận ảnh hưởng thưa: mỗi cột là liều của một chùm tia
+    DoseInfluenceMatrix beam_dose_matrices;
+    int outside_voxel_stride = -1;                 // Lấy mẫu voxel ngoài cấu trúc (0 = bỏ, < 0 = tự động)
+    
+    // Liều tổng giữ giữa các lần đánh giá, cập nhật theo cột khi ít trọng số thay đổi
+    RunningDose running_dose;
+    
+    // Buffer sai số liều của gradient, dùng lại qua các lần lặp
+    GridPool grid_pool;
+    StructureVoxels rank_scratch;                  // Voxel sắp theo liều của mục tiêu theo thứ hạng
+    Profiler profiler;                             // Thời gian/bộ đếm của lần tối ưu gần nhất
+    
+    // Thuật toán của optimize() và các tham số của bộ giải có cận (bounded_solver.h)
+    SolverMethod solver = SolverMethod::GradientDescent;
+    int lbfgs_memory = 8;
+    double lower_weight = 0.0;
+    double upper_weight = std::numeric_limits<double>::infinity();
+    double projected_gradient_tolerance = 1e-5;
+    SolverResult last_result;
+    
+    // Công việc đang chạy optimize(control): nhận tiến trình thay cho std::cout và cờ hủy
+    JobControl* job_control = nullptr;
+    double best_reported_objective = std::numeric_limits<double>::infinity();
+    
+public:
+    // Nhận theo giá trị: truyền std::move (hoặc view) để tránh sao chép lưới
+    GradientOptimizer(
+        DoseVolume dose_matrix,
+        std::map<std::string, StructureMask> structure_masks,
+        double learning_rate = 0.01,
+        int max_iterations = 100,
+        double convergence_threshold = 1e-4
+    ) : dose_matrix(std::move(dose_matrix)), structure_masks(std::move(structure_masks)),
+        learning_rate(learning_rate), max_iterations(max_iterations),
+        convergence_threshold(convergence_threshold) {
+        structure_voxels = quangstation::build_structure_voxels(this->structure_masks);
+    }
+    
+    // Mặt nạ dạng lưới (có thể là view) được nén một lần, không giữ lại
+    GradientOptimizer(
+        DoseVolume dose_matrix,
+        const std::map<std::string, MaskVolume>& structure_masks,
+        double learning_rate = 0.01,
+        int max_iterations = 100,
+        double convergence_threshold = 1e-4
+    ) : GradientOptimizer(std::move(dose_matrix), quangstation::compress_masks(structure_masks),
+                          learning_rate, max_iterations, convergence_threshold) {}
+    
+    // Giao diện cũ với mảng lồng nhau
+    GradientOptimizer(
+        const std::vector<std::vector<std::vector<double>>>& dose_matrix,
+        const std::map<std::string, std::vector<std::vector<std::vector<int>>>>& structure_masks,
+        double learning_rate = 0.01,
+        int max_iterations = 100,
+        double convergence_threshold = 1e-4
+    ) : GradientOptimizer(DoseVolume::from_nested(dose_matrix), convert_masks(structure_masks),
+                          learning_rate, max_iterations, convergence_threshold) {}
+    
+    // Thêm mục tiêu để tối ưu hóa
+    void add_objective(const ObjectiveFunction& objective) {
+        check_objective_grid(objective, beam_dose_matrices, outside_voxel_stride);
+        objectives.push_back(objective);
+    }
+    
+    // Thêm ma trận liều của từng chùm tia (phải cùng kích thước với ma trận liều).
+    // Chỉ các voxel thuộc hợp các cấu trúc (và lưới lấy mẫu bên ngoài) được lưu lại.
+    void add_beam_dose_matrix(const DoseVolume& beam_dose) {
+        if (!dose_matrix.empty() && !beam_dose.same_shape(dose_matrix)) {
+            throw std::invalid_argument("Kích thước ma trận liều chùm tia không khớp với ma trận liều");
+        }
+        if (beam_dose_matrices.empty()) {
+            beam_dose_matrices = DoseInfluenceMatrix(beam_dose);
+            beam_dose_matrices.set_voxel_mask(
+                influence_voxel_mask(beam_dose, structure_masks, objectives, outside_voxel_stride));
+        }
+        beam_dose_matrices.add_column(beam_dose);
+        running_dose.invalidate();
+    }
+    
+    // Dùng trực tiếp ma trận ảnh hưởng do dose engine dựng sẵn (thay cho các cột đã thêm)
+    void set_influence_matrix(DoseInfluenceMatrix matrix) {
+        if (!dose_matrix.empty() && !matrix.same_grid(dose_matrix)) {
+            throw std::invalid_argument("Kích thước ma trận ảnh hưởng không khớp với ma trận liều");
+        }
+        beam_dose_matrices = std::move(matrix);
+        beam_weights.clear();
+        running_dose.invalidate();
+    }
+    
+    // Ánh xạ ma trận ảnh hưởng từ tệp (xem dose_matrix_file.h), cột theo column_ids (rỗng: mọi cột)
+    void load_influence_matrix_file(const std::string& path, const std::vector<std::string>& column_ids = {}) {
+        set_influence_matrix(quangstation::open_dose_matrix_file(path, column_ids));
+    }
+    
+    /**
+     * Bước lấy mẫu voxel ngoài cấu trúc cho các cột thêm sau (0 = chỉ giữ voxel trong cấu
+     * trúc). Mặc định (< 0) tự động: giữ toàn bộ lưới nếu có mục tiêu CONFORMITY (PIV và
+     * gradient của nó cần liều mô ngoài cấu trúc), ngược lại chỉ giữ voxel trong cấu trúc.
+     */
+    void set_outside_voxel_stride(int stride) {
+        outside_voxel_stride = std::max(-1, stride);
+    }
+    
+    const DoseInfluenceMatrix& get_influence_matrix() const {
+        return beam_dose_matrices;
+    }
+    
+    void add_beam_dose_matrix(const std::vector<std::vector<std::vector<double>>>& beam_dose) {
+        add_beam_dose_matrix(DoseVolume::from_nested(beam_dose));
+    }
+    
+    // Nén mặt nạ từ mảng lồng nhau, từng cấu trúc một (chỉ một lưới tạm tại một thời điểm)
+    static std::map<std::string, StructureMask> convert_masks(
+        const std::map<std::string, std::vector<std::vector<std::vector<int>>>>& masks) {
+        std::map<std::string, StructureMask> result;
+        for (const auto& entry : masks) {
+            result.emplace(entry.first, StructureMask(MaskVolume::from_nested(entry.second)));
+        }
+        return result;
+    }
+    
+    // Khởi tạo trọng số chùm tia ban đầu (đều nhau)
+    void initialize_beam_weights() {
+        int num_beams = beam_dose_matrices.empty() ? 0 : beam_dose_matrices.num_columns();
+        if (num_beams > 0) {
+            beam_weights.resize(num_beams, std::vector<double>(1, 1.0 / num_beams));
+        }
+    }
+    
+    // Tính hàm mục tiêu (mục tiêu càng thấp càng tốt)
+    double calculate_objective_function() {
+        double total_objective = 0.0;
+        
+        // Liều tổng theo trọng số hiện tại: chỉ các cột có trọng số đổi được cộng lại
+        sync_running_dose();
+        Profiler::ScopedTimer timer(profiler, "objective");
+        RunningDose& structure_doses = running_dose;
+        const DoseVolume& total_dose = running_dose.dose();
+        
+        // Liều từng cấu trúc được gom một lần, dùng chung cho mọi mục tiêu trên cấu trúc đó
+        StructureDoseSample no_doses;
+        
+        // Đánh giá mỗi mục tiêu
+        for (const auto& objective : objectives) {
+            double objective_value = 0.0;
+            
+            // Lấy mặt nạ cấu trúc; mặt nạ khác kích thước coi như không có voxel
+            const auto& mask = structure_masks.at(objective.structure_name);
+            const bool mask_matches = mask.same_shape(total_dose);
+            StructureDoseSample& doses = mask_matches ? *structure_doses.find(objective.structure_name) : no_doses;
+            
+            // Tính giá trị mục tiêu theo loại
+            switch (objective.type) {
+                case ObjectiveFunction::MAX_DOSE: {
+                    // Mục tiêu: Liều tối đa <= mục tiêu
+                    double max_dose = doses.max();
+                    if (max_dose > objective.dose) {
+                        objective_value = std::pow(max_dose - objective.dose, 2);
+                    }
+                    break;
+                }
+                case ObjectiveFunction::MIN_DOSE: {
+                    // Mục tiêu: Liều tối thiểu >= mục tiêu
+                    double min_dose = doses.min();
+                    if (min_dose < objective.dose) {
+                        objective_value = std::pow(objective.dose - min_dose, 2);
+                    }
+                    break;
+                }
+                case ObjectiveFunction::MAX_DVH: {
+                    // Mục tiêu: Liều ở % thể tích <= mục tiêu
+                    if (!doses.empty()) {
+                        size_t index = static_cast<size_t>((1.0 - objective.volume_percent / 100.0) * doses.size());
+                        double dose_at_volume = doses.at_rank(index);
+                        if (dose_at_volume > objective.dose) {
+                            objective_value = std::pow(dose_at_volume - objective.dose, 2);
+                        }
+                    }
+                    break;
+                }
+                case ObjectiveFunction::MIN_DVH: {
+                    // Mục tiêu: Liều ở % thể tích >= mục tiêu
+                    if (!doses.empty()) {
+                        size_t index = static_cast<size_t>((objective.volume_percent / 100.0) * doses.size());
+                        double dose_at_volume = doses.at_rank(index);
+                        if (dose_at_volume < objective.dose) {
+                            objective_value = std::pow(objective.dose - dose_at_volume, 2);
+                        }
+                    }
+                    break;
+                }
+                case ObjectiveFunction::MEAN_DOSE: {
+                    // Mục tiêu: Liều trung bình = mục tiêu
+                    if (!doses.empty()) {
+                        objective_value = std::pow(doses.mean() - objective.dose, 2);
+                    }
+                    break;
+                }
+                case ObjectiveFunction::CONFORMITY: {
+                    // Paddick CI = (TV_PIV)² / (TV × PIV)
+                    // TV_PIV: thể tích đích nhận liều kê toa
+                    // TV: thể tích đích
+                    // PIV: thể tích nhận liều kê toa (trên toàn lưới)
+                    double paddick_ci = 0.0;
+                    if (mask_matches) {
+                        paddick_ci = paddick_conformity(structure_doses.count_at_least(objective.dose),
+                                                        doses, objective.dose);
+                    }
+                    
+                    // Mục tiêu là tối đa hóa chỉ số Paddick (gần 1.0)
+                    // Chuyển thành bài toán tối thiểu hóa
+                    objective_value = std::max(0.0, 1.0 - paddick_ci);
+                    break;
+                }
+                case ObjectiveFunction::HOMOGENEITY: {
+                    // Mục tiêu: Độ đồng nhất cao (chênh lệch liều trong PTV thấp)
+                    if (doses.size() > 1) {
+                        double d98 = doses.at_rank(static_cast<size_t>(0.02 * doses.size()));
+                        double d2 = doses.at_rank(static_cast<size_t>(0.98 * doses.size()));
+                        double homogeneity_index = d2 / d98;
+                        // Mục tiêu: HI càng gần 1 càng tốt
+                        objective_value = std::pow(homogeneity_index - 1.0, 2) * 100;
+                    }
+                    break;
+                }
+                case ObjectiveFunction::UNIFORMITY: {
+                    // Mục tiêu: Độ đều (std deviation thấp)
+                    if (doses.size() > 1) {
+                        double mean = doses.mean();
+                        double std_dev = std::sqrt(doses.sum_squares() / doses.size() - mean * mean);
+                        objective_value = std::pow(std_dev / mean, 2) * 100;
+                    }
+                    break;
+                }
+            }
+            
+            // Cộng vào mục tiêu tổng với trọng số
+            total_objective += objective_value * objective.weight;
+        }
+        
+        return total_objective;
+    }
+    
+    // Chỉ số Paddick: TV và TV_PIV từ liều của cấu trúc, PIV đếm trên toàn lưới
+    // (RunningDose::count_at_least cập nhật PIV theo cột thay vì dựng lại mặt nạ đồng liều)
+    static double paddick_conformity(size_t piv_volume, const StructureDoseSample& target,
+                                     double prescribed_dose) {
+        size_t tv_volume = target.size();
+        size_t tv_piv_volume = target.count_at_least(prescribed_dose);
+        if (tv_volume == 0 || piv_volume == 0) {
+            return 0.0;
+        }
+        return std::pow(static_cast<double>(tv_piv_volume), 2) /
+               (static_cast<double>(tv_volume) * piv_volume);
+    }
+    
+    // Tính tổng liều dựa trên trọng số chùm tia hiện tại (SpMV trên ma trận ảnh hưởng)
+    DoseVolume calculate_total_dose() {
+        if (beam_dose_matrices.empty()) {
+            return DoseVolume::like(dose_matrix, 0.0);
+        }
+        
+        return beam_dose_matrices.multiply(column_weights());
+    }
+    
+    /**
+     * Gradient giải tích (adjoint) theo trọng số chùm tia.
+     *
+     * Với D = Σ_b w_b·B_b, dF/dw_b = Σ_i (dF/dD_i)·B_b[i]: một lượt duyệt liều tổng
+     * để cộng dồn dF/dD_i (sai số liều) của mọi mục tiêu, rồi một phép nhân B^T·g
+     * thưa trên ma trận ảnh hưởng. MAX/MIN dose và DVH dùng đạo hàm tại voxel
+     * đạt giá trị tương ứng; CONFORMITY/HOMOGENEITY dùng hàm thay thế trơn.
+     */
+    std::vector<std::vector<double>> calculate_gradient() {
+        // Ma trận gradient có cùng kích thước với trọng số chùm tia
+        std::vector<std::vector<double>> gradient(beam_weights.size());
+        for (size_t b = 0; b < gradient.size(); ++b) {
+            gradient[b].resize(beam_weights[b].size(), 0.0);
+        }
+        
+        // Liều tổng hiện tại
+        sync_running_dose();
+        const DoseVolume& current_dose = running_dose.dose();
+        
+        if (beam_dose_matrices.empty()) {
+            return gradient;
+        }
+        Profiler::ScopedTimer timer(profiler, "gradient", beam_dose_matrices.nnz());
+        
+        // Sai số liều dF/dD_i cộng dồn qua các mục tiêu
+        GridPool::Buffer<double> dose_error = grid_pool.acquire_buffer<double>(current_dose.size(), 0.0);
+        for (const auto& objective : objectives) {
+            if (structure_masks.at(objective.structure_name).same_shape(current_dose)) {
+                accumulate_objective_gradient(objective, current_dose, dose_error.data());
+            }
+        }
+        
+        // B^T·g trên các phần tử đã lưu của ma trận ảnh hưởng
+        std::vector<double> column_gradient = beam_dose_matrices.transpose_multiply(dose_error.data());
+        grid_pool.release_buffer(std::move(dose_error));
+        for (size_t b = 0; b < gradient.size() && b < column_gradient.size(); ++b) {
+            // Mọi control point của chùm tia cùng nhân với một cột
+            std::fill(gradient[b].begin(), gradient[b].end(), column_gradient[b]);
+        }
+        
+        return gradient;
+    }
+    
+    /**
+     * Gradient số bằng sai phân hữu hạn (dùng để kiểm tra calculate_gradient).
+     * Mỗi nhiễu loạn chỉ đổi một cột nên liều tổng và mẫu liều cấu trúc được
+     * cập nhật trên các voxel của cột đó rồi hoàn lại, không tính lại từ đầu.
+     */
+    std::vector<std::vector<double>> calculate_numerical_gradient(double delta = 1e-5) {
+        std::vector<std::vector<double>> gradient(beam_weights.size());
+        double current_objective = calculate_objective_function();
+        
+        for (size_t b = 0; b < beam_weights.size(); ++b) {
+            gradient[b].resize(beam_weights[b].size(), 0.0);
+            for (size_t c = 0; c < beam_weights[b].size(); ++c) {
+                beam_weights[b][c] += delta;
+                gradient[b][c] = (calculate_objective_function() - current_objective) / delta;
+                beam_weights[b][c] -= delta;
+            }
+            // Đưa cột b về trọng số ban đầu trước khi nhiễu loạn cột tiếp theo
+            sync_running_dose();
+        }
+        
+        return gradient;
+    }
+    
+    // Thuật toán của optimize(): "gradient_descent" (mặc định), "projected_gradient" hoặc "lbfgsb"
+    void set_solver(const std::string& name) {
+        solver = quangstation::solver_method_from_string(name);
+    }
+    
+    std::string get_solver() const {
+        return quangstation::solver_method_to_string(solver);
+    }
+    
+    // Số cặp (s, y) của L-BFGS
+    void set_lbfgs_memory(int memory) {
+        lbfgs_memory = std::max(1, memory);
+    }
+    
+    // Cận của từng trọng số control point cho ProjectedGradient/LBFGSB (gradient descent chỉ kẹp >= 0)
+    void set_weight_bounds(double lower, double upper) {
+        if (!(lower <= upper)) {
+            throw std::invalid_argument("Cận dưới của trọng số phải nhỏ hơn hoặc bằng cận trên");
+        }
+        lower_weight = lower;
+        upper_weight = upper;
+    }
+    
+    // Ngưỡng dừng theo gradient chiếu, tương đối so với max(1, giá trị ban đầu)
+    void set_projected_gradient_tolerance(double tolerance) {
+        projected_gradient_tolerance = std::max(0.0, tolerance);
+    }
+    
+    // Trọng số xuất phát (warm start), ví dụ kết quả của lần tối ưu trước:
+    // mỗi chùm tia một vector control point, số chùm tia phải bằng số cột đã thêm
+    void set_initial_weights(const std::vector<std::vector<double>>& weights) {
+        if (!beam_dose_matrices.empty() && weights.size() != beam_dose_matrices.num_columns()) {
+            throw std::invalid_argument("Số trọng số xuất phát không khớp với số chùm tia");
+        }
+        for (const auto& beam_weight : weights) {
+            if (beam_weight.empty()) {
+                throw std::invalid_argument("Mỗi chùm tia cần ít nhất một trọng số control point");
+            }
+        }
+        beam_weights = weights;
+    }
+    
+    /**
+     * Tối ưu trọng số bằng thuật toán đã chọn, bắt đầu từ trọng số hiện tại
+     * (khởi tạo đều nếu chưa có). Kết quả (hội tụ, số lần lặp, số lần đánh giá,
+     * giá trị mục tiêu) cũng được giữ lại cho get_last_result().
+     */
+    SolverResult optimize() {
+        ScopedProfileSession profile(profiler, grid_pool);
+        // Khởi tạo trọng số chùm tia nếu chưa có
+        if (beam_weights.empty()) {
+            initialize_beam_weights();
+        }
+        
+        best_reported_objective = std::numeric_limits<double>::infinity();
+        if (solver == SolverMethod::GradientDescent) {
+            last_result = optimize_gradient_descent();
+        } else {
+            last_result = optimize_bounded();
+        }
+        return last_result;
+    }
+    
+    /**
+     * Như optimize() nhưng chạy dưới một JobControl (thường là của AsyncJob): sau mỗi
+     * lần lặp báo {"optimize", lần lặp, max_iterations, mục tiêu} và trọng số tốt nhất
+     * đến lúc đó (phẳng theo chùm tia, control point) thay vì in ra std::cout. Khi
+     * control bị hủy, dừng ở lần lặp kế tiếp với message "Đã hủy" và giữ trọng số hiện có.
+     */
+    SolverResult optimize(JobControl& control) {
+        JobControl* saved_control = job_control;
+        job_control = &control;
+        try {
+            optimize();
+        } catch (...) {
+            job_control = saved_control;
+            throw;
+        }
+        job_control = saved_control;
+        return last_result;
+    }
+    
+    const SolverResult& get_last_result() const {
+        return last_result;
+    }
+    
+    // Kết quả hai giai đoạn của optimize_multiresolution
+    struct MultiResolutionResult {
+        SolverResult coarse;
+        SolverResult fine;
+    };
+    
+    /**
+     * Tối ưu thô-đến-mịn: giai đoạn đầu tối ưu đến hội tụ (tối đa coarse_iterations lần
+     * lặp) trên coarse_matrix, ma trận ảnh hưởng cùng các chùm tia trên lưới liều thô
+     * (DoseAlgorithm::calculate_influence_matrix với on_dose_grid), với mặt nạ cấu trúc
+     * lấy mẫu lại lên lưới đó; trọng số thu được là điểm xuất phát cho tối đa
+     * fine_iterations lần lặp trên ma trận ảnh hưởng hiện tại (lưới mịn). Mục tiêu tính
+     * theo liều từng voxel nên gần như không đổi giữa hai lưới, và giai đoạn mịn chỉ
+     * cần vài lần lặp. Hai ma trận phải mang spacing/origin cùng đơn vị (mm).
+     */
+    MultiResolutionResult optimize_multiresolution(DoseInfluenceMatrix coarse_matrix,
+                                                   int coarse_iterations, int fine_iterations) {
+        if (beam_dose_matrices.empty()) {
+            throw std::invalid_argument("Chưa có ma trận ảnh hưởng trên lưới mịn");
+        }
+        if (coarse_matrix.num_columns() != beam_dose_matrices.num_columns()) {
+            throw std::invalid_argument("Ma trận ảnh hưởng thô và mịn có số chùm tia khác nhau");
+        }
+        
+        ScopedProfileSession profile(profiler, grid_pool);
+        const GridGeometry fine_grid = geometry_of(beam_dose_matrices);
+        const GridGeometry coarse_grid = geometry_of(coarse_matrix);
+        std::map<std::string, StructureMask> coarse_masks;
+        for (const auto& entry : structure_masks) {
+            // Mặt nạ khác kích thước lưới mịn coi như không có voxel, như trong hàm mục tiêu
+            coarse_masks.emplace(entry.first, entry.second.same_shape(fine_grid)
+                ? StructureMask(quangstation::resample_mask(entry.second.to_volume(), fine_grid, coarse_grid))
+                : StructureMask());
+        }
+        
+        GradientOptimizer coarse(coarse_matrix.make_grid(), std::move(coarse_masks), learning_rate,
+                                 coarse_iterations, convergence_threshold);
+        coarse.objectives = objectives;
+        coarse.solver = solver;
+        coarse.lbfgs_memory = lbfgs_memory;
+        coarse.lower_weight = lower_weight;
+        coarse.upper_weight = upper_weight;
+        coarse.projected_gradient_tolerance = projected_gradient_tolerance;
+        coarse.job_control = job_control;
+        coarse.set_influence_matrix(std::move(coarse_matrix));
+        if (!beam_weights.empty()) {
+            coarse.set_initial_weights(beam_weights);
+        }
+        
+        MultiResolutionResult result;
+        result.coarse = coarse.optimize();
+        profiler.merge(coarse.get_profile_stats());
+        set_initial_weights(coarse.get_optimized_weights());
+        
+        const int saved_iterations = max_iterations;
+        max_iterations = fine_iterations;
+        try {
+            result.fine = optimize();
+        } catch (...) {
+            max_iterations = saved_iterations;
+            throw;
+        }
+        max_iterations = saved_iterations;
+        return result;
+    }
+    
+    // Chuẩn hóa trọng số để tổng bằng 1
+    void normalize_weights() {
+        double sum = 0.0;
+        
+        // Tính tổng tất cả trọng số
+        for (const auto& beam_weight : beam_weights) {
+            sum += std::accumulate(beam_weight.begin(), beam_weight.end(), 0.0);
+        }
+        
+        // Chia tất cả trọng số cho tổng
+        if (sum > 0.0) {
+            for (auto& beam_weight : beam_weights) {
+                for (auto& weight : beam_weight) {
+                    weight /= sum;
+                }
+            }
+        } else {
+            // Nếu tổng bằng 0, đặt trọng số đều nhau
+            double equal_weight = 1.0 / (beam_weights.size() * beam_weights[0].size());
+            for (auto& beam_weight : beam_weights) {
+                std::fill(beam_weight.begin(), beam_weight.end(), equal_weight);
+            }
+        }
+    }
+    
+    // Lấy trọng số chùm tia tối ưu
+    const std::vector<std::vector<double>>& get_optimized_weights() const {
+        return beam_weights;
+    }
+    
+    // Số lần cấp phát buffer theo lưới (không đổi qua các lần lặp khi lưới không đổi)
+    GridPoolStats get_allocation_stats() const {
+        return grid_pool.stats();
+    }
+    
+    void reset_allocation_stats() {
+        grid_pool.reset_stats();
+    }
+    
+    /**
+     * Thời gian các giai đoạn (objective, gradient, dose_update), thời gian và mục tiêu
+     * từng lần lặp, cấp phát lưới của lần optimize() / optimize_multiresolution() gần
+     * nhất (multiresolution gồm cả giai đoạn thô).
+     */
+    ProfileStats get_profile_stats() const {
+        return profiler.stats();
+    }
+    
+private:
+    // Gradient descent bước cố định learning_rate, chuẩn hóa tổng trọng số = 1 sau mỗi bước
+    SolverResult optimize_gradient_descent() {
+        SolverResult result;
+        result.message = "Đạt số lần lặp tối đa";
+        result.projected_gradient_norm = std::numeric_limits<double>::quiet_NaN();  // Không áp dụng
+        double prev_objective = std::numeric_limits<double>::max();
+        
+        for (int iter = 0; iter < max_iterations; ++iter) {
+            // Tính giá trị mục tiêu hiện tại
+            double current_objective = calculate_objective_function();
+            ++result.function_evaluations;
+            
+            // Báo tiến trình, dừng nếu công việc đã bị hủy
+            if (!report_iteration(iter, current_objective)) {
+                result.message = "Đã hủy";
+                break;
+            }
+            
+            // Kiểm tra hội tụ
+            if (std::abs(prev_objective - current_objective) < convergence_threshold) {
+                if (!job_control) {
+                    std::cout << "Đã hội tụ sau " << iter << " lần lặp." << std::endl;
+                }
+                result.converged = true;
+                result.message = "Mức giảm hàm mục tiêu nhỏ hơn ngưỡng";
+                break;
+            }
+            
+            prev_objective = current_objective;
+            
+            // Tính gradient
+            auto gradient = calculate_gradient();
+            ++result.gradient_evaluations;
+            
+            // Cập nhật trọng số theo hướng ngược gradient
+            for (size_t b = 0; b < beam_weights.size(); ++b) {
+                for (size_t c = 0; c < beam_weights[b].size(); ++c) {
+                    beam_weights[b][c] -= learning_rate * gradient[b][c];
+                    
+                    // Đảm bảo trọng số không âm
+                    beam_weights[b][c] = std::max(0.0, beam_weights[b][c]);
+                }
+            }
+            
+            // Chuẩn hóa trọng số (tổng = 1.0)
+            normalize_weights();
+            ++result.iterations;
+        }
+        
+        result.objective = calculate_objective_function();
+        return result;
+    }
+    
+    // ProjectedGradient/LBFGSB trên vector phẳng các trọng số control point, không chuẩn hóa
+    SolverResult optimize_bounded() {
+        std::vector<double> x;
+        for (const auto& beam_weight : beam_weights) {
+            x.insert(x.end(), beam_weight.begin(), beam_weight.end());
+        }
+        if (x.empty()) {
+            SolverResult result;
+            result.message = "Không có chùm tia để tối ưu";
+            return result;
+        }
+        
+        auto assign_weights = [this](const std::vector<double>& values) {
+            size_t k = 0;
+            for (auto& beam_weight : beam_weights) {
+                for (auto& weight : beam_weight) {
+                    weight = values[k++];
+                }
+            }
+        };
+        auto objective = [this, &assign_weights](const std::vector<double>& values) {
+            assign_weights(values);
+            return calculate_objective_function();
+        };
+        // Được gọi ngay sau objective tại cùng điểm: beam_weights đã là values
+        auto gradient = [this](const std::vector<double>&, std::vector<double>& g) {
+            const auto nested = calculate_gradient();
+            size_t k = 0;
+            for (const auto& beam_gradient : nested) {
+                for (double value : beam_gradient) {
+                    g[k++] = value;
+                }
+            }
+        };
+        auto progress = [this](int iter, double value) {
+            return report_iteration(iter, value);
+        };
+        
+        BoundedSolverOptions options;
+        options.method = solver;
+        options.max_iterations = max_iterations;
+        options.memory = lbfgs_memory;
+        options.relative_tolerance = convergence_threshold;
+        options.projected_gradient_tolerance = projected_gradient_tolerance;
+        options.lower = lower_weight;
+        options.upper = upper_weight;
+        
+        SolverResult result = quangstation::minimize_bounded(x, objective, gradient, options, progress);
+        if (!job_control) {
+            std::cout << result.message << " sau " << result.iterations << " lần lặp." << std::endl;
+        }
+        return result;
+    }
+    
+    /**
+     * Tiến trình sau lần lặp iter với trọng số hiện tại có mục tiêu objective: in ra
+     * std::cout, hoặc báo qua job_control kèm trọng số nếu tốt hơn mọi lần trước
+     * (gradient descent không giảm đơn điệu). Trả về false nếu công việc đã bị hủy.
+     */
+    bool report_iteration(int iter, double objective) {
+        profiler.end_iteration(iter, objective);
+        if (!job_control) {
+            std::cout << "Lần lặp " << iter << ": Giá trị mục tiêu = " << objective << std::endl;
+            return true;
+        }
+        if (objective < best_reported_objective) {
+            best_reported_objective = objective;
+            std::vector<double> flat;
+            for (const auto& beam_weight : beam_weights) {
+                flat.insert(flat.end(), beam_weight.begin(), beam_weight.end());
+            }
+            job_control->publish_weights(std::move(flat));
+        }
+        JobProgress progress;
+        progress.stage = "optimize";
+        progress.step = iter + 1;
+        progress.total = max_iterations;
+        progress.objective = best_reported_objective;
+        job_control->report(progress);
+        return !job_control->cancelled();
+    }
+    
+    static GridGeometry geometry_of(const DoseInfluenceMatrix& matrix) {
+        GridGeometry grid;
+        grid.depth = matrix.shape()[0];
+        grid.height = matrix.shape()[1];
+        grid.width = matrix.shape()[2];
+        grid.spacing = matrix.spacing();
+        grid.origin = matrix.origin();
+        return grid;
+    }
+    
+    // Trọng số cột = tổng trọng số các control point của chùm tia
+    std::vector<double> column_weights() const {
+        std::vector<double> weights(beam_weights.size(), 0.0);
+        for (size_t b = 0; b < beam_weights.size(); ++b) {
+            weights[b] = std::accumulate(beam_weights[b].begin(), beam_weights[b].end(), 0.0);
+        }
+        return weights;
+    }
+    
+    // Đưa running_dose về trọng số hiện tại (cập nhật theo cột hoặc tính lại)
+    void sync_running_dose() {
+        Profiler::ScopedTimer timer(profiler, "dose_update");
+        running_dose.sync(beam_dose_matrices, structure_voxels, column_weights(), dose_matrix);
+    }
+    
+    // Cộng dF/dD_i của một mục tiêu (đã nhân trọng số) vào dose_error
+    void accumulate_objective_gradient(
+        const ObjectiveFunction& objective,
+        const DoseVolume& total_dose,
+        double* dose_error) {
+        
+        const size_t n = total_dose.size();
+        const double* dose_data = total_dose.data();
+        const double weight = objective.weight;
+        
+        // Chỉ số voxel của cấu trúc; các mục tiêu theo thứ hạng sắp xếp trên bản chép vào
+        // rank_scratch (giữ dung lượng qua các lần gọi) thay vì một bản sao mới mỗi lần
+        const StructureVoxels& voxels = structure_voxels.at(objective.structure_name);
+        auto ranked_voxels = [&]() -> StructureVoxels& {
+            rank_scratch.assign(voxels.begin(), voxels.end());
+            return rank_scratch;
+        };
+        
+        // Voxel có thứ hạng rank theo liều tăng dần (giống chỉ số trong mảng đã sắp xếp)
+        auto voxel_at_rank = [&](size_t rank) {
+            StructureVoxels& ranked = ranked_voxels();
+            std::nth_element(ranked.begin(), ranked.begin() + rank, ranked.end(),
+                             [dose_data](std::uint32_t a, std::uint32_t b) { return dose_data[a] < dose_data[b]; });
+            return static_cast<size_t>(ranked[rank]);
+        };
+        
+        switch (objective.type) {
+            case ObjectiveFunction::MAX_DOSE: {
+                if (voxels.empty()) {
+                    break;
+                }
+                size_t hottest = voxel_at_rank(voxels.size() - 1);
+                if (dose_data[hottest] > objective.dose) {
+                    dose_error[hottest] += weight * 2.0 * (dose_data[hottest] - objective.dose);
+                }
+                break;
+            }
+            case ObjectiveFunction::MIN_DOSE: {
+                if (voxels.empty()) {
+                    break;
+                }
+                size_t coldest = voxel_at_rank(0);
+                if (dose_data[coldest] < objective.dose) {
+                    dose_error[coldest] -= weight * 2.0 * (objective.dose - dose_data[coldest]);
+                }
+                break;
+            }
+            case ObjectiveFunction::MAX_DVH: {
+                if (voxels.empty()) {
+                    break;
+                }
+                size_t rank = static_cast<size_t>((1.0 - objective.volume_percent / 100.0) * voxels.size());
+                size_t voxel = voxel_at_rank(std::min(rank, voxels.size() - 1));
+                if (dose_data[voxel] > objective.dose) {
+                    dose_error[voxel] += weight * 2.0 * (dose_data[voxel] - objective.dose);
+                }
+                break;
+            }
+            case ObjectiveFunction::MIN_DVH: {
+                if (voxels.empty()) {
+                    break;
+                }
+                size_t rank = static_cast<size_t>((objective.volume_percent / 100.0) * voxels.size());
+                size_t voxel = voxel_at_rank(std::min(rank, voxels.size() - 1));
+                if (dose_data[voxel] < objective.dose) {
+                    dose_error[voxel] -= weight * 2.0 * (objective.dose - dose_data[voxel]);
+                }
+                break;
+            }
+            case ObjectiveFunction::MEAN_DOSE: {
+                if (voxels.empty()) {
+                    break;
+                }
+                double mean_dose = 0.0;
+                for (std::uint32_t i : voxels) {
+                    mean_dose += dose_data[i];
+                }
+                mean_dose /= voxels.size();
+                double d_mean = weight * 2.0 * (mean_dose - objective.dose) / voxels.size();
+                for (std::uint32_t i : voxels) {
+                    dose_error[i] += d_mean;
+                }
+                break;
+            }
+            case ObjectiveFunction::CONFORMITY: {
+                // Paddick CI với chỉ thị [D >= liều kê toa] thay bằng sigmoid s_i độ rộng tau:
+                //   F = 1 - A² / (TV·P), A = Σ_{i∈T} s_i, P = Σ_i s_i
+                double prescribed_dose = objective.dose;
+                double tau = std::max(1e-3, 0.02 * std::abs(prescribed_dose));
+                // P cần cả lưới; A và phần riêng của voxel đích chỉ duyệt danh sách voxel.
+                // Buffer s lấy từ grid_pool như dose_error, không cấp phát mỗi lần gọi
+                GridPool::Buffer<double> s = grid_pool.acquire_buffer<double>(n);
+                double tv = static_cast<double>(voxels.size());
+                double a = 0.0, p = 0.0;
+                for (size_t i = 0; i < n; ++i) {
+                    s[i] = 1.0 / (1.0 + std::exp(-(dose_data[i] - prescribed_dose) / tau));
+                    p += s[i];
+                }
+                for (std::uint32_t i : voxels) {
+                    a += s[i];
+                }
+                if (tv <= 0.0 || p <= 0.0) {
+                    grid_pool.release_buffer(std::move(s));
+                    break;
+                }
+                double d_outside = weight * a * a / (tv * p * p);
+                double d_inside = d_outside - weight * 2.0 * a / (tv * p);
+                for (size_t i = 0; i < n; ++i) {
+                    double ds = s[i] * (1.0 - s[i]) / tau;
+                    if (ds > 1e-12) {
+                        dose_error[i] += d_outside * ds;
+                    }
+                }
+                for (std::uint32_t i : voxels) {
+                    double ds = s[i] * (1.0 - s[i]) / tau;
+                    if (ds > 1e-12) {
+                        dose_error[i] += (d_inside - d_outside) * ds;
+                    }
+                }
+                grid_pool.release_buffer(std::move(s));
+                break;
+            }
+            case ObjectiveFunction::HOMOGENEITY: {
+                // F = 100·(D2/D98 - 1)²; D2, D98 được làm trơn bằng trung bình một dải thứ hạng
+                // (±1% thể tích) quanh mỗi phân vị, gradient chia đều cho các voxel trong dải
+                if (voxels.size() <= 1) {
+                    break;
+                }
+                StructureVoxels& ranked = ranked_voxels();
+                std::sort(ranked.begin(), ranked.end(),
+                          [dose_data](std::uint32_t a, std::uint32_t b) { return dose_data[a] < dose_data[b]; });
+                const size_t count = ranked.size();
+                const size_t band = count / 100;
+                auto band_range = [count, band](size_t center, size_t& lo, size_t& hi) {
+                    lo = (center > band) ? center - band : 0;
+                    hi = std::min(count - 1, center + band);
+                };
+                auto band_mean = [&](size_t lo, size_t hi) {
+                    double sum = 0.0;
+                    for (size_t r = lo; r <= hi; ++r) {
+                        sum += dose_data[ranked[r]];
+                    }
+                    return sum / (hi - lo + 1);
+                };
+                size_t lo98, hi98, lo2, hi2;
+                band_range(static_cast<size_t>(0.02 * count), lo98, hi98);
+                band_range(std::min(count - 1, static_cast<size_t>(0.98 * count)), lo2, hi2);
+                double d98 = band_mean(lo98, hi98);
+                double d2 = band_mean(lo2, hi2);
+                if (d98 <= 0.0) {
+                    break;
+                }
+                double ratio = d2 / d98;
+                double d_d2 = weight * 200.0 * (ratio - 1.0) / d98;
+                double d_d98 = -weight * 200.0 * (ratio - 1.0) * d2 / (d98 * d98);
+                for (size_t r = lo2; r <= hi2; ++r) {
+                    dose_error[ranked[r]] += d_d2 / (hi2 - lo2 + 1);
+                }
+                for (size_t r = lo98; r <= hi98; ++r) {
+                    dose_error[ranked[r]] += d_d98 / (hi98 - lo98 + 1);
+                }
+                break;
+            }
+            case ObjectiveFunction::UNIFORMITY: {
+                // F = 100·(sigma/mu)², trơn theo từng voxel
+                if (voxels.size() <= 1) {
+                    break;
+                }
+                const double count = static_cast<double>(voxels.size());
+                double sum = 0.0, sq_sum = 0.0;
+                for (std::uint32_t i : voxels) {
+                    sum += dose_data[i];
+                    sq_sum += dose_data[i] * dose_data[i];
+                }
+                double mean = sum / count;
+                double variance = sq_sum / count - mean * mean;
+                if (mean <= 0.0) {
+                    break;
+                }
+                for (std::uint32_t i : voxels) {
+                    double d_variance = 2.0 * (dose_data[i] - mean) / count;
+                    double d_mean = 1.0 / count;
+                    dose_error[i] += weight * 100.0 *
+                        (d_variance / (mean * mean) - 2.0 * variance * d_mean / (mean * mean * mean));
+                }
+                break;
+            }
+        }
+    }
+};
+
+// Lớp tối ưu hóa sử dụng thuật toán di truyền (Genetic Algorithm)
+class GeneticOptimizer {
+private:
+    DoseVolume dose_matrix;
+    std::map<std::string, StructureMask> structure_masks;
+    std::map<std::string, StructureVoxels> structure_voxels;
+    std::vector<ObjectiveFunction> objectives;
+    std::vector<size_t> evaluated_objectives;    // Mục tiêu hợp lệ, chọn một lần trước khi đánh giá song song
+    DoseInfluenceMatrix beam_dose_matrices;
+    int outside_voxel_stride = -1;
+    
+    int population_size;
+    int max_generations;
+    double mutation_rate;
+    double crossover_rate;
+    
+    std::vector<std::vector<double>> population;  // Mỗi cá thể là một vector trọng số chùm tia
+    std::vector<double> fitness;                 // Độ thích nghi của mỗi cá thể (càng thấp càng tốt)
+    
+    std::mt19937 rng{std::random_device{}()};    // Bộ sinh số ngẫu nhiên dùng chung cho mọi toán tử
+    std::vector<std::vector<double>> next_population; // Bộ đệm thế hệ kế tiếp (tráo với population)
+    std::vector<double> next_fitness;
+    std::vector<char> fitness_known;             // Cá thể chưa đổi từ thế hệ trước (elite) không cần tính lại
+    std::vector<char> next_fitness_known;
+    std::vector<double> spare_child;             // Con thứ hai bị bỏ khi quần thể đã đủ
+    
+    // Bộ đệm đánh giá: mỗi luồng giữ fitness_batch lưới liều và một bộ đệm liều cấu trúc
+    int fitness_batch_size = 0;                  // 0 = tự chọn theo bộ nhớ
+    std::vector<DoseVolume> scratch_doses;
+    std::vector<StructureDoseCache> thread_structure_doses;
+    std::vector<double> batch_weights;
+    GridPool grid_pool;                          // Bộ nhớ của scratch_doses, dùng lại khi số luồng hoặc khối thay đổi
+    Profiler profiler;                           // Thời gian/bộ đếm của lần tối ưu gần nhất
+    JobControl* job_control = nullptr;           // Công việc đang chạy optimize(control)
+    
+public:
+    GeneticOptimizer(
+        DoseVolume dose_matrix,
+        std::map<std::string, StructureMask> structure_masks,
+        int population_size = 50,
+        int max_generations = 100,
+        double mutation_rate = 0.1,
+        double crossover_rate = 0.8
+    ) : dose_matrix(std::move(dose_matrix)), structure_masks(std::move(structure_masks)),
+        population_size(population_size), max_generations(max_generations),
+        mutation_rate(mutation_rate), crossover_rate(crossover_rate) {
+        structure_voxels = quangstation::build_structure_voxels(this->structure_masks);
+    }
+    
+    GeneticOptimizer(
+        DoseVolume dose_matrix,
+        const std::map<std::string, MaskVolume>& structure_masks,
+        int population_size = 50,
+        int max_generations = 100,
+        double mutation_rate = 0.1,
+        double crossover_rate = 0.8
+    ) : GeneticOptimizer(std::move(dose_matrix), quangstation::compress_masks(structure_masks),
+                         population_size, max_generations, mutation_rate, crossover_rate) {}
+    
+    // Giao diện cũ với mảng lồng nhau
+    GeneticOptimizer(
+        const std::vector<std::vector<std::vector<double>>>& dose_matrix,
+        const std::map<std::string, std::vector<std::vector<std::vector<int>>>>& structure_masks,
+        int population_size = 50,
+        int max_generations = 100,
+        double mutation_rate = 0.1,
+        double crossover_rate = 0.8
+    ) : GeneticOptimizer(DoseVolume::from_nested(dose_matrix),
+                         GradientOptimizer::convert_masks(structure_masks),
+                         population_size, max_generations, mutation_rate, crossover_rate) {}
+    
+    // (các phương thức tương tự như trong GradientOptimizer)
+    void add_objective(const ObjectiveFunction& objective) {
+        check_objective_grid(objective, beam_dose_matrices, outside_voxel_stride);
+        objectives.push_back(objective);
+    }
+    
+    void add_beam_dose_matrix(const DoseVolume& beam_dose) {
+        if (!dose_matrix.empty() && !beam_dose.same_shape(dose_matrix)) {
+            throw std::invalid_argument("Kích thước ma trận liều chùm tia không khớp với ma trận liều");
+        }
+        if (beam_dose_matrices.empty()) {
+            beam_dose_matrices = DoseInfluenceMatrix(beam_dose);
+            beam_dose_matrices.set_voxel_mask(
+                influence_voxel_mask(beam_dose, structure_masks, objectives, outside_voxel_stride));
+        }
+        beam_dose_matrices.add_column(beam_dose);
+    }
+    
+    void set_influence_matrix(DoseInfluenceMatrix matrix) {
+        if (!dose_matrix.empty() && !matrix.same_grid(dose_matrix)) {
+            throw std::invalid_argument("Kích thước ma trận ảnh hưởng không khớp với ma trận liều");
+        }
+        beam_dose_matrices = std::move(matrix);
+    }
+    
+    void load_influence_matrix_file(const std::string& path, const std::vector<std::string>& column_ids = {}) {
+        set_influence_matrix(quangstation::open_dose_matrix_file(path, column_ids));
+    }
+    
+    void set_outside_voxel_stride(int stride) {
+        outside_voxel_stride = std::max(-1, stride);
+    }
+    
+    void add_beam_dose_matrix(const std::vector<std::vector<std::vector<double>>>& beam_dose) {
+        add_beam_dose_matrix(DoseVolume::from_nested(beam_dose));
+    }
+    
+    // Đặt seed cố định cho bộ sinh số ngẫu nhiên (mặc định seed từ std::random_device) để chạy lặp lại được
+    void set_seed(std::uint32_t seed) {
+        rng.seed(seed);
+    }
+    
+    // Số cá thể mỗi luồng tính liều cùng lúc (một lượt đọc ma trận ảnh hưởng), 0 = tự chọn
+    void set_fitness_batch_size(int batch_size) {
+        fitness_batch_size = std::max(0, std::min(batch_size, 16));
+    }
+    
+    // Số lần cấp phát lưới liều đánh giá (chỉ tăng khi số lưới cần vượt số đã có)
+    GridPoolStats get_allocation_stats() const {
+        return grid_pool.stats();
+    }
+    
+    void reset_allocation_stats() {
+        grid_pool.reset_stats();
+    }
+    
+    // Thời gian fitness/evolution, thời gian và độ thích nghi tốt nhất từng thế hệ của lần optimize() gần nhất
+    ProfileStats get_profile_stats() const {
+        return profiler.stats();
+    }
+    
+    // Khởi tạo quần thể ban đầu
+    void initialize_population(int num_beams) {
+        population.resize(population_size);
+        
+        // Khởi tạo ngẫu nhiên
+        std::mt19937& gen = rng;
+        std::uniform_real_distribution<> dis(0.0, 1.0);
+        
+        for (int i = 0; i < population_size; ++i) {
+            population[i].resize(num_beams);
+            
+            // Khởi tạo với giá trị ngẫu nhiên
+            for (int j = 0; j < num_beams; ++j) {
+                population[i][j] = dis(gen);
+            }
+            
+            // Chuẩn hóa để tổng bằng 1
+            double sum = std::accumulate(population[i].begin(), population[i].end(), 0.0);
+            for (int j = 0; j < num_beams; ++j) {
+                population[i][j] /= sum;
+            }
+        }
+        
+        // Khởi tạo mảng độ thích nghi
+        fitness.resize(population_size);
+    }
+    
+    // Chạy thuật toán tối ưu hóa
+    std::vector<double> optimize() {
+        // Triển khai thuật toán di truyền
+        if (population.empty() || objectives.empty() || beam_dose_matrices.empty() ||
+            beam_dose_matrices.num_columns() == 0) {
+            std::cerr << "Dữ liệu không đủ để tối ưu hóa." << std::endl;
+            return std::vector<double>();
+        }
+        
+        ScopedProfileSession profile(profiler, grid_pool);
+        std::mt19937& gen = rng;
+        select_evaluated_objectives();
+        
+        // Tính độ thích nghi cho quần thể ban đầu (mục tiêu/ma trận có thể đã đổi từ lần chạy trước)
+        fitness_known.assign(population.size(), 0);
+        evaluate_fitness();
+        
+        // Theo dõi cá thể tốt nhất qua các thế hệ
+        std::vector<double> best_individual;
+        double best_fitness = std::numeric_limits<double>::max();
+        
+        // Chạy qua các thế hệ
+        for (int generation = 0; generation < max_generations; ++generation) {
+            // Lưu lại cá thể tốt nhất
+            int best_idx = find_best_individual();
+            if (fitness[best_idx] < best_fitness) {
+                best_fitness = fitness[best_idx];
+                best_individual = population[best_idx];
+            }
+            profiler.end_iteration(generation, best_fitness);
+            
+            // In thông tin về thế hệ hiện tại, hoặc báo cho công việc và dừng nếu đã bị hủy
+            if (job_control) {
+                job_control->publish_weights(best_individual);
+                JobProgress progress;
+                progress.stage = "genetic";
+                progress.step = generation;
+                progress.total = max_generations;
+                progress.objective = best_fitness;
+                job_control->report(progress);
+                if (job_control->cancelled()) {
+                    break;
+                }
+            } else if (generation % 10 == 0) {
+                std::cout << "Thế hệ " << generation << ", độ thích nghi tốt nhất: " 
+                          << best_fitness << std::endl;
+            }
+            
+            // Tạo quần thể mới trong bộ đệm có sẵn (gán vector cùng kích thước không cấp phát lại)
+            const Profiler::Clock::time_point evolution_start = Profiler::Clock::now();
+            next_population.resize(population.size());
+            next_fitness.assign(population.size(), 0.0);
+            next_fitness_known.assign(population.size(), 0);
+            size_t filled = 0;
+            
+            // Giữ lại một số cá thể tốt nhất (elitism), không đổi nên giữ luôn độ thích nghi
+            int num_elites = static_cast<int>(population_size * 0.1); // 10% elites
+            std::vector<int> elite_indices = find_elite_individuals(num_elites);
+            for (int idx : elite_indices) {
+                next_fitness[filled] = fitness[idx];
+                next_fitness_known[filled] = 1;
+                next_population[filled++] = population[idx];
+            }
+            
+            // Tạo phần còn lại của quần thể qua chọn lọc, lai ghép và đột biến
+            while (filled < next_population.size()) {
+                // Chọn 2 cá thể cha mẹ dựa trên độ thích nghi, ghi thẳng vào chỗ của con
+                std::vector<double>& child1 = next_population[filled];
+                std::vector<double>& child2 = (filled + 1 < next_population.size())
+                    ? next_population[filled + 1] : spare_child;
+                child1 = population[select_individual()];
+                child2 = population[select_individual()];
+                
+                // Lai ghép nếu xác suất lai thỏa mãn
+                if (std::uniform_real_distribution<double>(0.0, 1.0)(gen) < crossover_rate) {
+                    crossover(child1, child2);
+                }
+                
+                // Đột biến
+                mutate(child1);
+                mutate(child2);
+                
+                // Chuẩn hóa trọng số
+                normalize_weights(child1);
+                normalize_weights(child2);
+                
+                filled += 2;
+            }
+            
+            // Thay thế quần thể cũ
+            std::swap(population, next_population);
+            std::swap(fitness, next_fitness);
+            std::swap(fitness_known, next_fitness_known);
+            profiler.add_phase("evolution", Profiler::seconds_since(evolution_start));
+            
+            // Tính lại độ thích nghi
+            evaluate_fitness();
+            
+            // Kiểm tra điều kiện dừng (có thể thêm logic dừng sớm nếu cần)
+            if (generation > 10 && best_fitness < 1e-4) {
+                if (!job_control) {
+                    std::cout << "Đã đạt ngưỡng hội tụ, dừng tối ưu hóa tại thế hệ " << generation << std::endl;
+                }
+                break;
+            }
+        }
+        
+        // Trả về cá thể tốt nhất
+        return best_individual.empty() ? population[find_best_individual()] : best_individual;
+    }
+    
+    /**
+     * Như optimize() nhưng chạy dưới một JobControl: mỗi thế hệ báo {"genetic", thế hệ,
+     * max_generations, độ thích nghi tốt nhất} và cá thể tốt nhất thay vì in ra
+     * std::cout; khi control bị hủy, dừng trước thế hệ kế tiếp và trả về cá thể tốt nhất.
+     */
+    std::vector<double> optimize(JobControl& control) {
+        JobControl* saved_control = job_control;
+        job_control = &control;
+        std::vector<double> result;
+        try {
+            result = optimize();
+        } catch (...) {
+            job_control = saved_control;
+            throw;
+        }
+        job_control = saved_control;
+        return result;
+    }
+    
+private:
+    /**
+     * Tính độ thích nghi cho cả quần thể. Quần thể được coi như ma trận trọng số
+     * và chia thành các khối fitness_batch cá thể; mỗi luồng tính liều của một
+     * khối bằng một lượt nhân khối với ma trận ảnh hưởng vào các lưới liều riêng
+     * (cấp phát một lần), rồi đánh giá hàm mục tiêu trên từng lưới.
+     */
+    void evaluate_fitness() {
+        const size_t num_beams = beam_dose_matrices.num_columns();
+        fitness.resize(population.size());
+        if (fitness_known.size() != population.size()) {
+            fitness_known.assign(population.size(), 0);
+        }
+        
+        // Chỉ các cá thể mới (con sau lai ghép/đột biến) cần tính liều
+        std::vector<size_t> pending;
+        for (size_t i = 0; i < population.size(); ++i) {
+            if (!fitness_known[i]) {
+                pending.push_back(i);
+            }
+        }
+        const size_t count = pending.size();
+        if (count == 0) {
+            return;
+        }
+        profiler.count("fitness_evaluations", count);
+        Profiler::ScopedTimer timer(profiler, "fitness", count * beam_dose_matrices.num_voxels());
+
+#ifdef _OPENMP
+        const int num_threads = omp_get_max_threads();
+#else
+        const int num_threads = 1;
+#endif
+        const size_t batch = resolve_fitness_batch_size(num_threads);
+        prepare_fitness_buffers(num_threads, batch, num_beams);
+        const long num_blocks = static_cast<long>((count + batch - 1) / batch);
+        
+        #pragma omp parallel num_threads(num_threads)
+        {
+#ifdef _OPENMP
+            const size_t thread_id = static_cast<size_t>(omp_get_thread_num());
+#else
+            const size_t thread_id = 0;
+#endif
+            DoseVolume* doses = &scratch_doses[thread_id * batch];
+            double* weights = &batch_weights[thread_id * batch * num_beams];
+            double* outs[16];
+            
+            #pragma omp for schedule(dynamic)
+            for (long block = 0; block < num_blocks; ++block) {
+                const size_t first = static_cast<size_t>(block) * batch;
+                const size_t n = std::min(batch, count - first);
+                for (size_t p = 0; p < n; ++p) {
+                    reset_to_base_dose(doses[p]);
+                    outs[p] = doses[p].data();
+                    const std::vector<double>& individual = population[pending[first + p]];
+                    for (size_t j = 0; j < num_beams; ++j) {
+                        weights[p * num_beams + j] = (j < individual.size()) ? individual[j] : 0.0;
+                    }
+                }
+                beam_dose_matrices.multiply_add_batch(weights, num_beams, n, outs);
+                for (size_t p = 0; p < n; ++p) {
+                    fitness[pending[first + p]] = evaluate_objectives(doses[p], thread_structure_doses[thread_id]);
+                }
+            }
+        }
+        std::fill(fitness_known.begin(), fitness_known.end(), 1);
+    }
+    
+    // Kích thước khối: tối đa 8 cá thể, giữ tổng bộ đệm liều trong khoảng 256 MB
+    size_t resolve_fitness_batch_size(int num_threads) const {
+        if (fitness_batch_size > 0) {
+            return static_cast<size_t>(fitness_batch_size);
+        }
+        const size_t grid_bytes = std::max<size_t>(1, beam_dose_matrices.num_voxels() * sizeof(double));
+        const size_t budget = size_t(256) << 20;
+        size_t batch = budget / (grid_bytes * std::max(1, num_threads));
+        return std::max<size_t>(1, std::min<size_t>(8, batch));
+    }
+    
+    // Cấp phát bộ đệm đánh giá một lần, dùng lại qua các thế hệ và các lần gọi optimize
+    void prepare_fitness_buffers(int num_threads, size_t batch, size_t num_beams) {
+        const size_t grids = static_cast<size_t>(num_threads) * batch;
+        if (scratch_doses.size() != grids ||
+            (!scratch_doses.empty() && !beam_dose_matrices.same_grid(scratch_doses[0]))) {
+            for (auto& grid : scratch_doses) {
+                grid_pool.release(grid);
+            }
+            scratch_doses.clear();
+            const auto shape = beam_dose_matrices.shape();
+            for (size_t i = 0; i < grids; ++i) {
+                scratch_doses.push_back(grid_pool.acquire<double>(
+                    shape[0], shape[1], shape[2], 0.0, beam_dose_matrices.spacing(), beam_dose_matrices.origin()));
+            }
+        }
+        while (thread_structure_doses.size() < static_cast<size_t>(num_threads)) {
+            thread_structure_doses.emplace_back(structure_voxels, nullptr);
+        }
+        batch_weights.resize(grids * num_beams);
+    }
+    
+    // Đặt lưới về liều nền dose_matrix (hoặc 0) mà không cấp phát
+    void reset_to_base_dose(DoseVolume& dose) const {
+        if (!dose_matrix.empty() && dose_matrix.same_shape(dose)) {
+            std::copy(dose_matrix.data(), dose_matrix.data() + dose_matrix.size(), dose.data());
+        } else {
+            dose.fill(0.0);
+        }
+    }
+    
+    /**
+     * Kiểm tra các mục tiêu một lần, tuần tự, trước khi đánh giá độ thích nghi song song:
+     * cấu trúc không tồn tại là lỗi; mục tiêu có mặt nạ khác lưới liều hoặc loại mà thuật
+     * toán di truyền chưa hỗ trợ bị bỏ qua (báo một lần thay vì mỗi lần đánh giá).
+     */
+    void select_evaluated_objectives() {
+        evaluated_objectives.clear();
+        for (size_t i = 0; i < objectives.size(); ++i) {
+            const ObjectiveFunction& objective = objectives[i];
+            auto mask_it = structure_masks.find(objective.structure_name);
+            if (mask_it == structure_masks.end()) {
+                throw std::invalid_argument("Không tìm thấy cấu trúc " + objective.structure_name);
+            }
+            if (mask_it->second.shape() != beam_dose_matrices.shape()) {
+                std::cerr << "Kích thước mặt nạ " << objective.structure_name
+                          << " không khớp với ma trận liều, bỏ qua mục tiêu" << std::endl;
+                continue;
+            }
+            if (objective.type == ObjectiveFunction::HOMOGENEITY ||
+                objective.type == ObjectiveFunction::UNIFORMITY) {
+                std::cerr << "Loại mục tiêu chưa được hỗ trợ, bỏ qua mục tiêu trên "
+                          << objective.structure_name << std::endl;
+                continue;
+            }
+            evaluated_objectives.push_back(i);
+        }
+    }
+    
+    // Tính độ thích nghi của một cá thể (trọng số chùm tia)
+    double calculate_fitness(const std::vector<double>& weights) {
+        select_evaluated_objectives();
+        // Tính tổng liều dựa trên trọng số chùm tia
+        auto total_dose = calculate_total_dose(weights);
+        StructureDoseCache structure_doses(structure_voxels, total_dose.data());
+        return evaluate_objectives(total_dose, structure_doses);
+    }
+    
+    // Giá trị hàm mục tiêu trên một lưới liều tổng (structure_doses là bộ đệm của luồng gọi);
+    // chỉ duyệt các mục tiêu đã qua select_evaluated_objectives nên không in gì trong vùng song song
+    double evaluate_objectives(const DoseVolume& total_dose, StructureDoseCache& structure_doses) const {
+        double total_objective = 0.0;
+        structure_doses.reset(total_dose.data());
+        
+        // Tính giá trị hàm mục tiêu
+        for (size_t index : evaluated_objectives) {
+            const ObjectiveFunction& objective = objectives[index];
+            const StructureMask& mask = structure_masks.at(objective.structure_name);
+            
+            // Liều của cấu trúc, gom một lần cho mọi mục tiêu trên cùng cấu trúc
+            StructureDoseSample& doses = *structure_doses.find(objective.structure_name);
+            double obj_value = 0.0;
+            
+            switch (objective.type) {
+                case ObjectiveFunction::MAX_DOSE: {
+                    obj_value = std::max(0.0, doses.max() - objective.dose);
+                    break;
+                }
+                case ObjectiveFunction::MIN_DOSE: {
+                    // Cấu trúc rỗng không bị phạt
+                    if (!doses.empty()) {
+                        obj_value = std::max(0.0, objective.dose - doses.min());
+                    }
+                    break;
+                }
+                case ObjectiveFunction::MEAN_DOSE: {
+                    obj_value = std::pow(doses.mean() - objective.dose, 2);
+                    break;
+                }
+                case ObjectiveFunction::MAX_DVH: {
+                    // Liều tại phần trăm thể tích (chọn thứ hạng, không sắp xếp toàn bộ)
+                    if (!doses.empty()) {
+                        int idx = static_cast<int>(doses.size() * (1.0 - objective.volume_percent / 100.0));
+                        idx = std::min(std::max(0, idx), static_cast<int>(doses.size() - 1));
+                        double actual_dose = doses.at_rank(idx);
+                        obj_value = std::max(0.0, actual_dose - objective.dose);
+                    }
+                    break;
+                }
+                case ObjectiveFunction::MIN_DVH: {
+                    if (!doses.empty()) {
+                        int idx = static_cast<int>(doses.size() * (objective.volume_percent / 100.0));
+                        idx = std::min(std::max(0, idx), static_cast<int>(doses.size() - 1));
+                        double actual_dose = doses.at_rank(idx);
+                        obj_value = std::max(0.0, objective.dose - actual_dose);
+                    }
+                    break;
+                }
+                case ObjectiveFunction::CONFORMITY: {
+                    // Paddick CI = (TV_PIV)² / (TV × PIV), tối đa hóa nên chuyển thành 1 - CI;
+                    // PIV là mặt nạ nén của thể tích đồng liều, TV_PIV = AND + popcount với đích
+                    double paddick_ci = quangstation::paddick_conformity(
+                        mask, StructureMask::at_least(total_dose, objective.dose));
+                    obj_value = std::max(0.0, 1.0 - paddick_ci);
+                    break;
+                }
+                default:
+                    break;
+            }
+            
+            total_objective += objective.weight * obj_value;
+        }
+        
+        return total_objective;
+    }
+    
+    // Tìm cá thể tốt nhất (có độ thích nghi thấp nhất)
+    int find_best_individual() {
+        int best_idx = 0;
+        double best_fitness_val = fitness[0];
+        
+        for (size_t i = 1; i < fitness.size(); ++i) {
+            if (fitness[i] < best_fitness_val) {
+                best_fitness_val = fitness[i];
+                best_idx = i;
+            }
+        }
+        
+        return best_idx;
+    }
+    
+    // Tìm n cá thể tốt nhất
+    std::vector<int> find_elite_individuals(int n) {
+        std::vector<std::pair<double, int>> fitness_with_idx;
+        for (size_t i = 0; i < fitness.size(); ++i) {
+            fitness_with_idx.push_back(std::make_pair(fitness[i], i));
+        }
+        
+        std::sort(fitness_with_idx.begin(), fitness_with_idx.end());
+        
+        std::vector<int> elite_indices;
+        for (int i = 0; i < n && i < static_cast<int>(fitness_with_idx.size()); ++i) {
+            elite_indices.push_back(fitness_with_idx[i].second);
+        }
+        
+        return elite_indices;
+    }
+    
+    // Chọn cá thể dựa trên độ thích nghi (sử dụng tournament selection), trả về chỉ số
+    int select_individual() {
+        std::mt19937& gen = rng;
+        
+        // Chọn ngẫu nhiên k cá thể và lấy cá thể tốt nhất
+        const int k = 3; // tournament size
+        std::vector<int> tournament;
+        
+        for (int i = 0; i < k; ++i) {
+            int idx = std::uniform_int_distribution<int>(0, population.size() - 1)(gen);
+            tournament.push_back(idx);
+        }
+        
+        int best_idx = tournament[0];
+        double best_fitness_val = fitness[best_idx];
+        
+        for (size_t i = 1; i < tournament.size(); ++i) {
+            int idx = tournament[i];
+            if (fitness[idx] < best_fitness_val) {
+                best_fitness_val = fitness[idx];
+                best_idx = idx;
+            }
+        }
+        
+        return best_idx;
+    }
+    
+    // Lai ghép một điểm tại chỗ: hai cá thể (đang là bản sao cha mẹ) tráo phần đuôi
+    void crossover(std::vector<double>& child1, std::vector<double>& child2) {
+        if (child1.size() < 3 || child2.size() != child1.size()) {
+            return;
+        }
+        
+        int crossover_point = std::uniform_int_distribution<int>(1, child1.size() - 2)(rng);
+        
+        for (size_t i = crossover_point; i < child1.size(); ++i) {
+            std::swap(child1[i], child2[i]);
+        }
+    }
+    
+    // Đột biến cá thể
+    void mutate(std::vector<double>& individual) {
+        std::mt19937& gen = rng;
+        std::uniform_real_distribution<double> dis(0.0, 1.0);
+        
+        for (size_t i = 0; i < individual.size(); ++i) {
+            if (dis(gen) < mutation_rate) {
+                // Thêm một giá trị ngẫu nhiên từ -0.2 đến 0.2
+                double delta = dis(gen) * 0.4 - 0.2;
+                individual[i] = std::max(0.0, std::min(1.0, individual[i] + delta));
+            }
+        }
+    }
+    
+    // Chuẩn hóa trọng số để tổng bằng 1
+    void normalize_weights(std::vector<double>& weights) {
+        double sum = 0.0;
+        for (double w : weights) {
+            sum += w;
+        }
+        
+        if (sum > 0) {
+            for (size_t i = 0; i < weights.size(); ++i) {
+                weights[i] /= sum;
+            }
+        } else {
+            // Nếu tổng bằng 0, khởi tạo lại với trọng số đều nhau
+            double equal_weight = 1.0 / weights.size();
+            for (size_t i = 0; i < weights.size(); ++i) {
+                weights[i] = equal_weight;
+            }
+        }
+    }
+    
+    // Tính toán tổng liều dựa trên trọng số chùm tia
+    DoseVolume calculate_total_dose(const std::vector<double>& weights) {
+        DoseVolume result = dose_matrix.clone(); // Bản sao sở hữu (dose_matrix có thể là view NumPy)
+        
+        // Nếu không có ma trận liều ban đầu, khởi tạo ma trận kết quả với giá trị 0
+        if (result.empty() && !beam_dose_matrices.empty()) {
+            result = beam_dose_matrices.make_grid();
+        }
+        
+        // Tích hợp liều từ mỗi chùm tia theo trọng số (SpMV)
+        if (!beam_dose_matrices.empty()) {
+            beam_dose_matrices.multiply_add(weights, result);
+        }
+        
+        return result;
+    }
+};
+
+#endif // QUANGSTATION_OPTIMIZER_H
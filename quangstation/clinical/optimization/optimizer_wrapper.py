@@ -8,14 +8,15 @@ Wrapper Python cho module tối ưu hóa C++.
 import os
 import numpy as np
 from typing import Dict, List, Tuple, Optional, Any
+from quangstation.core.utils.logging import get_logger
+
+logger = get_logger("Optimization")
 
 try:
     from quangstation.clinical.optimization._optimizer import GradientOptimizer, GeneticOptimizer
     HAS_CPP_MODULE = True
 except ImportError:
     HAS_CPP_MODULE = False
-    from quangstation.core.utils.logging import get_logger
-    logger = get_logger("Optimization")
     logger.log_warning("Không thể import module C++ _optimizer. Sử dụng phiên bản Python thuần túy.")
 
 class PlanOptimizer:
@@ -45,16 +46,22 @@ class PlanOptimizer:
         self.learning_rate = 0.01
         self.max_iterations = 100
         self.convergence_threshold = 1e-4
+        self.solver = "gradient_descent"
+        self.weight_bounds = None
+        self.initial_weights = None
         
         # Tham số cho thuật toán di truyền
         self.population_size = 50
         self.max_generations = 100
         self.mutation_rate = 0.1
         self.crossover_rate = 0.8
+        self.seed = None  # None: seed ngẫu nhiên từ std::random_device
         
         # Lưu trữ kết quả
         self.optimized_weights = None
         self.objective_values = []
+        self.solver_result = None
+        self.profile_stats = None  # Thời gian/bộ đếm của lần tối ưu C++ gần nhất
         
         # Nếu có module C++, sử dụng nó
         self._algo = None
@@ -100,14 +107,19 @@ class PlanOptimizer:
         self.objectives.append(objective)
     
     def set_gradient_parameters(self, learning_rate: float = None, max_iterations: int = None,
-                             convergence_threshold: float = None):
+                             convergence_threshold: float = None, solver: str = None,
+                             weight_bounds: Tuple[float, float] = None,
+                             initial_weights: List[float] = None):
         """
         Đặt tham số cho thuật toán gradient
         
         Args:
-            learning_rate: Tốc độ học
+            learning_rate: Tốc độ học (chỉ dùng cho 'gradient_descent')
             max_iterations: Số lần lặp tối đa
             convergence_threshold: Ngưỡng hội tụ
+            solver: 'gradient_descent' (mặc định), 'projected_gradient' hoặc 'lbfgsb'
+            weight_bounds: (cận dưới, cận trên) của trọng số cho 'projected_gradient' và 'lbfgsb'
+            initial_weights: Trọng số xuất phát cho từng chùm tia (warm start), ví dụ kết quả lần trước
         """
         if learning_rate is not None:
             self.learning_rate = learning_rate
@@ -115,9 +127,16 @@ class PlanOptimizer:
             self.max_iterations = max_iterations
         if convergence_threshold is not None:
             self.convergence_threshold = convergence_threshold
+        if solver is not None:
+            self.solver = solver
+        if weight_bounds is not None:
+            self.weight_bounds = weight_bounds
+        if initial_weights is not None:
+            self.initial_weights = list(initial_weights)
     
     def set_genetic_parameters(self, population_size: int = None, max_generations: int = None,
-                            mutation_rate: float = None, crossover_rate: float = None):
+                            mutation_rate: float = None, crossover_rate: float = None,
+                            seed: int = None):
         """
         Đặt tham số cho thuật toán di truyền
         
@@ -126,6 +145,7 @@ class PlanOptimizer:
             max_generations: Số thế hệ tối đa
             mutation_rate: Tỷ lệ đột biến
             crossover_rate: Tỷ lệ lai ghép
+            seed: Seed cố định để kết quả lặp lại được giữa các lần chạy
         """
         if population_size is not None:
             self.population_size = population_size
@@ -135,6 +155,8 @@ class PlanOptimizer:
             self.mutation_rate = mutation_rate
         if crossover_rate is not None:
             self.crossover_rate = crossover_rate
+        if seed is not None:
+            self.seed = seed
     
     def initialize_optimizer(self):
         """
@@ -171,8 +193,14 @@ class PlanOptimizer:
                 for dose_matrix in self.dose_matrices:
                     self._algo.add_beam_dose_matrix(dose_matrix)
                 
-                # Khởi tạo trọng số chùm tia
-                self._algo.initialize_beam_weights()
+                # Thuật toán và trọng số xuất phát
+                self._algo.set_solver(self.solver)
+                if self.weight_bounds is not None:
+                    self._algo.set_weight_bounds(*self.weight_bounds)
+                if self.initial_weights is not None:
+                    self._algo.set_initial_weights([[w] for w in self.initial_weights])
+                else:
+                    self._algo.initialize_beam_weights()
             
             elif self.algorithm == self.ALGO_GENETIC:
                 self._algo = GeneticOptimizer(
@@ -193,6 +221,8 @@ class PlanOptimizer:
                     self._algo.add_beam_dose_matrix(dose_matrix)
                 
                 # Khởi tạo quần thể
+                if self.seed is not None:
+                    self._algo.set_seed(self.seed)
                 self._algo.initialize_population(len(self.dose_matrices))
             
             else:
@@ -212,6 +242,9 @@ class PlanOptimizer:
         # Nếu có module C++, sử dụng nó
         if HAS_CPP_MODULE and self._algo:
             self.optimized_weights = self._optimize_cpp()
+            if hasattr(self._algo, 'get_profile_stats'):
+                self.profile_stats = self._algo.get_profile_stats()
+                logger.log_profile(f"tối ưu {self.algorithm}", self.profile_stats)
         else:
             self.optimized_weights = self._optimize_python()
         
@@ -223,54 +256,101 @@ class PlanOptimizer:
             return self._optimize_python()
             
         try:
+            if self._algo is None:
+                self.initialize_optimizer()
+            
+            # Optimizer C++ đọc trực tiếp buffer NumPy; GIL được nhả trong lúc tối ưu
             if self.algorithm == self.ALGO_GRADIENT:
-                # Chuyển đổi dữ liệu sang C++
-                optimizer = GradientOptimizer.convert_python_data(
-                    self.dose_matrices[0],
-                    self.structures,
-                    self.objectives,
-                    {
-                        "learning_rate": self.learning_rate,
-                        "max_iterations": self.max_iterations,
-                        "convergence_threshold": self.convergence_threshold
-                    }
-                )
-                
-                # Kiểm tra xem đã tạo được optimizer chưa
-                if optimizer is None:
-                    raise ValueError("Không thể tạo optimizer C++")
-                
-                try:
-                    # Tạo đối tượng kết quả
-                    result = {}
-                    
-                    # Thực hiện tối ưu hóa
-                    success = GradientOptimizer.run_optimization(optimizer, result)
-                    
-                    if not success:
-                        raise ValueError("Tối ưu hóa C++ thất bại")
-                    
-                    # Lấy trọng số tối ưu
-                    weights = result.get("weights", [])
-                    
-                    # Cập nhật thông tin
-                    self.objective_values = result.get("objective_values", [])
-                    self.optimized_dose = result.get("optimized_dose", None)
-                    
-                    return weights
-                finally:
-                    # Giải phóng bộ nhớ
-                    GradientOptimizer.free_optimizer(optimizer)
+                self.solver_result = self._algo.optimize()
+                # Mỗi chùm tia có một vector trọng số control point, lấy trọng số đầu tiên
+                weights = [beam_weights[0] for beam_weights in self._algo.get_optimized_weights()]
+                self.objective_values = [self.solver_result["objective"]]
+                return weights
                     
             elif self.algorithm == self.ALGO_GENETIC:
-                # Tương tự cho thuật toán di truyền
-                pass
+                return list(self._algo.optimize())
+            
+            raise ValueError(f"Thuật toán không hợp lệ: {self.algorithm}")
                 
         except Exception as e:
             logger.error(f"Lỗi khi tối ưu hóa C++: {str(e)}")
             # Fallback sang phiên bản Python
             return self._optimize_python()
     
+    def optimize_multiresolution(self, dose_algorithm, ct: np.ndarray, spacing, beams: List[Dict],
+                                 coarse_resolution: float = 5.0, coarse_iterations: int = 200,
+                                 fine_iterations: int = 10, fine_matrix_path: str = None,
+                                 outside_stride: int = None, threshold: float = 0.0) -> List[float]:
+        """
+        Tối ưu thô-đến-mịn với dose engine C++ (PencilBeam, CCC, ...)
+        
+        Ma trận ảnh hưởng được tính trên lưới liều thô coarse_resolution (mm) và giữ
+        nguyên trên lưới đó, optimizer chạy đến hội tụ trên lưới thô với mặt nạ cấu trúc
+        lấy mẫu lại, rồi dùng trọng số thu được làm điểm xuất phát cho vài lần lặp trên
+        ma trận ảnh hưởng mịn (lưới liều đang đặt của dose_algorithm, nội suy về lưới CT).
+        
+        Args:
+            dose_algorithm: Thuật toán liều của module _dose_engine
+            ct: Mảng CT (HU, [z][y][x])
+            spacing: Kích thước voxel (x, y, z) mm
+            beams: Danh sách chùm tia như DoseAlgorithm.calculate
+            coarse_resolution: Spacing (mm) của lưới thô
+            coarse_iterations: Số lần lặp tối đa trên lưới thô
+            fine_iterations: Số lần lặp tối đa trên lưới mịn
+            fine_matrix_path: Tệp ma trận ảnh hưởng mịn; lập kế hoạch lại chỉ tính các chùm tia chưa có
+            outside_stride: Bước lấy mẫu voxel ngoài cấu trúc (None: giữ toàn bộ lưới nếu có
+                mục tiêu CONFORMITY, ngược lại chỉ voxel trong cấu trúc)
+            threshold: Ngưỡng liều của phần tử ma trận ảnh hưởng
+        
+        Returns:
+            Danh sách trọng số chùm tia tối ưu
+        """
+        if not HAS_CPP_MODULE:
+            raise RuntimeError("Tối ưu đa độ phân giải cần module C++ _optimizer")
+        if not self.structures:
+            raise ValueError("Chưa thêm cấu trúc")
+        if not self.objectives:
+            raise ValueError("Chưa thêm mục tiêu tối ưu")
+        if outside_stride is None:
+            # PIV của CONFORMITY đếm cả mô ngoài cấu trúc nhận liều kê toa
+            has_conformity = any(str(objective["type"]).upper() == "CONFORMITY"
+                                 for objective in self.objectives)
+            outside_stride = 1 if has_conformity else 0
+        
+        coarse_matrix = dose_algorithm.calculate_influence_matrix(
+            ct, spacing, beams, self.structures, outside_stride, threshold,
+            resolution=coarse_resolution, on_dose_grid=True)
+        
+        self._algo = GradientOptimizer(np.zeros(ct.shape), self.structures, self.learning_rate,
+                                       fine_iterations, self.convergence_threshold)
+        self.algorithm = self.ALGO_GRADIENT
+        for objective in self.objectives:
+            self._algo.add_objective(objective)
+        self._algo.set_solver(self.solver)
+        if self.weight_bounds is not None:
+            self._algo.set_weight_bounds(*self.weight_bounds)
+        
+        if fine_matrix_path:
+            info = dose_algorithm.calculate_influence_matrix_file(
+                ct, spacing, beams, self.structures, fine_matrix_path, outside_stride, threshold)
+            self._algo.load_influence_matrix_file(fine_matrix_path, info["column_ids"])
+        else:
+            self._algo.set_influence_matrix(dose_algorithm.calculate_influence_matrix(
+                ct, spacing, beams, self.structures, outside_stride, threshold))
+        if self.initial_weights is not None:
+            self._algo.set_initial_weights([[w] for w in self.initial_weights])
+        
+        result = self._algo.optimize_multiresolution(coarse_matrix, coarse_iterations, fine_iterations)
+        self.profile_stats = self._algo.get_profile_stats()
+        logger.log_profile("tối ưu đa độ phân giải", self.profile_stats)
+        self.solver_result = result["fine"]
+        self.objective_values = [result["coarse"]["objective"], result["fine"]["objective"]]
+        logger.info(f"Tối ưu đa độ phân giải: {result['coarse']['iterations']} lần lặp thô, "
+                    f"{result['fine']['iterations']} lần lặp mịn")
+        
+        self.optimized_weights = [beam_weights[0] for beam_weights in self._algo.get_optimized_weights()]
+        return self.optimized_weights
+    
     def _optimize_python(self) -> List[float]:
         """
         Tối ưu hóa sử dụng triển khai Python thuần túy
@@ -290,9 +370,10 @@ class PlanOptimizer:
         # Khởi tạo trọng số chùm tia ngẫu nhiên
         import random
         import numpy as np
+        rng = random.Random(self.seed)
         
         # Khởi tạo trọng số với giá trị nhỏ ngẫu nhiên 
-        weights = [random.uniform(0.1, 1.0) for _ in range(len(self.dose_matrices))]
+        weights = [rng.uniform(0.1, 1.0) for _ in range(len(self.dose_matrices))]
         
         # Chuẩn hóa trọng số
         total = sum(weights)
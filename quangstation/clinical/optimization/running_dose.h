@@ -0,0 +1,237 @@
+#ifndef QUANGSTATION_RUNNING_DOSE_H
+#define QUANGSTATION_RUNNING_DOSE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "volume3d.h"
+#include "influence_matrix.h"
+#include "structure_dose.h"
+
+namespace quangstation {
+
+/**
+ * Liều tổng D = Σ_j w_j · B_j được giữ lại giữa các lần đánh giá.
+ *
+ * Khi chỉ một vài trọng số thay đổi, update_weight() cộng Δw · B_j trên các
+ * phần tử đã lưu của cột j và sửa các mẫu liều cấu trúc chỉ tại những voxel
+ * đó, nên một bước tìm kiếm cục bộ tốn O(số phần tử của cột) thay vì
+ * O(số voxel × số chùm tia). Giao điểm giữa cột và từng cấu trúc được dựng
+ * lười, một lần cho mỗi cột.
+ *
+ * Các đối số matrix/structure_voxels phải là cùng đối tượng qua các lần gọi;
+ * gọi invalidate() khi ma trận ảnh hưởng hoặc cấu trúc thay đổi.
+ */
+class RunningDose {
+public:
+    // Bỏ toàn bộ trạng thái (lần sync tiếp theo sẽ dựng lại từ đầu)
+    void invalidate() {
+        valid_ = false;
+        footprints_.clear();
+    }
+    
+    bool valid() const { return valid_; }
+    const DoseVolume& dose() const { return dose_; }
+    const std::vector<double>& weights() const { return weights_; }
+    
+    // Tính lại liều tổng từ đầu; ma trận rỗng cho lưới 0 cùng kích thước với fallback_grid
+    void rebuild(const DoseInfluenceMatrix& matrix,
+                 const std::map<std::string, StructureVoxels>& structure_voxels,
+                 const std::vector<double>& weights,
+                 const DoseVolume& fallback_grid) {
+        if (matrix.empty()) {
+            dose_ = DoseVolume::like(fallback_grid, 0.0);
+        } else if (valid_ && matrix.same_grid(dose_)) {
+            dose_.fill(0.0);
+            matrix.multiply_add(weights, dose_);
+        } else {
+            dose_ = matrix.multiply(weights);
+        }
+        weights_ = weights;
+        weights_.resize(matrix.empty() ? 0 : matrix.num_columns(), 0.0);
+        thresholds_.clear();
+        
+        if (names_.size() != structure_voxels.size()) {
+            footprints_.clear();
+        }
+        names_.clear();
+        voxels_.clear();
+        for (const auto& entry : structure_voxels) {
+            names_.push_back(entry.first);
+            voxels_.push_back(&entry.second);
+        }
+        samples_.resize(names_.size());
+        for (auto& sample : samples_) {
+            sample.valid = false;
+        }
+        valid_ = true;
+    }
+    
+    /**
+     * Đưa liều về weights: cập nhật từng cột nếu số phần tử của các cột thay đổi
+     * nhỏ hơn một nửa ma trận, ngược lại tính lại từ đầu.
+     */
+    void sync(const DoseInfluenceMatrix& matrix,
+              const std::map<std::string, StructureVoxels>& structure_voxels,
+              const std::vector<double>& weights,
+              const DoseVolume& fallback_grid) {
+        if (!valid_ || matrix.empty() || !matrix.same_grid(dose_) ||
+            weights_.size() != matrix.num_columns()) {
+            rebuild(matrix, structure_voxels, weights, fallback_grid);
+            return;
+        }
+        std::size_t changed_nnz = 0;
+        for (std::size_t j = 0; j < weights_.size(); ++j) {
+            double w = j < weights.size() ? weights[j] : 0.0;
+            if (w != weights_[j]) {
+                changed_nnz += matrix.column(j).count;
+            }
+        }
+        if (2 * changed_nnz > matrix.nnz()) {
+            rebuild(matrix, structure_voxels, weights, fallback_grid);
+            return;
+        }
+        for (std::size_t j = 0; j < weights_.size(); ++j) {
+            double w = j < weights.size() ? weights[j] : 0.0;
+            if (w != weights_[j]) {
+                update_weight(matrix, j, w);
+            }
+        }
+    }
+    
+    // Đặt trọng số cột j thành weight: D += Δw · B_j, sửa các mẫu cấu trúc đã gom
+    void update_weight(const DoseInfluenceMatrix& matrix, std::size_t j, double weight) {
+        const double delta = weight - weights_[j];
+        weights_[j] = weight;
+        if (delta == 0.0) {
+            return;
+        }
+        
+        const DoseInfluenceMatrix::Column column = matrix.column(j);
+        double* dose_data = dose_.data();
+        for (std::size_t k = 0; k < column.count; ++k) {
+            double& d = dose_data[column.row(k)];
+            const double old = d;
+            d += delta * column.values[k];
+            for (auto& threshold : thresholds_) {
+                threshold.second += (d >= threshold.first) - (old >= threshold.first);
+            }
+        }
+        
+        const ColumnFootprint& footprint = column_footprint(matrix, j);
+        for (std::size_t s = 0; s < samples_.size(); ++s) {
+            if (!samples_[s].valid) {
+                continue;
+            }
+            StructureDoseSample& sample = samples_[s].sample;
+            for (std::size_t e = footprint.structure_ptr[s]; e < footprint.structure_ptr[s + 1]; ++e) {
+                sample.update(footprint.position[e], dose_data[column.row(footprint.nonzero[e])]);
+            }
+        }
+    }
+    
+    // Mẫu liều của cấu trúc name (nullptr nếu không có)
+    StructureDoseSample* find(const std::string& name) {
+        auto it = std::lower_bound(names_.begin(), names_.end(), name);
+        if (it == names_.end() || *it != name) {
+            return nullptr;
+        }
+        Entry& entry = samples_[it - names_.begin()];
+        if (!entry.valid) {
+            entry.sample.gather(*voxels_[it - names_.begin()], dose_.data());
+            entry.valid = true;
+        }
+        return &entry.sample;
+    }
+    
+    // Số voxel của lưới có liều >= threshold (đếm một lần, sau đó cập nhật theo từng cột)
+    std::size_t count_at_least(double threshold) {
+        for (const auto& entry : thresholds_) {
+            if (entry.first == threshold) {
+                return entry.second;
+            }
+        }
+        const std::size_t n = dose_.size();
+        const double* dose_data = dose_.data();
+        long count = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            count += dose_data[i] >= threshold;
+        }
+        thresholds_.emplace_back(threshold, count);
+        return static_cast<std::size_t>(count);
+    }
+    
+private:
+    struct Entry {
+        StructureDoseSample sample;
+        bool valid = false;
+    };
+    
+    // Giao của một cột với từng cấu trúc: (vị trí trong cột, vị trí trong cấu trúc)
+    struct ColumnFootprint {
+        bool built = false;
+        std::vector<std::size_t> structure_ptr;
+        std::vector<std::uint32_t> nonzero;
+        std::vector<std::uint32_t> position;
+    };
+    
+    const ColumnFootprint& column_footprint(const DoseInfluenceMatrix& matrix, std::size_t j) {
+        if (footprints_.size() != matrix.num_columns()) {
+            footprints_.assign(matrix.num_columns(), ColumnFootprint());
+        }
+        ColumnFootprint& footprint = footprints_[j];
+        if (footprint.built) {
+            return footprint;
+        }
+        
+        // Hàng của cột theo thứ tự tăng dần (mọi cột của DoseInfluenceMatrix đã sắp sẵn; kiểm tra cho chắc)
+        const DoseInfluenceMatrix::Column column = matrix.column(j);
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> sorted;
+        sorted.reserve(column.count);
+        for (std::size_t k = 0; k < column.count; ++k) {
+            sorted.emplace_back(column.row(k), static_cast<std::uint32_t>(k));
+        }
+        if (!std::is_sorted(sorted.begin(), sorted.end())) {
+            std::sort(sorted.begin(), sorted.end());
+        }
+        
+        // Trộn với danh sách voxel (đã sắp) của từng cấu trúc
+        footprint.structure_ptr.assign(1, 0);
+        for (const StructureVoxels* voxels : voxels_) {
+            std::size_t a = 0, b = 0;
+            while (a < sorted.size() && b < voxels->size()) {
+                if (sorted[a].first < (*voxels)[b]) {
+                    ++a;
+                } else if ((*voxels)[b] < sorted[a].first) {
+                    ++b;
+                } else {
+                    footprint.nonzero.push_back(sorted[a].second);
+                    footprint.position.push_back(static_cast<std::uint32_t>(b));
+                    ++a;
+                    ++b;
+                }
+            }
+            footprint.structure_ptr.push_back(footprint.nonzero.size());
+        }
+        footprint.built = true;
+        return footprint;
+    }
+    
+    bool valid_ = false;
+    DoseVolume dose_;
+    std::vector<double> weights_;
+    std::vector<std::string> names_;             // Theo thứ tự của std::map (đã sắp)
+    std::vector<const StructureVoxels*> voxels_;
+    std::vector<Entry> samples_;
+    std::vector<ColumnFootprint> footprints_;
+    std::vector<std::pair<double, long>> thresholds_;  // (ngưỡng, số voxel >= ngưỡng)
+};
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_RUNNING_DOSE_H
@@ -0,0 +1,182 @@
+#ifndef QUANGSTATION_STRUCTURE_DOSE_H
+#define QUANGSTATION_STRUCTURE_DOSE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "volume3d.h"
+#include "structure_mask.h"
+
+namespace quangstation {
+
+// Danh sách chỉ số voxel tuyến tính của một cấu trúc (theo thứ tự bộ nhớ)
+using StructureVoxels = std::vector<std::uint32_t>;
+
+// Dựng danh sách voxel cho mọi cấu trúc, một lần khi khởi tạo optimizer
+inline std::map<std::string, StructureVoxels> build_structure_voxels(
+    const std::map<std::string, StructureMask>& masks) {
+    std::map<std::string, StructureVoxels> result;
+    for (const auto& entry : masks) {
+        result.emplace(entry.first, entry.second.voxels());
+    }
+    return result;
+}
+
+/**
+ * Liều của một cấu trúc cho một lần đánh giá: gom một lần, dùng chung cho mọi
+ * mục tiêu trên cùng cấu trúc. Min/max/tổng được tính ngay khi gom; liều theo
+ * thứ hạng (DVH) dùng nth_element, O(n) thay vì sắp xếp toàn bộ.
+ *
+ * Liều được giữ theo thứ tự voxel nên update() có thể sửa từng voxel: tổng và
+ * tổng bình phương cập nhật O(1), min/max chỉ quét lại khi giá trị cực trị giảm.
+ */
+class StructureDoseSample {
+public:
+    StructureDoseSample() = default;
+    
+    StructureDoseSample(const StructureVoxels& voxels, const double* dose) {
+        gather(voxels, dose);
+    }
+    
+    // Gom lại liều (dùng lại bộ nhớ của lần gom trước)
+    void gather(const StructureVoxels& voxels, const double* dose) {
+        doses_.resize(voxels.size());
+        ranked_valid_ = false;
+        extrema_valid_ = true;
+        min_ = std::numeric_limits<double>::max();
+        max_ = -std::numeric_limits<double>::max();
+        sum_ = 0.0;
+        sum_squares_ = 0.0;
+        for (std::size_t k = 0; k < voxels.size(); ++k) {
+            double d = dose[voxels[k]];
+            doses_[k] = d;
+            min_ = std::min(min_, d);
+            max_ = std::max(max_, d);
+            sum_ += d;
+            sum_squares_ += d * d;
+        }
+    }
+    
+    // Đổi liều của voxel thứ k (theo thứ tự trong danh sách voxel) thành dose
+    void update(std::size_t k, double dose) {
+        const double old = doses_[k];
+        doses_[k] = dose;
+        sum_ += dose - old;
+        sum_squares_ += dose * dose - old * old;
+        ranked_valid_ = false;
+        if (extrema_valid_) {
+            if ((old == max_ && dose < old) || (old == min_ && dose > old)) {
+                extrema_valid_ = false;
+            } else {
+                max_ = std::max(max_, dose);
+                min_ = std::min(min_, dose);
+            }
+        }
+    }
+    
+    bool empty() const { return doses_.empty(); }
+    std::size_t size() const { return doses_.size(); }
+    double min() const { refresh_extrema(); return doses_.empty() ? 0.0 : min_; }
+    double max() const { refresh_extrema(); return doses_.empty() ? 0.0 : max_; }
+    double sum() const { return sum_; }
+    double sum_squares() const { return sum_squares_; }
+    double mean() const { return doses_.empty() ? 0.0 : sum_ / doses_.size(); }
+    
+    // Liều tại thứ hạng rank theo thứ tự tăng dần (giống doses[rank] sau std::sort); 0 nếu rỗng
+    double at_rank(std::size_t rank) {
+        if (doses_.empty()) {
+            return 0.0;
+        }
+        if (!ranked_valid_) {
+            ranked_.assign(doses_.begin(), doses_.end());
+            ranked_valid_ = true;
+        }
+        rank = std::min(rank, ranked_.size() - 1);
+        std::nth_element(ranked_.begin(), ranked_.begin() + rank, ranked_.end());
+        return ranked_[rank];
+    }
+    
+    // Số voxel có liều >= threshold
+    std::size_t count_at_least(double threshold) const {
+        return static_cast<std::size_t>(std::count_if(doses_.begin(), doses_.end(),
+            [threshold](double d) { return d >= threshold; }));
+    }
+    
+private:
+    void refresh_extrema() const {
+        if (extrema_valid_) {
+            return;
+        }
+        min_ = std::numeric_limits<double>::max();
+        max_ = -std::numeric_limits<double>::max();
+        for (double d : doses_) {
+            min_ = std::min(min_, d);
+            max_ = std::max(max_, d);
+        }
+        extrema_valid_ = true;
+    }
+    
+    std::vector<double> doses_;               // Theo thứ tự voxel
+    std::vector<double> ranked_;              // Bản sao cho nth_element
+    bool ranked_valid_ = false;
+    mutable bool extrema_valid_ = true;
+    mutable double min_ = std::numeric_limits<double>::max();
+    mutable double max_ = -std::numeric_limits<double>::max();
+    double sum_ = 0.0;
+    double sum_squares_ = 0.0;
+};
+
+/**
+ * Bộ đệm mẫu liều theo cấu trúc cho một lần đánh giá hàm mục tiêu. Mỗi luồng
+ * dùng một đối tượng riêng nên có thể đánh giá song song; reset() chuyển sang
+ * lưới liều khác mà vẫn giữ bộ nhớ đã cấp phát.
+ */
+class StructureDoseCache {
+public:
+    StructureDoseCache(const std::map<std::string, StructureVoxels>& structure_voxels, const double* dose)
+        : structure_voxels_(&structure_voxels), dose_(dose) {}
+    
+    void reset(const double* dose) {
+        dose_ = dose;
+        for (auto& entry : samples_) {
+            entry.second.valid = false;
+        }
+    }
+    
+    // nullptr nếu không có cấu trúc tên name
+    StructureDoseSample* find(const std::string& name) {
+        auto it = samples_.find(name);
+        if (it != samples_.end() && it->second.valid) {
+            return &it->second.sample;
+        }
+        auto voxels = structure_voxels_->find(name);
+        if (voxels == structure_voxels_->end()) {
+            return nullptr;
+        }
+        if (it == samples_.end()) {
+            it = samples_.emplace(name, Entry()).first;
+        }
+        it->second.sample.gather(voxels->second, dose_);
+        it->second.valid = true;
+        return &it->second.sample;
+    }
+    
+private:
+    struct Entry {
+        StructureDoseSample sample;
+        bool valid = false;
+    };
+    
+    const std::map<std::string, StructureVoxels>* structure_voxels_;
+    const double* dose_;
+    std::map<std::string, Entry> samples_;
+};
+
+} // namespace quangstation
+
+#endif // QUANGSTATION_STRUCTURE_DOSE_H
@@ -21,6 +21,12 @@ from quangstation.core.utils.logging import get_logger
 # Initialize logger
 logger = get_logger("DVH")
 
+try:
+    from quangstation.clinical.dose_calculation._dose_engine import calculate_dose_histograms
+    HAS_CPP_DVH = True
+except ImportError:
+    HAS_CPP_DVH = False
+
 class DVHCalculator:
     """
     Lớp tính toán Dose Volume Histogram (DVH) từ dữ liệu liều và cấu trúc.
@@ -147,7 +153,7 @@ class DVHCalculator:
                 raise ValueError("Phải chỉ định structure_name hoặc structure_mask")
             if structure_name not in self.structures:
                 raise ValueError(f"Cấu trúc {structure_name} không tồn tại")
-            structure_mask = self.structures[structure_name]
+            structure_mask = self._structure_mask(structure_name)
         
         # Kiểm tra kích thước
         if structure_mask.shape != dose_volume.shape:
@@ -167,10 +173,6 @@ class DVHCalculator:
                     'volume_metrics': {}
                 }
             
-            # Tính thể tích cấu trúc (cc)
-            voxel_volume_cc = np.prod(self.voxel_size) / 1000  # mm³ -> cc
-            structure_volume_cc = len(mask_indices[0]) * voxel_volume_cc
-            
             # Lấy giá trị liều trong cấu trúc
             dose_values = dose_volume[mask_indices] * self.dose_grid_scaling  # Chuyển sang Gy
             
@@ -180,46 +182,9 @@ class DVHCalculator:
             
             # Tính histogram vi phân
             hist, bin_edges = np.histogram(dose_values, bins=bins, range=(0, dose_max))
-            bin_centers = (bin_edges[:-1] + bin_edges[1:]) / 2
-            
-            # Chuyển sang thể tích tương đối (%)
-            rel_volumes = hist / len(dose_values) * 100
             
-            # Tính DVH tích lũy
-            cum_volumes = np.zeros_like(rel_volumes)
-            for i in range(len(rel_volumes)):
-                cum_volumes[i] = np.sum(rel_volumes[i:])
-            
-            # Làm trơn DVH để trông đẹp hơn
-            try:
-                from scipy.signal import savgol_filter
-                if len(cum_volumes) > 11:  # Cần ít nhất window_length điểm
-                    cum_volumes_smooth = savgol_filter(cum_volumes, 11, 3)
-                    cum_volumes = np.maximum(cum_volumes_smooth, 0)  # Đảm bảo không âm
-            except ImportError:
-                logger.info("Không có scipy, không làm trơn DVH")
-            
-            # Tính các chỉ số liều
-            dose_metrics = self.calculate_dose_metrics(dose_values)
-            
-            # Tính các chỉ số thể tích
-            volume_metrics = self.calculate_volume_metrics(bin_centers, cum_volumes)
-            
-            # Tạo kết quả DVH
-            dvh_data = {
-                'name': structure_name,
-                'volume_cc': structure_volume_cc,
-                'differential': {
-                    'dose': bin_centers.tolist(),
-                    'volume': rel_volumes.tolist()
-                },
-                'cumulative': {
-                    'dose': bin_centers.tolist(),
-                    'volume': cum_volumes.tolist()
-                },
-                'dose_metrics': dose_metrics,
-                'volume_metrics': volume_metrics
-            }
+            dvh_data = self._dvh_from_histogram(structure_name, hist, bin_edges, len(dose_values),
+                                                self.calculate_dose_metrics(dose_values))
             
             # Lưu kết quả
             if structure_name is not None:
@@ -234,6 +199,69 @@ class DVHCalculator:
             logger.error(traceback.format_exc())
             return None
     
+    def _structure_mask(self, name: str) -> np.ndarray:
+        """Mặt nạ của cấu trúc đã add_structure (lưu dạng dict) hoặc gán trực tiếp"""
+        structure = self.structures[name]
+        return structure["mask"] if isinstance(structure, dict) else structure
+    
+    def _dvh_from_histogram(self, structure_name: str, hist: np.ndarray, bin_edges: np.ndarray,
+                            num_voxels: int, dose_metrics: Dict[str, float]) -> Dict:
+        """
+        DVH vi phân/tích lũy và các chỉ số thể tích từ histogram liều của cấu trúc.
+        Dùng chung cho đường NumPy và đường C++ để hai đường cho cùng kết quả.
+        
+        Args:
+            structure_name: Tên cấu trúc
+            hist: Số voxel theo bin (như np.histogram)
+            bin_edges: Cạnh bin (bins + 1 giá trị, Gy)
+            num_voxels: Tổng số voxel của cấu trúc (kể cả liều ngoài khoảng bin)
+            dose_metrics: Chỉ số liều (calculate_dose_metrics)
+            
+        Returns:
+            Dict chứa thông tin DVH
+        """
+        # Tính thể tích cấu trúc (cc)
+        voxel_volume_cc = np.prod(self.voxel_size) / 1000  # mm³ -> cc
+        structure_volume_cc = num_voxels * voxel_volume_cc
+        
+        bin_centers = (bin_edges[:-1] + bin_edges[1:]) / 2
+        
+        # Chuyển sang thể tích tương đối (%)
+        rel_volumes = hist / num_voxels * 100
+        
+        # Tính DVH tích lũy
+        cum_volumes = np.zeros_like(rel_volumes)
+        for i in range(len(rel_volumes)):
+            cum_volumes[i] = np.sum(rel_volumes[i:])
+        
+        # Làm trơn DVH để trông đẹp hơn
+        try:
+            from scipy.signal import savgol_filter
+            if len(cum_volumes) > 11:  # Cần ít nhất window_length điểm
+                cum_volumes_smooth = savgol_filter(cum_volumes, 11, 3)
+                cum_volumes = np.maximum(cum_volumes_smooth, 0)  # Đảm bảo không âm
+        except ImportError:
+            logger.info("Không có scipy, không làm trơn DVH")
+        
+        # Tính các chỉ số thể tích
+        volume_metrics = self.calculate_volume_metrics(bin_centers, cum_volumes)
+        
+        # Tạo kết quả DVH
+        return {
+            'name': structure_name,
+            'volume_cc': structure_volume_cc,
+            'differential': {
+                'dose': bin_centers.tolist(),
+                'volume': rel_volumes.tolist()
+            },
+            'cumulative': {
+                'dose': bin_centers.tolist(),
+                'volume': cum_volumes.tolist()
+            },
+            'dose_metrics': dose_metrics,
+            'volume_metrics': volume_metrics
+        }
+    
     def calculate_dose_metrics(self, dose_values: np.ndarray) -> Dict[str, float]:
         """
         Tính các chỉ số liều từ tập hợp giá trị liều.
@@ -348,8 +376,17 @@ class DVHCalculator:
         if dose_max is None and self.dose_data is not None:
             dose_max = np.max(self.dose_data) * self.dose_grid_scaling * 1.1
             
-        # Tính DVH cho từng cấu trúc
+        # Engine C++: histogram và chỉ số liều của mọi cấu trúc, cùng quy ước với NumPy
+        if HAS_CPP_DVH and self.dose_data is not None and self.structures:
+            try:
+                results = self._calculate_dvh_for_all_cpp(bins, dose_max)
+            except Exception as error:
+                logger.warning(f"Không tính được DVH bằng engine C++, dùng NumPy: {error}")
+        
+        # Tính DVH cho từng cấu trúc còn lại (NumPy)
         for name in self.structures:
+            if name in results:
+                continue
             try:
                 results[name] = self.calculate_dvh(
                     structure_name=name,
@@ -361,6 +398,44 @@ class DVHCalculator:
                 
         return results
     
+    def _calculate_dvh_for_all_cpp(self, bins: int, dose_max: float) -> Dict[str, Dict]:
+        """
+        Như calculate_dvh_for_all cho các cấu trúc engine C++ tính được: histogram và chỉ số
+        liều lấy từ C++ (cùng quy ước với np.histogram, np.median và calculate_dose_metrics),
+        phần còn lại dùng chung _dvh_from_histogram với calculate_dvh. Cấu trúc rỗng hoặc
+        có mặt nạ không dùng được để lại cho đường NumPy.
+        """
+        if dose_max is None or not dose_max > 0:
+            return {}
+        dose_gy = np.ascontiguousarray(self.dose_data * self.dose_grid_scaling, dtype=np.float64)
+        masks = {}
+        for name in self.structures:
+            mask = self._structure_mask(name)
+            if isinstance(mask, np.ndarray) and mask.shape == dose_gy.shape:
+                masks[name] = np.ascontiguousarray(mask > 0, dtype=np.uint8)
+        if not masks:
+            return {}
+        
+        volume_levels = [1, 2, 5, 10, 20, 50, 80, 90, 95, 98, 99]
+        histograms = calculate_dose_histograms(dose_gy, self.voxel_size, masks, bins=bins, dose_max=dose_max,
+                                               volume_levels=volume_levels)
+        bin_edges = np.linspace(0, dose_max, bins + 1)
+        
+        results = {}
+        for name, histogram in histograms.items():
+            if histogram["voxel_count"] == 0:
+                continue
+            dose_metrics = {"min": histogram["d_min"], "max": histogram["d_max"],
+                            "mean": histogram["d_mean"], "median": histogram["d_median"]}
+            for x in volume_levels:
+                dose_metrics[f"D{x}"] = histogram["D"][float(x)]
+            dvh_data = self._dvh_from_histogram(name, histogram["counts"], bin_edges,
+                                                histogram["voxel_count"], dose_metrics)
+            self.dvh_results[name] = dvh_data
+            results[name] = dvh_data
+            logger.info(f"Đã tính DVH cho cấu trúc {name}")
+        return results
+    
     def compare_dose_metrics(self, structures: List[str] = None) -> Dict:
         """
         So sánh các thông số liều giữa các cấu trúc.
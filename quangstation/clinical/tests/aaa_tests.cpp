@@ -0,0 +1,91 @@
+// AAA: liều sơ cấp + tán xạ, hiệu chỉnh không đồng nhất, bộ đệm depth map và đa luồng
+
+#include <cstdint>
+
+#include "test_harness.h"
+
+namespace {
+
+using namespace quangstation::test;
+
+Plan conformal_plan(double prescribed_dose) {
+    Plan plan = quangstation::bench::make_plan(quangstation::bench::PlanKind::Conformal3D, small_phantom());
+    plan.prescribed_dose = prescribed_dose;
+    return plan;
+}
+
+double total(const DoseVolume& dose) {
+    double sum = 0.0;
+    for (double value : dose) {
+        sum += value;
+    }
+    return sum;
+}
+
+QS_TEST(aaa_normalises_and_is_thread_count_independent) {
+    const auto& phantom = small_phantom();
+    const Plan plan = conformal_plan(2.0);
+
+    AAA engine;
+    engine.set_num_threads(1);
+    const DoseVolume serial = engine.calculate(phantom.ct, phantom.ptv, plan);
+    QS_CHECK(serial.same_shape(phantom.ct));
+    QS_CHECK_NEAR(mean_in_mask(serial, phantom.ptv), plan.prescribed_dose, 1e-9);
+    QS_CHECK(*std::min_element(serial.begin(), serial.end()) >= 0.0);
+
+    // Mỗi luồng cộng vào lưới riêng: chỉ thứ tự cộng số thực khác nhau
+    engine.set_num_threads(3);
+    QS_CHECK_NEAR(max_abs_difference(engine.calculate(phantom.ct, phantom.ptv, plan), serial), 0.0, 1e-12);
+}
+
+QS_TEST(aaa_scatter_adds_dose_to_primary) {
+    const auto& phantom = small_phantom();
+    const Plan plan = conformal_plan(0.0);
+
+    AAA with_scatter;
+    const DoseVolume dose = with_scatter.calculate(phantom.ct, MaskVolume(), plan);
+    AAA primary_only;
+    primary_only.set_max_scatter_radius(0.0);
+    const DoseVolume primary = primary_only.calculate(phantom.ct, MaskVolume(), plan);
+
+    QS_CHECK(total(dose) > total(primary));
+    for (std::size_t i = 0; i < dose.size(); ++i) {
+        QS_CHECK(dose.data()[i] >= primary.data()[i]);
+    }
+}
+
+QS_TEST(aaa_num_photons_scales_only_unnormalised_dose) {
+    const auto& phantom = small_phantom();
+    AAA engine;
+    const DoseVolume raw = engine.calculate(phantom.ct, MaskVolume(), conformal_plan(0.0));
+    const DoseVolume normalised = engine.calculate(phantom.ct, phantom.ptv, conformal_plan(2.0));
+
+    engine.set_num_photons(2000000);
+    const DoseVolume raw_doubled = engine.calculate(phantom.ct, MaskVolume(), conformal_plan(0.0));
+    QS_CHECK_NEAR(total(raw_doubled), 2.0 * total(raw), 1e-9 * total(raw));
+    QS_CHECK_NEAR(max_abs_difference(engine.calculate(phantom.ct, phantom.ptv, conformal_plan(2.0)), normalised),
+                  0.0, 1e-12);
+}
+
+QS_TEST(aaa_heterogeneity_correction_and_water_depth_cache) {
+    const auto& phantom = small_phantom();
+    const Plan plan = conformal_plan(2.0);
+    const CTVolume water = CTVolume::like(phantom.ct, static_cast<std::int16_t>(0));
+
+    AAA engine;
+    const DoseVolume water_dose = engine.calculate(water, phantom.ptv, plan);
+    const DoseVolume slab_dose = engine.calculate(phantom.ct, phantom.ptv, plan);
+    QS_CHECK(max_abs_difference(water_dose, slab_dose) > 1e-3);
+
+    // Tắt hiệu chỉnh: mọi CT được coi là nước (HU 0 có mật độ điện tử 1)
+    engine.set_heterogeneity_correction(false);
+    QS_CHECK_NEAR(max_abs_difference(engine.calculate(phantom.ct, phantom.ptv, plan), water_dose), 0.0, 1e-12);
+
+    // Depth map của lưới nước khóa theo hình học lưới: CT khác cùng lưới dùng lại cả bốn chùm tia
+    QS_CHECK_NEAR(max_abs_difference(engine.calculate(water, phantom.ptv, plan), water_dose), 0.0, 1e-12);
+    quangstation::ProfileStats stats = engine.get_profile_stats();
+    QS_CHECK(stats.counters["depth_cache_hits"] == plan.beams.size());
+    QS_CHECK(stats.counters["depth_cache_misses"] == 0);
+}
+
+} // namespace
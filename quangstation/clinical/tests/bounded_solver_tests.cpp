@@ -0,0 +1,99 @@
+// Bộ giải có cận (L-BFGS-B, gradient chiếu) trên bài toán bậc hai có nghiệm đã biết
+
+#include <stdexcept>
+#include <vector>
+
+#include "bounded_solver.h"
+#include "test_harness.h"
+
+using quangstation::BoundedSolverOptions;
+using quangstation::SolverMethod;
+using quangstation::SolverResult;
+
+namespace {
+
+using namespace quangstation::test;
+
+// f(x) = Σ a_i (x_i - c_i)² + (x_0 - x_1)²: nghiệm có cận phải tìm bằng tập hoạt động
+struct BoundedQuadratic {
+    std::vector<double> a = {1.0, 4.0, 0.5, 2.0, 3.0};
+    std::vector<double> c = {-1.0, 0.4, 2.5, 0.7, -0.2};
+
+    double value(const std::vector<double>& x) const {
+        double f = (x[0] - x[1]) * (x[0] - x[1]);
+        for (std::size_t i = 0; i < x.size(); ++i) {
+            f += a[i] * (x[i] - c[i]) * (x[i] - c[i]);
+        }
+        return f;
+    }
+
+    void gradient(const std::vector<double>& x, std::vector<double>& g) const {
+        for (std::size_t i = 0; i < x.size(); ++i) {
+            g[i] = 2.0 * a[i] * (x[i] - c[i]);
+        }
+        g[0] += 2.0 * (x[0] - x[1]);
+        g[1] -= 2.0 * (x[0] - x[1]);
+    }
+};
+
+void check_bounded_quadratic(SolverMethod method) {
+    BoundedQuadratic problem;
+    BoundedSolverOptions options;
+    options.method = method;
+    options.lower = 0.0;
+    options.upper = 1.0;
+    options.max_iterations = 200;
+    options.relative_tolerance = 0.0;
+    options.projected_gradient_tolerance = 1e-10;
+
+    std::vector<double> x(5, 0.5);
+    int accepted = 0;
+    SolverResult result = quangstation::minimize_bounded(
+        x,
+        [&](const std::vector<double>& v) { return problem.value(v); },
+        [&](const std::vector<double>& v, std::vector<double>& g) { problem.gradient(v, g); },
+        options,
+        [&](int, double) { ++accepted; return true; });
+
+    // x_0 = 0 (cận dưới); x_1 tự do: 2·4(x_1 - 0.4) - 2(0 - x_1) = 0 → x_1 = 0.32;
+    // x_2 = 1 (cận trên); x_3 = 0.7; x_4 = 0 (cận dưới)
+    const std::vector<double> expected = {0.0, 0.32, 1.0, 0.7, 0.0};
+    QS_CHECK(result.converged);
+    QS_CHECK(result.iterations == accepted);
+    QS_CHECK(result.function_evaluations >= result.iterations);
+    for (std::size_t i = 0; i < x.size(); ++i) {
+        QS_CHECK(x[i] >= 0.0 && x[i] <= 1.0);
+        QS_CHECK_NEAR(x[i], expected[i], 1e-7);
+    }
+    QS_CHECK_NEAR(result.objective, problem.value(expected), 1e-10);
+}
+
+QS_TEST(bounded_solver_lbfgsb_finds_constrained_minimum) {
+    check_bounded_quadratic(SolverMethod::LBFGSB);
+}
+
+QS_TEST(bounded_solver_projected_gradient_finds_constrained_minimum) {
+    check_bounded_quadratic(SolverMethod::ProjectedGradient);
+}
+
+QS_TEST(bounded_solver_stops_when_progress_returns_false) {
+    BoundedQuadratic problem;
+    BoundedSolverOptions options;
+    options.upper = 1.0;
+    std::vector<double> x = {5.0, -3.0, 0.5, 0.5, 0.5};  // Xuất phát ngoài miền: được chiếu vào
+    SolverResult result = quangstation::minimize_bounded(
+        x,
+        [&](const std::vector<double>& v) { return problem.value(v); },
+        [&](const std::vector<double>& v, std::vector<double>& g) { problem.gradient(v, g); },
+        options,
+        [](int iteration, double) { return iteration < 1; });
+    QS_CHECK(!result.converged);
+    QS_CHECK(result.iterations == 2);
+    for (double value : x) {
+        QS_CHECK(value >= 0.0 && value <= 1.0);
+    }
+    QS_CHECK_THROWS(quangstation::solver_method_from_string("newton"), std::invalid_argument);
+    QS_CHECK(quangstation::solver_method_from_string("l-bfgs-b") == SolverMethod::LBFGSB);
+}
+
+} // namespace
@@ -0,0 +1,117 @@
+// Vận chuyển collapsed-cone: lưới đường của các hướng cone và cân bằng TERMA-liều
+
+#include <array>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include "collapsed_cone.h"
+#include "test_harness.h"
+
+using quangstation::CollapsedConeTransport;
+using quangstation::ConeDirection;
+using quangstation::ConeKernel;
+using quangstation::ConeLattice;
+
+namespace {
+
+using namespace quangstation::test;
+
+QS_TEST(cone_lattice_lines_cover_every_voxel_once_per_direction) {
+    const std::array<std::size_t, 3> dims = {7, 5, 6};  // (x, y, z)
+    const std::array<double, 3> spacing = {2.0, 3.0, 2.5};
+    ConeLattice lattice(dims, spacing, 12);
+    QS_CHECK(lattice.directions().size() == 12);
+    QS_CHECK(lattice.matches(dims, spacing, 12));
+    QS_CHECK(!lattice.matches(dims, spacing, 24));
+    QS_CHECK(!lattice.matches({7, 5, 7}, spacing, 12));
+    QS_CHECK(ConeLattice(dims, spacing, 0).directions().size() == 1);
+
+    double solid_angle = 0.0;
+    for (const ConeDirection& cone : lattice.directions()) {
+        const auto& u = cone.direction;
+        QS_CHECK_NEAR(u[0] * u[0] + u[1] * u[1] + u[2] * u[2], 1.0, 1e-12);
+        QS_CHECK_NEAR(cone.step_length, spacing[cone.axis] / std::abs(u[cone.axis]), 1e-12);
+        solid_angle += cone.solid_angle;
+
+        std::vector<int> visits(dims[0] * dims[1] * dims[2], 0);
+        for (long oc = cone.origin_c_min; oc <= cone.origin_c_max; ++oc) {
+            for (long ob = cone.origin_b_min; ob <= cone.origin_b_max; ++ob) {
+                for (long k = 0; k < static_cast<long>(dims[cone.axis]); ++k) {
+                    std::array<long, 3> voxel;
+                    voxel[cone.axis] = k;
+                    voxel[cone.axis_b] = ob + cone.shift_b[k];
+                    voxel[cone.axis_c] = oc + cone.shift_c[k];
+                    if (voxel[cone.axis_b] < 0 || voxel[cone.axis_b] >= static_cast<long>(dims[cone.axis_b]) ||
+                        voxel[cone.axis_c] < 0 || voxel[cone.axis_c] >= static_cast<long>(dims[cone.axis_c])) {
+                        continue;
+                    }
+                    ++visits[(voxel[2] * dims[1] + voxel[1]) * dims[0] + voxel[0]];
+                }
+            }
+        }
+        for (int count : visits) {
+            QS_CHECK(count == 1);
+        }
+    }
+    QS_CHECK_NEAR(solid_angle, 1.0, 1e-12);
+}
+
+QS_TEST(cone_transport_reaches_equilibrium_in_uniform_medium) {
+    // TERMA đều trong môi trường đặc (quãng đường bức xạ dài gấp nhiều lần tầm kernel):
+    // ở tâm năng lượng nhận vào bằng năng lượng giải phóng, liều = TERMA
+    const std::size_t n = 20;
+    const std::array<double, 3> spacing = {5.0, 5.0, 5.0};
+    Volume3D<double> density(n, n, n, 20.0, spacing);
+    Volume3D<double> terma(n, n, n, 1.0, spacing);
+    ConeLattice lattice({n, n, n}, spacing, 24);
+    DoseVolume dose(n, n, n, 0.0, spacing);
+
+    CollapsedConeTransport::transport(density, terma, lattice, ConeKernel::for_photon(6.0), {0.0, 1.0, 0.0}, dose, 2.0);
+    QS_CHECK_NEAR(dose(n / 2, n / 2, n / 2), 2.0, 1e-6);
+    for (double value : dose) {
+        QS_CHECK(value > 0.0 && value <= 2.0 + 1e-9);
+    }
+    // Voxel góc chỉ nhận năng lượng từ một phần các hướng
+    QS_CHECK(dose(0, 0, 0) < 1.9);
+
+    // TERMA bằng 0 ở nửa sau theo y: liều giảm dần (không bằng 0 ngay) sau mặt phân cách
+    for (std::size_t z = 0; z < n; ++z) {
+        for (std::size_t y = n / 2; y < n; ++y) {
+            for (std::size_t x = 0; x < n; ++x) {
+                terma(z, y, x) = 0.0;
+            }
+        }
+    }
+    DoseVolume half = DoseVolume::like(dose, 0.0);
+    CollapsedConeTransport::transport(density, terma, lattice, ConeKernel::for_photon(6.0), {0.0, 1.0, 0.0}, half);
+    QS_CHECK(half(n / 2, n / 2, n / 2) > 0.0);
+    QS_CHECK(half(n / 2, n / 2, n / 2) < half(n / 2, n / 2 - 1, n / 2));
+    QS_CHECK(half(n / 2, n / 2 + 1, n / 2) < half(n / 2, n / 2, n / 2));
+}
+
+QS_TEST(collapsed_cone_engine_cone_transport) {
+    const auto& phantom = small_phantom();
+    const Plan plan = quangstation::bench::make_plan(quangstation::bench::PlanKind::Conformal3D, phantom);
+
+    CollapsedConeConvolution engine(8);
+    QS_CHECK(engine.get_transport_mode() == "cone");
+    QS_CHECK_THROWS(engine.set_transport_mode("ray"), std::invalid_argument);
+    const DoseVolume first = engine.calculate(phantom.ct, phantom.ptv, plan);
+    QS_CHECK_NEAR(mean_in_mask(first, phantom.ptv), plan.prescribed_dose, 1e-9);
+    QS_CHECK(*std::min_element(first.begin(), first.end()) >= 0.0);
+
+    // Lưới cone được dùng lại: lần tính thứ hai cho cùng kết quả
+    QS_CHECK(max_abs_difference(engine.calculate(phantom.ct, phantom.ptv, plan), first) == 0.0);
+
+    engine.set_num_cones(0);
+    QS_CHECK(engine.get_num_cones() == 1);
+    engine.set_num_cones(24);
+    const DoseVolume more_cones = engine.calculate(phantom.ct, phantom.ptv, plan);
+    QS_CHECK(max_abs_difference(more_cones, first) > 1e-6);
+
+    engine.set_transport_mode("kernel");
+    QS_CHECK(max_abs_difference(engine.calculate(phantom.ct, phantom.ptv, plan), more_cones) > 1e-6);
+}
+
+} // namespace
@@ -0,0 +1,138 @@
+// Tích chập kernel liều: direct / separable / FFT so với tổng trực tiếp
+
+#include <cmath>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+#include "convolution.h"
+#include "test_harness.h"
+
+using quangstation::ConvolutionMode;
+using quangstation::KernelConvolver;
+using quangstation::PreparedKernel;
+using quangstation::SeparableKernel;
+
+namespace {
+
+using namespace quangstation::test;
+
+DensityVolume random_density(std::size_t depth, std::size_t height, std::size_t width, std::uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 2.0);
+    DensityVolume density(depth, height, width, 0.0);
+    for (double& value : density) {
+        value = uniform(rng);
+    }
+    return density;
+}
+
+// Kernel (2·half + 1)³: Gaussian tách được, hoặc 1/(1 + r²) không tách được
+Volume3D<double> make_kernel(int half, bool separable) {
+    const std::size_t n = 2 * half + 1;
+    Volume3D<double> kernel(n, n, n, 0.0);
+    for (int z = -half; z <= half; ++z) {
+        for (int y = -half; y <= half; ++y) {
+            for (int x = -half; x <= half; ++x) {
+                const double r2 = x * x + 0.5 * y * y + 2.0 * z * z;
+                kernel(z + half, y + half, x + half) = separable ? std::exp(-0.3 * r2) : 1.0 / (1.0 + r2);
+            }
+        }
+    }
+    return kernel;
+}
+
+// out(z, y, x) = Σ K(c + dz, c + dy, c + dx) · ρ(z + dz, y + dy, x + dx), |d| <= half, biên bằng 0
+DensityVolume direct_sum(const DensityVolume& density, const Volume3D<double>& kernel, int half) {
+    const long c = static_cast<long>(kernel.depth()) / 2;
+    DensityVolume out = DensityVolume::like(density, 0.0);
+    for (long z = 0; z < static_cast<long>(density.depth()); ++z) {
+        for (long y = 0; y < static_cast<long>(density.height()); ++y) {
+            for (long x = 0; x < static_cast<long>(density.width()); ++x) {
+                double sum = 0.0;
+                for (long dz = -half; dz <= half; ++dz) {
+                    for (long dy = -half; dy <= half; ++dy) {
+                        for (long dx = -half; dx <= half; ++dx) {
+                            const long nz = z + dz, ny = y + dy, nx = x + dx;
+                            if (nz >= 0 && ny >= 0 && nx >= 0 && nz < static_cast<long>(density.depth()) &&
+                                ny < static_cast<long>(density.height()) && nx < static_cast<long>(density.width())) {
+                                sum += kernel(c + dz, c + dy, c + dx) * density(nz, ny, nx);
+                            }
+                        }
+                    }
+                }
+                out(z, y, x) = sum;
+            }
+        }
+    }
+    return out;
+}
+
+void check_mode(ConvolutionMode mode, const DensityVolume& density, const Volume3D<double>& kernel, int half) {
+    const DensityVolume expected = direct_sum(density, kernel, half);
+    const double tolerance = 1e-10 * max_value(expected);
+
+    KernelConvolver convolver(mode);
+    QS_CHECK_NEAR(max_abs_difference(convolver.correlate(density, kernel, half), expected), 0.0, tolerance);
+
+    // Kernel chuẩn bị sẵn (phân tích hạng 1 và phổ được giữ lại): lần gọi thứ hai dùng phổ đã đệm
+    PreparedKernel prepared(kernel);
+    QS_CHECK_NEAR(max_abs_difference(convolver.correlate(density, prepared, half), expected), 0.0, tolerance);
+    QS_CHECK_NEAR(max_abs_difference(convolver.correlate(density, prepared, half), expected), 0.0, tolerance);
+}
+
+QS_TEST(convolution_modes_match_direct_sum_for_separable_kernel) {
+    const DensityVolume density = random_density(9, 10, 11, 81);
+    const Volume3D<double> kernel = make_kernel(3, true);
+    QS_CHECK(SeparableKernel::factorize(kernel, 3).valid);
+
+    for (ConvolutionMode mode : {ConvolutionMode::Direct, ConvolutionMode::Separable, ConvolutionMode::FFT}) {
+        check_mode(mode, density, kernel, 3);
+        check_mode(mode, density, kernel, 1);  // Cửa sổ cắt nhỏ hơn kernel
+    }
+    QS_CHECK(KernelConvolver().resolve_mode(kernel, 3) == ConvolutionMode::Separable);
+}
+
+QS_TEST(convolution_fft_matches_direct_sum_for_non_separable_kernel) {
+    const DensityVolume density = random_density(8, 12, 7, 82);
+    const Volume3D<double> kernel = make_kernel(4, false);
+    QS_CHECK(!SeparableKernel::factorize(kernel, 4).valid);
+
+    check_mode(ConvolutionMode::FFT, density, kernel, 4);
+    check_mode(ConvolutionMode::Direct, density, kernel, 4);
+    QS_CHECK_THROWS(KernelConvolver(ConvolutionMode::Separable).correlate(density, kernel, 4), std::invalid_argument);
+
+    // Auto: kernel không tách được chuyển sang FFT từ cửa sổ fft_threshold
+    KernelConvolver automatic;
+    automatic.set_fft_threshold(9);
+    QS_CHECK(automatic.resolve_mode(kernel, 4) == ConvolutionMode::FFT);
+    QS_CHECK(automatic.resolve_mode(kernel, 3) == ConvolutionMode::Direct);
+}
+
+QS_TEST(convolution_rejects_invalid_kernels_and_modes) {
+    const DensityVolume density = random_density(4, 4, 4, 83);
+    QS_CHECK_THROWS(KernelConvolver().correlate(density, Volume3D<double>(4, 4, 4, 1.0), 1), std::invalid_argument);
+    QS_CHECK_THROWS(quangstation::convolution_mode_from_string("winograd"), std::invalid_argument);
+    QS_CHECK(quangstation::convolution_mode_from_string("FFT") == ConvolutionMode::FFT);
+}
+
+QS_TEST(collapsed_cone_kernel_transport_agrees_across_convolution_modes) {
+    const auto& phantom = small_phantom();
+    const Plan plan = quangstation::bench::make_plan(quangstation::bench::PlanKind::Conformal3D, phantom);
+
+    auto run = [&](const std::string& mode) {
+        CollapsedConeConvolution engine;
+        engine.set_transport_mode("kernel");
+        engine.set_convolution_mode(mode);
+        QS_CHECK(engine.get_convolution_mode() == mode);
+        return engine.calculate(phantom.ct, phantom.ptv, plan);
+    };
+
+    const DoseVolume direct = run("direct");
+    QS_CHECK_NEAR(mean_in_mask(direct, phantom.ptv), plan.prescribed_dose, 1e-9);
+    for (const char* mode : {"separable", "fft", "auto"}) {
+        QS_CHECK_NEAR(max_abs_difference(run(mode), direct), 0.0, 1e-9 * max_value(direct));
+    }
+}
+
+} // namespace
@@ -0,0 +1,154 @@
+// Lưới liều thô: hình học, lấy mẫu lại lên lưới CT và tinh chỉnh thích nghi
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+
+#include "resample.h"
+#include "test_harness.h"
+
+using quangstation::GridGeometry;
+
+namespace {
+
+using namespace quangstation::test;
+
+// f(x, y, z) = 1 + 0.2·x + 0.1·y - 0.05·z (mm, tọa độ tuyệt đối) trên lưới grid
+DoseVolume linear_field(const GridGeometry& grid) {
+    DoseVolume field = grid.make<double>(0.0);
+    for (std::size_t z = 0; z < grid.depth; ++z) {
+        for (std::size_t y = 0; y < grid.height; ++y) {
+            for (std::size_t x = 0; x < grid.width; ++x) {
+                field(z, y, x) = 1.0 + 0.2 * (grid.origin[0] + x * grid.spacing[0]) +
+                                 0.1 * (grid.origin[1] + y * grid.spacing[1]) -
+                                 0.05 * (grid.origin[2] + z * grid.spacing[2]);
+            }
+        }
+    }
+    return field;
+}
+
+double max_abs_error(const DoseVolume& dose, const DoseVolume& reference, const MaskVolume& mask) {
+    double error = 0.0;
+    for (std::size_t i = 0; i < dose.size(); ++i) {
+        if (mask.data()[i]) {
+            error = std::max(error, std::abs(dose.data()[i] - reference.data()[i]));
+        }
+    }
+    return error;
+}
+
+QS_TEST(coarsened_grid_covers_the_ct_grid) {
+    GridGeometry ct;
+    ct.depth = 10;
+    ct.height = 20;
+    ct.width = 31;
+    ct.spacing = {1.0, 2.0, 5.0};
+    ct.origin = {-15.0, 3.0, 7.5};
+
+    QS_CHECK(quangstation::coarsened(ct, 0.0) == ct);
+    const GridGeometry coarse = quangstation::coarsened(ct, 4.0);
+    QS_CHECK(coarse.origin == ct.origin);
+    QS_CHECK(coarse.spacing == (std::array<double, 3>{4.0, 4.0, 5.0}));  // z đã thô hơn: giữ nguyên
+    QS_CHECK(coarse.width == 9);     // 30 mm / 4 → 8 khoảng, phủ tới 32 mm
+    QS_CHECK(coarse.height == 11);   // 38 mm / 4 → 10 khoảng, phủ tới 40 mm
+    QS_CHECK(coarse.depth == 10);
+    QS_CHECK(coarse.hash() != ct.hash());
+
+    PencilBeam engine;
+    QS_CHECK(engine.dose_grid_for(ct) == ct);
+    engine.set_dose_grid_resolution(4.0);
+    QS_CHECK(engine.dose_grid_for(ct) == coarse);
+    engine.set_dose_grid(ct);  // Lưới cố định ưu tiên hơn resolution
+    QS_CHECK(engine.dose_grid_for(coarse) == ct);
+    engine.clear_dose_grid();
+    QS_CHECK(engine.dose_grid_for(ct) == coarse);
+}
+
+QS_TEST(resampling_preserves_linear_fields_and_constants) {
+    GridGeometry fine;
+    fine.depth = 9;
+    fine.height = 13;
+    fine.width = 17;
+    fine.spacing = {1.5, 2.0, 2.0};
+    fine.origin = {-10.0, 4.0, 0.0};
+    const GridGeometry coarse = quangstation::coarsened(fine, 6.0);
+
+    // Thô → mịn là nội suy tam tuyến tính: đúng tuyệt đối cho trường tuyến tính bên trong lưới thô
+    const DoseVolume upsampled = quangstation::resample_trilinear<double>(linear_field(coarse), fine);
+    QS_CHECK(GridGeometry::of(upsampled) == fine);
+    QS_CHECK_NEAR(max_abs_difference(upsampled, linear_field(fine)), 0.0, 1e-12);
+
+    // Mịn → thô là lọc trung bình: giữ hằng số; trường tuyến tính đúng tại điểm thô trùng voxel mịn, xa biên
+    const DoseVolume constant = quangstation::resample_trilinear<double>(fine.make<double>(2.5), coarse);
+    for (double value : constant) {
+        QS_CHECK_NEAR(value, 2.5, 1e-12);
+    }
+    const DoseVolume downsampled = quangstation::resample_trilinear<double>(linear_field(fine), coarse);
+    const DoseVolume expected = linear_field(coarse);
+    QS_CHECK_NEAR(downsampled(1, 1, 1), expected(1, 1, 1), 1e-12);
+
+    const Volume3D<float> as_float = quangstation::resample_trilinear<float>(linear_field(coarse), fine);
+    QS_CHECK_NEAR(as_float(4, 6, 8), static_cast<float>(upsampled(4, 6, 8)), 0.0);
+}
+
+QS_TEST(resampled_mask_keeps_structures_smaller_than_a_voxel) {
+    GridGeometry fine;
+    fine.depth = 12;
+    fine.height = 12;
+    fine.width = 12;
+    fine.spacing = {1.0, 1.0, 1.0};
+    const GridGeometry coarse = quangstation::coarsened(fine, 4.0);
+
+    MaskVolume block = fine.make<std::uint8_t>(0);
+    MaskVolume dot = fine.make<std::uint8_t>(0);
+    for (std::size_t z = 0; z < 12; ++z) {
+        for (std::size_t y = 0; y < 12; ++y) {
+            for (std::size_t x = 0; x < 6; ++x) {
+                block(z, y, x) = 1;
+            }
+        }
+    }
+    dot(5, 6, 7) = 1;
+
+    // Nửa x < 6 mm: các voxel thô ở x = 0, 4 bật, x = 8, 12 tắt
+    const MaskVolume coarse_block = quangstation::resample_mask(block, coarse);
+    QS_CHECK(GridGeometry::of(coarse_block) == coarse);
+    QS_CHECK(coarse_block(1, 1, 0) == 1 && coarse_block(1, 1, 1) == 1);
+    QS_CHECK(coarse_block(1, 1, 2) == 0 && coarse_block(1, 1, 3) == 0);
+
+    const MaskVolume coarse_dot = quangstation::resample_mask(dot, coarse);
+    QS_CHECK(quangstation::bounding_box(coarse_dot).size() >= 1);
+    QS_CHECK(coarse_dot(1, 2, 2) == 1);  // Voxel thô gần (7, 6, 5) mm nhất
+
+    QS_CHECK_THROWS(quangstation::resample_mask(dot, coarse, fine), std::invalid_argument);
+}
+
+QS_TEST(coarse_dose_grid_with_adaptive_refinement) {
+    const auto& phantom = small_phantom();
+    const Plan plan = quangstation::bench::make_plan(quangstation::bench::PlanKind::Conformal3D, phantom);
+
+    PencilBeam engine;
+    const DoseVolume reference = engine.calculate(phantom.ct, phantom.ptv, plan);
+
+    // Lưới 6 mm: liều trả về trên lưới CT, vẫn chuẩn hóa theo liều kê toa trên PTV
+    engine.set_dose_grid_resolution(6.0);
+    const DoseVolume coarse = engine.calculate(phantom.ct, phantom.ptv, plan);
+    QS_CHECK(coarse.same_shape(phantom.ct));
+    QS_CHECK_NEAR(mean_in_mask(coarse, phantom.ptv), plan.prescribed_dose, 1e-9);
+    const double coarse_error = max_abs_error(coarse, reference, phantom.ptv);
+    QS_CHECK(coarse_error > 1e-3);
+
+    // Tinh chỉnh quanh PTV: liều trong PTV gần liều tính trên lưới CT hơn
+    engine.set_adaptive_refinement(true, 0.9, 3.0);
+    const DoseVolume refined = engine.calculate(phantom.ct, phantom.ptv, plan);
+    QS_CHECK(refined.same_shape(phantom.ct));
+    QS_CHECK_NEAR(mean_in_mask(refined, phantom.ptv), plan.prescribed_dose, 1e-9);
+    QS_CHECK(engine.get_profile_stats().counters["refinement_regions"] > 0);
+    QS_CHECK(max_abs_error(refined, reference, phantom.ptv) < 0.5 * coarse_error);
+    QS_CHECK(*std::min_element(refined.begin(), refined.end()) >= 0.0);
+}
+
+} // namespace
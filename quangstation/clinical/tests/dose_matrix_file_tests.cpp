@@ -0,0 +1,98 @@
+// Tệp ma trận liều (ánh xạ bộ nhớ): đọc lại, ghi tiếp và cắt khối ghi dở
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "dose_matrix_file.h"
+#include "test_harness.h"
+
+namespace {
+
+using namespace quangstation::test;
+
+QS_TEST(dose_matrix_file_round_trip) {
+    TemporaryFile file("dose_matrix_file_tests_round_trip.qsdm");
+    DoseVolume grid(5, 6, 7, 0.0, {2.5, 2.5, 3.0}, {-10.0, 4.0, 1.5});
+    std::vector<DoseVolume> columns = random_columns(grid, 2, 0.2, 21);
+    columns.push_back(random_columns(grid, 1, 0.9, 22).front());  // Được lưu dạng dày
+    DoseInfluenceMatrix matrix = matrix_from_columns(columns);
+
+    quangstation::save_dose_matrix_file(file.path, matrix, {"a", "b", "c"}, 42);
+    quangstation::DoseMatrixFileInfo info = quangstation::read_dose_matrix_file_info(file.path);
+    QS_CHECK(info.chunks.size() == 3);
+    QS_CHECK(info.ct_hash == 42);
+    QS_CHECK(info.spacing == grid.spacing() && info.origin == grid.origin());
+    QS_CHECK(!info.find("a")->dense && info.find("c")->dense);
+    QS_CHECK(info.valid_bytes == file.size());
+
+    DoseInfluenceMatrix loaded = quangstation::open_dose_matrix_file(file.path, {"c", "a"}, 42, true);
+    QS_CHECK(loaded.num_columns() == 2);
+    QS_CHECK(max_abs_difference(loaded.column_dose(0), matrix.column_dose(2)) == 0.0);
+    QS_CHECK(max_abs_difference(loaded.column_dose(1), matrix.column_dose(0)) == 0.0);
+
+    QS_CHECK_THROWS(quangstation::open_dose_matrix_file(file.path, {"missing"}), std::out_of_range);
+    QS_CHECK_THROWS(quangstation::open_dose_matrix_file(file.path, {}, 7), std::runtime_error);
+}
+
+QS_TEST(dose_matrix_file_resume_truncates_partial_chunk) {
+    TemporaryFile file("dose_matrix_file_tests_resume.qsdm");
+    DoseVolume grid(4, 5, 6, 0.0);
+    std::vector<DoseVolume> columns = random_columns(grid, 3, 0.3, 31);
+    DoseInfluenceMatrix matrix = matrix_from_columns(columns);
+
+    std::size_t complete_bytes = 0;
+    {
+        quangstation::DoseMatrixFileWriter writer(file.path, grid, 99);
+        QS_CHECK(!writer.resumed());
+        writer.append("beam-0", matrix.column(0));
+        writer.append("beam-1", matrix.column(1));
+        complete_bytes = file.size();
+    }
+
+    // Tiến trình bị dừng khi đang ghi cột thứ ba: chỉ có header khối và một phần dữ liệu
+    {
+        std::ofstream out(file.path, std::ios::binary | std::ios::app);
+        quangstation::DoseMatrixChunkHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = quangstation::kDoseMatrixChunkMagic;
+        header.count = 1000;
+        header.id_bytes = 6;
+        header.payload_bytes = quangstation::detail::chunk_payload_bytes(6, false, 1000);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write("beam-2\0\0partial", 15);
+    }
+    QS_CHECK(file.size() > complete_bytes);
+
+    quangstation::DoseMatrixFileInfo info = quangstation::read_dose_matrix_file_info(file.path);
+    QS_CHECK(info.chunks.size() == 2);
+    QS_CHECK(info.valid_bytes == complete_bytes);
+
+    {
+        quangstation::DoseMatrixFileWriter writer(file.path, grid, 99);
+        QS_CHECK(writer.resumed());
+        QS_CHECK(writer.contains("beam-0") && writer.contains("beam-1") && !writer.contains("beam-2"));
+        QS_CHECK(file.size() == complete_bytes);
+        writer.append("beam-2", matrix.column(2));
+        // Cột cùng id ghi sau thay cho cột trước
+        writer.append("beam-0", matrix.column(2));
+        QS_CHECK(writer.column_ids().size() == 3);
+    }
+
+    DoseInfluenceMatrix loaded = quangstation::open_dose_matrix_file(file.path, {"beam-0", "beam-1", "beam-2"}, 99, true);
+    QS_CHECK(max_abs_difference(loaded.column_dose(0), matrix.column_dose(2)) == 0.0);
+    QS_CHECK(max_abs_difference(loaded.column_dose(1), matrix.column_dose(1)) == 0.0);
+    QS_CHECK(max_abs_difference(loaded.column_dose(2), matrix.column_dose(2)) == 0.0);
+
+    // Lưới hoặc CT khác: tệp được tạo lại từ đầu
+    {
+        quangstation::DoseMatrixFileWriter writer(file.path, grid, 100);
+        QS_CHECK(!writer.resumed());
+        QS_CHECK(writer.column_ids().empty());
+    }
+    QS_CHECK(quangstation::read_dose_matrix_file_info(file.path).chunks.empty());
+}
+
+} // namespace
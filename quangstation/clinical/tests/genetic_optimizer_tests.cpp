@@ -0,0 +1,89 @@
+// GeneticOptimizer: đánh giá độ thích nghi song song theo khối và seed cố định
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "optimizer.h"
+#include "test_harness.h"
+
+using quangstation::JobControl;
+
+namespace {
+
+using namespace quangstation::test;
+
+struct GeneticRun {
+    std::vector<double> weights;
+    double best_fitness;
+    GridPoolStats allocations;
+};
+
+// 5 chùm tia ngẫu nhiên, mục tiêu liều trung bình PTV và liều cực đại OAR
+GeneticRun run_genetic(std::uint32_t seed, int batch_size, int threads) {
+    DoseVolume grid(6, 7, 8, 0.0);
+    std::map<std::string, MaskVolume> masks = {{"PTV", random_mask(grid, 0.3, 101)},
+                                               {"OAR", random_mask(grid, 0.2, 102)}};
+    GeneticOptimizer optimizer(grid, masks, 20, 15);
+    optimizer.add_objective(ObjectiveFunction("PTV", ObjectiveFunction::MEAN_DOSE, 1.0));
+    optimizer.add_objective(ObjectiveFunction("OAR", ObjectiveFunction::MAX_DOSE, 0.5));
+    for (const DoseVolume& column : random_columns(grid, 5, 0.6, 103)) {
+        optimizer.add_beam_dose_matrix(column);
+    }
+    optimizer.set_seed(seed);
+    optimizer.set_fitness_batch_size(batch_size);
+
+#ifdef _OPENMP
+    const int saved = omp_get_max_threads();
+    omp_set_num_threads(threads);
+#else
+    (void)threads;
+#endif
+    optimizer.initialize_population(5);
+    JobControl control;  // Báo tiến trình qua control thay vì in ra std::cout
+    GeneticRun run;
+    run.weights = optimizer.optimize(control);
+#ifdef _OPENMP
+    omp_set_num_threads(saved);
+#endif
+    run.best_fitness = control.progress().objective;
+    run.allocations = optimizer.get_allocation_stats();
+    return run;
+}
+
+QS_TEST(genetic_optimizer_is_reproducible_for_a_seed) {
+    const GeneticRun first = run_genetic(7, 0, 1);
+    QS_CHECK(first.weights.size() == 5);
+    double sum = 0.0;
+    for (double w : first.weights) {
+        QS_CHECK(w >= 0.0);
+        sum += w;
+    }
+    QS_CHECK_NEAR(sum, 1.0, 1e-12);
+
+    QS_CHECK(run_genetic(7, 0, 1).weights == first.weights);
+    QS_CHECK(run_genetic(8, 0, 1).weights != first.weights);
+}
+
+QS_TEST(genetic_optimizer_batching_and_threads_do_not_change_the_result) {
+    // Liều mỗi cá thể không phụ thuộc khối hay luồng tính nó: cùng seed cho cùng quá trình tiến hóa
+    const GeneticRun reference = run_genetic(11, 1, 1);
+    for (int batch_size : {2, 4, 16}) {
+        for (int threads : {1, 3}) {
+            const GeneticRun run = run_genetic(11, batch_size, threads);
+            QS_CHECK(run.weights == reference.weights);
+            QS_CHECK(run.best_fitness == reference.best_fitness);
+        }
+    }
+
+    // Một luồng, khối 4: bốn lưới liều đánh giá cấp phát một lần, dùng lại qua mọi thế hệ
+    const GeneticRun batched = run_genetic(11, 4, 1);
+    QS_CHECK(batched.allocations.allocations == 4);
+}
+
+} // namespace
@@ -0,0 +1,164 @@
+// Chuyển đổi HU sang mật độ bằng bảng tra dày và bộ đệm lưới mật độ dùng chung
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "hu_conversion.h"
+#include "test_harness.h"
+
+using quangstation::BasicDensityCache;
+using quangstation::HUtoEDConverter;
+using quangstation::Material;
+
+namespace {
+
+using namespace quangstation::test;
+
+// Bảng ba điểm: mật độ điện tử 0 → 1 → 3, mật độ khối 0.5 → 1 → 2
+HUtoEDConverter three_point_converter() {
+    HUtoEDConverter converter;
+    converter.set_materials({{100, Material("Xương", 2.0, 3.0)},
+                             {-100, Material("Phổi", 0.5, 0.0)},
+                             {0, Material("Nước", 1.0, 1.0)}});
+    return converter;
+}
+
+QS_TEST(hu_lookup_interpolates_and_clamps_the_table) {
+    const HUtoEDConverter converter = three_point_converter();
+    QS_CHECK(converter.materials().size() == 3);
+    QS_CHECK(converter.materials().front().name == "Phổi");
+
+    QS_CHECK_NEAR(converter.convert(-100), 0.0, 1e-15);
+    QS_CHECK_NEAR(converter.convert(-50), 0.5, 1e-15);
+    QS_CHECK_NEAR(converter.convert(0), 1.0, 1e-15);
+    QS_CHECK_NEAR(converter.convert(25), 1.5, 1e-15);
+    QS_CHECK_NEAR(converter.mass_density(50), 1.5, 1e-15);
+
+    // Ngoài bảng lấy giá trị biên, kể cả ở hai đầu khoảng int16
+    QS_CHECK_NEAR(converter.convert(-32768), 0.0, 1e-15);
+    QS_CHECK_NEAR(converter.convert(40000), 3.0, 1e-15);
+    QS_CHECK_NEAR(converter.mass_density(-1000), 0.5, 1e-15);
+
+    QS_CHECK(converter.material(-101).name == "Phổi");
+    QS_CHECK(converter.material(-1).name == "Phổi");
+    QS_CHECK(converter.material(0).name == "Nước");
+    QS_CHECK(converter.material(99).name == "Nước");
+    QS_CHECK(converter.material(100).name == "Xương");
+
+    QS_CHECK_THROWS(HUtoEDConverter().set_materials({}), std::invalid_argument);
+}
+
+QS_TEST(hu_volume_conversion_matches_per_voxel_lookup) {
+    const HUtoEDConverter converter;
+    CTVolume ct(5, 6, 7, static_cast<std::int16_t>(0), {2.0, 2.5, 3.0});
+    std::int16_t hu = -32768;
+    for (std::int16_t& value : ct) {
+        value = hu;
+        hu = static_cast<std::int16_t>(hu + 313);
+    }
+
+    const Volume3D<double> density = converter.convert_volume(ct);
+    const Volume3D<float> density_f = converter.convert_volume<float>(ct);
+    const Volume3D<double> mass = converter.mass_density_volume(ct);
+    const Volume3D<std::uint8_t> material = converter.material_volume(ct);
+    QS_CHECK(density.same_shape(ct));
+    for (std::size_t i = 0; i < ct.size(); ++i) {
+        const int h = ct.data()[i];
+        QS_CHECK(density.data()[i] == converter.convert(h));
+        QS_CHECK(density_f.data()[i] == static_cast<float>(converter.convert(h)));
+        QS_CHECK(mass.data()[i] == converter.mass_density(h));
+        QS_CHECK(&converter.materials()[material.data()[i]] == &converter.material(h));
+    }
+}
+
+QS_TEST(hu_table_file_and_density_key) {
+    TemporaryFile file("hu_conversion_tests.txt");
+    {
+        std::ofstream out(file.path);
+        out << "# HU ED\n"
+            << "0 1.0\n"
+            << "-1000 0.001 0.0012 Không khí\n"
+            << "không phải số\n"
+            << "1000 2.0 2.2\n";
+    }
+    HUtoEDConverter converter;
+    const std::uint64_t default_key = converter.density_key(42);
+    converter.load_from_file(file.path);
+    QS_CHECK(converter.materials().size() == 3);
+    QS_CHECK(converter.materials()[0].name == "Không khí");
+    QS_CHECK(converter.materials()[1].name == "HU 0");
+    QS_CHECK_NEAR(converter.mass_density(0), 1.0, 1e-15);  // Thiếu mật độ khối: lấy bằng ED
+    QS_CHECK_NEAR(converter.mass_density(1000), 2.2, 1e-15);
+    QS_CHECK_NEAR(converter.convert(500), 1.5, 1e-15);
+
+    // Khóa phụ thuộc cả CT và bảng
+    const std::uint64_t file_key = converter.density_key(42);
+    QS_CHECK(file_key != default_key);
+    QS_CHECK(converter.density_key(43) != file_key);
+
+    // File không có dòng hợp lệ: giữ bảng hiện tại
+    {
+        std::ofstream out(file.path);
+        out << "không có dòng hợp lệ\n";
+    }
+    converter.load_from_file(file.path);
+    QS_CHECK(converter.density_key(42) == file_key);
+    converter.load_from_file("khong_ton_tai.txt");
+    QS_CHECK(converter.density_key(42) == file_key);
+}
+
+QS_TEST(density_cache_evicts_least_recently_used) {
+    BasicDensityCache<double> cache(2);
+    auto grid = [](double value) { return std::make_shared<const Volume3D<double>>(2, 2, 2, value); };
+    cache.insert(1, grid(1.0));
+    cache.insert(2, grid(2.0));
+    QS_CHECK(cache.find(1) != nullptr);  // 2 thành lưới lâu không dùng nhất
+    cache.insert(3, grid(3.0));
+    QS_CHECK(cache.size() == 2);
+    QS_CHECK(cache.find(2) == nullptr);
+    QS_CHECK((*cache.find(1))(0, 0, 0) == 1.0);
+    QS_CHECK((*cache.find(3))(0, 0, 0) == 3.0);
+
+    cache.set_max_entries(0);
+    cache.insert(4, grid(4.0));
+    QS_CHECK(cache.size() == 0);
+}
+
+QS_TEST(density_cache_is_shared_across_engines_and_keyed_by_table) {
+    const auto& phantom = small_phantom();
+    const Plan plan = quangstation::bench::make_plan(quangstation::bench::PlanKind::Conformal3D, phantom);
+
+    AAA first;
+    first.clear_density_cache();
+    const DoseVolume reference = first.calculate(phantom.ct, phantom.ptv, plan);
+    quangstation::ProfileStats stats = first.get_profile_stats();
+    QS_CHECK(stats.counters["density_cache_misses"] == 1);
+    QS_CHECK(stats.counters["density_cache_hits"] == 0);
+
+    // Thuật toán mới (như wrapper Python dựng cho mỗi lần tính) dùng lại lưới đã đệm
+    AAA second;
+    QS_CHECK(max_abs_difference(second.calculate(phantom.ct, phantom.ptv, plan), reference) == 0.0);
+    stats = second.get_profile_stats();
+    QS_CHECK(stats.counters["density_cache_misses"] == 0);
+    QS_CHECK(stats.counters["density_cache_hits"] == 1);
+
+    // Bảng khác: khóa khác, chuyển đổi lại
+    TemporaryFile file("hu_conversion_engine_tests.txt");
+    {
+        std::ofstream out(file.path);
+        out << "-1000 0.001\n0 1.0\n1000 1.8\n";
+    }
+    second.set_hu_to_ed_conversion_file(file.path);
+    second.calculate(phantom.ct, phantom.ptv, plan);
+    stats = second.get_profile_stats();
+    QS_CHECK(stats.counters["density_cache_misses"] == 1);
+    QS_CHECK(stats.counters["density_cache_hits"] == 0);
+    first.clear_density_cache();
+}
+
+} // namespace
@@ -0,0 +1,110 @@
+// Ma trận ảnh hưởng CSC: giá trị float32, mặt nạ voxel, ngưỡng, from_csc và multiply_add song song
+
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "influence_matrix.h"
+#include "test_harness.h"
+
+namespace {
+
+using namespace quangstation::test;
+
+QS_TEST(influence_matrix_stores_float32_columns) {
+    DoseVolume grid(6, 5, 7, 0.0, {2.0, 2.0, 3.0});
+    std::vector<DoseVolume> columns = random_columns(grid, 4, 0.3, 11);
+    DoseInfluenceMatrix matrix = matrix_from_columns(columns);
+
+    QS_CHECK(matrix.num_columns() == 4);
+    for (std::size_t j = 0; j < columns.size(); ++j) {
+        DoseVolume stored = matrix.column_dose(j);
+        for (std::size_t i = 0; i < stored.size(); ++i) {
+            QS_CHECK(stored.data()[i] == static_cast<double>(static_cast<float>(columns[j].data()[i])));
+        }
+    }
+
+    std::vector<double> weights = {0.5, 1.25, 0.0, 2.0};
+    QS_CHECK_NEAR(max_abs_difference(matrix.multiply(weights), reference_dose(columns, weights)), 0.0, 1e-12);
+
+    // B^T·g so với tích trực tiếp
+    std::vector<double> g(grid.size());
+    for (std::size_t i = 0; i < g.size(); ++i) {
+        g[i] = std::sin(0.1 * i);
+    }
+    std::vector<double> gradient = matrix.transpose_multiply(g.data());
+    for (std::size_t j = 0; j < columns.size(); ++j) {
+        double expected = 0.0;
+        for (std::size_t i = 0; i < g.size(); ++i) {
+            expected += static_cast<double>(static_cast<float>(columns[j].data()[i])) * g[i];
+        }
+        QS_CHECK_NEAR(gradient[j], expected, 1e-10);
+    }
+}
+
+QS_TEST(influence_matrix_voxel_mask_and_threshold) {
+    DoseVolume grid(4, 4, 4, 0.0);
+    std::vector<DoseVolume> columns = random_columns(grid, 2, 1.0, 5);
+    MaskVolume keep = random_mask(grid, 0.25, 9);
+
+    DoseInfluenceMatrix matrix(grid);
+    matrix.set_voxel_mask(keep);
+    QS_CHECK(matrix.has_voxel_mask());
+    matrix.add_column(columns[0]);
+    matrix.add_column(columns[1], 0.6);
+
+    for (std::size_t j = 0; j < 2; ++j) {
+        DoseVolume stored = matrix.column_dose(j);
+        for (std::size_t i = 0; i < grid.size(); ++i) {
+            const double value = columns[j].data()[i];
+            const bool kept = keep.data()[i] && (j == 0 || value >= 0.6);
+            QS_CHECK(stored.data()[i] == (kept ? static_cast<double>(static_cast<float>(value)) : 0.0));
+        }
+    }
+}
+
+QS_TEST(influence_matrix_from_csc_sorts_and_rejects_duplicates) {
+    DoseVolume grid(2, 2, 2, 0.0);
+    DoseInfluenceMatrix matrix = DoseInfluenceMatrix::from_csc(grid, {0, 3, 4}, {5, 1, 3, 2}, {5.0f, 1.0f, 3.0f, 2.0f});
+    DoseInfluenceMatrix::Column column = matrix.column(0);
+    QS_CHECK(column.count == 3);
+    QS_CHECK(column.row(0) == 1 && column.row(1) == 3 && column.row(2) == 5);
+    QS_CHECK(column.values[0] == 1.0f && column.values[1] == 3.0f && column.values[2] == 5.0f);
+
+    QS_CHECK_THROWS(DoseInfluenceMatrix::from_csc(grid, {0, 2}, {4, 4}, {1.0f, 2.0f}), std::invalid_argument);
+    QS_CHECK_THROWS(DoseInfluenceMatrix::from_csc(grid, {0, 1}, {8}, {1.0f}), std::out_of_range);
+    QS_CHECK_THROWS(DoseInfluenceMatrix::from_csc(grid, {0, 2}, {1}, {1.0f}), std::invalid_argument);
+}
+
+QS_TEST(influence_matrix_multiply_add_matches_reference_across_row_blocks) {
+    // Nhiều khối hàng kMultiplyBlock: mỗi luồng tìm đoạn của từng cột bằng tìm kiếm nhị phân
+    DoseVolume grid(20, 20, 31, 0.0);
+    std::vector<DoseVolume> columns = random_columns(grid, 5, 0.05, 13);
+    columns.push_back(random_columns(grid, 1, 1.0, 14).front());
+    DoseInfluenceMatrix matrix = matrix_from_columns(columns);
+    const std::vector<double> weights = {0.3, 1.0, 2.5, 0.0, 0.7, 1.1};
+    const DoseVolume expected = reference_dose(columns, weights);
+
+    for (int threads : {1, 3}) {
+#ifdef _OPENMP
+        const int saved = omp_get_max_threads();
+        omp_set_num_threads(threads);
+#endif
+        DoseVolume out = DoseVolume::like(grid, 1.0);
+        matrix.multiply_add(weights, out);
+#ifdef _OPENMP
+        omp_set_num_threads(saved);
+#endif
+        for (std::size_t i = 0; i < out.size(); ++i) {
+            QS_CHECK_NEAR(out.data()[i], 1.0 + expected.data()[i], 1e-12);
+        }
+    }
+    DoseVolume wrong_grid(20, 20, 30, 0.0);
+    QS_CHECK_THROWS(matrix.multiply_add(weights, wrong_grid), std::invalid_argument);
+}
+
+} // namespace
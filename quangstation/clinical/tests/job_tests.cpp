@@ -0,0 +1,154 @@
+// Công việc chạy nền: tiến trình, kết quả tạm và hủy giữa chùm tia / lần lặp / thế hệ
+
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "job.h"
+#include "optimizer.h"
+#include "test_harness.h"
+
+using quangstation::AsyncJob;
+using quangstation::JobCancelled;
+using quangstation::JobControl;
+using quangstation::JobProgress;
+
+namespace {
+
+using namespace quangstation::test;
+
+QS_TEST(async_job_returns_result_progress_and_errors) {
+    std::vector<int> steps;
+    AsyncJob<int> job(
+        [](JobControl& control) {
+            for (int step = 1; step <= 3; ++step) {
+                control.report({"test", step, 3});
+            }
+            control.publish_weights({0.25, 0.75});
+            return 42;
+        },
+        [&](const JobProgress& progress) { steps.push_back(progress.step); });
+    QS_CHECK(job.get() == 42);
+    QS_CHECK(job.done());
+    QS_CHECK(steps == (std::vector<int>{1, 2, 3}));
+    QS_CHECK(job.control().progress().stage == "test");
+    QS_CHECK(job.control().best_weights() == (std::vector<double>{0.25, 0.75}));
+
+    AsyncJob<int> failing([](JobControl&) -> int { throw std::logic_error("lỗi"); });
+    QS_CHECK(failing.wait(-1.0));
+    QS_CHECK_THROWS(failing.get(), std::logic_error);
+}
+
+QS_TEST(async_job_cancel_stops_a_waiting_job) {
+    // Công việc chỉ dừng khi bị hủy: chưa xong sau thời gian chờ, get() ném JobCancelled
+    AsyncJob<int> job([](JobControl& control) {
+        while (true) {
+            control.throw_if_cancelled();
+        }
+        return 0;
+    });
+    QS_CHECK(!job.wait(0.01));
+    QS_CHECK(!job.done());
+    job.cancel();
+    QS_CHECK(job.control().cancelled());
+    QS_CHECK_THROWS(job.get(), JobCancelled);
+    QS_CHECK(job.done());
+}
+
+QS_TEST(incremental_dose_matches_calculate_and_cancels_between_beams) {
+    const auto& phantom = small_phantom();
+    const Plan plan = quangstation::bench::make_plan(quangstation::bench::PlanKind::Conformal3D, phantom);
+    const int num_beams = static_cast<int>(plan.beams.size());
+    PencilBeam engine;
+    const DoseVolume reference = engine.calculate(phantom.ct, phantom.ptv, plan);
+
+    AsyncJob<DoseVolume> job([&](JobControl& control) {
+        return engine.calculate_incremental(phantom.ct, phantom.ptv, plan, control);
+    });
+    QS_CHECK_NEAR(max_abs_difference(job.get(), reference), 0.0, 1e-12);
+    QS_CHECK(job.control().progress().step == num_beams);
+    QS_CHECK(job.control().progress().total == num_beams);
+
+    // Hủy sau chùm tia đầu: liều tạm là liều (chưa chuẩn hóa) của đúng một chùm tia
+    JobControl* self = nullptr;
+    JobControl control([&](const JobProgress& progress) {
+        if (progress.step == 1) {
+            self->cancel();
+        }
+    });
+    self = &control;
+    QS_CHECK_THROWS(engine.calculate_incremental(phantom.ct, phantom.ptv, plan, control), JobCancelled);
+    QS_CHECK(control.progress().step == 1);
+    std::shared_ptr<const DoseVolume> partial = control.partial_dose();
+    QS_CHECK(partial != nullptr);
+    Plan first_beam(plan.id, plan.technique, 0.0, plan.fractions);
+    first_beam.beams.push_back(plan.beams.front());
+    QS_CHECK_NEAR(max_abs_difference(*partial, engine.calculate(phantom.ct, MaskVolume(), first_beam)), 0.0, 1e-12);
+}
+
+struct OptimizerInputs {
+    DoseVolume grid = DoseVolume(6, 7, 8, 0.0);
+    std::map<std::string, MaskVolume> masks;
+    std::vector<DoseVolume> columns;
+
+    OptimizerInputs() {
+        masks = {{"PTV", random_mask(grid, 0.3, 121)}, {"OAR", random_mask(grid, 0.2, 122)}};
+        columns = random_columns(grid, 4, 0.6, 123);
+    }
+};
+
+QS_TEST(gradient_optimizer_stops_at_the_next_iteration_when_cancelled) {
+    const OptimizerInputs inputs;
+    GradientOptimizer optimizer(inputs.grid, inputs.masks, 0.01, 50, 0.0);
+    optimizer.add_objective(ObjectiveFunction("PTV", ObjectiveFunction::MEAN_DOSE, 1.0));
+    optimizer.add_objective(ObjectiveFunction("OAR", ObjectiveFunction::MAX_DOSE, 0.5));
+    for (const DoseVolume& column : inputs.columns) {
+        optimizer.add_beam_dose_matrix(column);
+    }
+    optimizer.set_solver("lbfgsb");
+
+    JobControl* self = nullptr;
+    JobControl control([&](const JobProgress& progress) {
+        if (progress.step == 2) {
+            self->cancel();
+        }
+    });
+    self = &control;
+    const SolverResult result = optimizer.optimize(control);
+    QS_CHECK(result.message == "Đã hủy");
+    QS_CHECK(!result.converged);
+    QS_CHECK(control.progress().stage == "optimize");
+    QS_CHECK(control.progress().step == 2);
+    QS_CHECK(control.best_weights().size() == inputs.columns.size());
+}
+
+QS_TEST(genetic_optimizer_returns_best_individual_when_cancelled) {
+    const OptimizerInputs inputs;
+    GeneticOptimizer optimizer(inputs.grid, inputs.masks, 10, 40);
+    optimizer.add_objective(ObjectiveFunction("PTV", ObjectiveFunction::MEAN_DOSE, 1.0));
+    for (const DoseVolume& column : inputs.columns) {
+        optimizer.add_beam_dose_matrix(column);
+    }
+    optimizer.set_seed(5);
+    optimizer.initialize_population(4);
+
+    std::vector<int> generations;
+    JobControl* self = nullptr;
+    JobControl control([&](const JobProgress& progress) {
+        generations.push_back(progress.step);
+        if (progress.step == 3) {
+            self->cancel();
+        }
+    });
+    self = &control;
+    // Dừng ngay sau thế hệ bị hủy, vẫn trả về cá thể tốt nhất đến lúc đó
+    const std::vector<double> best = optimizer.optimize(control);
+    QS_CHECK(generations == (std::vector<int>{0, 1, 2, 3}));
+    QS_CHECK(control.progress().stage == "genetic");
+    QS_CHECK(best == control.best_weights());
+    QS_CHECK(best.size() == inputs.columns.size());
+}
+
+} // namespace
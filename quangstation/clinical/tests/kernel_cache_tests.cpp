@@ -0,0 +1,108 @@
+// Dose/scatter kernel theo kích thước vật lý và bộ đệm kernel dùng chung cả tiến trình
+
+#include <array>
+#include <cmath>
+
+#include "kernel_cache.h"
+#include "test_harness.h"
+
+using quangstation::DoseKernelCache;
+using quangstation::ParticleType;
+
+namespace {
+
+using namespace quangstation::test;
+
+double total(const Volume3D<double>& kernel) {
+    double sum = 0.0;
+    for (double value : kernel) {
+        sum += value;
+    }
+    return sum;
+}
+
+QS_TEST(dose_kernel_keeps_its_physical_size_on_any_grid) {
+    const Volume3D<double> reference = quangstation::make_dose_kernel(ParticleType::Photon, 6.0, {2.5, 2.5, 2.5},
+                                                                      quangstation::kDefaultDoseKernelRadius);
+    QS_CHECK(reference.depth() == 11);  // Kernel 11³ trên lưới tham chiếu 2.5 mm
+    QS_CHECK_NEAR(total(reference), 1.0, 1e-12);
+
+    // Lưới 1.25 mm: gấp đôi số voxel, cùng hình dạng theo mm
+    const Volume3D<double> fine = quangstation::make_dose_kernel(ParticleType::Photon, 6.0, {1.25, 1.25, 1.25},
+                                                                 quangstation::kDefaultDoseKernelRadius);
+    QS_CHECK(fine.depth() == 21);
+    QS_CHECK_NEAR(total(fine), 1.0, 1e-12);
+    QS_CHECK_NEAR(fine(10, 10, 12) / fine(10, 10, 10), reference(5, 5, 6) / reference(5, 5, 5), 1e-12);
+    QS_CHECK_NEAR(fine(14, 10, 10) / fine(10, 10, 10), reference(7, 5, 5) / reference(5, 5, 5), 1e-12);
+
+    const Volume3D<double> proton = quangstation::make_dose_kernel(ParticleType::Proton, 150.0, {2.5, 2.5, 2.5},
+                                                                   quangstation::kDefaultDoseKernelRadius);
+    QS_CHECK_NEAR(total(proton), 1.0, 1e-12);
+    QS_CHECK(total(quangstation::make_dose_kernel(ParticleType::Other, 6.0, {2.5, 2.5, 2.5},
+                                                  quangstation::kDefaultDoseKernelRadius)) == 0.0);
+}
+
+QS_TEST(scatter_kernel_is_cut_at_its_radius) {
+    const std::array<double, 3> spacing = {2.0, 3.0, 4.0};
+    const Volume3D<double> kernel = quangstation::make_scatter_kernel(spacing, 10.0, 0.05, 0.3);
+    QS_CHECK(kernel.depth() == 11);  // Nửa cạnh ceil(10 / 2) theo spacing nhỏ nhất
+    QS_CHECK_NEAR(total(kernel), 0.3, 1e-12);
+    const int half = 5;
+    for (int z = 0; z < 11; ++z) {
+        for (int y = 0; y < 11; ++y) {
+            for (int x = 0; x < 11; ++x) {
+                const double r = std::sqrt(std::pow((x - half) * spacing[0], 2) + std::pow((y - half) * spacing[1], 2) +
+                                           std::pow((z - half) * spacing[2], 2));
+                QS_CHECK((kernel(z, y, x) > 0.0) == (r < 10.0));
+            }
+        }
+    }
+}
+
+QS_TEST(kernel_cache_returns_one_kernel_per_key) {
+    DoseKernelCache& cache = DoseKernelCache::instance();
+    const std::array<double, 3> spacing = {1.7, 1.9, 2.3};  // Lưới chỉ kiểm thử này dùng
+    const std::size_t before = cache.size();
+
+    const DoseKernelCache::Entry photon = cache.dose_kernel(ParticleType::Photon, 6.0, spacing);
+    QS_CHECK(cache.dose_kernel(ParticleType::Photon, 6.0, spacing) == photon);
+    QS_CHECK(cache.dose_kernel(ParticleType::Photon, 10.0, spacing) != photon);
+    QS_CHECK(cache.dose_kernel(ParticleType::Electron, 6.0, spacing) != photon);
+    QS_CHECK(cache.dose_kernel(ParticleType::Photon, 6.0, {1.7, 1.9, 2.4}) != photon);
+    QS_CHECK(cache.dose_kernel(ParticleType::Photon, 6.0, spacing, 20.0) != photon);
+    QS_CHECK(cache.size() == before + 5);
+
+    const DoseKernelCache::Entry scatter = cache.scatter_kernel(spacing, 10.0, 0.05, 0.3);
+    QS_CHECK(cache.scatter_kernel(spacing, 10.0, 0.05, 0.3) == scatter);
+    QS_CHECK(cache.scatter_kernel(spacing, 10.0, 0.05, 0.4) != scatter);
+    QS_CHECK(cache.size() == before + 7);
+
+    // 6X, 10X và 6E đã có; 6FFF dùng chung kernel với 6X: chỉ thêm 9E, 12E, 15E
+    cache.prewarm(spacing);
+    QS_CHECK(cache.size() == before + 10);
+    QS_CHECK(cache.dose_kernel(ParticleType::Photon, 6.0, spacing) == photon);
+    QS_CHECK(max_abs_difference(photon->kernel(), quangstation::make_dose_kernel(
+                                                      ParticleType::Photon, 6.0, spacing,
+                                                      quangstation::kDefaultDoseKernelRadius)) == 0.0);
+}
+
+QS_TEST(kernel_cache_is_shared_across_engines) {
+    const auto& phantom = small_phantom();
+    const Plan plan = quangstation::bench::make_plan(quangstation::bench::PlanKind::Conformal3D, phantom);
+    DoseKernelCache& cache = DoseKernelCache::instance();
+
+    CollapsedConeConvolution first;
+    first.set_transport_mode("kernel");
+    const DoseVolume reference = first.calculate(phantom.ct, phantom.ptv, plan);
+    const std::size_t size = cache.size();
+
+    // Đối tượng mới cùng lưới, cùng chùm tia: không dựng thêm kernel nào
+    CollapsedConeConvolution second;
+    second.set_transport_mode("kernel");
+    QS_CHECK(max_abs_difference(second.calculate(phantom.ct, phantom.ptv, plan), reference) == 0.0);
+    QS_CHECK(cache.size() == size);
+    QS_CHECK(cache.dose_kernel(ParticleType::Photon, plan.beams.front()->energy, phantom.ct.spacing()) != nullptr);
+    QS_CHECK(cache.size() == size);
+}
+
+} // namespace
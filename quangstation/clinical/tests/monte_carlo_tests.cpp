@@ -0,0 +1,72 @@
+// Monte Carlo: lặp lại được theo seed với mọi số luồng, dừng sớm theo độ không chắc chắn
+
+#include <cstdint>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "test_harness.h"
+
+namespace {
+
+using namespace quangstation::test;
+
+QS_TEST(monte_carlo_is_reproducible_for_a_seed) {
+    const auto& phantom = small_phantom();
+    Plan plan = quangstation::bench::make_plan(quangstation::bench::PlanKind::Conformal3D, phantom);
+    auto run = [&](std::uint64_t seed) {
+        MonteCarlo engine;
+        engine.set_num_histories(20000);
+        engine.set_num_batches(4);
+        engine.set_target_uncertainty(0.0);
+        engine.set_seed(seed);
+        DoseVolume dose = engine.calculate(phantom.ct, phantom.ptv, plan);
+        QS_CHECK(engine.get_last_histories() == 20000);
+        QS_CHECK(engine.get_last_uncertainty() > 0.0);
+        return dose;
+    };
+
+    DoseVolume first = run(7);
+    QS_CHECK_NEAR(mean_in_mask(first, phantom.ptv), plan.prescribed_dose, 1e-9);
+
+    // Cùng seed: cùng kết quả với mọi số luồng (chỉ khác thứ tự cộng số thực)
+#ifdef _OPENMP
+    const int threads = omp_get_max_threads();
+    omp_set_num_threads(3);
+#endif
+    DoseVolume second = run(7);
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    QS_CHECK_NEAR(max_abs_difference(first, second), 0.0, 1e-9 * plan.prescribed_dose);
+
+    DoseVolume other = run(8);
+    QS_CHECK(max_abs_difference(first, other) > 1e-6);
+}
+
+QS_TEST(monte_carlo_stops_at_the_target_uncertainty) {
+    const auto& phantom = small_phantom();
+    const Plan plan = quangstation::bench::make_plan(quangstation::bench::PlanKind::Conformal3D, phantom);
+
+    MonteCarlo engine;
+    engine.set_num_histories(400000);
+    engine.set_num_batches(40);
+    engine.set_seed(3);
+    engine.set_target_uncertainty(0.0);
+    engine.calculate(phantom.ct, phantom.ptv, plan);
+    const double full_uncertainty = engine.get_last_uncertainty();
+    QS_CHECK(engine.get_last_histories() == 400000);
+    QS_CHECK(engine.get_last_batches() == 40);
+
+    // Mục tiêu lỏng hơn độ không chắc chắn của cả lần chạy nhưng đạt được sau vài lô
+    const double target = 2.5 * full_uncertainty;
+    engine.set_target_uncertainty(target);
+    const DoseVolume dose = engine.calculate(phantom.ct, phantom.ptv, plan);
+    QS_CHECK(engine.get_last_uncertainty() <= target);
+    QS_CHECK(engine.get_last_batches() >= 4 && engine.get_last_batches() < 40);
+    QS_CHECK(engine.get_last_histories() < 400000);
+    QS_CHECK_NEAR(mean_in_mask(dose, phantom.ptv), plan.prescribed_dose, 1e-9);
+}
+
+} // namespace
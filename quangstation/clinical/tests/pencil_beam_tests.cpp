@@ -0,0 +1,101 @@
+// Pencil beam: fast_exp, đường cong liều theo loại hạt và chuẩn hóa theo liều kê toa
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <string>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "depth_dose.h"
+#include "fast_math.h"
+#include "test_harness.h"
+
+using quangstation::DepthDoseCurve;
+using quangstation::ParticleType;
+
+namespace {
+
+using namespace quangstation::test;
+
+QS_TEST(fast_exp_matches_std_exp) {
+    for (double x = -708.0; x <= 709.0; x += 0.37) {
+        const double expected = std::exp(x);
+        QS_CHECK(std::abs(quangstation::fast_exp(x) - expected) <= 2e-15 * expected);
+    }
+    QS_CHECK(quangstation::fast_exp(0.0) == 1.0);
+    QS_CHECK(quangstation::fast_exp(-709.0) == 0.0);
+    QS_CHECK(quangstation::fast_exp(800.0) == quangstation::fast_exp(709.0));
+}
+
+QS_TEST(depth_dose_curves_per_particle_type) {
+    QS_CHECK(quangstation::particle_type_from_string("photon") == ParticleType::Photon);
+    QS_CHECK(quangstation::particle_type_from_string("electron") == ParticleType::Electron);
+    QS_CHECK(quangstation::particle_type_from_string("proton") == ParticleType::Proton);
+    QS_CHECK(quangstation::particle_type_from_string("neutron") == ParticleType::Other);
+
+    const DepthDoseCurve<ParticleType::Photon> photon(6.0);
+    const DepthDoseCurve<ParticleType::Electron> electron(12.0);  // r_p = 54 mm
+    const DepthDoseCurve<ParticleType::Proton> proton(100.0);     // Phạm vi 300 mm
+    const DepthDoseCurve<ParticleType::Other> other(6.0);
+    for (double depth = 0.0; depth < 400.0; depth += 1.5) {
+        QS_CHECK_NEAR(photon(depth), std::exp(-0.005 * depth), 1e-15);
+
+        const double u = (depth - 54.0) / 54.0;
+        const double electron_expected = depth < 54.0 ? (1.0 - depth / 54.0) * std::exp(-4.0 * u * u) : 0.0;
+        QS_CHECK_NEAR(electron(depth), electron_expected, 1e-14);
+
+        const double v = (depth - 300.0) / 300.0;
+        const double proton_expected = depth <= 300.0 ? 0.8 + 5.0 * std::exp(-20.0 * v * v) : 0.0;
+        QS_CHECK_NEAR(proton(depth), proton_expected, 1e-14);
+
+        QS_CHECK(other(depth) == 0.0);
+    }
+    QS_CHECK_NEAR(proton(300.0), 5.8, 1e-14);  // Đỉnh Bragg tại cuối phạm vi
+}
+
+QS_TEST(pencil_beam_normalises_mean_target_dose_to_prescription) {
+    const auto& phantom = small_phantom();
+    Plan plan = quangstation::bench::make_plan(quangstation::bench::PlanKind::Conformal3D, phantom);
+    PencilBeam engine;
+    DoseVolume dose = engine.calculate(phantom.ct, phantom.ptv, plan);
+    QS_CHECK(dose.same_shape(phantom.ct));
+    QS_CHECK_NEAR(mean_in_mask(dose, phantom.ptv), plan.prescribed_dose, 1e-9);
+    QS_CHECK(*std::min_element(dose.begin(), dose.end()) >= 0.0);
+
+    // Cùng kết quả với mọi số luồng (mỗi hàng voxel do một luồng tính)
+#ifdef _OPENMP
+    const int threads = omp_get_max_threads();
+    omp_set_num_threads(3);
+#endif
+    const DoseVolume threaded = engine.calculate(phantom.ct, phantom.ptv, plan);
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    QS_CHECK_NEAR(max_abs_difference(threaded, dose), 0.0, 1e-12);
+}
+
+QS_TEST(pencil_beam_dose_follows_the_particle_type) {
+    const auto& phantom = small_phantom();
+    const Plan conformal = quangstation::bench::make_plan(quangstation::bench::PlanKind::Conformal3D, phantom);
+    auto single_beam = [&](const std::string& type, double energy) {
+        Plan plan(conformal.id, conformal.technique, 0.0, conformal.fractions);
+        auto beam = std::make_shared<Beam>(*conformal.beams.front());
+        beam->type = type;
+        beam->energy = energy;
+        plan.beams.push_back(beam);
+        return plan;
+    };
+
+    PencilBeam engine;
+    const DoseVolume photon = engine.calculate(phantom.ct, MaskVolume(), single_beam("photon", 6.0));
+    const DoseVolume electron = engine.calculate(phantom.ct, MaskVolume(), single_beam("electron", 6.0));
+    QS_CHECK(max_value(photon) > 0.0);
+    QS_CHECK(max_value(electron) > 0.0);
+    QS_CHECK(max_abs_difference(photon, electron) > 1e-6 * max_value(photon));
+    QS_CHECK(max_value(engine.calculate(phantom.ct, MaskVolume(), single_beam("neutron", 6.0))) == 0.0);
+}
+
+} // namespace
@@ -0,0 +1,130 @@
+// Profiler: phiên ngoài cùng xóa thống kê, phiên lồng cộng dồn; thống kê của dose engine và optimizer
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "optimizer.h"
+#include "profiler.h"
+#include "test_harness.h"
+
+using quangstation::GridPool;
+using quangstation::JobControl;
+using quangstation::ProfileStats;
+using quangstation::Profiler;
+using quangstation::ScopedProfileSession;
+
+namespace {
+
+using namespace quangstation::test;
+
+QS_TEST(profiler_outer_session_resets_and_inner_sessions_accumulate) {
+    Profiler profiler;
+    QS_CHECK(profiler.session() == 0);
+
+    QS_CHECK(profiler.begin());
+    const std::uint64_t first = profiler.session();
+    QS_CHECK(first > 0);
+    profiler.count("hits");
+    profiler.add_phase("ray_trace", 0.5, 100);
+    QS_CHECK(!profiler.begin());  // Phiên lồng: cùng số thứ tự, không xóa
+    QS_CHECK(profiler.session() == first);
+    profiler.count("hits", 2);
+    profiler.add_phase("ray_trace", 0.25, 50);
+    profiler.add_beam_task("b0", 0.1);
+    profiler.add_beam_task("b1", 0.2);
+    profiler.add_beam_task("b0", 0.3);
+    profiler.end();
+    QS_CHECK(profiler.session() == first);
+    profiler.end_iteration(0, 5.0);
+    profiler.end_iteration(1, 4.0);
+    profiler.end();
+    QS_CHECK(profiler.session() == 0);
+
+    ProfileStats stats = profiler.stats();
+    QS_CHECK(stats.counters["hits"] == 3);
+    QS_CHECK(stats.phases["ray_trace"].calls == 2);
+    QS_CHECK(stats.phases["ray_trace"].voxels == 150);
+    QS_CHECK_NEAR(stats.phases["ray_trace"].seconds, 0.75, 1e-12);
+    QS_CHECK(stats.beams.size() == 2);
+    QS_CHECK(stats.beams[0].beam_id == "b0" && stats.beams[0].tasks == 2);
+    QS_CHECK_NEAR(stats.beams[0].seconds, 0.4, 1e-12);
+    QS_CHECK(stats.iterations.size() == 2 && stats.iterations[1].objective == 4.0);
+    QS_CHECK(stats.total_seconds >= 0.0);
+
+    // Bản sao là bộ đo rỗng; phiên ngoài cùng mới xóa thống kê cũ
+    QS_CHECK(Profiler(profiler).stats().counters.empty());
+    QS_CHECK(profiler.begin());
+    QS_CHECK(profiler.session() > first);
+    QS_CHECK(profiler.stats().counters.empty());
+    ProfileStats other;
+    other.counters["hits"] = 4;
+    other.phases["solve"].calls = 1;
+    profiler.merge(other);
+    profiler.end();
+    QS_CHECK(profiler.stats().counters["hits"] == 4);
+    QS_CHECK(profiler.stats().phases["solve"].calls == 1);
+}
+
+QS_TEST(profile_session_counts_grid_allocations_once) {
+    Profiler profiler;
+    GridPool pool;
+    DoseVolume grid(4, 4, 4, 0.0);
+    {
+        ScopedProfileSession outer(profiler, pool);
+        QS_CHECK(outer.outermost());
+        pool.release(pool.acquire_like<double>(grid));
+        {
+            ScopedProfileSession inner(profiler, pool);
+            QS_CHECK(!inner.outermost());
+            pool.release(pool.acquire_like<double>(grid));
+        }
+    }
+    ProfileStats stats = profiler.stats();
+    QS_CHECK(stats.counters["grid_allocations"] == 1);
+    QS_CHECK(stats.counters["grid_reuses"] == 1);
+    QS_CHECK(stats.counters["grid_bytes_allocated"] == grid.size() * sizeof(double));
+}
+
+QS_TEST(dose_engine_profile_covers_the_last_public_call) {
+    const auto& phantom = small_phantom();
+    const Plan plan = quangstation::bench::make_plan(quangstation::bench::PlanKind::Conformal3D, phantom);
+
+    AAA engine;
+    engine.calculate_plans(phantom.ct, phantom.ptv, {plan, plan, plan});
+    ProfileStats stats = engine.get_profile_stats();
+    QS_CHECK(stats.phases["normalize"].calls == 3);  // Ba lần calculate lồng trong một phiên
+    QS_CHECK(stats.beams.size() == plan.beams.size());
+    QS_CHECK(stats.beams.front().beam_id == plan.beams.front()->id);
+    QS_CHECK(stats.total_seconds > 0.0);
+
+    engine.calculate(phantom.ct, phantom.ptv, plan);
+    stats = engine.get_profile_stats();
+    QS_CHECK(stats.phases["normalize"].calls == 1);
+    QS_CHECK(stats.counters["depth_cache_hits"] == plan.beams.size());
+}
+
+QS_TEST(genetic_optimizer_profile_records_each_generation) {
+    DoseVolume grid(5, 5, 5, 0.0);
+    std::map<std::string, MaskVolume> masks = {{"PTV", random_mask(grid, 0.4, 131)}};
+    GeneticOptimizer optimizer(grid, masks, 8, 6);
+    optimizer.add_objective(ObjectiveFunction("PTV", ObjectiveFunction::MEAN_DOSE, 1.0));
+    for (const DoseVolume& column : random_columns(grid, 3, 0.5, 132)) {
+        optimizer.add_beam_dose_matrix(column);
+    }
+    optimizer.set_seed(1);
+    optimizer.initialize_population(3);
+    JobControl control;
+    optimizer.optimize(control);
+
+    ProfileStats stats = optimizer.get_profile_stats();
+    QS_CHECK(stats.iterations.size() == 6);
+    for (std::size_t g = 0; g < stats.iterations.size(); ++g) {
+        QS_CHECK(stats.iterations[g].iteration == static_cast<int>(g));
+    }
+    QS_CHECK(stats.iterations.back().objective == control.progress().objective);
+    QS_CHECK(stats.counters["fitness_evaluations"] > 0);
+}
+
+} // namespace
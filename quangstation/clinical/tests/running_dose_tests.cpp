@@ -0,0 +1,131 @@
+// Liều tổng cập nhật từng cột (RunningDose) so với tính lại toàn bộ
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "running_dose.h"
+#include "test_harness.h"
+
+using quangstation::RunningDose;
+using quangstation::StructureDoseSample;
+using quangstation::StructureVoxels;
+
+namespace {
+
+using namespace quangstation::test;
+
+QS_TEST(running_dose_incremental_updates_match_full_recompute) {
+    DoseVolume grid(6, 6, 6, 0.0);
+    std::vector<DoseVolume> columns = random_columns(grid, 6, 0.15, 61);
+    DoseInfluenceMatrix matrix = matrix_from_columns(columns);
+    std::map<std::string, quangstation::StructureMask> masks;
+    masks.emplace("PTV", quangstation::StructureMask(random_mask(grid, 0.3, 62)));
+    masks.emplace("OAR", quangstation::StructureMask(random_mask(grid, 0.2, 63)));
+    std::map<std::string, StructureVoxels> voxels = quangstation::build_structure_voxels(masks);
+
+    std::vector<double> weights = {1.0, 0.5, 0.25, 2.0, 1.5, 0.75};
+    RunningDose running;
+    running.rebuild(matrix, voxels, weights, grid);
+    QS_CHECK(running.valid());
+    // Gom mẫu và đếm ngưỡng trước khi cập nhật để kiểm tra đường cập nhật từng voxel
+    running.find("PTV");
+    running.find("OAR");
+    const double threshold = 1.0;
+    running.count_at_least(threshold);
+
+    std::mt19937 rng(64);
+    std::uniform_int_distribution<std::size_t> pick(0, weights.size() - 1);
+    std::uniform_real_distribution<double> uniform(0.0, 3.0);
+    for (int step = 0; step < 40; ++step) {
+        const std::size_t j = pick(rng);
+        weights[j] = step % 7 == 0 ? 0.0 : uniform(rng);
+        running.update_weight(matrix, j, weights[j]);
+    }
+
+    DoseVolume expected = reference_dose(columns, weights);
+    QS_CHECK_NEAR(max_abs_difference(running.dose(), expected), 0.0, 1e-12);
+    QS_CHECK(running.weights() == weights);
+
+    for (const auto& entry : voxels) {
+        StructureDoseSample fresh(entry.second, running.dose().data());
+        StructureDoseSample* incremental = running.find(entry.first);
+        QS_CHECK(incremental != nullptr);
+        QS_CHECK(incremental->size() == fresh.size());
+        QS_CHECK(incremental->min() == fresh.min());
+        QS_CHECK(incremental->max() == fresh.max());
+        QS_CHECK_NEAR(incremental->mean(), fresh.mean(), 1e-12);
+        for (std::size_t rank = 0; rank < fresh.size(); rank += 7) {
+            QS_CHECK(incremental->at_rank(rank) == fresh.at_rank(rank));
+        }
+    }
+    QS_CHECK(running.find("missing") == nullptr);
+
+    std::size_t expected_count = 0;
+    for (double value : running.dose()) {
+        expected_count += value >= threshold;
+    }
+    QS_CHECK(running.count_at_least(threshold) == expected_count);
+}
+
+QS_TEST(running_dose_sync_updates_changed_columns) {
+    DoseVolume grid(5, 5, 5, 0.0);
+    std::vector<DoseVolume> columns = random_columns(grid, 8, 0.1, 71);
+    DoseInfluenceMatrix matrix = matrix_from_columns(columns);
+    std::map<std::string, quangstation::StructureMask> masks;
+    masks.emplace("PTV", quangstation::StructureMask(random_mask(grid, 0.5, 72)));
+    std::map<std::string, StructureVoxels> voxels = quangstation::build_structure_voxels(masks);
+
+    std::vector<double> weights(8, 1.0);
+    RunningDose running;
+    running.sync(matrix, voxels, weights, grid);
+    running.find("PTV");
+
+    // Một cột đổi: cập nhật từng cột; mọi cột đổi: tính lại từ đầu
+    weights[3] = 0.25;
+    running.sync(matrix, voxels, weights, grid);
+    QS_CHECK_NEAR(max_abs_difference(running.dose(), reference_dose(columns, weights)), 0.0, 1e-12);
+    for (double& w : weights) {
+        w *= 2.0;
+    }
+    running.sync(matrix, voxels, weights, grid);
+    QS_CHECK_NEAR(max_abs_difference(running.dose(), reference_dose(columns, weights)), 0.0, 1e-12);
+
+    StructureDoseSample fresh(voxels.at("PTV"), running.dose().data());
+    QS_CHECK_NEAR(running.find("PTV")->mean(), fresh.mean(), 1e-12);
+
+    // Ma trận rỗng: lưới 0 cùng kích thước với fallback_grid
+    RunningDose empty;
+    empty.sync(DoseInfluenceMatrix(), voxels, {}, grid);
+    QS_CHECK(empty.dose().same_shape(grid));
+    QS_CHECK(*std::max_element(empty.dose().begin(), empty.dose().end()) == 0.0);
+}
+
+QS_TEST(running_dose_invalidate_rebuilds_for_a_new_matrix) {
+    DoseVolume grid(4, 4, 4, 0.0);
+    std::vector<DoseVolume> columns = random_columns(grid, 3, 0.4, 73);
+    DoseInfluenceMatrix matrix = matrix_from_columns(columns);
+    std::map<std::string, quangstation::StructureMask> masks;
+    masks.emplace("PTV", quangstation::StructureMask(random_mask(grid, 0.5, 74)));
+    std::map<std::string, StructureVoxels> voxels = quangstation::build_structure_voxels(masks);
+
+    const std::vector<double> weights = {1.0, 2.0, 0.5};
+    RunningDose running;
+    QS_CHECK(!running.valid());
+    running.sync(matrix, voxels, weights, grid);
+    QS_CHECK(running.valid());
+
+    // Ma trận đổi nội dung (cùng đối tượng, cùng trọng số): phải invalidate để tính lại
+    columns = random_columns(grid, 3, 0.4, 75);
+    matrix = matrix_from_columns(columns);
+    running.invalidate();
+    QS_CHECK(!running.valid());
+    running.sync(matrix, voxels, weights, grid);
+    QS_CHECK_NEAR(max_abs_difference(running.dose(), reference_dose(columns, weights)), 0.0, 1e-12);
+    StructureDoseSample fresh(voxels.at("PTV"), running.dose().data());
+    QS_CHECK_NEAR(running.find("PTV")->mean(), fresh.mean(), 1e-12);
+}
+
+} // namespace
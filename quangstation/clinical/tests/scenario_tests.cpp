@@ -0,0 +1,102 @@
+// Nhiều kế hoạch trên cùng CT và kịch bản dịch chuyển bệnh nhân so với từng lần calculate
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "test_harness.h"
+
+namespace {
+
+using namespace quangstation::test;
+
+// Bản sao plan không có liều kê toa, isocenter mọi chùm tia dời offset (mm)
+Plan offset_plan(const Plan& plan, const std::array<double, 3>& offset) {
+    Plan result(plan.id, plan.technique, 0.0, plan.fractions);
+    for (const auto& beam : plan.beams) {
+        auto moved = std::make_shared<Beam>(*beam);
+        for (int a = 0; a < 3; ++a) {
+            moved->isocenter[a] += offset[a];
+        }
+        result.beams.push_back(moved);
+    }
+    return result;
+}
+
+QS_TEST(calculate_plans_matches_individual_calculations) {
+    const auto& phantom = small_phantom();
+    const Plan conformal = quangstation::bench::make_plan(quangstation::bench::PlanKind::Conformal3D, phantom);
+    Plan fewer_beams = quangstation::bench::make_plan(quangstation::bench::PlanKind::Conformal3D, phantom);
+    fewer_beams.prescribed_dose = 3.0;
+    fewer_beams.beams.pop_back();
+    const Plan imrt = quangstation::bench::make_plan(quangstation::bench::PlanKind::IMRT, phantom);
+    const std::vector<Plan> plans = {conformal, fewer_beams, imrt};
+
+    AAA engine;
+    const std::vector<DoseVolume> doses = engine.calculate_plans(phantom.ct, phantom.ptv, plans);
+    QS_CHECK(doses.size() == plans.size());
+    // Ba chùm tia của kế hoạch thứ hai cùng hình học với kế hoạch đầu: dùng lại depth map
+    quangstation::ProfileStats stats = engine.get_profile_stats();
+    QS_CHECK(stats.counters["depth_cache_hits"] >= fewer_beams.beams.size());
+
+    for (std::size_t p = 0; p < plans.size(); ++p) {
+        AAA single;
+        const DoseVolume expected = single.calculate(phantom.ct, phantom.ptv, plans[p]);
+        QS_CHECK_NEAR(max_abs_difference(doses[p], expected), 0.0, 1e-12 * max_value(expected));
+        QS_CHECK_NEAR(mean_in_mask(doses[p], phantom.ptv), plans[p].prescribed_dose, 1e-9);
+    }
+}
+
+QS_TEST(calculate_shifted_keeps_the_nominal_normalisation) {
+    const auto& phantom = small_phantom();
+    const Plan plan = quangstation::bench::make_plan(quangstation::bench::PlanKind::Conformal3D, phantom);
+    const std::vector<std::array<double, 3>> shifts = {{3.0, 0.0, 0.0}, {0.0, 0.0, 0.0}, {0.0, -4.5, 1.5}};
+
+    PencilBeam engine;
+    const std::vector<DoseVolume> doses = engine.calculate_shifted(phantom.ct, phantom.ptv, plan, shifts);
+    QS_CHECK(doses.size() == shifts.size());
+    QS_CHECK_NEAR(max_abs_difference(doses[1], engine.calculate(phantom.ct, phantom.ptv, plan)), 0.0, 1e-12);
+
+    // Bệnh nhân dời s: isocenter dời -s trong tọa độ CT, cùng hệ số chuẩn hóa với kịch bản danh định
+    const DoseVolume nominal = engine.calculate(phantom.ct, MaskVolume(), offset_plan(plan, {0.0, 0.0, 0.0}));
+    const double scale = plan.prescribed_dose / mean_in_mask(nominal, phantom.ptv);
+    for (std::size_t i = 0; i < shifts.size(); ++i) {
+        DoseVolume expected =
+            engine.calculate(phantom.ct, MaskVolume(), offset_plan(plan, {-shifts[i][0], -shifts[i][1], -shifts[i][2]}));
+        expected.scale(scale);
+        QS_CHECK_NEAR(max_abs_difference(doses[i], expected), 0.0, 1e-12 * max_value(expected));
+    }
+    QS_CHECK(std::abs(mean_in_mask(doses[0], phantom.ptv) - plan.prescribed_dose) > 1e-6);
+
+    // Không có kịch bản (0, 0, 0): kịch bản danh định được tính thêm để lấy hệ số chuẩn hóa
+    const std::vector<DoseVolume> shifted_only =
+        engine.calculate_shifted(phantom.ct, phantom.ptv, plan, {shifts[0], shifts[2]});
+    QS_CHECK(shifted_only.size() == 2);
+    QS_CHECK_NEAR(max_abs_difference(shifted_only[0], doses[0]), 0.0, 1e-12);
+    QS_CHECK_NEAR(max_abs_difference(shifted_only[1], doses[2]), 0.0, 1e-12);
+}
+
+QS_TEST(calculate_shifted_dose_cloud_moves_the_nominal_dose) {
+    const auto& phantom = small_phantom();
+    const Plan plan = quangstation::bench::make_plan(quangstation::bench::PlanKind::Conformal3D, phantom);
+
+    PencilBeam engine;
+    const DoseVolume nominal = engine.calculate(phantom.ct, phantom.ptv, plan);
+    // Dời đúng một voxel (3 mm) theo x: liều tại x là liều danh định tại x + 1
+    const std::vector<DoseVolume> doses =
+        engine.calculate_shifted(phantom.ct, phantom.ptv, plan, {{0.0, 0.0, 0.0}, {3.0, 0.0, 0.0}}, false);
+    QS_CHECK(doses[0].same_shape(phantom.ct));
+    QS_CHECK_NEAR(max_abs_difference(doses[0], nominal), 0.0, 1e-12);
+    for (std::size_t z = 0; z < nominal.depth(); ++z) {
+        for (std::size_t y = 0; y < nominal.height(); ++y) {
+            for (std::size_t x = 0; x < nominal.width(); ++x) {
+                const std::size_t source = std::min(x + 1, nominal.width() - 1);
+                QS_CHECK_NEAR(doses[1](z, y, x), nominal(z, y, source), 1e-12);
+            }
+        }
+    }
+}
+
+} // namespace
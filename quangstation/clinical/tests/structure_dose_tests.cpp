@@ -0,0 +1,105 @@
+// Danh sách voxel cấu trúc và mẫu liều theo cấu trúc (thứ hạng, cập nhật từng voxel, bộ đệm)
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "structure_dose.h"
+#include "test_harness.h"
+
+using quangstation::StructureDoseCache;
+using quangstation::StructureDoseSample;
+using quangstation::StructureVoxels;
+
+namespace {
+
+using namespace quangstation::test;
+
+QS_TEST(structure_dose_sample_ranks_and_updates) {
+    StructureDoseSample empty;
+    QS_CHECK(empty.empty());
+    QS_CHECK(empty.at_rank(0) == 0.0 && empty.at_rank(5) == 0.0);
+    QS_CHECK(empty.min() == 0.0 && empty.max() == 0.0 && empty.mean() == 0.0);
+
+    std::vector<double> dose = {4.0, 1.0, 3.0, 9.0, 2.0, 7.0};
+    StructureVoxels voxels = {0, 1, 2, 3, 4, 5};
+    StructureDoseSample sample(voxels, dose.data());
+    QS_CHECK(sample.at_rank(0) == 1.0 && sample.at_rank(3) == 4.0 && sample.at_rank(100) == 9.0);
+
+    sample.update(3, 0.5);  // Cực đại giảm: min/max quét lại
+    QS_CHECK(sample.max() == 7.0 && sample.min() == 0.5);
+    QS_CHECK_NEAR(sample.mean(), (4.0 + 1.0 + 3.0 + 0.5 + 2.0 + 7.0) / 6.0, 1e-15);
+    QS_CHECK(sample.at_rank(0) == 0.5 && sample.at_rank(5) == 7.0);
+}
+
+QS_TEST(structure_dose_sample_matches_sorted_reference) {
+    std::mt19937 rng(91);
+    std::uniform_real_distribution<double> uniform(0.0, 5.0);
+    std::vector<double> dose(200);
+    for (double& value : dose) {
+        value = uniform(rng);
+    }
+    StructureVoxels voxels;
+    for (std::uint32_t i = 0; i < dose.size(); i += 3) {
+        voxels.push_back(i);
+    }
+
+    StructureDoseSample sample(voxels, dose.data());
+    std::vector<double> values;
+    for (std::uint32_t i : voxels) {
+        values.push_back(dose[i]);
+    }
+    for (int step = 0; step < 3; ++step) {
+        std::vector<double> sorted = values;
+        std::sort(sorted.begin(), sorted.end());
+        QS_CHECK(sample.size() == values.size());
+        QS_CHECK(sample.min() == sorted.front() && sample.max() == sorted.back());
+        for (std::size_t rank = 0; rank < sorted.size(); rank += 5) {
+            QS_CHECK(sample.at_rank(rank) == sorted[rank]);
+        }
+        const double threshold = 2.5;
+        QS_CHECK(sample.count_at_least(threshold) ==
+                 static_cast<std::size_t>(std::count_if(values.begin(), values.end(),
+                                                        [&](double d) { return d >= threshold; })));
+
+        // Sửa vài voxel: cực đại giảm, cực tiểu tăng và giá trị ở giữa
+        const std::size_t max_k = std::max_element(values.begin(), values.end()) - values.begin();
+        values[max_k] = 0.1 * step;
+        sample.update(max_k, values[max_k]);
+        const std::size_t min_k = std::min_element(values.begin(), values.end()) - values.begin();
+        values[min_k] = 4.0 + step;
+        sample.update(min_k, values[min_k]);
+        values[7] = 1.5;
+        sample.update(7, 1.5);
+    }
+}
+
+QS_TEST(structure_dose_cache_gathers_once_per_dose) {
+    DoseVolume grid(4, 5, 6, 0.0);
+    std::map<std::string, quangstation::StructureMask> masks;
+    const MaskVolume ptv = random_mask(grid, 0.3, 92);
+    masks.emplace("PTV", quangstation::StructureMask(ptv));
+    std::map<std::string, StructureVoxels> voxels = quangstation::build_structure_voxels(masks);
+    QS_CHECK(voxels.at("PTV") == masks.at("PTV").voxels());
+
+    std::vector<double> first(grid.size()), second(grid.size());
+    for (std::size_t i = 0; i < grid.size(); ++i) {
+        first[i] = 0.01 * i;
+        second[i] = 2.0 + 0.01 * i;
+    }
+    StructureDoseCache cache(voxels, first.data());
+    StructureDoseSample* sample = cache.find("PTV");
+    QS_CHECK(sample != nullptr);
+    QS_CHECK(cache.find("PTV") == sample);
+    QS_CHECK(cache.find("missing") == nullptr);
+    QS_CHECK_NEAR(sample->mean(), StructureDoseSample(voxels.at("PTV"), first.data()).mean(), 1e-15);
+
+    cache.reset(second.data());
+    sample = cache.find("PTV");
+    QS_CHECK_NEAR(sample->mean(), StructureDoseSample(voxels.at("PTV"), second.data()).mean(), 1e-15);
+    QS_CHECK(sample->min() >= 2.0);
+}
+
+} // namespace
@@ -0,0 +1,108 @@
+// Mặt nạ cấu trúc nén (StructureMask): đoạn voxel, giao, độ phù hợp và hợp cấu trúc
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "structure_mask.h"
+#include "test_harness.h"
+
+namespace {
+
+using namespace quangstation::test;
+
+QS_TEST(structure_mask_runs_match_dense_mask) {
+    DoseVolume grid(5, 7, 70, 0.0);  // Hàng dài hơn 64 voxel: đoạn vắt qua ranh giới word
+    MaskVolume dense = random_mask(grid, 0.4, 41);
+    for (std::size_t x = 10; x < 90 && x < grid.width(); ++x) {
+        dense(2, 3, x) = 1;
+    }
+    quangstation::StructureMask mask(dense);
+
+    std::size_t expected_count = 0;
+    for (std::uint8_t value : dense) {
+        expected_count += value ? 1 : 0;
+    }
+    QS_CHECK(mask.count() == expected_count);
+
+    // Các đoạn theo thứ tự bộ nhớ, không chồng lấn, phủ đúng các voxel của mặt nạ
+    std::vector<std::uint32_t> visited;
+    mask.for_each_run([&](std::size_t z, std::size_t y, std::size_t x_begin, std::size_t x_end) {
+        QS_CHECK(x_begin < x_end);
+        for (std::size_t x = x_begin; x < x_end; ++x) {
+            visited.push_back(static_cast<std::uint32_t>((z * grid.height() + y) * grid.width() + x));
+        }
+    });
+    QS_CHECK(std::is_sorted(visited.begin(), visited.end()));
+    QS_CHECK(visited == mask.voxels());
+    for (std::uint32_t index : visited) {
+        QS_CHECK(dense.data()[index] != 0);
+    }
+    QS_CHECK(visited.size() == expected_count);
+
+    MaskVolume round_trip = mask.to_volume();
+    for (std::size_t i = 0; i < dense.size(); ++i) {
+        QS_CHECK((round_trip.data()[i] != 0) == (dense.data()[i] != 0));
+    }
+    QS_CHECK(quangstation::StructureMask(MaskVolume::like(grid, static_cast<std::uint8_t>(0))).count() == 0);
+}
+
+QS_TEST(structure_mask_overlap_and_conformity) {
+    DoseVolume dose(6, 6, 80, 0.0);
+    std::mt19937 rng(51);
+    std::uniform_real_distribution<double> uniform(0.0, 3.0);
+    for (double& value : dose) {
+        value = uniform(rng);
+    }
+    MaskVolume target_dense = random_mask(dose, 0.3, 52);
+    quangstation::StructureMask target(target_dense);
+    quangstation::StructureMask isodose = quangstation::StructureMask::at_least(dose, 2.0);
+
+    std::size_t tv = 0, piv = 0, both = 0;
+    double target_sum = 0.0;
+    for (std::size_t i = 0; i < dose.size(); ++i) {
+        const bool in_target = target_dense.data()[i] != 0;
+        const bool covered = dose.data()[i] >= 2.0;
+        tv += in_target;
+        piv += covered;
+        both += in_target && covered;
+        if (in_target) {
+            target_sum += dose.data()[i];
+        }
+    }
+    QS_CHECK(isodose.count() == piv);
+    QS_CHECK(target.overlap(isodose) == both);
+    QS_CHECK(isodose.overlap(target) == both);
+    QS_CHECK_NEAR(target.sum(dose), target_sum, 1e-9);
+    QS_CHECK_NEAR(quangstation::paddick_conformity(target, isodose),
+                  static_cast<double>(both) * both / (static_cast<double>(tv) * piv), 1e-15);
+}
+
+QS_TEST(influence_matrix_structure_union_matches_for_dense_and_compressed_masks) {
+    DoseVolume grid(6, 7, 9, 0.0);
+    std::map<std::string, MaskVolume> dense = {{"PTV", random_mask(grid, 0.2, 15)}, {"OAR", random_mask(grid, 0.1, 16)}};
+    std::map<std::string, quangstation::StructureMask> compressed;
+    for (const auto& entry : dense) {
+        compressed.emplace(entry.first, quangstation::StructureMask(entry.second));
+    }
+
+    for (int stride : {0, 3}) {
+        const MaskVolume from_dense = DoseInfluenceMatrix::structure_union(grid, dense, stride);
+        const MaskVolume from_compressed = DoseInfluenceMatrix::structure_union(grid, compressed, stride);
+        for (std::size_t z = 0; z < grid.depth(); ++z) {
+            for (std::size_t y = 0; y < grid.height(); ++y) {
+                for (std::size_t x = 0; x < grid.width(); ++x) {
+                    const bool sampled = stride > 0 && z % stride == 0 && y % stride == 0 && x % stride == 0;
+                    const bool expected = dense.at("PTV")(z, y, x) || dense.at("OAR")(z, y, x) || sampled;
+                    QS_CHECK((from_dense(z, y, x) != 0) == expected);
+                    QS_CHECK(from_compressed(z, y, x) == from_dense(z, y, x));
+                }
+            }
+        }
+    }
+}
+
+} // namespace
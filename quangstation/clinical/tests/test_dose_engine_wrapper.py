@@ -0,0 +1,76 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+"""
+Kiểm tra DoseCalculator với module C++ _dose_engine: chọn lớp C++ theo thuật toán
+và độ phân giải lưới liều.
+
+Chạy: python -m unittest discover -s quangstation/clinical/tests
+(bỏ qua khi chưa build _dose_engine).
+"""
+
+import unittest
+
+try:
+    import numpy as np
+    from quangstation.clinical.dose_calculation import dose_engine_wrapper
+    HAS_CPP_MODULE = dose_engine_wrapper.HAS_CPP_MODULE
+except ImportError:
+    HAS_CPP_MODULE = False
+
+
+@unittest.skipUnless(HAS_CPP_MODULE, "chưa build module C++ _dose_engine")
+class CppAlgorithmRoutingTest(unittest.TestCase):
+    def test_mapped_classes_exist_in_extension(self):
+        from quangstation.clinical.dose_calculation import _dose_engine
+        for algorithm, class_name in dose_engine_wrapper.DoseCalculator.CPP_ALGORITHM_CLASSES.items():
+            self.assertTrue(hasattr(_dose_engine, class_name), class_name)
+            self.assertTrue(dose_engine_wrapper.DoseCalculator(algorithm=algorithm)._has_cpp_extension())
+
+    def test_python_only_algorithms_skip_extension(self):
+        Calculator = dose_engine_wrapper.DoseCalculator
+        for algorithm in (Calculator.ALGO_ACUROS_XB, Calculator.ALGO_GRID_BASED,
+                          Calculator.ALGO_CONVOLUTION, "unknown"):
+            self.assertFalse(Calculator(algorithm=algorithm)._has_cpp_extension())
+
+
+@unittest.skipUnless(HAS_CPP_MODULE, "chưa build module C++ _dose_engine")
+class DoseGridResolutionTest(unittest.TestCase):
+    # CT 20³ voxel 1 mm: lưới 4 mm phủ 19 mm cần ceil(19 / 4) + 1 = 6 điểm mỗi trục
+    CT_SHAPE = (20, 20, 20)
+    SPACING = [1.0, 1.0, 1.0]
+
+    def calculate(self, resolution_mm, options=None):
+        calculator = dose_engine_wrapper.DoseCalculator(
+            algorithm=dose_engine_wrapper.DoseCalculator.ALGO_PENCIL_BEAM,
+            resolution_mm=resolution_mm)
+        calculator.set_patient_data(np.zeros(self.CT_SHAPE, dtype=np.int16), self.SPACING)
+        calculator.add_beam({'id': 'B1', 'gantry_angle': 0.0, 'isocenter': [10.0, 10.0, 10.0]})
+        if options:
+            calculator.set_calculation_options(options)
+        dose = calculator.calculate_dose()
+        self.assertIsNotNone(dose)
+        self.assertEqual(dose.shape, self.CT_SHAPE)
+        return calculator
+
+    def test_resolution_mm_sets_engine_dose_grid(self):
+        calculator = self.calculate(4.0)
+        self.assertEqual(calculator._cpp_algorithm.get_dose_grid_resolution(), 4.0)
+        self.assertEqual(calculator.calculation_info['dose_grid_shape'], (6, 6, 6))
+
+    def test_resolution_at_ct_spacing_keeps_ct_grid(self):
+        calculator = self.calculate(1.0)
+        self.assertEqual(calculator.calculation_info['dose_grid_shape'], self.CT_SHAPE)
+
+    def test_dose_grid_resolution_option_overrides_resolution_mm(self):
+        calculator = self.calculate(4.0, {'dose_grid_resolution': 0.0})
+        self.assertEqual(calculator.calculation_info['dose_grid_shape'], self.CT_SHAPE)
+
+        calculator.set_calculation_options({'dose_grid_resolution': 2.0})
+        calculator.calculate_dose()
+        self.assertEqual(calculator._cpp_algorithm_key[1], 2.0)
+        self.assertEqual(calculator.calculation_info['dose_grid_shape'], (11, 11, 11))
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,199 @@
+/**
+ * Bộ chạy kiểm thử tối giản cho các thành phần C++ (không cần thư viện ngoài).
+ *
+ * Mỗi tệp *_tests.cpp trong thư mục này đăng ký các QS_TEST của mình; test_main.cpp
+ * chạy chúng. Dựng và chạy bằng: python setup.py build_tests (tệp thực thi
+ * build/tests/engine_tests, đối số đầu tiên lọc các trường hợp theo tên). Lỗi đầu
+ * tiên dừng trường hợp đó. Phantom và lưới nhỏ để chạy nhanh trên một luồng.
+ */
+
+#ifndef QUANGSTATION_TEST_HARNESS_H
+#define QUANGSTATION_TEST_HARNESS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "volume3d.h"
+#include "influence_matrix.h"
+#include "phantoms.h"
+
+namespace quangstation {
+namespace test {
+
+struct TestCase {
+    const char* name;
+    void (*run)();
+};
+
+inline std::vector<TestCase>& test_registry() {
+    static std::vector<TestCase> tests;
+    return tests;
+}
+
+struct TestRegistration {
+    TestRegistration(const char* name, void (*run)()) {
+        test_registry().push_back({name, run});
+    }
+};
+
+struct TestFailure : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+inline std::string failure_location(const char* file, int line) {
+    std::ostringstream out;
+    out << file << ":" << line << ": ";
+    return out.str();
+}
+
+// ---------------------------------------------------------------------------
+// Dữ liệu dùng chung
+// ---------------------------------------------------------------------------
+
+// Các cột liều ngẫu nhiên trên lưới grid: mỗi voxel khác 0 với xác suất density
+inline std::vector<DoseVolume> random_columns(const DoseVolume& grid, std::size_t num_columns, double density,
+                                              std::uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::vector<DoseVolume> columns;
+    for (std::size_t j = 0; j < num_columns; ++j) {
+        DoseVolume column = DoseVolume::like(grid, 0.0);
+        for (double& value : column) {
+            if (uniform(rng) < density) {
+                value = 0.1 + uniform(rng);
+            }
+        }
+        columns.push_back(std::move(column));
+    }
+    return columns;
+}
+
+inline DoseInfluenceMatrix matrix_from_columns(const std::vector<DoseVolume>& columns) {
+    DoseInfluenceMatrix matrix(columns.front());
+    for (const DoseVolume& column : columns) {
+        matrix.add_column(column);
+    }
+    return matrix;
+}
+
+// Σ_j w_j · float(B_j) tính trực tiếp bằng double
+inline DoseVolume reference_dose(const std::vector<DoseVolume>& columns, const std::vector<double>& weights) {
+    DoseVolume dose = DoseVolume::like(columns.front(), 0.0);
+    for (std::size_t j = 0; j < columns.size(); ++j) {
+        for (std::size_t i = 0; i < dose.size(); ++i) {
+            dose.data()[i] += weights[j] * static_cast<double>(static_cast<float>(columns[j].data()[i]));
+        }
+    }
+    return dose;
+}
+
+inline double max_abs_difference(const DoseVolume& a, const DoseVolume& b) {
+    double diff = 0.0;
+    for (std::size_t i = 0; i < a.size(); ++i) {
+        diff = std::max(diff, std::abs(a.data()[i] - b.data()[i]));
+    }
+    return diff;
+}
+
+inline double max_value(const DoseVolume& dose) {
+    return dose.size() > 0 ? *std::max_element(dose.begin(), dose.end()) : 0.0;
+}
+
+inline MaskVolume random_mask(const DoseVolume& grid, double density, std::uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    MaskVolume mask = MaskVolume::like(grid, static_cast<std::uint8_t>(0));
+    for (std::uint8_t& value : mask) {
+        value = uniform(rng) < density ? 1 : 0;
+    }
+    return mask;
+}
+
+inline double mean_in_mask(const DoseVolume& dose, const MaskVolume& mask) {
+    double sum = 0.0;
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < dose.size(); ++i) {
+        if (mask.data()[i]) {
+            sum += dose.data()[i];
+            ++count;
+        }
+    }
+    return count > 0 ? sum / count : 0.0;
+}
+
+// Tệp tạm trong thư mục hiện tại, xóa khi ra khỏi phạm vi
+struct TemporaryFile {
+    std::string path;
+
+    explicit TemporaryFile(const std::string& name) : path(name) {
+        std::remove(path.c_str());
+    }
+
+    ~TemporaryFile() {
+        std::remove(path.c_str());
+    }
+
+    std::size_t size() const {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        return in ? static_cast<std::size_t>(in.tellg()) : 0;
+    }
+};
+
+// Phantom tấm 16³ voxel 3 mm (PTV cầu ở tâm, OAR phía sau theo y)
+inline const bench::Phantom& small_phantom() {
+    static const bench::Phantom phantom = bench::make_slab_phantom("test", 16, 16, 16, {3.0, 3.0, 3.0});
+    return phantom;
+}
+
+} // namespace test
+} // namespace quangstation
+
+#define QS_TEST(name) \
+    void name(); \
+    ::quangstation::test::TestRegistration name##_registration(#name, &name); \
+    void name()
+
+#define QS_CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            throw ::quangstation::test::TestFailure( \
+                ::quangstation::test::failure_location(__FILE__, __LINE__) + "không thỏa " #condition); \
+        } \
+    } while (0)
+
+#define QS_CHECK_NEAR(actual, expected, tolerance) \
+    do { \
+        const double qs_actual = (actual); \
+        const double qs_expected = (expected); \
+        if (!(std::abs(qs_actual - qs_expected) <= (tolerance))) { \
+            std::ostringstream qs_message; \
+            qs_message.precision(17); \
+            qs_message << ::quangstation::test::failure_location(__FILE__, __LINE__) << #actual << " = " \
+                       << qs_actual << ", cần " << qs_expected << " ± " << (tolerance); \
+            throw ::quangstation::test::TestFailure(qs_message.str()); \
+        } \
+    } while (0)
+
+#define QS_CHECK_THROWS(expression, exception_type) \
+    do { \
+        bool qs_thrown = false; \
+        try { \
+            expression; \
+        } catch (const exception_type&) { \
+            qs_thrown = true; \
+        } \
+        if (!qs_thrown) { \
+            throw ::quangstation::test::TestFailure( \
+                ::quangstation::test::failure_location(__FILE__, __LINE__) + #expression " không ném " #exception_type); \
+        } \
+    } while (0)
+
+#endif // QUANGSTATION_TEST_HARNESS_H
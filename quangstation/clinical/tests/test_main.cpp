@@ -0,0 +1,28 @@
+// Chạy các QS_TEST đã đăng ký; đối số đầu tiên (nếu có) lọc theo tên (chuỗi con)
+
+#include <exception>
+#include <iostream>
+#include <string>
+
+#include "test_harness.h"
+
+int main(int argc, char** argv) {
+    const std::string filter = argc > 1 ? argv[1] : "";
+    int run = 0;
+    int failed = 0;
+    for (const quangstation::test::TestCase& test : quangstation::test::test_registry()) {
+        if (!filter.empty() && std::string(test.name).find(filter) == std::string::npos) {
+            continue;
+        }
+        ++run;
+        try {
+            test.run();
+            std::cout << "[  OK  ] " << test.name << std::endl;
+        } catch (const std::exception& error) {
+            ++failed;
+            std::cout << "[ FAIL ] " << test.name << ": " << error.what() << std::endl;
+        }
+    }
+    std::cout << run - failed << "/" << run << " trường hợp đạt" << std::endl;
+    return failed == 0 ? 0 : 1;
+}
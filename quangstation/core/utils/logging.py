@@ -336,6 +336,28 @@ class QuangLogger:
         else:
             self.log_error(message, **kwargs)
     
+    def log_profile(self, operation: str, stats: Dict[str, Any], max_phases: int = 6, **kwargs):
+        """
+        Ghi log thống kê thời gian của module C++ (get_profile_stats)
+        
+        Args:
+            operation: Tên thao tác
+            stats: Dict {total_seconds, phases, counters, beams, iterations}
+            max_phases: Số giai đoạn tốn thời gian nhất ghi ở mức info
+        """
+        if not stats:
+            return
+        phases = sorted(stats.get('phases', {}).items(), key=lambda item: item[1]['seconds'], reverse=True)
+        phases_str = ", ".join(f"{name} {phase['seconds']:.3f}s" for name, phase in phases[:max_phases])
+        message = f"Hiệu năng {operation}: tổng {stats.get('total_seconds', 0.0):.3f}s"
+        if phases_str:
+            message += f", giai đoạn: {phases_str}"
+        counters = stats.get('counters', {})
+        if counters:
+            message += ", bộ đếm: " + ", ".join(f"{name}={value}" for name, value in sorted(counters.items()))
+        self.log_info(message, **kwargs)
+        self.log_debug(f"Chi tiết hiệu năng {operation}: {json.dumps(stats, ensure_ascii=False)}", **kwargs)
+    
     def log_user_action(self, user: str, action: str, target: str = None, result: str = None, **kwargs):
         """
         Ghi log hành động của người dùng
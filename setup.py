@@ -1,6 +1,8 @@
 import os
 from setuptools import setup, find_packages, Extension
+import glob
 import platform
+import subprocess
 import sys
 from setuptools.command.build_ext import build_ext
 
@@ -13,17 +15,84 @@ is_windows = platform.system() == 'Windows'
 
 # Lớp xử lý quá trình biên dịch mở rộng
 class BuildExt(build_ext):
+    def openmp_flags(self, compiler_type):
+        """Cờ biên dịch/liên kết OpenMP dùng được với trình biên dịch hiện tại, ([], []) nếu không có."""
+        if os.environ.get('QUANGSTATION_NO_OPENMP'):
+            return [], []
+        if compiler_type == 'msvc':
+            # OpenMP 2.0 của /openmp không hỗ trợ chỉ số vòng lặp không dấu và collapse
+            candidates = [(['/openmp:llvm'], [])]
+        elif sys.platform == 'darwin':
+            # Apple Clang cần libomp (Homebrew) và gọi qua -Xpreprocessor
+            candidates = [(['-Xpreprocessor', '-fopenmp'], ['-lomp']), (['-fopenmp'], ['-fopenmp'])]
+        else:
+            candidates = [(['-fopenmp'], ['-fopenmp'])]
+        
+        import tempfile
+        for compile_args, link_args in candidates:
+            with tempfile.TemporaryDirectory() as tmpdir:
+                source = os.path.join(tmpdir, 'check_openmp.cpp')
+                with open(source, 'w') as f:
+                    f.write('#include <omp.h>\nint main() { return omp_get_max_threads() > 0 ? 0 : 1; }\n')
+                try:
+                    objects = self.compiler.compile([source], output_dir=tmpdir, extra_postargs=compile_args)
+                    self.compiler.link_executable(objects, os.path.join(tmpdir, 'check_openmp'),
+                                                  extra_postargs=link_args)
+                    return compile_args, link_args
+                except Exception:
+                    continue
+        print("Cảnh báo: không tìm thấy OpenMP, các module C++ sẽ chạy một luồng")
+        return [], []
+    
+    def compiler_accepts(self, args):
+        """Trình biên dịch hiện tại có biên dịch được một tệp rỗng với args không."""
+        import tempfile
+        with tempfile.TemporaryDirectory() as tmpdir:
+            source = os.path.join(tmpdir, 'check_flags.cpp')
+            with open(source, 'w') as f:
+                f.write('int main() { return 0; }\n')
+            try:
+                self.compiler.compile([source], output_dir=tmpdir, extra_postargs=args)
+                return True
+            except Exception:
+                return False
+    
+    def native_arch_flags(self, compiler_type):
+        """QUANGSTATION_NATIVE_ARCH=1: sinh mã cho CPU hiện tại (AVX2/AVX-512/NEON), bản dựng không mang sang máy khác được."""
+        if not os.environ.get('QUANGSTATION_NATIVE_ARCH'):
+            return []
+        if compiler_type == 'msvc':
+            # MSVC không tự dò CPU: dùng AVX2
+            candidates = [['/arch:AVX2']]
+        else:
+            candidates = [['-march=native'], ['-mcpu=native']]
+        for args in candidates:
+            if self.compiler_accepts(args):
+                return args
+        print("Cảnh báo: trình biên dịch không hỗ trợ cờ kiến trúc native, dùng kiến trúc mặc định")
+        return []
+    
+    def cpp_compile_args(self, compiler_type):
+        """Cờ C++14 tối ưu dùng chung cho các extension và benchmark."""
+        if compiler_type == 'msvc':  # Windows với MSVC
+            return ['/std:c++14', '/EHsc', '/O2']
+        # GCC/Clang trên Linux/Mac
+        # -fno-trapping-math: cho phép vector hóa các phép chọn/so sánh số thực (không đổi kết quả)
+        args = ['-std=c++14', '-O3', '-fno-trapping-math']
+        if sys.platform == 'darwin':  # macOS
+            args.append('-stdlib=libc++')
+        return args
+    
     def build_extensions(self):
         # Phát hiện trình biên dịch C++ và đặt cờ phù hợp
         compiler_type = self.compiler.compiler_type
+        openmp_compile_args, openmp_link_args = self.openmp_flags(compiler_type)
+        native_args = self.native_arch_flags(compiler_type)
         
         for ext in self.extensions:
-            if compiler_type == 'msvc':  # Windows với MSVC
-                ext.extra_compile_args = ['/std:c++14', '/EHsc', '/O2']
-            else:  # GCC/Clang trên Linux/Mac
-                ext.extra_compile_args = ['-std=c++14', '-O3']
-                if sys.platform == 'darwin':  # macOS
-                    ext.extra_compile_args.append('-stdlib=libc++')
+            # Song song hóa chùm tia/control point và các vòng lặp voxel
+            ext.extra_compile_args = self.cpp_compile_args(compiler_type) + openmp_compile_args + native_args
+            ext.extra_link_args = list(ext.extra_link_args or []) + openmp_link_args
             
             # Thêm include_dirs cho các thư viện phổ biến
             import numpy
@@ -31,6 +100,100 @@ class BuildExt(build_ext):
             
         super().build_extensions()
 
+# Dựng benchmark C++ (Google Benchmark) cạnh các extension: python setup.py build_benchmarks
+class BuildBenchmarks(BuildExt):
+    description = "dựng benchmark dose engine/optimizer (Google Benchmark) vào build/benchmarks"
+    user_options = BuildExt.user_options + [
+        ('benchmark-dir=', None, "thư mục cài Google Benchmark (include/, lib/), mặc định $BENCHMARK_ROOT"),
+    ]
+    
+    def initialize_options(self):
+        super().initialize_options()
+        self.benchmark_dir = None
+    
+    def finalize_options(self):
+        super().finalize_options()
+        if self.benchmark_dir is None:
+            self.benchmark_dir = os.environ.get('BENCHMARK_ROOT')
+    
+    def run(self):
+        # Không cần pybind11/numpy: chỉ một tệp thực thi liên kết với libbenchmark
+        from distutils.ccompiler import new_compiler
+        from distutils.sysconfig import customize_compiler
+        self.compiler = new_compiler(compiler=self.compiler, verbose=self.verbose,
+                                     dry_run=self.dry_run, force=self.force)
+        customize_compiler(self.compiler)
+        compiler_type = self.compiler.compiler_type
+        
+        clinical = os.path.join('quangstation', 'clinical')
+        include_dirs = [os.path.join(clinical, name)
+                        for name in ('common', 'dose_calculation', 'optimization', 'benchmarks')]
+        library_dirs = []
+        if self.benchmark_dir:
+            include_dirs.append(os.path.join(self.benchmark_dir, 'include'))
+            library_dirs.append(os.path.join(self.benchmark_dir, 'lib'))
+        if compiler_type == 'msvc':
+            libraries = ['benchmark', 'shlwapi', 'psapi']
+        else:
+            libraries = ['benchmark', 'pthread']
+        
+        # Cùng cờ với _dose_engine/_optimizer để số đo phản ánh bản dựng thật
+        openmp_compile_args, openmp_link_args = self.openmp_flags(compiler_type)
+        compile_args = self.cpp_compile_args(compiler_type) + openmp_compile_args + self.native_arch_flags(compiler_type)
+        
+        output_dir = os.path.join('build', 'benchmarks')
+        os.makedirs(output_dir, exist_ok=True)
+        objects = self.compiler.compile([os.path.join(clinical, 'benchmarks', 'engine_benchmark.cpp')],
+                                        output_dir=self.build_temp, include_dirs=include_dirs,
+                                        extra_postargs=compile_args)
+        self.compiler.link_executable(objects, 'engine_benchmark', output_dir=output_dir,
+                                      libraries=libraries, library_dirs=library_dirs,
+                                      extra_postargs=openmp_link_args, target_lang='c++')
+
+# Dựng và chạy kiểm thử C++ (không cần thư viện ngoài): python setup.py build_tests
+class BuildTests(BuildExt):
+    description = "dựng kiểm thử C++ của dose engine/optimizer vào build/tests và chạy"
+    user_options = BuildExt.user_options + [
+        ('no-run', None, "chỉ dựng, không chạy"),
+    ]
+    boolean_options = BuildExt.boolean_options + ['no-run']
+    
+    def initialize_options(self):
+        super().initialize_options()
+        self.no_run = False
+    
+    def run(self):
+        # Không cần pybind11/numpy: một tệp thực thi từ các header C++
+        from distutils.ccompiler import new_compiler
+        from distutils.sysconfig import customize_compiler
+        self.compiler = new_compiler(compiler=self.compiler, verbose=self.verbose,
+                                     dry_run=self.dry_run, force=self.force)
+        customize_compiler(self.compiler)
+        compiler_type = self.compiler.compiler_type
+        
+        clinical = os.path.join('quangstation', 'clinical')
+        include_dirs = [os.path.join(clinical, name)
+                        for name in ('common', 'dose_calculation', 'optimization', 'benchmarks', 'tests')]
+        
+        # Cùng cờ với _dose_engine/_optimizer để kiểm thử đúng bản dựng thật
+        openmp_compile_args, openmp_link_args = self.openmp_flags(compiler_type)
+        compile_args = self.cpp_compile_args(compiler_type) + openmp_compile_args + self.native_arch_flags(compiler_type)
+        
+        # test_main.cpp và mọi tệp *_tests.cpp thành một tệp thực thi
+        sources = sorted(glob.glob(os.path.join(clinical, 'tests', '*.cpp')))
+        output_dir = os.path.join('build', 'tests')
+        os.makedirs(output_dir, exist_ok=True)
+        objects = self.compiler.compile(sources, output_dir=self.build_temp, include_dirs=include_dirs,
+                                        extra_postargs=compile_args)
+        self.compiler.link_executable(objects, 'engine_tests', output_dir=output_dir,
+                                      extra_postargs=openmp_link_args, target_lang='c++')
+        if self.no_run:
+            return
+        # Chạy trong build/tests: các tệp tạm của kiểm thử nằm ở đó
+        executable = os.path.abspath(os.path.join(output_dir, self.compiler.executable_filename('engine_tests')))
+        if subprocess.call([executable], cwd=output_dir) != 0:
+            raise SystemExit("Kiểm thử C++ thất bại")
+
 # Kiểm tra xem pybind11 đã được cài đặt chưa
 try:
     import pybind11
@@ -43,13 +206,16 @@ except ImportError:
 # Khai báo extension modules
 extensions = []
 
+# Thư mục header C++ dùng chung giữa dose engine và optimizer (Volume3D, ...)
+common_include = os.path.join('quangstation', 'clinical', 'common')
+
 # Chỉ thêm C++ extensions nếu QUANGSTATION_SKIP_CPP không được đặt
 if not os.environ.get('QUANGSTATION_SKIP_CPP') and have_pybind11:
     # Module tính toán liều C++
     dose_engine_module = Extension(
         'quangstation.clinical.dose_calculation._dose_engine',
         sources=['quangstation/clinical/dose_calculation/dose_engine.cpp'],
-        include_dirs=[pybind11_include],
+        include_dirs=[pybind11_include, common_include],
     )
     extensions.append(dose_engine_module)
 
@@ -57,7 +223,7 @@ if not os.environ.get('QUANGSTATION_SKIP_CPP') and have_pybind11:
     optimizer_module = Extension(
         'quangstation.clinical.optimization._optimizer',
         sources=['quangstation/clinical/optimization/optimizer.cpp'],
-        include_dirs=[pybind11_include],
+        include_dirs=[pybind11_include, common_include],
     )
     extensions.append(optimizer_module)
 
@@ -76,7 +242,7 @@ setup(
     url="https://github.com/quangmac/QuangStationV2",
     packages=find_packages(),
     ext_modules=extensions,
-    cmdclass={'build_ext': BuildExt},
+    cmdclass={'build_ext': BuildExt, 'build_benchmarks': BuildBenchmarks, 'build_tests': BuildTests},
     classifiers=[
         "Programming Language :: Python :: 3",
         "License :: OSI Approved :: MIT License",